@@ -0,0 +1,211 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * This program measures the throughput of a function queue guarded by
+ * each lock type. Every thread pushes and pops in a loop, doing some
+ * work between the operations, for each combination of thread count
+ * and work length below. Less work between operations means more
+ * contention on the queue lock. The total number of operations of each
+ * run can be given as the first argument.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "../function_queue.h"
+#include "../qterror.h"
+
+/* the number of push and pop pairs of each run unless given */
+#ifndef BENCH_OPS
+#define BENCH_OPS 200000
+#endif
+
+/* the capacity of the queue, which is more than the threads can fill */
+#define BENCH_CAPACITY 1024
+
+/*
+ * This structure holds the parameters of one benchmark thread. The
+ * member q is the queue to use. The member ops is the number of push
+ * and pop pairs to do. The member work is the number of iterations of
+ * the work loop between two operations.
+ */
+struct bench_thread {
+	struct function_queue* q;
+	unsigned long ops;
+	unsigned int work;
+};
+
+static void* run_thread(void*);
+static void noop(void*);
+static void work(unsigned int);
+static unsigned long run(enum fqlocktype, unsigned int, unsigned int,
+		unsigned long);
+
+static const char* const lock_names[FQLOCK_LAST] = {
+	"mutex",
+#ifdef FQLOCK_EXPERIMENTAL
+	"adaptive",
+	"ticket",
+	"mcs",
+#endif
+};
+
+static const unsigned int thread_counts[] = {1, 2, 4, 8, 16};
+static const unsigned int work_lengths[] = {0, 100, 1000};
+
+/* keeps the work loop from being optimized away */
+static volatile unsigned int sink = 0;
+
+int
+main(int argc, char** argv)
+{
+	unsigned long ops = BENCH_OPS;
+	size_t w = 0;
+
+	if(argc > 1)
+		ops = strtoul(argv[1], NULL, 10);
+
+	(void) printf("%-10s %8s %6s %12s\n", "lock", "threads", "work",
+			"ops/s");
+
+	for(w = 0; w < sizeof(work_lengths) / sizeof(*work_lengths); ++w) {
+		size_t t = 0;
+
+		for(t = 0; t < sizeof(thread_counts) / sizeof(*thread_counts);
+				++t) {
+			int l = 0;
+
+			for(l = 0; l < FQLOCK_LAST; ++l) {
+				unsigned long rate = run((enum fqlocktype) l,
+						thread_counts[t],
+						work_lengths[w], ops);
+
+				(void) printf("%-10s %8u %6u %12lu\n",
+						lock_names[l],
+						thread_counts[t],
+						work_lengths[w], rate);
+			}
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * This procedure runs nthreads threads which together do ops push and
+ * pop pairs on a queue guarded by a lock of type locktype, with work
+ * iterations of the work loop between operations. It returns the
+ * number of operations per second, or 0 if the run failed.
+ */
+static unsigned long
+run(enum fqlocktype locktype, unsigned int nthreads, unsigned int work,
+		unsigned long ops)
+{
+	struct function_queue q;
+	struct bench_thread args;
+	struct timespec start;
+	struct timespec end;
+	pthread_t* threads = NULL;
+	unsigned long usec = 0;
+	unsigned int i = 0;
+	unsigned int started = 0;
+
+	if(fqinitwithlock(&q, FQTYPE_IA, BENCH_CAPACITY, locktype)
+			!= QTSUCCESS)
+		return 0;
+
+	threads = malloc(nthreads * sizeof(*threads));
+
+	if(threads == NULL) {
+		(void) fqdestroy(&q);
+		return 0;
+	}
+
+	args.q = &q;
+	args.ops = ops / nthreads;
+	args.work = work;
+	(void) clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for(i = 0; i < nthreads; ++i)
+		if(pthread_create(&threads[i], NULL, run_thread, &args) == 0)
+			++started;
+
+	for(i = 0; i < started; ++i)
+		(void) pthread_join(threads[i], NULL);
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &end);
+	free(threads);
+	(void) fqdestroy(&q);
+
+	if(started < nthreads)
+		return 0;
+
+	usec = (unsigned long) (end.tv_sec - start.tv_sec) * 1000000
+			+ (unsigned long) (end.tv_nsec / 1000)
+			- (unsigned long) (start.tv_nsec / 1000);
+
+	if(usec == 0)
+		usec = 1;
+
+	/* each pair is two operations */
+	return args.ops * nthreads * 2 * 1000000 / usec;
+}
+
+/*
+ * This procedure is the body of a benchmark thread. The variable arg is
+ * a pointer to a struct bench_thread. The value of arg must not be NULL.
+ */
+static void*
+run_thread(void* arg)
+{
+	struct bench_thread* args = arg;
+	struct function_queue_element e;
+	unsigned long i = 0;
+
+	for(i = 0; i < args->ops; ++i) {
+		(void) fqpush(args->q, noop, NULL, 1);
+		work(args->work);
+		/* every thread pushes first, so the pop always finishes */
+		(void) fqpop(args->q, &e, 1);
+		work(args->work);
+	}
+
+	return NULL;
+}
+
+/*
+ * This procedure is the function which is pushed. It is never called.
+ */
+static void
+noop(void* arg)
+{
+	(void) arg;
+}
+
+/*
+ * This procedure spins for n iterations outside of the queue lock.
+ */
+static void
+work(unsigned int n)
+{
+	unsigned int i = 0;
+
+	for(i = 0; i < n; ++i)
+		sink = sink + i;
+}
@@ -0,0 +1,542 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * This program measures each queue type and a pool on top of it with the
+ * performance counters of the processor. For each type and thread count
+ * below, it reports the throughput and the cycles, instructions, cache
+ * misses and context switches per operation, which tell lock convoys,
+ * false sharing and allocator misses apart where the throughput alone
+ * does not. In the queue runs, every thread pushes and pops in a loop.
+ * In the pool runs, the main thread pushes empty tasks for the workers.
+ * Counters which the kernel does not allow, for example in a virtual
+ * machine or with a strict perf_event_paranoid setting, are printed as
+ * "-". The total number of operations of each run can be given as the
+ * first argument.
+ */
+
+/* syscall() is an extension */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <linux/perf_event.h>
+
+#include "../function_queue.h"
+#include "../fq/static_queue.h"
+#include "../qtpool.h"
+#include "../qterror.h"
+
+/* the number of operations of each run unless given */
+#ifndef BENCH_OPS
+#define BENCH_OPS 100000
+#endif
+
+/* the capacity of the queue, which is more than the threads can fill */
+#define BENCH_CAPACITY 1024
+
+/* the number of counters in the table below */
+#define BENCH_NCOUNTERS 4
+
+/*
+ * This structure describes a performance counter. The member name is
+ * the heading of its column. The members type and config select the
+ * event as described in perf_event_open(2).
+ */
+struct bench_counter {
+	const char* name;
+	__u32 type;
+	__u64 config;
+};
+
+/*
+ * This structure holds the results of one run. The member ops is the
+ * number of operations done, and the member rate is the number of them
+ * per second, or 0 if the run failed. The member counts holds the value of each counter, and the member valid is
+ * non-zero for the counters which could be read.
+ */
+struct bench_result {
+	unsigned long ops;
+	unsigned long rate;
+	unsigned long counts[BENCH_NCOUNTERS];
+	int valid[BENCH_NCOUNTERS];
+};
+
+/*
+ * This structure holds the parameters of one queue benchmark thread.
+ * The member q is the queue to use. The member ops is the number of
+ * push and pop pairs to do.
+ */
+struct bench_thread {
+	struct function_queue* q;
+	unsigned long ops;
+};
+
+FQSTATIC_DEFINE(bench_static, BENCH_CAPACITY)
+
+/*
+ * This structure holds the parameters of one static queue benchmark
+ * thread. The member q is the queue to use. The member ops is the
+ * number of push and pop pairs to do.
+ */
+struct bench_static_thread {
+	struct bench_static* q;
+	unsigned long ops;
+};
+
+static int open_counters(int*);
+static void close_counters(const int*, struct bench_result*);
+static int run_queue(enum fqtype, unsigned int, unsigned long,
+		struct bench_result*);
+static int run_pool(enum fqtype, unsigned int, unsigned long,
+		struct bench_result*);
+static int run_static(unsigned int, unsigned long, struct bench_result*);
+static void* run_thread(void*);
+static void* run_static_thread(void*);
+static void noop(void*);
+static unsigned long elapsed_usec(const struct timespec*);
+static void print_result(const char*, const char*, unsigned int,
+		const struct bench_result*);
+
+static const struct bench_counter counters[BENCH_NCOUNTERS] = {
+	{ "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ "instrs", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ "misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ "ctxsw", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+};
+
+/* the intrusive type needs nodes from the caller, so it is left out */
+static const enum fqtype types[] = {
+	FQTYPE_IA,
+	FQTYPE_LL,
+	FQTYPE_SHARDED,
+	FQTYPE_FC,
+};
+
+static const char* const type_names[] = {
+	"ia",
+	"ll",
+	"sharded",
+	"fc",
+};
+
+static const unsigned int thread_counts[] = {1, 2, 4, 8};
+
+int
+main(int argc, char** argv)
+{
+	struct bench_result result;
+	unsigned long ops = BENCH_OPS;
+	int fds[BENCH_NCOUNTERS];
+	size_t i = 0;
+	size_t t = 0;
+	int available = 0;
+	int err = 0;
+
+	if(argc > 1)
+		ops = strtoul(argv[1], NULL, 10);
+
+	/* closing the counters may change errno */
+	err = open_counters(fds);
+	close_counters(fds, &result);
+
+	for(i = 0; i < BENCH_NCOUNTERS; ++i)
+		available += result.valid[i];
+
+	if(available == 0)
+		(void) printf("# performance counters are unavailable (%s);"
+				" only the throughput is measured\n",
+				strerror(err));
+
+	(void) printf("%-6s %-8s %8s %12s", "bench", "type", "threads",
+			"ops/s");
+
+	for(i = 0; i < BENCH_NCOUNTERS; ++i)
+		(void) printf(" %10s", counters[i].name);
+
+	(void) printf("\n");
+
+	for(t = 0; t < sizeof(types) / sizeof(*types); ++t) {
+		for(i = 0; i < sizeof(thread_counts) / sizeof(*thread_counts);
+				++i) {
+			(void) run_queue(types[t], thread_counts[i], ops,
+					&result);
+			print_result("queue", type_names[t],
+					thread_counts[i], &result);
+			(void) run_pool(types[t], thread_counts[i], ops,
+					&result);
+			print_result("pool", type_names[t], thread_counts[i],
+					&result);
+		}
+	}
+
+	for(i = 0; i < sizeof(thread_counts) / sizeof(*thread_counts); ++i) {
+		(void) run_static(thread_counts[i], ops, &result);
+		print_result("queue", "static", thread_counts[i], &result);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * This procedure opens each counter for the calling process and the
+ * threads it creates afterwards, and stores the file descriptors in the
+ * array pointed to by fds. A counter which cannot be opened gets -1. If
+ * the kernel does not allow counting in the kernel, the counter is
+ * opened for user space only. The procedure returns the errno value of
+ * the last counter which could not be opened, or 0 if all were opened.
+ */
+static int
+open_counters(int* fds)
+{
+	struct perf_event_attr attr;
+	size_t i = 0;
+	int err = 0;
+
+	for(i = 0; i < BENCH_NCOUNTERS; ++i) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = counters[i].type;
+		attr.config = counters[i].config;
+		attr.inherit = 1;
+		attr.exclude_hv = 1;
+		fds[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+				0UL);
+
+		if(fds[i] == -1 && (errno == EACCES || errno == EPERM)) {
+			attr.exclude_kernel = 1;
+			fds[i] = (int) syscall(SYS_perf_event_open, &attr, 0,
+					-1, -1, 0UL);
+		}
+
+		if(fds[i] == -1)
+			err = errno;
+	}
+
+	return err;
+}
+
+/*
+ * This procedure reads and closes the counters whose file descriptors
+ * are in the array pointed to by fds, storing their values in the
+ * result pointed to by r. The counts of threads created after the
+ * counters were opened are included once the threads have exited.
+ */
+static void
+close_counters(const int* fds, struct bench_result* r)
+{
+	__u64 value = 0;
+	size_t i = 0;
+
+	for(i = 0; i < BENCH_NCOUNTERS; ++i) {
+		r->valid[i] = 0;
+		r->counts[i] = 0;
+
+		if(fds[i] == -1)
+			continue;
+
+		if(read(fds[i], &value, sizeof(value)) == sizeof(value)) {
+			r->counts[i] = (unsigned long) value;
+			r->valid[i] = 1;
+		}
+
+		(void) close(fds[i]);
+	}
+}
+
+/*
+ * This procedure runs nthreads threads which together do ops push and
+ * pop pairs on a queue of the given type, counting the events of all of
+ * them in the result pointed to by r. It returns non-zero if the run
+ * failed.
+ */
+static int
+run_queue(enum fqtype type, unsigned int nthreads, unsigned long ops,
+		struct bench_result* r)
+{
+	struct function_queue q;
+	struct bench_thread args;
+	struct timespec start;
+	pthread_t* threads = NULL;
+	unsigned long usec = 0;
+	unsigned int i = 0;
+	unsigned int started = 0;
+	int fds[BENCH_NCOUNTERS];
+
+	r->ops = 0;
+	r->rate = 0;
+
+	if(fqinit(&q, type, BENCH_CAPACITY) != QTSUCCESS)
+		return -1;
+
+	threads = malloc(nthreads * sizeof(*threads));
+
+	if(threads == NULL) {
+		(void) fqdestroy(&q);
+		return -1;
+	}
+
+	args.q = &q;
+	args.ops = ops / nthreads;
+	(void) open_counters(fds);
+	(void) clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for(i = 0; i < nthreads; ++i)
+		if(pthread_create(&threads[i], NULL, run_thread, &args) == 0)
+			++started;
+
+	for(i = 0; i < started; ++i)
+		(void) pthread_join(threads[i], NULL);
+
+	usec = elapsed_usec(&start);
+	close_counters(fds, r);
+	free(threads);
+	(void) fqdestroy(&q);
+
+	if(started < nthreads)
+		return -1;
+
+	/* each pair is two operations */
+	r->ops = args.ops * nthreads * 2;
+	r->rate = r->ops * 1000000 / usec;
+	return 0;
+}
+
+/*
+ * This procedure runs a pool of nthreads workers on a queue of the
+ * given type while the calling thread pushes ops empty tasks, counting
+ * the events of the pusher and the workers in the result pointed to by
+ * r. It returns non-zero if the run failed.
+ */
+static int
+run_pool(enum fqtype type, unsigned int nthreads, unsigned long ops,
+		struct bench_result* r)
+{
+	struct function_queue q;
+	struct qtpool tq;
+	struct qtpool_startup_info si;
+	struct qtmetricsvalues v;
+	struct timespec start;
+	struct timespec pause;
+	unsigned long usec = 0;
+	unsigned long i = 0;
+	int started = 0;
+	int fds[BENCH_NCOUNTERS];
+
+	r->ops = 0;
+	r->rate = 0;
+
+	if(fqinit(&q, type, BENCH_CAPACITY) != QTSUCCESS)
+		return -1;
+
+	si.fq = &q;
+	si.max_threads = nthreads;
+
+	if(qtinit(&tq, &si) != QTSUCCESS) {
+		(void) fqdestroy(&q);
+		return -1;
+	}
+
+	pause.tv_sec = 0;
+	pause.tv_nsec = 100000;
+	(void) open_counters(fds);
+	(void) clock_gettime(CLOCK_MONOTONIC, &start);
+	(void) qtstart(&tq, &started);
+
+	for(i = 0; started > 0 && i < ops; ++i)
+		if(fqpush(&q, noop, NULL, 1) != QTSUCCESS)
+			break;
+
+	do {
+		(void) nanosleep(&pause, NULL);
+		qtpoolmetrics(&tq, &v);
+	} while(started > 0 && v.executed < i);
+
+	usec = elapsed_usec(&start);
+	(void) qtstop(&tq, 1);
+	close_counters(fds, r);
+	(void) qtdestroy(&tq);
+	(void) fqdestroy(&q);
+
+	if(i < ops)
+		return -1;
+
+	r->ops = ops;
+	r->rate = ops * 1000000 / usec;
+	return 0;
+}
+
+/*
+ * This procedure runs nthreads threads which together do ops push and
+ * pop pairs on a queue defined by FQSTATIC_DEFINE, counting the events
+ * of all of them in the result pointed to by r. It returns non-zero if
+ * the run failed.
+ */
+static int
+run_static(unsigned int nthreads, unsigned long ops, struct bench_result* r)
+{
+	struct bench_static q;
+	struct bench_static_thread args;
+	struct timespec start;
+	pthread_t* threads = NULL;
+	unsigned long usec = 0;
+	unsigned int i = 0;
+	unsigned int started = 0;
+	int fds[BENCH_NCOUNTERS];
+
+	r->ops = 0;
+	r->rate = 0;
+
+	if(bench_staticinit(&q) != QTSUCCESS)
+		return -1;
+
+	threads = malloc(nthreads * sizeof(*threads));
+
+	if(threads == NULL) {
+		(void) bench_staticdestroy(&q);
+		return -1;
+	}
+
+	args.q = &q;
+	args.ops = ops / nthreads;
+	(void) open_counters(fds);
+	(void) clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for(i = 0; i < nthreads; ++i)
+		if(pthread_create(&threads[i], NULL, run_static_thread,
+				&args) == 0)
+			++started;
+
+	for(i = 0; i < started; ++i)
+		(void) pthread_join(threads[i], NULL);
+
+	usec = elapsed_usec(&start);
+	close_counters(fds, r);
+	free(threads);
+	(void) bench_staticdestroy(&q);
+
+	if(started < nthreads)
+		return -1;
+
+	/* each pair is two operations */
+	r->ops = args.ops * nthreads * 2;
+	r->rate = r->ops * 1000000 / usec;
+	return 0;
+}
+
+/*
+ * This procedure is the body of a queue benchmark thread. The variable
+ * arg is a pointer to a struct bench_thread. The value of arg must not
+ * be NULL.
+ */
+static void*
+run_thread(void* arg)
+{
+	struct bench_thread* args = arg;
+	struct function_queue_element e;
+	unsigned long i = 0;
+
+	for(i = 0; i < args->ops; ++i) {
+		(void) fqpush(args->q, noop, NULL, 1);
+		/* every thread pushes first, so the pop always finishes */
+		(void) fqpop(args->q, &e, 1);
+	}
+
+	return NULL;
+}
+
+/*
+ * This procedure is the body of a static queue benchmark thread. The
+ * variable arg is a pointer to a struct bench_static_thread. The value
+ * of arg must not be NULL.
+ */
+static void*
+run_static_thread(void* arg)
+{
+	struct bench_static_thread* args = arg;
+	struct function_queue_element e;
+	unsigned long i = 0;
+
+	for(i = 0; i < args->ops; ++i) {
+		(void) bench_staticpush(args->q, noop, NULL, 1);
+		/* every thread pushes first, so the pop always finishes */
+		(void) bench_staticpop(args->q, &e, 1);
+	}
+
+	return NULL;
+}
+
+/*
+ * This procedure is the function which is pushed.
+ */
+static void
+noop(void* arg)
+{
+	(void) arg;
+}
+
+/*
+ * This procedure returns the number of microseconds since the time
+ * pointed to by start on the monotonic clock, but at least 1.
+ */
+static unsigned long
+elapsed_usec(const struct timespec* start)
+{
+	struct timespec end;
+	unsigned long usec = 0;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &end);
+	usec = (unsigned long) (end.tv_sec - start->tv_sec) * 1000000
+			+ (unsigned long) (end.tv_nsec / 1000)
+			- (unsigned long) (start->tv_nsec / 1000);
+	return usec == 0 ? 1 : usec;
+}
+
+/*
+ * This procedure prints one line with the result pointed to by r. The
+ * counters are printed per operation with two decimals, counting the
+ * same operations as the rate.
+ */
+static void
+print_result(const char* bench, const char* type, unsigned int nthreads,
+		const struct bench_result* r)
+{
+	size_t i = 0;
+
+	(void) printf("%-6s %-8s %8u %12lu", bench, type, nthreads, r->rate);
+
+	for(i = 0; i < BENCH_NCOUNTERS; ++i) {
+		unsigned long hundredths = 0;
+
+		if(!r->valid[i] || r->rate == 0 || r->ops == 0) {
+			(void) printf(" %10s", "-");
+			continue;
+		}
+
+		hundredths = r->counts[i] * 100 / r->ops;
+		(void) printf(" %7lu.%02lu", hundredths / 100,
+				hundredths % 100);
+	}
+
+	(void) printf("\n");
+}
@@ -0,0 +1,539 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <assert.h>
+
+#include "../function_queue_element.h"
+#include "../function_queue.h"
+#include "combining_queue.h"
+#include "../qtatomic.h"
+#include "../qtthreadid.h"
+#include "../qterror.h"
+
+/*
+ * This contains the constants which describe the kind of request
+ * published in a slot.
+ */
+enum fqcombiningop {
+	FQCOMBINING_PUSH = 1, /* push the element of the slot */
+	FQCOMBINING_POP, /* pop into the element of the slot */
+	FQCOMBINING_PEEK /* peek into the element of the slot */
+};
+
+static enum qterror fqinitcombining(union fqvariant*, unsigned);
+static enum qterror fqdestroycombining(union fqvariant*);
+static enum qterror fqpushcombining(union fqvariant*,
+		const struct function_queue_element*, int);
+static enum qterror fqpopcombining(union fqvariant*,
+		struct function_queue_element*, int);
+static enum qterror fqpeekcombining(union fqvariant*,
+		struct function_queue_element*, int);
+static enum qterror fqresizecombining(union fqvariant*, unsigned int, int);
+static enum qterror fqisemptycombining(union fqvariant*, int*, int);
+static enum qterror fqisfullcombining(union fqvariant*, int*, int);
+static unsigned int fqsizecombining(union fqvariant*);
+static enum qterror submit(struct fqcombining*, int,
+		struct function_queue_element*);
+static struct fqcombiningslot* claim_slot(struct fqcombining*);
+static void combine(struct fqcombining*);
+static enum qterror apply(struct fqcombining*, int,
+		struct function_queue_element*);
+static int try_acquire(struct fqcombining*);
+static void acquire(struct fqcombining*);
+static void release(struct fqcombining*);
+static enum qterror grow_elements(struct fqcombining*, unsigned int);
+
+/*
+ * This is the function dispatch table for manipulating the queue in an
+ * implementation-agnostic way. Requests are applied by whichever thread
+ * holds the combiner lock, so the procedures synchronize themselves.
+ */
+const struct fqdispatchtable fqdispatchtablecombining = {
+	fqinitcombining,
+	fqdestroycombining,
+	fqpushcombining,
+	fqpopcombining,
+	fqpeekcombining,
+	fqresizecombining,
+	fqisemptycombining,
+	fqisfullcombining,
+	NULL,
+	fqsizecombining,
+	1,
+};
+
+/*
+ * This procedure initializes the queue. The value of max_elements is
+ * the maximum number of elements which will fit in the queue. Memory
+ * is allocated for the slots and every element up front. This procedure
+ * returns an error code indicating its status. The value of q must not
+ * be NULL.
+ */
+static enum qterror
+fqinitcombining(union fqvariant* q, unsigned max_elements)
+{
+	unsigned int i = 0;
+	size_t aligned = 0;
+
+	assert(q != NULL);
+	q->combining.memory = malloc(FQCOMBINING_SLOTS
+			* sizeof(*q->combining.slots) + FQCOMBINING_CACHE_LINE);
+
+	if(q->combining.memory == NULL)
+		return QTEMALLOC;
+
+	q->combining.elements = malloc(max_elements
+			* sizeof(*q->combining.elements));
+
+	if(q->combining.elements == NULL && max_elements > 0) {
+		free(q->combining.memory);
+		return QTEMALLOC;
+	}
+
+	aligned = ((size_t) q->combining.memory + FQCOMBINING_CACHE_LINE - 1)
+			& ~(size_t) (FQCOMBINING_CACHE_LINE - 1);
+	q->combining.slots = (union fqcombiningslotpad*) aligned;
+
+	for(i = 0; i < FQCOMBINING_SLOTS; ++i) {
+		q->combining.slots[i].slot.owner = 0;
+		q->combining.slots[i].slot.pending = 0;
+	}
+
+	q->combining.locked = 0;
+	q->combining.front = 0;
+	q->combining.size = 0;
+	q->combining.capacity = max_elements;
+	q->combining.max_size = max_elements;
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure destroys the given queue. The memory for elements in
+ * the queue is freed. An attempt to use the object after it has been
+ * destroyed results in undefined behavior. This procedure returns an
+ * error code indicating its status. The value of q must not be NULL.
+ */
+static enum qterror
+fqdestroycombining(union fqvariant* q)
+{
+	assert(q != NULL);
+	free(q->combining.elements);
+	free(q->combining.memory);
+	q->combining.elements = NULL;
+	q->combining.memory = NULL;
+	q->combining.slots = NULL;
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure pushes a copy of the element pointed to by e onto the
+ * queue. The request is published in a slot and applied by the
+ * combiner, which may be the calling thread. The calling thread waits
+ * for at most one combining pass whatever the value of block. If the
+ * queue is full, the procedure returns QTEFQFULL, and a blocking
+ * fqpush() parks the thread until a pop makes room. This procedure
+ * returns an error code to indicate its status. The value of q must not
+ * be NULL. The value of e must not be NULL.
+ */
+static enum qterror
+fqpushcombining(union fqvariant* q, const struct function_queue_element* e,
+		int block)
+{
+	struct function_queue_element copy;
+
+	(void) block;
+
+	assert(q != NULL);
+	assert(e != NULL);
+
+	/* fail without publishing a request if the queue is full */
+	if(QTATOMIC_LOAD(&q->combining.size, QTATOMIC_RELAXED)
+			>= QTATOMIC_LOAD(&q->combining.max_size,
+					QTATOMIC_RELAXED))
+		return QTEFQFULL;
+
+	copy = *e;
+	return submit(&q->combining, FQCOMBINING_PUSH, &copy);
+}
+
+/*
+ * This procedure pops a function pointer from the front of the queue.
+ * The function pointer and its information is stored in a function
+ * queue element. The value of this function queue element is copied to
+ * the address pointed to by the variable e and then removed from the
+ * queue. The calling thread waits for at most one combining pass
+ * whatever the value of block. If the queue is empty, the procedure
+ * returns QTEFQEMPTY, and a blocking fqpop() parks the thread until an
+ * element is pushed. This procedure returns an error code to indicate
+ * its status. The value of q must not be NULL. The value of e must not
+ * be NULL.
+ */
+static enum qterror
+fqpopcombining(union fqvariant* q, struct function_queue_element* e,
+		int block)
+{
+	(void) block;
+
+	assert(q != NULL);
+	assert(e != NULL);
+
+	if(QTATOMIC_LOAD(&q->combining.size, QTATOMIC_RELAXED) == 0)
+		return QTEFQEMPTY;
+
+	return submit(&q->combining, FQCOMBINING_POP, e);
+}
+
+/*
+ * This procedure peeks at the function pointer at the front of the
+ * queue. The function pointer and its information is stored in a
+ * function queue element. The value of this function queue element is
+ * copied to the address pointed to by the variable e. The calling
+ * thread waits for at most one combining pass whatever the value of
+ * block. This procedure returns an error code to indicate its status.
+ * The value of q must not be NULL. The value of e must not be NULL.
+ */
+static enum qterror
+fqpeekcombining(union fqvariant* q, struct function_queue_element* e,
+		int block)
+{
+	(void) block;
+
+	assert(q != NULL);
+	assert(e != NULL);
+
+	if(QTATOMIC_LOAD(&q->combining.size, QTATOMIC_RELAXED) == 0)
+		return QTEFQEMPTY;
+
+	return submit(&q->combining, FQCOMBINING_PEEK, e);
+}
+
+/*
+ * This procedure changes the maximum number of elements allowed in the
+ * queue. If the queue holds more elements than the new maximum value
+ * len, it keeps them, but accepts no more until it has drained below
+ * the maximum. This procedure takes the combiner lock itself and may
+ * wait for it if the value of block is non-zero. This procedure returns
+ * an error code indicating its status. The value of q must not be NULL.
+ */
+static enum qterror
+fqresizecombining(union fqvariant* q, unsigned int len, int block)
+{
+	enum qterror ret = QTSUCCESS;
+
+	assert(q != NULL);
+
+	if(block)
+		acquire(&q->combining);
+	else if(!try_acquire(&q->combining))
+		return QTEPTMTRYLOCK;
+
+	if(len > q->combining.capacity)
+		ret = grow_elements(&q->combining, len);
+
+	if(ret == QTSUCCESS)
+		QTATOMIC_STORE(&q->combining.max_size, len, QTATOMIC_RELAXED);
+
+	release(&q->combining);
+	return ret;
+}
+
+/*
+ * This procedure checks if the given queue is empty. It sets the value
+ * at the address pointed to by isempty to 0 if the queue is empty.
+ * Otherwise, it sets the value pointed to by isempty to non-zero. The
+ * queue is not locked, so the result may be stale by the time it is
+ * used. This procedure returns an error code indicating its status. The
+ * value of q must not be NULL. The value of isempty must not be NULL.
+ */
+static enum qterror
+fqisemptycombining(union fqvariant* q, int* isempty, int block)
+{
+	(void) block;
+
+	assert(q != NULL);
+	assert(isempty != NULL);
+	*isempty = QTATOMIC_LOAD(&q->combining.size, QTATOMIC_RELAXED) == 0;
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure checks if the given queue is full. It sets the value
+ * at the address pointed to by isfull to 0 if the queue is full.
+ * Otherwise, it sets the value pointed to by isfull to non-zero. The
+ * queue is not locked, so the result may be stale by the time it is
+ * used. This procedure returns an error code indicating its status. The
+ * value of q must not be NULL. The value of isfull must not be NULL.
+ */
+static enum qterror
+fqisfullcombining(union fqvariant* q, int* isfull, int block)
+{
+	(void) block;
+
+	assert(q != NULL);
+	assert(isfull != NULL);
+	*isfull = QTATOMIC_LOAD(&q->combining.size, QTATOMIC_RELAXED)
+			>= QTATOMIC_LOAD(&q->combining.max_size,
+					QTATOMIC_RELAXED);
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure counts the elements in the given queue. The queue is not
+ * locked, so the result may be stale by the time it is used. The value
+ * of q must not be NULL.
+ */
+static unsigned int
+fqsizecombining(union fqvariant* q)
+{
+	assert(q != NULL);
+	return QTATOMIC_LOAD(&q->combining.size, QTATOMIC_RELAXED);
+}
+
+/*
+ * This procedure publishes a request of kind op in a slot and waits
+ * until it has been applied. While waiting, the calling thread becomes
+ * the combiner whenever the combiner lock is free, applying its own
+ * request along with every other published one. If no slot is free,
+ * the request is applied directly under the combiner lock. The element
+ * e is the input of a push and receives the output of a pop or peek.
+ * This procedure returns the status of the request. The value of q must
+ * not be NULL. The value of e must not be NULL.
+ */
+static enum qterror
+submit(struct fqcombining* q, int op, struct function_queue_element* e)
+{
+	struct fqcombiningslot* slot = NULL;
+	enum qterror ret = QTSUCCESS;
+	unsigned int spins = 0;
+
+	assert(q != NULL);
+	assert(e != NULL);
+	slot = claim_slot(q);
+
+	if(slot == NULL) {
+		acquire(q);
+		ret = apply(q, op, e);
+		combine(q);
+		release(q);
+		return ret;
+	}
+
+	slot->op = op;
+	slot->element = *e;
+	QTATOMIC_STORE(&slot->pending, 1, QTATOMIC_RELEASE);
+
+	while(QTATOMIC_LOAD(&slot->pending, QTATOMIC_ACQUIRE) != 0) {
+		if(try_acquire(q)) {
+			combine(q);
+			release(q);
+		} else if(++spins % FQCOMBINING_SPINS == 0) {
+			(void) sched_yield();
+		}
+	}
+
+	ret = slot->result;
+	*e = slot->element;
+	QTATOMIC_STORE(&slot->owner, 0, QTATOMIC_RELEASE);
+	return ret;
+}
+
+/*
+ * This procedure claims a free slot for the calling thread. The search
+ * starts at the slot picked by the thread number, so a thread usually
+ * gets the same slot back. This procedure returns NULL if every slot is
+ * in use. The value of q must not be NULL.
+ */
+static struct fqcombiningslot*
+claim_slot(struct fqcombining* q)
+{
+	unsigned int id = 0;
+	unsigned int i = 0;
+
+	assert(q != NULL);
+
+	if(qtthreadid(&id) != QTSUCCESS)
+		id = 0;
+
+	for(i = 0; i < FQCOMBINING_SLOTS; ++i) {
+		struct fqcombiningslot* slot =
+				&q->slots[(id + i) % FQCOMBINING_SLOTS].slot;
+		unsigned int expected = 0;
+
+		if(QTATOMIC_LOAD(&slot->owner, QTATOMIC_RELAXED) == 0
+				&& QTATOMIC_CAS(&slot->owner, &expected, 1,
+						QTATOMIC_ACQUIRE))
+			return slot;
+	}
+
+	return NULL;
+}
+
+/*
+ * This procedure applies every published request in one pass over the
+ * slots, in slot order. The combiner lock must be held by the calling
+ * thread. The value of q must not be NULL.
+ */
+static void
+combine(struct fqcombining* q)
+{
+	unsigned int i = 0;
+
+	assert(q != NULL);
+
+	for(i = 0; i < FQCOMBINING_SLOTS; ++i) {
+		struct fqcombiningslot* slot = &q->slots[i].slot;
+
+		if(QTATOMIC_LOAD(&slot->pending, QTATOMIC_ACQUIRE) == 0)
+			continue;
+
+		slot->result = apply(q, slot->op, &slot->element);
+		QTATOMIC_STORE(&slot->pending, 0, QTATOMIC_RELEASE);
+	}
+}
+
+/*
+ * This procedure applies one request of kind op to the element ring.
+ * The combiner lock must be held by the calling thread. This procedure
+ * returns the status of the request. The value of q must not be NULL.
+ * The value of e must not be NULL.
+ */
+static enum qterror
+apply(struct fqcombining* q, int op, struct function_queue_element* e)
+{
+	unsigned int back = 0;
+
+	assert(q != NULL);
+	assert(e != NULL);
+
+	switch(op) {
+	case FQCOMBINING_PUSH:
+		if(q->size >= q->max_size)
+			return QTEFQFULL;
+
+		back = q->front + q->size;
+
+		if(back >= q->capacity)
+			back -= q->capacity;
+
+		q->elements[back] = *e;
+		QTATOMIC_STORE(&q->size, q->size + 1, QTATOMIC_RELAXED);
+		return QTSUCCESS;
+	case FQCOMBINING_POP:
+		if(q->size == 0)
+			return QTEFQEMPTY;
+
+		*e = q->elements[q->front];
+
+		if(++q->front >= q->capacity)
+			q->front = 0;
+
+		QTATOMIC_STORE(&q->size, q->size - 1, QTATOMIC_RELAXED);
+		return QTSUCCESS;
+	case FQCOMBINING_PEEK:
+		if(q->size == 0)
+			return QTEFQEMPTY;
+
+		*e = q->elements[q->front];
+		return QTSUCCESS;
+	default:
+		return QTEINVALID;
+	}
+}
+
+/*
+ * This procedure tries to take the combiner lock without waiting. It
+ * returns non-zero if the lock was taken. The value of q must not be
+ * NULL.
+ */
+static int
+try_acquire(struct fqcombining* q)
+{
+	unsigned int expected = 0;
+
+	assert(q != NULL);
+
+	/* only attempt the exchange when the lock looks free */
+	if(QTATOMIC_LOAD(&q->locked, QTATOMIC_RELAXED) != 0)
+		return 0;
+
+	return QTATOMIC_CAS(&q->locked, &expected, 1, QTATOMIC_ACQUIRE);
+}
+
+/*
+ * This procedure takes the combiner lock, spinning and then yielding
+ * the CPU until it is free. The value of q must not be NULL.
+ */
+static void
+acquire(struct fqcombining* q)
+{
+	unsigned int spins = 0;
+
+	assert(q != NULL);
+
+	while(!try_acquire(q))
+		if(++spins % FQCOMBINING_SPINS == 0)
+			(void) sched_yield();
+}
+
+/*
+ * This procedure releases the combiner lock. The value of q must not be
+ * NULL.
+ */
+static void
+release(struct fqcombining* q)
+{
+	assert(q != NULL);
+	QTATOMIC_STORE(&q->locked, 0, QTATOMIC_RELEASE);
+}
+
+/*
+ * This procedure reallocates the element ring so that it can hold
+ * capacity elements. The elements are moved to the start of the new
+ * array in order. The combiner lock must be held by the calling thread.
+ * This procedure returns an error code indicating its status. The value
+ * of q must not be NULL.
+ */
+static enum qterror
+grow_elements(struct fqcombining* q, unsigned int capacity)
+{
+	struct function_queue_element* elements = NULL;
+	unsigned int i = 0;
+
+	assert(q != NULL);
+	assert(capacity >= q->size);
+	elements = malloc(capacity * sizeof(*elements));
+
+	if(elements == NULL)
+		return QTEMALLOC;
+
+	for(i = 0; i < q->size; ++i) {
+		unsigned int index = q->front + i;
+
+		if(index >= q->capacity)
+			index -= q->capacity;
+
+		elements[i] = q->elements[index];
+	}
+
+	free(q->elements);
+	q->elements = elements;
+	q->front = 0;
+	q->capacity = capacity;
+	return QTSUCCESS;
+}
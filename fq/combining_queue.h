@@ -0,0 +1,87 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef COMBINING_QUEUE_H
+#define COMBINING_QUEUE_H
+
+#include "../function_queue_element.h"
+#include "../function_queue.h"
+#include "../qterror.h"
+
+/* the number of request slots in a flat-combining queue */
+#ifndef FQCOMBINING_SLOTS
+#define FQCOMBINING_SLOTS 64
+#endif
+
+/* the size of a cache line which each request slot is padded to */
+#ifndef FQCOMBINING_CACHE_LINE
+#define FQCOMBINING_CACHE_LINE 64
+#endif
+
+/* the number of times a waiting thread spins before yielding the CPU */
+#ifndef FQCOMBINING_SPINS
+#define FQCOMBINING_SPINS 64
+#endif
+
+/*
+ * This structure is a slot in which a thread publishes one request for
+ * the combiner. The member owner is non-zero while a thread has claimed
+ * the slot. The member pending is non-zero while the request waits to
+ * be applied. The member op is the kind of request. The member element
+ * is the element to push, or receives the element popped or peeked.
+ * The member result is the status of the applied request.
+ */
+struct fqcombiningslot {
+	unsigned int owner;
+	unsigned int pending;
+	int op;
+	struct function_queue_element element;
+	enum qterror result;
+};
+
+/*
+ * This union pads a request slot to a whole number of cache lines so
+ * that threads waiting on neighbouring slots do not share one.
+ */
+union fqcombiningslotpad {
+	struct fqcombiningslot slot;
+	char pad[(sizeof(struct fqcombiningslot) + FQCOMBINING_CACHE_LINE
+			- 1) / FQCOMBINING_CACHE_LINE
+			* FQCOMBINING_CACHE_LINE];
+};
+
+/*
+ * This structure is used to store a flat-combining queue. Threads
+ * publish their requests in the slots, and whichever thread holds the
+ * combiner lock applies every published request to the element ring
+ * in one pass.
+ */
+struct fqcombining {
+	void* memory; /* the allocation holding the slots */
+	union fqcombiningslotpad* slots; /* the cache-aligned slots */
+	unsigned int locked; /* non-zero while a thread is combining */
+	/* a pointer to an element array */
+	struct function_queue_element* elements;
+	unsigned int front; /* the index of the first element */
+	unsigned int size; /* the number of elements in the queue */
+	unsigned int capacity; /* the number of elements allocated */
+	unsigned int max_size; /* the maximum number of elements */
+};
+
+extern const struct fqdispatchtable fqdispatchtablecombining;
+
+#endif
+
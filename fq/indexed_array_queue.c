@@ -19,7 +19,6 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <assert.h>
-#include <string.h>
 
 #include "../function_queue_element.h"
 #include "../function_queue.h"
@@ -28,7 +27,8 @@
 
 static enum qterror fqinitia(union fqvariant*, unsigned);
 static enum qterror fqdestroyia(union fqvariant*);
-static enum qterror fqpushia(union fqvariant*, void (*)(void*), void*, int);
+static enum qterror fqpushia(union fqvariant*,
+		const struct function_queue_element*, int);
 static enum qterror fqpopia(union fqvariant*, struct function_queue_element*,
 		int);
 static enum qterror fqpeekia(union fqvariant*, struct function_queue_element*,
@@ -51,6 +51,9 @@ const struct fqdispatchtable fqdispatchtableia = {
 	fqresizeia,
 	fqisemptyia,
 	fqisfullia,
+	NULL,
+	NULL,
+	0,
 };
 
 /*
@@ -93,29 +96,27 @@ fqdestroyia(union fqvariant* q)
 }
 
 /*
- * This procedure pushes the given function pointer onto the queue. The
- * function pointer is stored with the given argument arg so the value
- * can be passed to it. This procedure does not block. It returns an
- * error code to indicate its status. The value of q must not be NULL.
+ * This procedure pushes a copy of the element pointed to by e onto the
+ * queue. This procedure does not block. It returns an error code to
+ * indicate its status. The value of q must not be NULL. The value of e
+ * must not be NULL.
  */
 static enum qterror
-fqpushia(union fqvariant* q, void (*func)(void*), void* arg, int block)
+fqpushia(union fqvariant* q, const struct function_queue_element* e,
+		int block)
 {
-	struct function_queue_element e;
-
 	/* suppress unused variable warning */
 	(void) block;
 
 	assert(q != NULL);
+	assert(e != NULL);
 
 	if(q->ia.size > q->ia.max_size)
 		return QTEFQFULL;
 
-	e.func = func;
-	e.arg = arg;
 	q->ia.back = inc_and_wrap_index(q->ia.back,
 			q->ia.max_size);
-	q->ia.elements[q->ia.back] = e;
+	q->ia.elements[q->ia.back] = *e;
 	++q->ia.size;
 	return QTSUCCESS;
 }
@@ -184,43 +185,39 @@ fqresizeia(union fqvariant* q, unsigned int len, int block)
 {
 	struct function_queue_element* new_array = NULL;
 	struct function_queue_element* old_array = NULL;
-	unsigned int real_front = 0;
+	unsigned int index = 0;
+	unsigned int kept = 0;
+	unsigned int i = 0;
 
 	/* suppress unused variable warning */
 	(void) block;
 
 	assert(q != NULL);
 
-	if(len == q->ia.size)
+	if(len == q->ia.max_size)
 		return QTSUCCESS;
 
 	new_array = malloc(len * sizeof(*new_array));
 
-	if(new_array == NULL)
+	if(new_array == NULL && len > 0)
 		return QTEMALLOC;
 
-	real_front = inc_and_wrap_index(q->ia.front, q->ia.max_size);
-
-	if(q->ia.back >= q->ia.front) {
-		memcpy(new_array, &q->ia.elements[real_front],
-				len * sizeof(*new_array));
-	} else if(q->ia.back < q->ia.front) {
-		size_t num_elements_to_copy1 =
-				len - q->ia.front;
-		size_t num_elements_to_copy2 = len - num_elements_to_copy1;
-
-		memcpy(new_array, &q->ia.elements[real_front],
-				num_elements_to_copy1 * sizeof(*new_array));
-		memcpy(&new_array[num_elements_to_copy1 + 1],
-				q->ia.elements,
-				num_elements_to_copy2 * sizeof(*new_array));
-	}
+	/* skip the least recently added elements which do not fit */
+	kept = q->ia.size < len ? q->ia.size : len;
+	index = q->ia.front;
 
-	if(q->ia.size > len)
-		q->ia.size = len;
+	for(i = kept; i < q->ia.size; ++i)
+		index = inc_and_wrap_index(index, q->ia.max_size);
+
+	for(i = 0; i < kept; ++i) {
+		index = inc_and_wrap_index(index, q->ia.max_size);
+		new_array[i] = q->ia.elements[index];
+	}
 
+	/* the front is the slot before the first element */
+	q->ia.size = kept;
 	q->ia.front = len > 0 ? len - 1 : 0;
-	q->ia.back = len > 0 ? len - 1 : 0;
+	q->ia.back = kept > 0 ? kept - 1 : q->ia.front;
 	old_array = q->ia.elements;
 	q->ia.elements = new_array;
 	q->ia.max_size = len;
@@ -27,7 +27,8 @@
 
 static enum qterror fqinitll(union fqvariant*, unsigned);
 static enum qterror fqdestroyll(union fqvariant*);
-static enum qterror fqpushll(union fqvariant*, void (*)(void*), void*, int);
+static enum qterror fqpushll(union fqvariant*,
+		const struct function_queue_element*, int);
 static enum qterror fqpopll(union fqvariant*, struct function_queue_element*,
 		int);
 static enum qterror fqpeekll(union fqvariant*, struct function_queue_element*,
@@ -35,8 +36,19 @@ static enum qterror fqpeekll(union fqvariant*, struct function_queue_element*,
 static enum qterror fqresizell(union fqvariant*, unsigned, int);
 static enum qterror fqisemptyll(union fqvariant*, int*, int);
 static enum qterror fqisfullll(union fqvariant*, int*, int);
+static enum qterror fqdestroylli(union fqvariant*);
+static enum qterror fqpushlli(union fqvariant*,
+		const struct function_queue_element*, int);
+static enum qterror fqpoplli(union fqvariant*,
+		struct function_queue_element*, int);
+static enum qterror fqresizelli(union fqvariant*, unsigned, int);
+static enum qterror fqpushnodelli(union fqvariant*, struct fqellnode*, int);
 
 static void fqellnode_trunc(struct fqellnode*);
+static void link_node(union fqvariant*, struct fqellnode*);
+static struct fqellnode* unlink_head(union fqvariant*,
+		struct function_queue_element*);
+static struct fqellnode* cut_list(union fqvariant*, unsigned int);
 /*
  * This is the function dispatch table for manipulating the queue in an
  * implementation-agnostic way.
@@ -50,6 +62,28 @@ const struct fqdispatchtable fqdispatchtablell = {
 	fqresizell,
 	fqisemptyll,
 	fqisfullll,
+	NULL,
+	NULL,
+	0,
+};
+
+/*
+ * This is the function dispatch table for manipulating an intrusive
+ * linked list queue. The nodes belong to the caller, who pushes them
+ * with fqpushnode(), so the queue never allocates or frees memory.
+ */
+const struct fqdispatchtable fqdispatchtablelli = {
+	fqinitll,
+	fqdestroylli,
+	fqpushlli,
+	fqpoplli,
+	fqpeekll,
+	fqresizelli,
+	fqisemptyll,
+	fqisfullll,
+	fqpushnodelli,
+	NULL,
+	0,
 };
 
 /*
@@ -87,46 +121,33 @@ fqdestroyll(union fqvariant* q)
 }
 
 /*
- * This procedure pushes the given function pointer onto the queue. The
- * function pointer is stored with the given argument arg so the value
- * can be passed to it. This procedure does not block. It returns an
- * error code to indicate its status. The value of q must not be NULL.
+ * This procedure pushes a copy of the element pointed to by e onto the
+ * queue. This procedure does not block. It returns an error code to
+ * indicate its status. The value of q must not be NULL. The value of e
+ * must not be NULL.
  */
 static enum qterror
-fqpushll(union fqvariant* q, void (*func)(void*), void* arg, int block)
+fqpushll(union fqvariant* q, const struct function_queue_element* e,
+		int block)
 {
-	struct function_queue_element e;
 	struct fqellnode* new_node = NULL;
 
 	/* suppress unused variable warning */
 	(void) block;
 
 	assert(q != NULL);
+	assert(e != NULL);
 
 	if(q->ll.size >= q->ll.max_size)
 		return QTEFQFULL;
 
-	e.func = func;
-	e.arg = arg;
 	new_node = malloc(sizeof(struct fqellnode));
 
 	if(new_node == NULL)
 		return QTEMALLOC;
 
-	new_node->element = e;
-	new_node->next = NULL;
-	++q->ll.size;
-
-	if(q->ll.tail == NULL) {
-		q->ll.tail = new_node;
-	} else {
-		q->ll.tail->next = new_node;
-		q->ll.tail = q->ll.tail->next;
-	}
-
-	if(q->ll.head == NULL)
-		q->ll.head = q->ll.tail;
-
+	new_node->element = *e;
+	link_node(q, new_node);
 	return QTSUCCESS;
 }
 
@@ -152,15 +173,8 @@ fqpopll(union fqvariant* q, struct function_queue_element* e, int block)
 	if(q->ll.size == 0)
 		return QTEFQEMPTY;
 
-	--q->ll.size;
-	*e = q->ll.head->element;
-	tmp = q->ll.head;
-	q->ll.head = q->ll.head->next;
+	tmp = unlink_head(q, e);
 	free(tmp);
-
-	if(q->ll.head == NULL)
-		q->ll.tail = NULL;
-
 	return QTSUCCESS;
 }
 
@@ -191,45 +205,19 @@ fqpeekll(union fqvariant* q, struct function_queue_element* e, int block)
 
 /*
  * This procedure changes the maximum number of elements allowed in the
- * queue. It reallocates the elements array memory based on the new
- * maximum value len. This procedure does not block. If the new length
- * is not enough to store all the elements in the queue, the least
- * recently added elements are removed. This procedure returns an error
- * code indicating its status. The value of q must not be NULL.
+ * queue. This procedure does not block. If the new length is not enough
+ * to store all the elements in the queue, the most recently added
+ * elements are removed and their nodes are freed. This procedure always
+ * succeeds. The value of q must not be NULL.
  */
 static enum qterror
 fqresizell(union fqvariant* q, unsigned int len, int block)
 {
-	struct fqellnode* tmp = NULL;
-
 	/* suppress unused variable warning */
 	(void) block;
 
 	assert(q != NULL);
-
-	q->ll.max_size = len;
-
-	if(len >= q->ll.size)
-		return QTSUCCESS;
-
-	tmp = q->ll.head;
-	q->ll.size = len;
-
-	while(len-- > 0 && tmp != NULL) {
-		tmp = tmp->next;
-	}
-
-	assert(tmp != NULL); /* this should never be possible */
-	fqellnode_trunc(tmp->next);
-
-	if(q->ll.size > 0) {
-		tmp->next = NULL;
-		q->ll.tail = tmp;
-	} else {
-		q->ll.head = NULL;
-		q->ll.tail = NULL;
-	}
-
+	fqellnode_trunc(cut_list(q, len));
 	return QTSUCCESS;
 }
 
@@ -280,3 +268,189 @@ fqellnode_trunc(struct fqellnode* node)
 	}
 }
 
+
+/*
+ * This procedure destroys the given intrusive queue. The nodes still in
+ * the queue are unlinked but not freed, since they belong to the
+ * caller. An attempt to use the object after it has been destoyed
+ * results in undefined behavior. This procedure always succeeds. The
+ * value of q must not be NULL.
+ */
+static enum qterror
+fqdestroylli(union fqvariant* q)
+{
+	assert(q != NULL);
+	(void) cut_list(q, 0);
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure rejects pushing an element without a node onto an
+ * intrusive queue, which has nowhere to store it. The procedure always
+ * returns QTEINVALID. The value of q must not be NULL.
+ */
+static enum qterror
+fqpushlli(union fqvariant* q, const struct function_queue_element* e,
+		int block)
+{
+	/* suppress unused variable warning */
+	(void) q;
+	(void) e;
+	(void) block;
+
+	return QTEINVALID;
+}
+
+/*
+ * This procedure pops a function pointer from the intrusive queue. The
+ * element of the head node is copied to the address pointed to by the
+ * variable e and the node is unlinked. The queue does not touch the
+ * node again, so the popped function may free or reuse it. This
+ * procedure does not block. It returns an error code to indicate its
+ * status. The value of q must not be NULL. The value of e must not be
+ * NULL.
+ */
+static enum qterror
+fqpoplli(union fqvariant* q, struct function_queue_element* e, int block)
+{
+	/* suppress unused variable warning */
+	(void) block;
+
+	assert(q != NULL);
+	assert(e != NULL);
+
+	if(q->ll.size == 0)
+		return QTEFQEMPTY;
+
+	(void) unlink_head(q, e);
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure changes the maximum number of elements allowed in the
+ * intrusive queue. If the new length is not enough to store all the
+ * nodes in the queue, the most recently added nodes are unlinked but
+ * not freed. This procedure does not block. This procedure always
+ * succeeds. The value of q must not be NULL.
+ */
+static enum qterror
+fqresizelli(union fqvariant* q, unsigned int len, int block)
+{
+	/* suppress unused variable warning */
+	(void) block;
+
+	assert(q != NULL);
+	(void) cut_list(q, len);
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure links the node pointed to by node, which holds its
+ * function pointer and argument already, at the back of the intrusive
+ * queue. The node must stay valid until it has been popped. This
+ * procedure does not block. It returns an error code to indicate its
+ * status. The value of q must not be NULL. The value of node must not
+ * be NULL.
+ */
+static enum qterror
+fqpushnodelli(union fqvariant* q, struct fqellnode* node, int block)
+{
+	/* suppress unused variable warning */
+	(void) block;
+
+	assert(q != NULL);
+	assert(node != NULL);
+
+	if(q->ll.size >= q->ll.max_size)
+		return QTEFQFULL;
+
+	link_node(q, node);
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure links the given node at the back of the list. The
+ * value of q must not be NULL. The value of node must not be NULL.
+ */
+static void
+link_node(union fqvariant* q, struct fqellnode* node)
+{
+	assert(q != NULL);
+	assert(node != NULL);
+
+	node->next = NULL;
+	++q->ll.size;
+
+	if(q->ll.tail == NULL) {
+		q->ll.tail = node;
+	} else {
+		q->ll.tail->next = node;
+		q->ll.tail = q->ll.tail->next;
+	}
+
+	if(q->ll.head == NULL)
+		q->ll.head = q->ll.tail;
+}
+
+/*
+ * This procedure unlinks the head node of the list, copies its element
+ * to the address pointed to by e and returns the node. The list must
+ * not be empty. The value of q must not be NULL. The value of e must
+ * not be NULL.
+ */
+static struct fqellnode*
+unlink_head(union fqvariant* q, struct function_queue_element* e)
+{
+	struct fqellnode* node = NULL;
+
+	assert(q != NULL);
+	assert(e != NULL);
+	assert(q->ll.head != NULL);
+
+	--q->ll.size;
+	node = q->ll.head;
+	*e = node->element;
+	q->ll.head = node->next;
+
+	if(q->ll.head == NULL)
+		q->ll.tail = NULL;
+
+	return node;
+}
+
+/*
+ * This procedure sets the maximum size of the list to len and cuts off
+ * the nodes past the first len. The first node which was cut off is
+ * returned, still linked to the nodes after it, or NULL if no node was
+ * cut off. The value of q must not be NULL.
+ */
+static struct fqellnode*
+cut_list(union fqvariant* q, unsigned int len)
+{
+	struct fqellnode* last = NULL;
+	struct fqellnode* rest = NULL;
+
+	assert(q != NULL);
+
+	q->ll.max_size = len;
+
+	if(len >= q->ll.size)
+		return NULL;
+
+	q->ll.size = len;
+
+	if(len == 0) {
+		rest = q->ll.head;
+		q->ll.head = NULL;
+		q->ll.tail = NULL;
+		return rest;
+	}
+
+	for(last = q->ll.head; --len > 0; last = last->next)
+		assert(last != NULL); /* this should never be possible */
+
+	rest = last->next;
+	last->next = NULL;
+	q->ll.tail = last;
+	return rest;
+}
@@ -26,7 +26,8 @@
 
 /*
  * This structure is a linked list node structure for function queue
- * elements.
+ * elements. For an intrusive queue, the caller embeds a node in its own
+ * data and pushes it with fqpushnode().
  */
 struct fqellnode {
 	struct function_queue_element element; /* the element value */
@@ -45,6 +46,7 @@ struct fqlinkedlist {
 };
 
 extern const struct fqdispatchtable fqdispatchtablell;
+extern const struct fqdispatchtable fqdispatchtablelli;
 
 #endif
 
@@ -0,0 +1,518 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "../function_queue_element.h"
+#include "../function_queue.h"
+#include "sharded_queue.h"
+#include "../qtatomic.h"
+#include "../qtthreadid.h"
+#include "../qterror.h"
+
+static enum qterror fqinitsharded(union fqvariant*, unsigned);
+static enum qterror fqdestroysharded(union fqvariant*);
+static enum qterror fqpushsharded(union fqvariant*,
+		const struct function_queue_element*, int);
+static enum qterror fqpopsharded(union fqvariant*,
+		struct function_queue_element*, int);
+static enum qterror fqpeeksharded(union fqvariant*,
+		struct function_queue_element*, int);
+static enum qterror fqresizesharded(union fqvariant*, unsigned int, int);
+static enum qterror fqisemptysharded(union fqvariant*, int*, int);
+static enum qterror fqisfullsharded(union fqvariant*, int*, int);
+static unsigned int fqsizesharded(union fqvariant*);
+static unsigned int first_shard(const struct fqsharded*);
+static unsigned int shard_max_size(unsigned int, unsigned int,
+		unsigned int);
+static enum qterror grow_shard(struct fqshard*, unsigned int);
+
+/*
+ * This is the function dispatch table for manipulating the queue in an
+ * implementation-agnostic way. Each sub-queue has its own lock, so the
+ * procedures synchronize themselves.
+ */
+const struct fqdispatchtable fqdispatchtablesharded = {
+	fqinitsharded,
+	fqdestroysharded,
+	fqpushsharded,
+	fqpopsharded,
+	fqpeeksharded,
+	fqresizesharded,
+	fqisemptysharded,
+	fqisfullsharded,
+	NULL,
+	fqsizesharded,
+	1,
+};
+
+/*
+ * This procedure initializes the queue. The value of max_elements is
+ * the maximum number of elements which will fit in the queue. It is
+ * split between the sub-queues so that together they hold exactly that
+ * many, and a queue smaller than FQSHARDED_SHARDS gets one sub-queue
+ * per element. Memory is allocated for every sub-queue up front. This
+ * procedure returns an error code indicating its status. The value of q
+ * must not be NULL.
+ */
+static enum qterror
+fqinitsharded(union fqvariant* q, unsigned max_elements)
+{
+	enum qterror ret = QTSUCCESS;
+	unsigned int i = 0;
+	size_t aligned = 0;
+
+	assert(q != NULL);
+	q->sharded.nshards = FQSHARDED_SHARDS;
+
+	if(max_elements < q->sharded.nshards)
+		q->sharded.nshards = max_elements > 0 ? max_elements : 1;
+
+	q->sharded.memory = malloc(FQSHARDED_SHARDS
+			* sizeof(*q->sharded.shards) + FQSHARDED_CACHE_LINE);
+
+	if(q->sharded.memory == NULL)
+		return QTEMALLOC;
+
+	aligned = ((size_t) q->sharded.memory + FQSHARDED_CACHE_LINE - 1)
+			& ~(size_t) (FQSHARDED_CACHE_LINE - 1);
+	q->sharded.shards = (union fqshardslot*) aligned;
+
+	for(i = 0; i < q->sharded.nshards && ret == QTSUCCESS; ++i) {
+		struct fqshard* shard = &q->sharded.shards[i].shard;
+		unsigned int max_size = shard_max_size(max_elements,
+				q->sharded.nshards, i);
+
+		shard->front = 0;
+		shard->size = 0;
+		shard->capacity = max_size;
+		shard->max_size = max_size;
+		shard->elements = malloc(max_size * sizeof(*shard->elements));
+
+		if(shard->elements == NULL && max_size > 0) {
+			ret = QTEMALLOC;
+		} else if(pthread_mutex_init(&shard->lock, NULL) != 0) {
+			free(shard->elements);
+			ret = QTEPTMINIT;
+		}
+	}
+
+	if(ret != QTSUCCESS) {
+		/* the sub-queue which failed is already cleaned up */
+		for(--i; i-- > 0;) {
+			(void) pthread_mutex_destroy(
+					&q->sharded.shards[i].shard.lock);
+			free(q->sharded.shards[i].shard.elements);
+		}
+
+		free(q->sharded.memory);
+	}
+
+	return ret;
+}
+
+/*
+ * This procedure destroys the given queue. The memory for elements in
+ * the queue is freed. An attempt to use the object after it has been
+ * destroyed results in undefined behavior. This procedure returns an
+ * error code indicating its status. The value of q must not be NULL.
+ */
+static enum qterror
+fqdestroysharded(union fqvariant* q)
+{
+	enum qterror ret = QTSUCCESS;
+	unsigned int i = 0;
+
+	assert(q != NULL);
+
+	for(i = 0; i < q->sharded.nshards; ++i) {
+		struct fqshard* shard = &q->sharded.shards[i].shard;
+
+		if(pthread_mutex_destroy(&shard->lock) != 0)
+			ret = QTEPTMDESTROY;
+
+		free(shard->elements);
+	}
+
+	free(q->sharded.memory);
+	q->sharded.memory = NULL;
+	q->sharded.shards = NULL;
+	return ret;
+}
+
+/*
+ * This procedure pushes a copy of the element pointed to by e onto the
+ * sub-queue of the calling thread, or onto the next sub-queue with room
+ * if that one is full. This procedure may block on the lock of a
+ * sub-queue if the value of block is non-zero. Otherwise, a sub-queue
+ * which is locked by another thread is skipped, and the procedure
+ * returns QTEPTMTRYLOCK rather than QTEFQFULL if it found no room in the
+ * others, since the queue may not be full. It returns an error code to
+ * indicate its status. The value of q must not be NULL. The value of e
+ * must not be NULL.
+ */
+static enum qterror
+fqpushsharded(union fqvariant* q, const struct function_queue_element* e,
+		int block)
+{
+	unsigned int start = 0;
+	unsigned int i = 0;
+	int contended = 0;
+
+	assert(q != NULL);
+	assert(e != NULL);
+	start = first_shard(&q->sharded);
+
+	for(i = 0; i < q->sharded.nshards; ++i) {
+		struct fqshard* shard = &q->sharded.shards[
+				(start + i) % q->sharded.nshards].shard;
+		unsigned int back = 0;
+
+		/* skip full sub-queues without taking their lock */
+		if(QTATOMIC_LOAD(&shard->size, QTATOMIC_RELAXED)
+				>= QTATOMIC_LOAD(&shard->max_size,
+						QTATOMIC_RELAXED))
+			continue;
+
+		if(block) {
+			if(pthread_mutex_lock(&shard->lock) != 0)
+				return QTEPTMLOCK;
+		} else if(pthread_mutex_trylock(&shard->lock) != 0) {
+			contended = 1;
+			continue;
+		}
+
+		if(shard->size >= shard->max_size) {
+			(void) pthread_mutex_unlock(&shard->lock);
+			continue;
+		}
+
+		back = shard->front + shard->size;
+
+		if(back >= shard->capacity)
+			back -= shard->capacity;
+
+		shard->elements[back] = *e;
+		QTATOMIC_STORE(&shard->size, shard->size + 1,
+				QTATOMIC_RELAXED);
+		(void) pthread_mutex_unlock(&shard->lock);
+		return QTSUCCESS;
+	}
+
+	return contended ? QTEPTMTRYLOCK : QTEFQFULL;
+}
+
+/*
+ * This procedure pops a function pointer from the sub-queue of the
+ * calling thread, or from the next non-empty sub-queue if that one is
+ * empty. The function pointer and its information is stored in a
+ * function queue element. The value of this function queue element is
+ * copied to the address pointed to by the variable e and then removed
+ * from the queue. This procedure may block on the lock of a sub-queue
+ * if the value of block is non-zero. Otherwise, a sub-queue which is
+ * locked by another thread is skipped, and the procedure returns
+ * QTEPTMTRYLOCK rather than QTEFQEMPTY if the others were empty. It
+ * returns an error code to indicate its status. The value of q must not
+ * be NULL. The value of e must not be NULL.
+ */
+static enum qterror
+fqpopsharded(union fqvariant* q, struct function_queue_element* e, int block)
+{
+	unsigned int start = 0;
+	unsigned int i = 0;
+	int contended = 0;
+
+	assert(q != NULL);
+	assert(e != NULL);
+	start = first_shard(&q->sharded);
+
+	for(i = 0; i < q->sharded.nshards; ++i) {
+		struct fqshard* shard = &q->sharded.shards[
+				(start + i) % q->sharded.nshards].shard;
+
+		/* skip empty sub-queues without taking their lock */
+		if(QTATOMIC_LOAD(&shard->size, QTATOMIC_RELAXED) == 0)
+			continue;
+
+		if(block) {
+			if(pthread_mutex_lock(&shard->lock) != 0)
+				return QTEPTMLOCK;
+		} else if(pthread_mutex_trylock(&shard->lock) != 0) {
+			contended = 1;
+			continue;
+		}
+
+		if(shard->size == 0) {
+			(void) pthread_mutex_unlock(&shard->lock);
+			continue;
+		}
+
+		*e = shard->elements[shard->front];
+
+		if(++shard->front >= shard->capacity)
+			shard->front = 0;
+
+		QTATOMIC_STORE(&shard->size, shard->size - 1,
+				QTATOMIC_RELAXED);
+		(void) pthread_mutex_unlock(&shard->lock);
+		return QTSUCCESS;
+	}
+
+	return contended ? QTEPTMTRYLOCK : QTEFQEMPTY;
+}
+
+/*
+ * This procedure peeks at the function pointer which the calling thread
+ * would pop next. The function pointer and its information is stored in
+ * a function queue element. The value of this function queue element
+ * is copied to the address pointed to by the variable e. This procedure
+ * may block on the lock of a sub-queue if the value of block is
+ * non-zero. Otherwise, it skips locked sub-queues like fqpopsharded().
+ * It returns an error code to indicate its status. The value of q must
+ * not be NULL. The value of e must not be NULL.
+ */
+static enum qterror
+fqpeeksharded(union fqvariant* q, struct function_queue_element* e, int block)
+{
+	unsigned int start = 0;
+	unsigned int i = 0;
+	int contended = 0;
+
+	assert(q != NULL);
+	assert(e != NULL);
+	start = first_shard(&q->sharded);
+
+	for(i = 0; i < q->sharded.nshards; ++i) {
+		struct fqshard* shard = &q->sharded.shards[
+				(start + i) % q->sharded.nshards].shard;
+		int found = 0;
+
+		if(QTATOMIC_LOAD(&shard->size, QTATOMIC_RELAXED) == 0)
+			continue;
+
+		if(block) {
+			if(pthread_mutex_lock(&shard->lock) != 0)
+				return QTEPTMLOCK;
+		} else if(pthread_mutex_trylock(&shard->lock) != 0) {
+			contended = 1;
+			continue;
+		}
+
+		found = shard->size > 0;
+
+		if(found)
+			*e = shard->elements[shard->front];
+
+		(void) pthread_mutex_unlock(&shard->lock);
+
+		if(found)
+			return QTSUCCESS;
+	}
+
+	return contended ? QTEPTMTRYLOCK : QTEFQEMPTY;
+}
+
+/*
+ * This procedure changes the maximum number of elements allowed in the
+ * queue. The new maximum value len is split between the sub-queues like
+ * in fqinitsharded(), but their number does not change. A sub-queue which holds more elements than
+ * its new maximum keeps them, but accepts no more until it has drained
+ * below the maximum. This procedure may block on the lock of each
+ * sub-queue if the value of block is non-zero. This procedure returns
+ * an error code indicating its status. The value of q must not be NULL.
+ */
+static enum qterror
+fqresizesharded(union fqvariant* q, unsigned int len, int block)
+{
+	enum qterror ret = QTSUCCESS;
+	unsigned int i = 0;
+
+	assert(q != NULL);
+
+	for(i = 0; i < q->sharded.nshards && ret == QTSUCCESS; ++i) {
+		struct fqshard* shard = &q->sharded.shards[i].shard;
+		unsigned int max_size = shard_max_size(len,
+				q->sharded.nshards, i);
+
+		if(block) {
+			if(pthread_mutex_lock(&shard->lock) != 0)
+				return QTEPTMLOCK;
+		} else {
+			if(pthread_mutex_trylock(&shard->lock) != 0)
+				return QTEPTMTRYLOCK;
+		}
+
+		if(max_size > shard->capacity)
+			ret = grow_shard(shard, max_size);
+
+		if(ret == QTSUCCESS)
+			QTATOMIC_STORE(&shard->max_size, max_size,
+					QTATOMIC_RELAXED);
+
+		(void) pthread_mutex_unlock(&shard->lock);
+	}
+
+	return ret;
+}
+
+/*
+ * This procedure checks if the given queue is empty. It sets the value
+ * at the address pointed to by isempty to 0 if the queue is empty.
+ * Otherwise, it sets the value pointed to by isempty to non-zero. The
+ * sub-queues are not locked, so the result may be stale by the time it
+ * is used. This procedure returns an error code indicating its status.
+ * The value of q must not be NULL. The value of isempty must not be
+ * NULL.
+ */
+static enum qterror
+fqisemptysharded(union fqvariant* q, int* isempty, int block)
+{
+	unsigned int i = 0;
+
+	(void) block;
+
+	assert(q != NULL);
+	assert(isempty != NULL);
+	*isempty = 1;
+
+	for(i = 0; i < q->sharded.nshards && *isempty; ++i)
+		*isempty = QTATOMIC_LOAD(&q->sharded.shards[i].shard.size,
+				QTATOMIC_RELAXED) == 0;
+
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure checks if the given queue is full. It sets the value
+ * at the address pointed to by isfull to 0 if the queue is full.
+ * Otherwise, it sets the value pointed to by isfull to non-zero. The
+ * sub-queues are not locked, so the result may be stale by the time it
+ * is used. This procedure returns an error code indicating its status.
+ * The value of q must not be NULL. The value of isfull must not be
+ * NULL.
+ */
+static enum qterror
+fqisfullsharded(union fqvariant* q, int* isfull, int block)
+{
+	unsigned int i = 0;
+
+	(void) block;
+
+	assert(q != NULL);
+	assert(isfull != NULL);
+	*isfull = 1;
+
+	for(i = 0; i < q->sharded.nshards && *isfull; ++i) {
+		struct fqshard* shard = &q->sharded.shards[i].shard;
+
+		*isfull = QTATOMIC_LOAD(&shard->size, QTATOMIC_RELAXED)
+				>= QTATOMIC_LOAD(&shard->max_size,
+						QTATOMIC_RELAXED);
+	}
+
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure counts the elements in the given queue by adding up the
+ * sizes of the sub-queues. The sub-queues are not locked, so the result
+ * may be stale by the time it is used. The value of q must not be NULL.
+ */
+static unsigned int
+fqsizesharded(union fqvariant* q)
+{
+	unsigned int size = 0;
+	unsigned int i = 0;
+
+	assert(q != NULL);
+
+	for(i = 0; i < q->sharded.nshards; ++i)
+		size += QTATOMIC_LOAD(&q->sharded.shards[i].shard.size,
+				QTATOMIC_RELAXED);
+
+	return size;
+}
+
+/*
+ * This procedure picks the sub-queue which the calling thread tries
+ * first. Threads are spread over the sub-queues by their thread number.
+ * The value of q must not be NULL.
+ */
+static unsigned int
+first_shard(const struct fqsharded* q)
+{
+	unsigned int id = 0;
+
+	assert(q != NULL);
+
+	if(qtthreadid(&id) != QTSUCCESS)
+		return 0;
+
+	return id % q->nshards;
+}
+
+/*
+ * This procedure calculates the maximum number of elements of the
+ * sub-queue with the given index out of nshards sub-queues so that
+ * together they hold exactly max_elements. The remainder is spread over
+ * the first sub-queues. The value of nshards must not be 0.
+ */
+static unsigned int
+shard_max_size(unsigned int max_elements, unsigned int nshards,
+		unsigned int index)
+{
+	assert(nshards > 0);
+	return max_elements / nshards + (index < max_elements % nshards);
+}
+
+/*
+ * This procedure reallocates the elements of a sub-queue so that it can
+ * hold capacity elements. The elements are moved to the start of the
+ * new array in order. The sub-queue lock must be held by the calling
+ * thread. This procedure returns an error code indicating its status.
+ * The value of shard must not be NULL.
+ */
+static enum qterror
+grow_shard(struct fqshard* shard, unsigned int capacity)
+{
+	struct function_queue_element* elements = NULL;
+	unsigned int i = 0;
+
+	assert(shard != NULL);
+	assert(capacity >= shard->size);
+	elements = malloc(capacity * sizeof(*elements));
+
+	if(elements == NULL)
+		return QTEMALLOC;
+
+	for(i = 0; i < shard->size; ++i) {
+		unsigned int index = shard->front + i;
+
+		if(index >= shard->capacity)
+			index -= shard->capacity;
+
+		elements[i] = shard->elements[index];
+	}
+
+	free(shard->elements);
+	shard->elements = elements;
+	shard->front = 0;
+	shard->capacity = capacity;
+	return QTSUCCESS;
+}
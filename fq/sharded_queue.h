@@ -0,0 +1,75 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SHARDED_QUEUE_H
+#define SHARDED_QUEUE_H
+
+#include <pthread.h>
+
+#include "../function_queue_element.h"
+#include "../function_queue.h"
+#include "../qterror.h"
+
+/* the number of sub-queues in a sharded queue */
+#ifndef FQSHARDED_SHARDS
+#define FQSHARDED_SHARDS 8
+#endif
+
+/* the size of a cache line which each sub-queue is padded to */
+#ifndef FQSHARDED_CACHE_LINE
+#define FQSHARDED_CACHE_LINE 64
+#endif
+
+/*
+ * This structure is one sub-queue of a sharded queue. It is a ring of
+ * elements guarded by its own lock.
+ */
+struct fqshard {
+	pthread_mutex_t lock; /* lock for the data of this sub-queue */
+	/* a pointer to an element array */
+	struct function_queue_element* elements;
+	unsigned int front; /* the index of the first element */
+	unsigned int size; /* the number of elements in the sub-queue */
+	unsigned int capacity; /* the number of elements allocated */
+	unsigned int max_size; /* the maximum number of elements */
+};
+
+/*
+ * This union pads a sub-queue to a whole number of cache lines so that
+ * neighbouring sub-queues do not share one.
+ */
+union fqshardslot {
+	struct fqshard shard;
+	char pad[(sizeof(struct fqshard) + FQSHARDED_CACHE_LINE - 1)
+			/ FQSHARDED_CACHE_LINE * FQSHARDED_CACHE_LINE];
+};
+
+/*
+ * This structure is used to store the sub-queues of a sharded queue.
+ * Each thread pushes to and pops from the sub-queue picked by its
+ * thread number first and sweeps the others when that one is full or
+ * empty, so the order of elements is only approximately FIFO.
+ */
+struct fqsharded {
+	void* memory; /* the allocation holding the sub-queues */
+	union fqshardslot* shards; /* the cache-aligned sub-queues */
+	unsigned int nshards; /* the number of sub-queues */
+};
+
+extern const struct fqdispatchtable fqdispatchtablesharded;
+
+#endif
+
@@ -0,0 +1,282 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef STATIC_QUEUE_H
+#define STATIC_QUEUE_H
+
+#include <pthread.h>
+
+#include "../fqlock.h"
+#include "../function_queue_element.h"
+#include "../qterror.h"
+
+/* the keyword which asks for the generated procedures to be inlined */
+#ifdef __GNUC__
+#define FQSTATIC_INLINE __inline__
+#else
+#define FQSTATIC_INLINE
+#endif
+
+/*
+ * This macro defines a function queue type with a fixed capacity known
+ * at compile time, for hot queues which do not need the other features
+ * of a function queue. Instead of going through a dispatch table, its
+ * procedures are static and may be inlined, and the ring is indexed by
+ * masking counters which only ever grow, so the capacity must be a
+ * power of two. The type is named struct name, and the procedures are
+ * the name followed by init, initwithlock, destroy, tryput, trytake,
+ * push and pop.
+ *
+ * The tryput and trytake procedures do not lock the queue; they are
+ * meant for a queue owned by one thread, or guarded by the caller. The
+ * push and pop procedures take the lock of the queue, which is any of
+ * the lock types of a function queue, and wait for room or an element
+ * if the value of block is non-zero. The condition variables are only
+ * signaled when a thread waits on them. Popped elements carry no
+ * enqueue timestamp.
+ *
+ * The member elements is the ring of elements. The member head counts
+ * the elements ever popped, and the member tail counts those ever
+ * pushed; both wrap around, which the masking and the unsigned
+ * difference of the two allow for. The member lock guards the queue for
+ * push and pop, and the members notempty and notfull are waited on by
+ * poppers and pushers, of which there are pop_waiters and push_waiters.
+ */
+#define FQSTATIC_DEFINE(name, capacity)					\
+typedef char name##_capacity_check[(capacity) > 0			\
+		&& ((capacity) & ((capacity) - 1)) == 0 ? 1 : -1];	\
+									\
+struct name {								\
+	struct function_queue_element elements[capacity];		\
+	unsigned int head;						\
+	unsigned int tail;						\
+	struct fqlock lock;						\
+	pthread_cond_t notempty;					\
+	pthread_cond_t notfull;						\
+	unsigned int pop_waiters;					\
+	unsigned int push_waiters;					\
+};									\
+									\
+/*									\
+ * This procedure initializes the queue q with a lock of the type	\
+ * locktype, and the queue is empty afterwards. The procedure returns	\
+ * an error code to indicate its status. The value of q must not be	\
+ * NULL.								\
+ */									\
+static FQSTATIC_INLINE enum qterror					\
+name##initwithlock(struct name* q, enum fqlocktype locktype)		\
+{									\
+	enum qterror ret = QTSUCCESS;					\
+									\
+	q->head = 0;							\
+	q->tail = 0;							\
+	q->pop_waiters = 0;						\
+	q->push_waiters = 0;						\
+	ret = fqlockinit(&q->lock, locktype);				\
+									\
+	if(ret != QTSUCCESS)						\
+		return ret;						\
+									\
+	if(pthread_cond_init(&q->notempty, NULL) != 0) {		\
+		(void) fqlockdestroy(&q->lock);				\
+		return QTEPTCINIT;					\
+	}								\
+									\
+	if(pthread_cond_init(&q->notfull, NULL) != 0) {			\
+		(void) pthread_cond_destroy(&q->notempty);		\
+		(void) fqlockdestroy(&q->lock);				\
+		return QTEPTCINIT;					\
+	}								\
+									\
+	return QTSUCCESS;						\
+}									\
+									\
+/*									\
+ * This procedure initializes the queue q with a pthread mutex as its	\
+ * lock, and the queue is empty afterwards. The procedure returns an	\
+ * error code to indicate its status. The value of q must not be NULL.	\
+ */									\
+static FQSTATIC_INLINE enum qterror					\
+name##init(struct name* q)						\
+{									\
+	return name##initwithlock(q, FQLOCK_MUTEX);			\
+}									\
+									\
+/*									\
+ * This procedure destroys the queue q. Its elements are discarded. The	\
+ * procedure returns an error code to indicate its status. The value of	\
+ * q must not be NULL.							\
+ */									\
+static FQSTATIC_INLINE enum qterror					\
+name##destroy(struct name* q)						\
+{									\
+	enum qterror ret = QTSUCCESS;					\
+									\
+	if(pthread_cond_destroy(&q->notfull) != 0)			\
+		ret = QTEPTCDESTROY;					\
+									\
+	if(pthread_cond_destroy(&q->notempty) != 0)			\
+		ret = QTEPTCDESTROY;					\
+									\
+	if(fqlockdestroy(&q->lock) != QTSUCCESS)			\
+		ret = QTEPTMDESTROY;					\
+									\
+	return ret;							\
+}									\
+									\
+/*									\
+ * This procedure pushes func and arg onto the queue q without locking	\
+ * it. The procedure returns QTEFQFULL if the queue is full, or		\
+ * QTSUCCESS otherwise. The value of q must not be NULL.		\
+ */									\
+static FQSTATIC_INLINE enum qterror					\
+name##tryput(struct name* q, void (*func)(void*), void* arg)		\
+{									\
+	struct function_queue_element* e = NULL;			\
+									\
+	if(q->tail - q->head == (capacity))				\
+		return QTEFQFULL;					\
+									\
+	e = &q->elements[q->tail & ((capacity) - 1)];			\
+	e->func = func;							\
+	e->arg = arg;							\
+	++q->tail;							\
+	return QTSUCCESS;						\
+}									\
+									\
+/*									\
+ * This procedure pops the oldest element of the queue q without	\
+ * locking it and stores its function and argument in the element	\
+ * pointed to by e. The procedure returns QTEFQEMPTY if the queue is	\
+ * empty, or QTSUCCESS otherwise. The value of q must not be NULL. The	\
+ * value of e must not be NULL.						\
+ */									\
+static FQSTATIC_INLINE enum qterror					\
+name##trytake(struct name* q, struct function_queue_element* e)		\
+{									\
+	const struct function_queue_element* s = NULL;			\
+									\
+	if(q->tail == q->head)						\
+		return QTEFQEMPTY;					\
+									\
+	s = &q->elements[q->head & ((capacity) - 1)];			\
+	e->func = s->func;						\
+	e->arg = s->arg;						\
+	++q->head;							\
+	return QTSUCCESS;						\
+}									\
+									\
+/*									\
+ * This procedure is a cleanup handler which forgets a waiting pusher	\
+ * and unlocks the queue when the pusher is cancelled. The variable arg	\
+ * is a pointer to the queue.						\
+ */									\
+static FQSTATIC_INLINE void						\
+name##releasepush(void* arg)						\
+{									\
+	struct name* q = (struct name*) arg;				\
+									\
+	--q->push_waiters;						\
+	(void) fqlockrelease(&q->lock);					\
+}									\
+									\
+/*									\
+ * This procedure is a cleanup handler which forgets a waiting popper	\
+ * and unlocks the queue when the popper is cancelled. The variable arg	\
+ * is a pointer to the queue.						\
+ */									\
+static FQSTATIC_INLINE void						\
+name##releasepop(void* arg)						\
+{									\
+	struct name* q = (struct name*) arg;				\
+									\
+	--q->pop_waiters;						\
+	(void) fqlockrelease(&q->lock);					\
+}									\
+									\
+/*									\
+ * This procedure pushes func and arg onto the queue q. If the queue is	\
+ * full, the procedure waits for room if the value of block is		\
+ * non-zero. The procedure returns an error code to indicate its	\
+ * status. The value of q must not be NULL.				\
+ */									\
+static FQSTATIC_INLINE enum qterror					\
+name##push(struct name* q, void (*func)(void*), void* arg, int block)	\
+{									\
+	struct fqlocknode locknode;					\
+	enum qterror ret = QTSUCCESS;					\
+									\
+	if(fqlockacquire(&q->lock, &locknode) != QTSUCCESS)		\
+		return QTEPTMLOCK;					\
+									\
+	ret = name##tryput(q, func, arg);				\
+									\
+	while(ret == QTEFQFULL && block) {				\
+		++q->push_waiters;					\
+		pthread_cleanup_push(name##releasepush, q);		\
+		(void) fqlockwait(&q->lock, &q->notfull, NULL);		\
+		pthread_cleanup_pop(0);					\
+		--q->push_waiters;					\
+		ret = name##tryput(q, func, arg);			\
+	}								\
+									\
+	if(ret == QTSUCCESS && q->pop_waiters > 0)			\
+		fqlockwake(&q->lock, &q->notempty, 0);			\
+									\
+	if(fqlockrelease(&q->lock) != QTSUCCESS)			\
+		return QTEPTMUNLOCK;					\
+									\
+	return ret;							\
+}									\
+									\
+/*									\
+ * This procedure pops the oldest element of the queue q and stores its	\
+ * function and argument in the element pointed to by e. If the queue	\
+ * is empty, the procedure waits for an element if the value of block	\
+ * is non-zero. The procedure returns an error code to indicate its	\
+ * status. The value of q must not be NULL. The value of e must not be	\
+ * NULL.								\
+ */									\
+static FQSTATIC_INLINE enum qterror					\
+name##pop(struct name* q, struct function_queue_element* e, int block)	\
+{									\
+	struct fqlocknode locknode;					\
+	enum qterror ret = QTSUCCESS;					\
+									\
+	if(fqlockacquire(&q->lock, &locknode) != QTSUCCESS)		\
+		return QTEPTMLOCK;					\
+									\
+	ret = name##trytake(q, e);					\
+									\
+	while(ret == QTEFQEMPTY && block) {				\
+		++q->pop_waiters;					\
+		pthread_cleanup_push(name##releasepop, q);		\
+		(void) fqlockwait(&q->lock, &q->notempty, NULL);	\
+		pthread_cleanup_pop(0);					\
+		--q->pop_waiters;					\
+		ret = name##trytake(q, e);				\
+	}								\
+									\
+	if(ret == QTSUCCESS && q->push_waiters > 0)			\
+		fqlockwake(&q->lock, &q->notfull, 0);			\
+									\
+	if(fqlockrelease(&q->lock) != QTSUCCESS)			\
+		return QTEPTMUNLOCK;					\
+									\
+	return ret;							\
+}
+
+#endif
@@ -0,0 +1,647 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "fqbuffer.h"
+#include "function_queue_element.h"
+#include "function_queue.h"
+#include "qterror.h"
+
+/*
+ * This structure holds the buffer of one thread. The member owner is a
+ * pointer to the producer-side buffer this belongs to, and the member fq
+ * is the function queue it flushes to. The member thread is the thread
+ * the buffer belongs to. The member next is the address of the next
+ * thread buffer of the owner. The member lock guards the members below
+ * it, since the flusher thread of the owner may flush the buffer of an
+ * idle thread. The member elements is a pointer to the array of
+ * buffered elements. The member first is the time at which the oldest
+ * buffered element was pushed. The member count is the number of
+ * buffered elements. The member flushing is non-zero while the thread
+ * in the member flusher pushes the elements onto the function queue
+ * without the lock held, and the member flushed is signaled when it is
+ * done. The member round is the last pass of the flusher thread which
+ * looked at the buffer; it is guarded by the lock of the owner.
+ */
+struct fqbufferlocal {
+	struct fqbuffer* owner;
+	struct function_queue* fq;
+	pthread_t thread;
+	struct fqbufferlocal* next;
+	pthread_mutex_t lock;
+	struct function_queue_element* elements;
+	struct timespec first;
+	unsigned int count;
+	int flushing;
+	pthread_t flusher;
+	pthread_cond_t flushed;
+	unsigned long round;
+};
+
+static enum qterror get_local(struct fqbuffer*, struct fqbufferlocal**);
+static void release_local(void*);
+static void free_local(struct fqbufferlocal*);
+static void* flush_loop(void*);
+static int flush_due(struct fqbuffer*);
+static enum qterror flush_local(struct fqbufferlocal*, int);
+static int flushing_here(const struct fqbufferlocal*);
+static unsigned long elapsed_usec(const struct timespec*);
+
+/*
+ * The initialized buffers, in which the destructors of exiting threads
+ * look their buffers up, since a buffer may be destroyed while a thread
+ * exits.
+ */
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fqbuffer* buffers = NULL;
+
+/*
+ * This procedure initializes the producer-side buffer b for the
+ * function queue fq. Each thread buffers at most capacity elements. If
+ * the value of max_delay is not 0, a buffer is also flushed once its
+ * oldest element has waited at least max_delay microseconds, by the
+ * next push of its thread or else by a flusher thread which looks at
+ * the buffers every max_delay / 2 microseconds. The procedure returns
+ * an error code to indicate its status. The value of b must not be
+ * NULL. The value of fq must not be NULL.
+ */
+enum qterror
+fqbufferinit(struct fqbuffer* b, struct function_queue* fq,
+		unsigned int capacity, unsigned long max_delay)
+{
+	assert(b != NULL);
+	assert(fq != NULL);
+
+	if(capacity == 0)
+		return QTEINVALID;
+
+	b->fq = fq;
+	b->locals = NULL;
+	b->capacity = capacity;
+	b->max_delay = max_delay;
+	b->stopping = 0;
+	b->round = 0;
+	b->releasing = 0;
+
+	if(pthread_mutex_init(&b->lock, NULL) != 0)
+		return QTEPTMINIT;
+
+	/* ignore more errors at these points */
+	if(pthread_cond_init(&b->tick, NULL) != 0) {
+		(void) pthread_mutex_destroy(&b->lock);
+		return QTEPTCINIT;
+	}
+
+	if(pthread_cond_init(&b->released, NULL) != 0) {
+		(void) pthread_cond_destroy(&b->tick);
+		(void) pthread_mutex_destroy(&b->lock);
+		return QTEPTCINIT;
+	}
+
+	if(pthread_key_create(&b->key, release_local) != 0) {
+		(void) pthread_cond_destroy(&b->released);
+		(void) pthread_cond_destroy(&b->tick);
+		(void) pthread_mutex_destroy(&b->lock);
+		return QTEPTKCREATE;
+	}
+
+	if(pthread_mutex_lock(&buffers_lock) != 0) {
+		(void) pthread_key_delete(b->key);
+		(void) pthread_cond_destroy(&b->released);
+		(void) pthread_cond_destroy(&b->tick);
+		(void) pthread_mutex_destroy(&b->lock);
+		return QTEPTMLOCK;
+	}
+
+	if(max_delay != 0 && pthread_create(&b->flusher, NULL, flush_loop,
+				b) != 0) {
+		(void) pthread_mutex_unlock(&buffers_lock);
+		(void) pthread_key_delete(b->key);
+		(void) pthread_cond_destroy(&b->released);
+		(void) pthread_cond_destroy(&b->tick);
+		(void) pthread_mutex_destroy(&b->lock);
+		return QTEPTCREATE;
+	}
+
+	b->next = buffers;
+	buffers = b;
+	(void) pthread_mutex_unlock(&buffers_lock);
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure destroys the given producer-side buffer. The flusher
+ * thread is stopped, the exiting threads which are flushing their
+ * buffers are waited for, and the elements still buffered by any other
+ * thread are flushed to the function queue, blocking if necessary,
+ * without the buffer locked. No thread may push through the buffer
+ * while or after it is destroyed, but the threads which pushed through
+ * it may exit meanwhile. The procedure returns an error code to
+ * indicate its status. The value of b must not be NULL.
+ */
+enum qterror
+fqbufferdestroy(struct fqbuffer* b)
+{
+	struct fqbufferlocal* l = NULL;
+	struct fqbuffer** it = NULL;
+	enum qterror ret = QTSUCCESS;
+
+	assert(b != NULL);
+
+	if(pthread_mutex_lock(&buffers_lock) != 0)
+		return QTEPTMLOCK;
+
+	/* threads which exit from now on leave their buffers to us */
+	(void) pthread_key_delete(b->key);
+
+	for(it = &buffers; *it != NULL; it = &(*it)->next) {
+		if(*it == b) {
+			*it = b->next;
+			break;
+		}
+	}
+
+	if(pthread_mutex_lock(&b->lock) != 0) {
+		(void) pthread_mutex_unlock(&buffers_lock);
+		return QTEPTMLOCK;
+	}
+
+	(void) pthread_mutex_unlock(&buffers_lock);
+
+	if(b->max_delay != 0) {
+		b->stopping = 1;
+		(void) pthread_cond_signal(&b->tick);
+		(void) pthread_mutex_unlock(&b->lock);
+		(void) pthread_join(b->flusher, NULL);
+		(void) pthread_mutex_lock(&b->lock);
+	}
+
+	l = b->locals;
+	b->locals = NULL;
+
+	while(b->releasing > 0)
+		(void) pthread_cond_wait(&b->released, &b->lock);
+
+	(void) pthread_mutex_unlock(&b->lock);
+
+	while(l != NULL) {
+		struct fqbufferlocal* next = l->next;
+		enum qterror flushed = QTSUCCESS;
+
+		(void) pthread_mutex_lock(&l->lock);
+		flushed = flush_local(l, 1);
+		(void) pthread_mutex_unlock(&l->lock);
+
+		if(ret == QTSUCCESS)
+			ret = flushed;
+
+		free_local(l);
+		l = next;
+	}
+
+	if(pthread_cond_destroy(&b->released) != 0 && ret == QTSUCCESS)
+		ret = QTEPTCDESTROY;
+
+	if(pthread_cond_destroy(&b->tick) != 0 && ret == QTSUCCESS)
+		ret = QTEPTCDESTROY;
+
+	if(pthread_mutex_destroy(&b->lock) != 0 && ret == QTSUCCESS)
+		ret = QTEPTMDESTROY;
+
+	return ret;
+}
+
+/*
+ * This procedure adds the given function pointer and argument arg to
+ * the buffer of the calling thread. The buffer is flushed to the
+ * function queue when it fills up or when its oldest element has
+ * waited for the maximum delay. A failed flush leaves the elements
+ * buffered for the next push or flush. If the buffer is still full, the
+ * error of the flush is returned. A function which the queue runs in
+ * the calling thread while it flushes the buffer, as under
+ * FQOVERFLOW_CALLERRUNS, pushes straight onto the queue once the buffer
+ * is full. This procedure may block if the value of block is non-zero.
+ * The procedure returns an error code to indicate its status. The value
+ * of b must not be NULL.
+ */
+enum qterror
+fqbufferpush(struct fqbuffer* b, void (*func)(void*), void* arg, int block)
+{
+	struct fqbufferlocal* l = NULL;
+	enum qterror ret = QTSUCCESS;
+
+	assert(b != NULL);
+	ret = get_local(b, &l);
+
+	if(ret != QTSUCCESS)
+		return ret;
+
+	if(pthread_mutex_lock(&l->lock) != 0)
+		return QTEPTMLOCK;
+
+	/* the flush in progress on this thread cannot make room */
+	if(l->count == b->capacity && flushing_here(l)) {
+		(void) pthread_mutex_unlock(&l->lock);
+		return fqpush(l->fq, func, arg, block);
+	}
+
+	if(l->count == b->capacity) {
+		ret = flush_local(l, block);
+
+		if(l->count == b->capacity) {
+			(void) pthread_mutex_unlock(&l->lock);
+			return ret != QTSUCCESS ? ret : QTEFQFULL;
+		}
+	}
+
+	if(l->count == 0 && b->max_delay != 0)
+		(void) clock_gettime(CLOCK_MONOTONIC, &l->first);
+
+	l->elements[l->count].func = func;
+	l->elements[l->count].arg = arg;
+	++l->count;
+
+	if(l->count == b->capacity || (b->max_delay != 0
+			&& elapsed_usec(&l->first) >= b->max_delay))
+		(void) flush_local(l, block);
+
+	(void) pthread_mutex_unlock(&l->lock);
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure flushes the elements buffered by the calling thread to
+ * the function queue in one locked batch. This procedure may block if
+ * the value of block is non-zero. The procedure returns an error code
+ * to indicate its status. The value of b must not be NULL.
+ */
+enum qterror
+fqbufferflush(struct fqbuffer* b, int block)
+{
+	struct fqbufferlocal* l = NULL;
+	enum qterror ret = QTSUCCESS;
+
+	assert(b != NULL);
+	l = pthread_getspecific(b->key);
+
+	if(l == NULL)
+		return QTSUCCESS;
+
+	if(pthread_mutex_lock(&l->lock) != 0)
+		return QTEPTMLOCK;
+
+	ret = flush_local(l, block);
+	(void) pthread_mutex_unlock(&l->lock);
+	return ret;
+}
+
+/*
+ * This procedure retrieves the buffer of the calling thread and stores
+ * its address at the address pointed to by out. The buffer is created
+ * the first time a thread asks for it. The procedure returns an error
+ * code to indicate its status. The value of b must not be NULL. The
+ * value of out must not be NULL.
+ */
+static enum qterror
+get_local(struct fqbuffer* b, struct fqbufferlocal** out)
+{
+	struct fqbufferlocal* l = NULL;
+
+	assert(b != NULL);
+	assert(out != NULL);
+	l = pthread_getspecific(b->key);
+
+	if(l != NULL) {
+		*out = l;
+		return QTSUCCESS;
+	}
+
+	l = malloc(sizeof(*l));
+
+	if(l == NULL)
+		return QTEMALLOC;
+
+	l->elements = malloc(b->capacity * sizeof(*l->elements));
+
+	if(l->elements == NULL) {
+		free(l);
+		return QTEMALLOC;
+	}
+
+	if(pthread_mutex_init(&l->lock, NULL) != 0) {
+		free(l->elements);
+		free(l);
+		return QTEPTMINIT;
+	}
+
+	if(pthread_cond_init(&l->flushed, NULL) != 0) {
+		(void) pthread_mutex_destroy(&l->lock);
+		free(l->elements);
+		free(l);
+		return QTEPTCINIT;
+	}
+
+	l->owner = b;
+	l->fq = b->fq;
+	l->thread = pthread_self();
+	l->count = 0;
+	l->flushing = 0;
+	l->round = 0;
+
+	if(pthread_setspecific(b->key, l) != 0) {
+		free_local(l);
+		return QTEPTSETSPECIFIC;
+	}
+
+	if(pthread_mutex_lock(&b->lock) != 0) {
+		(void) pthread_setspecific(b->key, NULL);
+		free_local(l);
+		return QTEPTMLOCK;
+	}
+
+	l->next = b->locals;
+	b->locals = l;
+	(void) pthread_mutex_unlock(&b->lock);
+	*out = l;
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure is the destructor of the buffer of an exiting thread.
+ * The buffer may have been taken and freed by fqbufferdestroy() before
+ * the destructor runs, so it is only used once it is found on the list
+ * of an initialized producer-side buffer. The thread then takes it off
+ * the list, so that fqbufferdestroy() waits for it instead of freeing
+ * it, flushes the buffered elements to the function queue, blocking if
+ * necessary, and frees the buffer. The variable arg is a pointer to the
+ * buffer of the thread. The value of arg must not be NULL.
+ */
+static void
+release_local(void* arg)
+{
+	struct fqbufferlocal* l = arg;
+	struct fqbufferlocal** it = NULL;
+	struct fqbuffer* b = NULL;
+	int listed = 0;
+
+	assert(l != NULL);
+	(void) pthread_mutex_lock(&buffers_lock);
+
+	for(b = buffers; b != NULL && !listed; b = b->next) {
+		(void) pthread_mutex_lock(&b->lock);
+
+		/* a freed buffer may have been reused by another thread */
+		for(it = &b->locals; *it != NULL; it = &(*it)->next) {
+			if(*it == l && pthread_equal(l->thread,
+						pthread_self())) {
+				*it = l->next;
+				listed = 1;
+				++b->releasing;
+				break;
+			}
+		}
+
+		(void) pthread_mutex_unlock(&b->lock);
+	}
+
+	(void) pthread_mutex_unlock(&buffers_lock);
+
+	if(!listed)
+		return;
+
+	b = l->owner;
+
+	/* the flusher thread may still be flushing the buffer */
+	(void) pthread_mutex_lock(&l->lock);
+	(void) flush_local(l, 1);
+	(void) pthread_mutex_unlock(&l->lock);
+	free_local(l);
+	(void) pthread_mutex_lock(&b->lock);
+
+	if(--b->releasing == 0)
+		(void) pthread_cond_broadcast(&b->released);
+
+	(void) pthread_mutex_unlock(&b->lock);
+}
+
+/*
+ * This procedure frees the thread buffer l, which no other thread may
+ * use any more. The value of l must not be NULL.
+ */
+static void
+free_local(struct fqbufferlocal* l)
+{
+	assert(l != NULL);
+	(void) pthread_cond_destroy(&l->flushed);
+	(void) pthread_mutex_destroy(&l->lock);
+	free(l->elements);
+	free(l);
+}
+
+/*
+ * This procedure is the body of the flusher thread of a buffer with a
+ * time bound. Every max_delay / 2 microseconds, it flushes the thread
+ * buffers whose oldest element has waited for the maximum delay, until
+ * the buffer is destroyed. The variable arg is a pointer to the buffer.
+ * The value of arg must not be NULL.
+ */
+static void*
+flush_loop(void* arg)
+{
+	struct fqbuffer* b = arg;
+	unsigned long period = 0;
+
+	assert(b != NULL);
+	period = b->max_delay / 2 > 0 ? b->max_delay / 2 : 1;
+	(void) pthread_mutex_lock(&b->lock);
+
+	while(!b->stopping) {
+		struct timespec abstime;
+		int err = 0;
+
+		(void) clock_gettime(CLOCK_REALTIME, &abstime);
+		abstime.tv_sec += (time_t) (period / 1000000UL);
+		abstime.tv_nsec += (long) (period % 1000000UL * 1000UL);
+
+		if(abstime.tv_nsec >= 1000000000L) {
+			++abstime.tv_sec;
+			abstime.tv_nsec -= 1000000000L;
+		}
+
+		do {
+			err = pthread_cond_timedwait(&b->tick, &b->lock,
+					&abstime);
+		} while(err == 0 && !b->stopping);
+
+		if(b->stopping)
+			break;
+
+		++b->round;
+
+		/* the list may change while a buffer is flushed */
+		while(flush_due(b))
+			continue;
+	}
+
+	(void) pthread_mutex_unlock(&b->lock);
+	return NULL;
+}
+
+/*
+ * This procedure flushes the first thread buffer which the flusher
+ * thread has not looked at during this pass and whose oldest element
+ * has waited for the maximum delay. Buffers in use by their thread are
+ * skipped, since their next push checks the delay, and so are those
+ * being flushed. The buffer is flushed without blocking and without the
+ * lock of b, which must be held by the calling thread. The procedure returns non-zero if it
+ * released the lock, in which case the list must be walked again, or 0
+ * once every buffer has been looked at. The value of b must not be
+ * NULL.
+ */
+static int
+flush_due(struct fqbuffer* b)
+{
+	struct fqbufferlocal* l = NULL;
+
+	assert(b != NULL);
+
+	for(l = b->locals; l != NULL; l = l->next) {
+		if(l->round == b->round)
+			continue;
+
+		l->round = b->round;
+
+		if(pthread_mutex_trylock(&l->lock) != 0)
+			continue;
+
+		if(!l->flushing && l->count > 0
+				&& elapsed_usec(&l->first) >= b->max_delay)
+			break;
+
+		(void) pthread_mutex_unlock(&l->lock);
+	}
+
+	if(l == NULL)
+		return 0;
+
+	/* an exiting thread waits for the lock of its buffer */
+	(void) pthread_mutex_unlock(&b->lock);
+	(void) flush_local(l, 0);
+	(void) pthread_mutex_unlock(&l->lock);
+	(void) pthread_mutex_lock(&b->lock);
+	return 1;
+}
+
+/*
+ * This procedure pushes the elements of the thread buffer l onto the
+ * function queue with fqpushv(). The elements which were not consumed
+ * stay in the buffer in their original order, ahead of those buffered
+ * meanwhile. The lock of the buffer must be held by the calling thread.
+ * It is released while the elements are pushed, since the queue may run
+ * functions in the calling thread. A flush by another thread is waited
+ * for first; a flush by the calling thread, which is then running one
+ * of those functions, is left to finish, and nothing is flushed. This
+ * procedure may block if the value of block is non-zero. The procedure
+ * returns an error code to indicate its status. The value of l must
+ * not be NULL.
+ */
+static enum qterror
+flush_local(struct fqbufferlocal* l, int block)
+{
+	enum qterror ret = QTSUCCESS;
+	unsigned int count = 0;
+	unsigned int pushed = 0;
+
+	assert(l != NULL);
+
+	while(l->flushing && !flushing_here(l))
+		(void) pthread_cond_wait(&l->flushed, &l->lock);
+
+	if(l->flushing || l->count == 0)
+		return QTSUCCESS;
+
+	/* only the flushing thread moves the elements it pushes */
+	count = l->count;
+	l->flushing = 1;
+	l->flusher = pthread_self();
+	(void) pthread_mutex_unlock(&l->lock);
+	ret = fqpushv(l->fq, l->elements, count, &pushed, block);
+	(void) pthread_mutex_lock(&l->lock);
+	l->flushing = 0;
+
+	if(pushed > 0) {
+		l->count -= pushed;
+		memmove(l->elements, &l->elements[pushed],
+				l->count * sizeof(*l->elements));
+	}
+
+	(void) pthread_cond_broadcast(&l->flushed);
+	return ret;
+}
+
+/*
+ * This procedure returns non-zero if the calling thread is flushing the
+ * thread buffer l. The lock of the buffer must be held by the calling
+ * thread. The value of l must not be NULL.
+ */
+static int
+flushing_here(const struct fqbufferlocal* l)
+{
+	assert(l != NULL);
+	return l->flushing && pthread_equal(l->flusher, pthread_self());
+}
+
+/*
+ * This procedure calculates the number of microseconds which have
+ * passed on the monotonic clock since the time pointed to by since.
+ * The result saturates instead of overflowing. The value of since must
+ * not be NULL.
+ */
+static unsigned long
+elapsed_usec(const struct timespec* since)
+{
+	struct timespec now;
+	unsigned long sec = 0;
+	long nsec = 0;
+
+	assert(since != NULL);
+	(void) clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if(now.tv_sec < since->tv_sec)
+		return 0;
+
+	sec = (unsigned long) (now.tv_sec - since->tv_sec);
+	nsec = now.tv_nsec - since->tv_nsec;
+
+	if(nsec < 0) {
+		if(sec == 0)
+			return 0;
+
+		--sec;
+		nsec += 1000000000L;
+	}
+
+	if(sec >= ULONG_MAX / 1000000UL)
+		return ULONG_MAX;
+
+	return sec * 1000000UL + (unsigned long) nsec / 1000UL;
+}
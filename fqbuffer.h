@@ -0,0 +1,75 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FQBUFFER_H
+#define FQBUFFER_H
+
+#include <pthread.h>
+
+#include "function_queue.h"
+#include "qterror.h"
+
+struct fqbufferlocal;
+
+/*
+ * This structure holds a producer-side buffer for a function queue.
+ * Each thread which pushes through the buffer gets its own array of
+ * elements, which is flushed to the queue in one locked batch. The
+ * member fq is a pointer to the function queue to flush to. The member
+ * key is the key of the buffer of each thread. The member lock guards
+ * the list of thread buffers pointed to by the member locals and the
+ * members below it. The member capacity is the number of elements each
+ * thread buffers before flushing. The member max_delay is the number of
+ * microseconds an element may stay buffered before it is flushed, or 0
+ * for no time bound. The member flusher is the thread which flushes the
+ * buffers of idle threads in time if there is a time bound; it waits on
+ * the member tick until the member stopping is set. The member round
+ * counts its passes over the thread buffers. The member releasing is
+ * the number of exiting threads which are flushing their buffers, and
+ * the member released is signaled when one of them is done. The member
+ * next is the address of the next initialized buffer.
+ */
+struct fqbuffer {
+	struct function_queue* fq;
+	pthread_key_t key;
+	pthread_mutex_t lock;
+	struct fqbufferlocal* locals;
+	unsigned int capacity;
+	unsigned long max_delay;
+	pthread_t flusher;
+	pthread_cond_t tick;
+	pthread_cond_t released;
+	int stopping;
+	unsigned long round;
+	unsigned int releasing;
+	struct fqbuffer* next;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum qterror fqbufferinit(struct fqbuffer*, struct function_queue*,
+		unsigned int, unsigned long);
+enum qterror fqbufferdestroy(struct fqbuffer*);
+enum qterror fqbufferpush(struct fqbuffer*, void (*)(void*), void*, int);
+enum qterror fqbufferflush(struct fqbuffer*, int);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
+
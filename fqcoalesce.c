@@ -0,0 +1,223 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "fqcoalesce.h"
+#include "qterror.h"
+
+static unsigned int find_slot(const struct fqcoalesce*, void (*)(void*),
+		void*);
+static unsigned int home_slot(const struct fqcoalesce*, void (*)(void*),
+		void*);
+static enum qterror grow(struct fqcoalesce*);
+
+/*
+ * This procedure initializes an empty coalescing index. The procedure
+ * returns an error code to indicate its status. The value of c must not
+ * be NULL.
+ */
+enum qterror
+fqcoalesceinit(struct fqcoalesce* c)
+{
+	assert(c != NULL);
+	c->entries = calloc(FQCOALESCE_MIN_CAPACITY, sizeof(*c->entries));
+
+	if(c->entries == NULL)
+		return QTEMALLOC;
+
+	c->capacity = FQCOALESCE_MIN_CAPACITY;
+	c->count = 0;
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure destroys the given index. The value of c must not be
+ * NULL.
+ */
+void
+fqcoalescedestroy(struct fqcoalesce* c)
+{
+	assert(c != NULL);
+	free(c->entries);
+	c->entries = NULL;
+	c->capacity = 0;
+	c->count = 0;
+}
+
+/*
+ * This procedure checks if the pair of func and arg is in the index. It
+ * returns non-zero if it is. The value of c must not be NULL.
+ */
+int
+fqcoalescefind(const struct fqcoalesce* c, void (*func)(void*), void* arg)
+{
+	assert(c != NULL);
+	return c->entries[find_slot(c, func, arg)].used;
+}
+
+/*
+ * This procedure adds the pair of func and arg to the index, growing it
+ * if it would be more than half full. Adding a pair which is already in
+ * the index does nothing. The procedure returns an error code to
+ * indicate its status. The value of c must not be NULL.
+ */
+enum qterror
+fqcoalesceadd(struct fqcoalesce* c, void (*func)(void*), void* arg)
+{
+	enum qterror ret = QTSUCCESS;
+	unsigned int slot = 0;
+
+	assert(c != NULL);
+
+	if((c->count + 1) * 2 > c->capacity) {
+		ret = grow(c);
+
+		if(ret != QTSUCCESS)
+			return ret;
+	}
+
+	slot = find_slot(c, func, arg);
+
+	if(!c->entries[slot].used) {
+		c->entries[slot].func = func;
+		c->entries[slot].arg = arg;
+		c->entries[slot].used = 1;
+		++c->count;
+	}
+
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure removes the pair of func and arg from the index if it
+ * is there. The entries after it in its probe sequence are shifted back
+ * so that no deleted markers are needed. The value of c must not be
+ * NULL.
+ */
+void
+fqcoalesceremove(struct fqcoalesce* c, void (*func)(void*), void* arg)
+{
+	unsigned int mask = 0;
+	unsigned int hole = 0;
+	unsigned int i = 0;
+
+	assert(c != NULL);
+	hole = find_slot(c, func, arg);
+
+	if(!c->entries[hole].used)
+		return;
+
+	mask = c->capacity - 1;
+	c->entries[hole].used = 0;
+	--c->count;
+
+	for(i = (hole + 1) & mask; c->entries[i].used; i = (i + 1) & mask) {
+		unsigned int home = home_slot(c, c->entries[i].func,
+				c->entries[i].arg);
+
+		/* move the entry if the hole lies between its home and it */
+		if(((i - home) & mask) >= ((i - hole) & mask)) {
+			c->entries[hole] = c->entries[i];
+			c->entries[i].used = 0;
+			hole = i;
+		}
+	}
+}
+
+/*
+ * This procedure finds the slot which holds the pair of func and arg,
+ * or the free slot which ends its probe sequence. The index is never
+ * full, so the search ends. The value of c must not be NULL.
+ */
+static unsigned int
+find_slot(const struct fqcoalesce* c, void (*func)(void*), void* arg)
+{
+	unsigned int mask = 0;
+	unsigned int i = 0;
+
+	assert(c != NULL);
+	mask = c->capacity - 1;
+
+	for(i = home_slot(c, func, arg); c->entries[i].used;
+			i = (i + 1) & mask)
+		if(c->entries[i].func == func && c->entries[i].arg == arg)
+			break;
+
+	return i;
+}
+
+/*
+ * This procedure calculates the slot where the probe sequence of the
+ * pair of func and arg starts. The bytes of both pointers are hashed
+ * with FNV-1a, since a function pointer cannot be converted to an
+ * integer portably. The value of c must not be NULL.
+ */
+static unsigned int
+home_slot(const struct fqcoalesce* c, void (*func)(void*), void* arg)
+{
+	const unsigned char* bytes = NULL;
+	unsigned long hash = 2166136261UL;
+	size_t i = 0;
+
+	assert(c != NULL);
+	bytes = (const unsigned char*) &func;
+
+	for(i = 0; i < sizeof(func); ++i)
+		hash = ((hash ^ bytes[i]) * 16777619UL) & 0xffffffffUL;
+
+	bytes = (const unsigned char*) &arg;
+
+	for(i = 0; i < sizeof(arg); ++i)
+		hash = ((hash ^ bytes[i]) * 16777619UL) & 0xffffffffUL;
+
+	return (unsigned int) hash & (c->capacity - 1);
+}
+
+/*
+ * This procedure doubles the capacity of the index and inserts every
+ * entry again. The procedure returns an error code to indicate its
+ * status. The value of c must not be NULL.
+ */
+static enum qterror
+grow(struct fqcoalesce* c)
+{
+	struct fqcoalesceentry* old = NULL;
+	unsigned int old_capacity = 0;
+	unsigned int i = 0;
+
+	assert(c != NULL);
+	old = c->entries;
+	old_capacity = c->capacity;
+	c->entries = calloc(old_capacity * 2, sizeof(*c->entries));
+
+	if(c->entries == NULL) {
+		c->entries = old;
+		return QTEMALLOC;
+	}
+
+	c->capacity = old_capacity * 2;
+
+	for(i = 0; i < old_capacity; ++i)
+		if(old[i].used)
+			c->entries[find_slot(c, old[i].func, old[i].arg)] =
+					old[i];
+
+	free(old);
+	return QTSUCCESS;
+}
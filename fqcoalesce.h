@@ -0,0 +1,65 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FQCOALESCE_H
+#define FQCOALESCE_H
+
+#include "qterror.h"
+
+/* the number of entries an index starts with; a power of two */
+#ifndef FQCOALESCE_MIN_CAPACITY
+#define FQCOALESCE_MIN_CAPACITY 16
+#endif
+
+/*
+ * This structure is one entry of a coalescing index. The members func
+ * and arg are the pair which is pending in the queue. The member used
+ * is non-zero if the entry holds a pair.
+ */
+struct fqcoalesceentry {
+	void (* func)(void*);
+	void* arg;
+	int used;
+};
+
+/*
+ * This structure holds the index of the pairs of function and argument
+ * which are pending in a coalescing function queue. It is a hash table
+ * with linear probing which is kept at most half full. The member
+ * entries is a pointer to the array of capacity entries, where the
+ * value of capacity is a power of two. The member count is the number
+ * of entries in use.
+ */
+struct fqcoalesce {
+	struct fqcoalesceentry* entries;
+	unsigned int capacity;
+	unsigned int count;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum qterror fqcoalesceinit(struct fqcoalesce*);
+void fqcoalescedestroy(struct fqcoalesce*);
+int fqcoalescefind(const struct fqcoalesce*, void (*)(void*), void*);
+enum qterror fqcoalesceadd(struct fqcoalesce*, void (*)(void*), void*);
+void fqcoalesceremove(struct fqcoalesce*, void (*)(void*), void*);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,259 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <limits.h>
+#include <assert.h>
+#include <time.h>
+
+#include "fqcodel.h"
+
+/* the largest count which the control law distinguishes */
+#define FQCODEL_MAX_COUNT 0xffffUL
+
+static int reached(const struct timespec*, const struct timespec*);
+static unsigned long elapsed(const struct timespec*, const struct timespec*);
+static void add_us(struct timespec*, unsigned long);
+static void control_law(const struct fqcodel*, struct timespec*);
+static unsigned long isqrt(unsigned long);
+
+/*
+ * This procedure initializes a CoDel controller which sheds load in the
+ * given mode while the time elements spend in the queue stays above
+ * target microseconds for interval microseconds. The value of c must not
+ * be NULL.
+ */
+void
+fqcodelinit(struct fqcodel* c, unsigned long target, unsigned long interval,
+		enum fqcodelmode mode)
+{
+	assert(c != NULL);
+	c->target = target;
+	c->interval = interval;
+	c->mode = mode;
+	c->above = 0;
+	c->first_above.tv_sec = 0;
+	c->first_above.tv_nsec = 0;
+	c->dropping = 0;
+	c->drop_next.tv_sec = 0;
+	c->drop_next.tv_nsec = 0;
+	c->count = 0;
+	c->last_count = 0;
+	c->reject = 0;
+	c->shed = 0;
+}
+
+/*
+ * This procedure feeds the controller c with an element popped at the
+ * time now which was pushed at the time enqueued, while remaining
+ * elements are left in the queue. An element without a time counts as
+ * not having waited, and load is never shed when the queue becomes
+ * empty. In the mode FQCODEL_REJECT, each decision to shed load makes
+ * one later push fail. The procedure returns non-zero if the element is to be
+ * dropped, which only happens in the mode FQCODEL_DROP. The value of c
+ * must not be NULL. The value of enqueued must not be NULL. The value of
+ * now must not be NULL.
+ */
+int
+fqcodeldequeue(struct fqcodel* c, const struct timespec* enqueued,
+		const struct timespec* now, unsigned int remaining)
+{
+	unsigned long sojourn = 0;
+	int ok_to_drop = 0;
+	int shed = 0;
+
+	assert(c != NULL);
+	assert(enqueued != NULL);
+	assert(now != NULL);
+
+	if(enqueued->tv_sec != 0 || enqueued->tv_nsec != 0)
+		sojourn = elapsed(enqueued, now);
+
+	if(sojourn < c->target || remaining == 0) {
+		c->above = 0;
+	} else if(!c->above) {
+		c->above = 1;
+		c->first_above = *now;
+		add_us(&c->first_above, c->interval);
+	} else if(reached(now, &c->first_above)) {
+		ok_to_drop = 1;
+	}
+
+	if(c->dropping) {
+		if(!ok_to_drop) {
+			c->dropping = 0;
+			c->reject = 0;
+		} else if(reached(now, &c->drop_next)) {
+			shed = 1;
+			++c->count;
+			control_law(c, &c->drop_next);
+		}
+	} else if(ok_to_drop) {
+		unsigned long delta = c->count - c->last_count;
+
+		shed = 1;
+		c->dropping = 1;
+
+		/* shedding which stopped recently resumes near its rate */
+		if(delta > 1 && elapsed(&c->drop_next, now) < 16 * c->interval)
+			c->count = delta;
+		else
+			c->count = 1;
+
+		c->drop_next = *now;
+		control_law(c, &c->drop_next);
+		c->last_count = c->count;
+	}
+
+	if(!shed)
+		return 0;
+
+	if(c->mode == FQCODEL_REJECT) {
+		++c->reject;
+		return 0;
+	}
+
+	++c->shed;
+	return 1;
+}
+
+/*
+ * This procedure checks if the controller c decided that a push is to
+ * be rejected, and consumes one such decision. It returns non-zero if
+ * the push is to be rejected. The value of c must not be NULL.
+ */
+int
+fqcodelreject(struct fqcodel* c)
+{
+	assert(c != NULL);
+
+	if(c->reject == 0)
+		return 0;
+
+	--c->reject;
+	++c->shed;
+	return 1;
+}
+
+/*
+ * This procedure returns non-zero if the time now is at or after the
+ * time t. The value of now must not be NULL. The value of t must not be
+ * NULL.
+ */
+static int
+reached(const struct timespec* now, const struct timespec* t)
+{
+	assert(now != NULL);
+	assert(t != NULL);
+	return now->tv_sec > t->tv_sec || (now->tv_sec == t->tv_sec
+			&& now->tv_nsec >= t->tv_nsec);
+}
+
+/*
+ * This procedure returns the number of microseconds from the time from
+ * to the time to, or 0 if to is before from. The value of from must not
+ * be NULL. The value of to must not be NULL.
+ */
+static unsigned long
+elapsed(const struct timespec* from, const struct timespec* to)
+{
+	long sec = 0;
+	long nsec = 0;
+
+	assert(from != NULL);
+	assert(to != NULL);
+
+	if(!reached(to, from))
+		return 0;
+
+	sec = (long) (to->tv_sec - from->tv_sec);
+	nsec = to->tv_nsec - from->tv_nsec;
+
+	if(nsec < 0) {
+		--sec;
+		nsec += 1000000000L;
+	}
+
+	if((unsigned long) sec >= ULONG_MAX / 1000000UL)
+		return ULONG_MAX;
+
+	return (unsigned long) sec * 1000000UL + (unsigned long) nsec / 1000UL;
+}
+
+/*
+ * This procedure adds us microseconds to the time t. The value of t must
+ * not be NULL.
+ */
+static void
+add_us(struct timespec* t, unsigned long us)
+{
+	assert(t != NULL);
+	t->tv_sec += (time_t) (us / 1000000UL);
+	t->tv_nsec += (long) (us % 1000000UL * 1000UL);
+
+	if(t->tv_nsec >= 1000000000L) {
+		t->tv_nsec -= 1000000000L;
+		++t->tv_sec;
+	}
+}
+
+/*
+ * This procedure advances the time t by the interval of the controller
+ * c divided by the square root of its count, so that load is shed ever
+ * faster while the queue stays too long. The division is done in fixed
+ * point with 8 fractional bits. The value of c must not be NULL. The
+ * value of t must not be NULL.
+ */
+static void
+control_law(const struct fqcodel* c, struct timespec* t)
+{
+	unsigned long count = 0;
+
+	assert(c != NULL);
+	assert(t != NULL);
+	count = c->count < FQCODEL_MAX_COUNT ? c->count : FQCODEL_MAX_COUNT;
+
+	if(count == 0)
+		count = 1;
+
+	add_us(t, (c->interval << 8) / isqrt(count << 16));
+}
+
+/*
+ * This procedure returns the square root of n, rounded down.
+ */
+static unsigned long
+isqrt(unsigned long n)
+{
+	unsigned long root = 0;
+	unsigned long bit = 1UL << (sizeof(unsigned long) * CHAR_BIT - 2);
+
+	while(bit > n)
+		bit >>= 2;
+
+	while(bit != 0) {
+		if(n >= root + bit) {
+			n -= root + bit;
+			root = (root >> 1) + bit;
+		} else {
+			root >>= 1;
+		}
+
+		bit >>= 2;
+	}
+
+	return root;
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FQCODEL_H
+#define FQCODEL_H
+
+#include <time.h>
+
+/*
+ * This contains the constants which describe what a controlled queue
+ * does when the controller decides to shed load.
+ */
+enum fqcodelmode {
+	FQCODEL_REJECT, /* reject the next push */
+	FQCODEL_DROP /* drop the element being popped, the oldest one */
+};
+
+/*
+ * This structure holds the state of a CoDel controller, which watches
+ * the time elements spend in a queue and sheds load while even the
+ * shortest of those times stays above a target for an interval. The
+ * members target and interval are in microseconds. The member mode
+ * tells how load is shed. The member above is non-zero once an element
+ * stayed longer than the target, and the member first_above is the time
+ * at which shedding starts if none stays shorter until then. The member
+ * dropping is non-zero while load is shed, at the times drop_next given
+ * by the control law; the member count is the number of elements shed
+ * since shedding started, and last_count the count when it last
+ * started. The member reject is the number of pushes still to be
+ * rejected. The member shed is the number of elements dropped or pushes
+ * rejected in total.
+ */
+struct fqcodel {
+	unsigned long target;
+	unsigned long interval;
+	enum fqcodelmode mode;
+	int above;
+	struct timespec first_above;
+	int dropping;
+	struct timespec drop_next;
+	unsigned long count;
+	unsigned long last_count;
+	unsigned long reject;
+	unsigned long shed;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void fqcodelinit(struct fqcodel*, unsigned long, unsigned long,
+		enum fqcodelmode);
+int fqcodeldequeue(struct fqcodel*, const struct timespec*,
+		const struct timespec*, unsigned int);
+int fqcodelreject(struct fqcodel*);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
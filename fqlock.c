@@ -0,0 +1,451 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <pthread.h>
+#include <sched.h>
+#include <assert.h>
+
+#include "fqlock.h"
+#include "qtatomic.h"
+#include "qterror.h"
+
+/*
+ * This structure is the argument of the cleanup handler of a thread
+ * parked on a spinning lock. The member lock is the lock to take back.
+ * The member node is the MCS node of the parked thread.
+ */
+struct fqlockparked {
+	struct fqlock* lock;
+	struct fqlocknode* node;
+};
+
+static int is_pthread_type(const struct fqlock*);
+static void unpark(void*);
+#ifdef FQLOCK_EXPERIMENTAL
+static void spin(unsigned int*);
+static enum qterror acquire_adaptive(struct fqlock*);
+static void relax(void);
+#endif
+
+/*
+ * This procedure initializes a lock of the given type. The procedure
+ * returns an error code to indicate its status. The value of lock must
+ * not be NULL.
+ */
+enum qterror
+fqlockinit(struct fqlock* lock, enum fqlocktype type)
+{
+	assert(lock != NULL);
+
+	if(type >= FQLOCK_LAST)
+		return QTEINVALID;
+
+	lock->type = type;
+	lock->next_ticket = 0;
+	lock->now_serving = 0;
+	lock->tail = NULL;
+	lock->holder = NULL;
+	lock->spins = 0;
+
+	if(pthread_mutex_init(&lock->mutex, NULL) != 0)
+		return QTEPTMINIT;
+
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure destroys the given lock. The lock must not be held.
+ * The procedure returns an error code to indicate its status. The value
+ * of lock must not be NULL.
+ */
+enum qterror
+fqlockdestroy(struct fqlock* lock)
+{
+	assert(lock != NULL);
+
+	if(pthread_mutex_destroy(&lock->mutex) != 0)
+		return QTEPTMDESTROY;
+
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure takes the lock, waiting until it is free. The node
+ * pointed to by node is used by MCS locks and must stay valid until the
+ * lock is released; it is ignored by the other types and may be NULL
+ * for them. The procedure returns an error code to indicate its status.
+ * The value of lock must not be NULL.
+ */
+enum qterror
+fqlockacquire(struct fqlock* lock, struct fqlocknode* node)
+{
+#ifdef FQLOCK_EXPERIMENTAL
+	struct fqlocknode* prev = NULL;
+	unsigned int ticket = 0;
+	unsigned int spins = 0;
+#else
+	(void) node;
+#endif
+
+	assert(lock != NULL);
+
+	switch(lock->type) {
+	case FQLOCK_MUTEX:
+		if(pthread_mutex_lock(&lock->mutex) != 0)
+			return QTEPTMLOCK;
+
+		return QTSUCCESS;
+#ifdef FQLOCK_EXPERIMENTAL
+	case FQLOCK_ADAPTIVE:
+		return acquire_adaptive(lock);
+	case FQLOCK_TICKET:
+		ticket = QTATOMIC_FETCH_ADD(&lock->next_ticket, 1,
+				QTATOMIC_RELAXED);
+
+		while(QTATOMIC_LOAD(&lock->now_serving, QTATOMIC_ACQUIRE)
+				!= ticket)
+			spin(&spins);
+
+		return QTSUCCESS;
+	case FQLOCK_MCS:
+		assert(node != NULL);
+		node->next = NULL;
+		node->waiting = 1;
+		prev = QTATOMIC_EXCHANGE(&lock->tail, node, QTATOMIC_ACQ_REL);
+
+		if(prev != NULL) {
+			QTATOMIC_STORE(&prev->next, node, QTATOMIC_RELEASE);
+
+			while(QTATOMIC_LOAD(&node->waiting, QTATOMIC_ACQUIRE))
+				spin(&spins);
+		}
+
+		lock->holder = node;
+		return QTSUCCESS;
+#endif
+	case FQLOCK_LAST:
+		break;
+	}
+
+	return QTEINVALID;
+}
+
+/*
+ * This procedure takes the lock if it is free, without waiting. The
+ * value of node is used as described for fqlockacquire(). The
+ * procedure returns QTEPTMTRYLOCK if the lock is held. Otherwise, it
+ * returns an error code to indicate its status. The value of lock must
+ * not be NULL.
+ */
+enum qterror
+fqlocktryacquire(struct fqlock* lock, struct fqlocknode* node)
+{
+#ifdef FQLOCK_EXPERIMENTAL
+	struct fqlocknode* expected = NULL;
+	unsigned int serving = 0;
+#else
+	(void) node;
+#endif
+
+	assert(lock != NULL);
+
+	switch(lock->type) {
+	case FQLOCK_MUTEX:
+#ifdef FQLOCK_EXPERIMENTAL
+	case FQLOCK_ADAPTIVE:
+#endif
+		if(pthread_mutex_trylock(&lock->mutex) != 0)
+			return QTEPTMTRYLOCK;
+
+		return QTSUCCESS;
+#ifdef FQLOCK_EXPERIMENTAL
+	case FQLOCK_TICKET:
+		/* the lock is free when no ticket is waiting to be served */
+		serving = QTATOMIC_LOAD(&lock->now_serving, QTATOMIC_RELAXED);
+
+		if(!QTATOMIC_CAS(&lock->next_ticket, &serving, serving + 1,
+					QTATOMIC_ACQUIRE))
+			return QTEPTMTRYLOCK;
+
+		return QTSUCCESS;
+	case FQLOCK_MCS:
+		assert(node != NULL);
+		node->next = NULL;
+		node->waiting = 0;
+
+		if(!QTATOMIC_CAS(&lock->tail, &expected, node,
+					QTATOMIC_ACQUIRE))
+			return QTEPTMTRYLOCK;
+
+		lock->holder = node;
+		return QTSUCCESS;
+#endif
+	case FQLOCK_LAST:
+		break;
+	}
+
+	return QTEINVALID;
+}
+
+/*
+ * This procedure releases the lock, which must be held by the calling
+ * thread. An MCS lock is handed to the next waiting thread. The
+ * procedure returns an error code to indicate its status. The value of
+ * lock must not be NULL.
+ */
+enum qterror
+fqlockrelease(struct fqlock* lock)
+{
+#ifdef FQLOCK_EXPERIMENTAL
+	struct fqlocknode* node = NULL;
+	struct fqlocknode* next = NULL;
+	unsigned int spins = 0;
+#endif
+
+	assert(lock != NULL);
+
+	switch(lock->type) {
+	case FQLOCK_MUTEX:
+#ifdef FQLOCK_EXPERIMENTAL
+	case FQLOCK_ADAPTIVE:
+#endif
+		if(pthread_mutex_unlock(&lock->mutex) != 0)
+			return QTEPTMUNLOCK;
+
+		return QTSUCCESS;
+#ifdef FQLOCK_EXPERIMENTAL
+	case FQLOCK_TICKET:
+		QTATOMIC_STORE(&lock->now_serving,
+				QTATOMIC_LOAD(&lock->now_serving,
+						QTATOMIC_RELAXED) + 1,
+				QTATOMIC_RELEASE);
+		return QTSUCCESS;
+	case FQLOCK_MCS:
+		node = lock->holder;
+		assert(node != NULL);
+		next = QTATOMIC_LOAD(&node->next, QTATOMIC_ACQUIRE);
+
+		if(next == NULL) {
+			struct fqlocknode* expected = node;
+
+			if(QTATOMIC_CAS(&lock->tail, &expected, NULL,
+						QTATOMIC_RELEASE))
+				return QTSUCCESS;
+
+			/* a thread is between joining and linking itself */
+			while((next = QTATOMIC_LOAD(&node->next,
+							QTATOMIC_ACQUIRE))
+					== NULL)
+				spin(&spins);
+		}
+
+		QTATOMIC_STORE(&next->waiting, 0, QTATOMIC_RELEASE);
+		return QTSUCCESS;
+#endif
+	case FQLOCK_LAST:
+		break;
+	}
+
+	return QTEINVALID;
+}
+
+/*
+ * This procedure releases the lock, which must be held by the calling
+ * thread, and waits on the condition variable cond until it is woken
+ * by fqlockwake() or the absolute time pointed to by abstime has
+ * passed. If abstime is NULL, the procedure waits without a time limit.
+ * The lock is held again when the procedure returns, also if the thread
+ * is cancelled while waiting. The spinning types wait under the parking
+ * mutex, which is taken before the lock is released so that no wake-up
+ * is missed. The procedure returns the value returned by the pthread
+ * condition wait. The value of lock must not be NULL. The value of cond
+ * must not be NULL.
+ */
+int
+fqlockwait(struct fqlock* lock, pthread_cond_t* cond,
+		const struct timespec* abstime)
+{
+	struct fqlockparked parked;
+	volatile int err = 0;
+
+	assert(lock != NULL);
+	assert(cond != NULL);
+
+	if(is_pthread_type(lock)) {
+		if(abstime == NULL)
+			return pthread_cond_wait(cond, &lock->mutex);
+
+		return pthread_cond_timedwait(cond, &lock->mutex, abstime);
+	}
+
+	parked.lock = lock;
+	parked.node = lock->holder;
+	err = pthread_mutex_lock(&lock->mutex);
+
+	if(err != 0)
+		return err;
+
+	(void) fqlockrelease(lock);
+	pthread_cleanup_push(unpark, &parked);
+
+	if(abstime == NULL)
+		err = pthread_cond_wait(cond, &lock->mutex);
+	else
+		err = pthread_cond_timedwait(cond, &lock->mutex, abstime);
+
+	pthread_cleanup_pop(1);
+	return err;
+}
+
+/*
+ * This procedure wakes one thread waiting on the condition variable
+ * cond through fqlockwait(), or every such thread if the value of all
+ * is non-zero. The lock should be held by the calling thread if the
+ * waiters test a state guarded by it. The value of lock must not be
+ * NULL. The value of cond must not be NULL.
+ */
+void
+fqlockwake(struct fqlock* lock, pthread_cond_t* cond, int all)
+{
+	int parking = 0;
+
+	assert(lock != NULL);
+	assert(cond != NULL);
+
+	/* the parking mutex orders this after a waiter has parked */
+	parking = !is_pthread_type(lock);
+
+	if(parking && pthread_mutex_lock(&lock->mutex) != 0)
+		return;
+
+	if(all)
+		(void) pthread_cond_broadcast(cond);
+	else
+		(void) pthread_cond_signal(cond);
+
+	if(parking)
+		(void) pthread_mutex_unlock(&lock->mutex);
+}
+
+/*
+ * This procedure checks if the lock is a pthread mutex, which condition
+ * variables can wait on directly. The value of lock must not be NULL.
+ */
+static int
+is_pthread_type(const struct fqlock* lock)
+{
+	assert(lock != NULL);
+#ifdef FQLOCK_EXPERIMENTAL
+	return lock->type == FQLOCK_MUTEX || lock->type == FQLOCK_ADAPTIVE;
+#else
+	return lock->type == FQLOCK_MUTEX;
+#endif
+}
+
+/*
+ * This procedure leaves the parking mutex of a spinning lock and takes
+ * the lock back. It runs when a parked thread wakes up or is cancelled.
+ * The variable arg is a pointer to a struct fqlockparked. The value of
+ * arg must not be NULL.
+ */
+static void
+unpark(void* arg)
+{
+	struct fqlockparked* parked = arg;
+
+	(void) pthread_mutex_unlock(&parked->lock->mutex);
+	(void) fqlockacquire(parked->lock, parked->node);
+}
+
+#ifdef FQLOCK_EXPERIMENTAL
+/*
+ * This procedure is called once per failed attempt to take a spinning
+ * lock. It yields the CPU every FQLOCK_SPINS calls, so that a preempted
+ * owner gets to run when there are more threads than CPUs. The value of
+ * spins must not be NULL.
+ */
+static void
+spin(unsigned int* spins)
+{
+	assert(spins != NULL);
+
+	if(++*spins % FQLOCK_SPINS == 0)
+		(void) sched_yield();
+}
+
+/*
+ * This procedure takes an adaptive mutex. A contended mutex is retried
+ * up to twice the average number of retries it needed before, plus a
+ * few, and no more than FQLOCK_SPINS times, before the thread sleeps on
+ * it. The average then moves an eighth of the way towards the retries
+ * this attempt needed, so the retries follow how long the mutex is
+ * usually held. The procedure returns an error code to indicate its
+ * status. The value of lock must not be NULL.
+ */
+static enum qterror
+acquire_adaptive(struct fqlock* lock)
+{
+	unsigned int average = 0;
+	unsigned int limit = 0;
+	unsigned int spins = 0;
+
+	assert(lock != NULL);
+
+	if(pthread_mutex_trylock(&lock->mutex) == 0)
+		return QTSUCCESS;
+
+	/* the average is a hint, so racing updates may lose one */
+	average = QTATOMIC_LOAD(&lock->spins, QTATOMIC_RELAXED);
+	limit = average * 2 + 10;
+
+	if(limit > FQLOCK_SPINS)
+		limit = FQLOCK_SPINS;
+
+	do {
+		if(++spins >= limit) {
+			if(pthread_mutex_lock(&lock->mutex) != 0)
+				return QTEPTMLOCK;
+
+			break;
+		}
+
+		relax();
+	} while(pthread_mutex_trylock(&lock->mutex) != 0);
+
+	if(spins >= average)
+		average += (spins - average) / 8;
+	else
+		average -= (average - spins + 7) / 8;
+
+	QTATOMIC_STORE(&lock->spins, average, QTATOMIC_RELAXED);
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure tells the CPU that the calling thread is waiting for a
+ * lock, which saves power and lets a sibling hardware thread run.
+ */
+static void
+relax(void)
+{
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+	__builtin_ia32_pause();
+#elif defined(__GNUC__) && defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+#endif
@@ -0,0 +1,105 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FQLOCK_H
+#define FQLOCK_H
+
+#include <pthread.h>
+#include <time.h>
+
+#include "qterror.h"
+
+/* the number of times a lock is retried before sleeping or yielding */
+#ifndef FQLOCK_SPINS
+#define FQLOCK_SPINS 100
+#endif
+
+/*
+ * This contains the constants which describe the lock which guards a
+ * function queue. FQLOCK_MUTEX is a plain pthread mutex. The other
+ * types are only built if FQLOCK_EXPERIMENTAL is defined, until they
+ * have been measured on multi-core hosts. FQLOCK_ADAPTIVE is a pthread
+ * mutex which is retried before sleeping, for short critical sections.
+ * It is retried up to about twice as many times as it usually took to
+ * become free, but no more than FQLOCK_SPINS times, so a lock which is
+ * held for long soon stops being retried.
+ * FQLOCK_TICKET is a spinning lock which is handed to threads in the
+ * order they arrived. FQLOCK_MCS is a spinning lock where each thread
+ * spins on its own node, so a release only touches the cache line of
+ * the next thread. The spinning locks yield the CPU while they spin.
+ * Threads waiting on a condition variable sleep under the pthread mutex
+ * for the first two types, and under a separate parking mutex for the
+ * others. FQLOCK_LAST is not a real type, but a marker of the final
+ * constant.
+ */
+enum fqlocktype {
+	FQLOCK_MUTEX, /* pthread mutex */
+#ifdef FQLOCK_EXPERIMENTAL
+	FQLOCK_ADAPTIVE, /* pthread mutex retried before sleeping */
+	FQLOCK_TICKET, /* first come, first served spinning lock */
+	FQLOCK_MCS, /* queue of spinning threads */
+#endif
+
+	FQLOCK_LAST /* not an actual type */
+};
+
+/*
+ * This structure is a place in the queue of threads waiting for an MCS
+ * lock. It is owned by the thread taking the lock and must stay valid
+ * until the lock is released. The member next is the node of the
+ * thread which waits next. The member waiting is non-zero while the
+ * owner must keep spinning.
+ */
+struct fqlocknode {
+	struct fqlocknode* next;
+	unsigned int waiting;
+};
+
+/*
+ * This structure holds a lock of any of the types above. The member
+ * mutex is the lock itself for the pthread types and the parking mutex
+ * for the spinning types. The members next_ticket and now_serving are
+ * used by the ticket lock. The members tail and holder are the last
+ * waiting node and the node of the owner of the MCS lock. The member
+ * spins is the running average of the retries an adaptive mutex needed
+ * when it was contended.
+ */
+struct fqlock {
+	enum fqlocktype type;
+	pthread_mutex_t mutex;
+	unsigned int next_ticket;
+	unsigned int now_serving;
+	struct fqlocknode* tail;
+	struct fqlocknode* holder;
+	unsigned int spins;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum qterror fqlockinit(struct fqlock*, enum fqlocktype);
+enum qterror fqlockdestroy(struct fqlock*);
+enum qterror fqlockacquire(struct fqlock*, struct fqlocknode*);
+enum qterror fqlocktryacquire(struct fqlock*, struct fqlocknode*);
+enum qterror fqlockrelease(struct fqlock*);
+int fqlockwait(struct fqlock*, pthread_cond_t*, const struct timespec*);
+void fqlockwake(struct fqlock*, pthread_cond_t*, int);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,600 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* robust mutexes are an extension of the selected standard */
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "fqshm.h"
+#include "qtatomic.h"
+#include "qterror.h"
+
+/* the size s rounded up to the alignment of the slots */
+#define FQSHM_ROUND(s) (((s) + sizeof(double) - 1) / sizeof(double) \
+		* sizeof(double))
+
+/*
+ * This structure is the header of a shared segment, which is followed
+ * by the slots of the queue. The member magic is FQSHM_MAGIC once the
+ * segment is ready, and the member version is FQSHM_VERSION. The member
+ * size is the size of the segment. The queue has capacity slots of
+ * slot_size bytes, each with room for a payload of payload bytes. The
+ * member head is the index of the oldest element, and the member count
+ * is the number of elements. The member tail is the index of the oldest
+ * slot which is not free, and the member busy is the number of slots
+ * from it up to the head, whose elements are running or ran after one
+ * which is still running. The member lock is a robust, process
+ * shared mutex which guards the queue, and the members notempty and
+ * notfull are signaled when an element is pushed or popped.
+ */
+struct fqshmsegment {
+	unsigned long magic;
+	unsigned long version;
+	unsigned long size;
+	unsigned long capacity;
+	unsigned long payload;
+	unsigned long slot_size;
+	unsigned long head;
+	unsigned long count;
+	unsigned long tail;
+	unsigned long busy;
+	pthread_mutex_t lock;
+	pthread_cond_t notempty;
+	pthread_cond_t notfull;
+};
+
+/*
+ * This structure is the header of a slot, which is followed by the
+ * payload. The member handler is the identifier of the handler, and the
+ * member length is the length of the payload. The member running is
+ * non-zero while a handler runs with the payload.
+ */
+struct fqshmslot {
+	unsigned long handler;
+	unsigned long length;
+	unsigned long running;
+};
+
+/*
+ * This structure holds an element whose handler runs. The member segment
+ * is the segment of the element, and the member slot is its slot.
+ */
+struct fqshmclaim {
+	struct fqshmsegment* segment;
+	struct fqshmslot* slot;
+};
+
+static enum qterror init_sync(struct fqshmsegment*);
+static struct fqshmslot* slot_at(struct fqshmsegment*, unsigned long);
+static enum qterror lock_segment(struct fqshmsegment*, int);
+static void release_segment(void*);
+static void release_slot(void*);
+static void wait_segment(struct fqshmsegment*, pthread_cond_t*);
+
+/*
+ * This procedure creates a shared segment of the given name holding a
+ * queue of capacity elements, each with a payload of up to payload
+ * bytes, and maps it. An existing segment of that name is replaced. The
+ * procedure returns an error code to indicate its status. The value of
+ * q must not be NULL. The value of name must not be NULL. The value of
+ * capacity must not be 0.
+ */
+enum qterror
+fqshmcreate(struct fqshm* q, const char* name, unsigned int capacity,
+		size_t payload)
+{
+	struct fqshmsegment* s = NULL;
+	void* mapped = MAP_FAILED;
+	size_t slot_size = 0;
+	enum qterror ret = QTSUCCESS;
+	int fd = -1;
+	int err = 0;
+
+	assert(q != NULL);
+	assert(name != NULL);
+
+	if(capacity == 0)
+		return QTEINVALID;
+
+	slot_size = FQSHM_ROUND(sizeof(struct fqshmslot) + payload);
+	q->size = FQSHM_ROUND(sizeof(*s)) + capacity * slot_size;
+	q->name = malloc(strlen(name) + 1);
+	memset(q->handlers, 0, sizeof(q->handlers));
+
+	if(q->name == NULL)
+		return QTEMALLOC;
+
+	strcpy(q->name, name);
+	fd = shm_open(name, O_CREAT | O_RDWR, 0600);
+
+	if(fd == -1) {
+		free(q->name);
+		return QTEERRNO;
+	}
+
+	if(ftruncate(fd, (off_t) q->size) == 0)
+		mapped = mmap(NULL, q->size, PROT_READ | PROT_WRITE,
+				MAP_SHARED, fd, 0);
+
+	/* close() must not hide the reason of the failure */
+	err = errno;
+	(void) close(fd);
+	errno = err;
+
+	if(mapped == MAP_FAILED) {
+		(void) shm_unlink(name);
+		free(q->name);
+		return QTEERRNO;
+	}
+
+	s = mapped;
+
+	/* a reused segment is not valid until it is reset */
+	QTATOMIC_STORE(&s->magic, 0UL, QTATOMIC_RELAXED);
+	QTATOMIC_FENCE(QTATOMIC_RELEASE);
+	s->version = FQSHM_VERSION;
+	s->size = q->size;
+	s->capacity = capacity;
+	s->payload = payload;
+	s->slot_size = slot_size;
+	s->head = 0;
+	s->count = 0;
+	s->tail = 0;
+	s->busy = 0;
+	ret = init_sync(s);
+
+	if(ret != QTSUCCESS) {
+		(void) munmap(mapped, q->size);
+		(void) shm_unlink(name);
+		free(q->name);
+		return ret;
+	}
+
+	QTATOMIC_STORE(&s->magic, FQSHM_MAGIC, QTATOMIC_RELEASE);
+	q->segment = s;
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure destroys a queue created by fqshmcreate(), unmaps it and
+ * removes its segment. Every other process must have detached from it.
+ * The procedure returns QTEINVALID if this process did not create the
+ * queue. Otherwise, it returns an error code to indicate its status. The
+ * value of q must not be NULL.
+ */
+enum qterror
+fqshmdestroy(struct fqshm* q)
+{
+	struct fqshmsegment* s = NULL;
+	enum qterror ret = QTSUCCESS;
+
+	assert(q != NULL);
+	s = q->segment;
+
+	if(q->name == NULL)
+		return QTEINVALID;
+
+	QTATOMIC_STORE(&s->magic, 0UL, QTATOMIC_RELAXED);
+
+	if(pthread_cond_destroy(&s->notfull) != 0)
+		ret = QTEPTCDESTROY;
+
+	if(pthread_cond_destroy(&s->notempty) != 0 && ret == QTSUCCESS)
+		ret = QTEPTCDESTROY;
+
+	if(pthread_mutex_destroy(&s->lock) != 0 && ret == QTSUCCESS)
+		ret = QTEPTMDESTROY;
+
+	if(munmap(q->segment, q->size) != 0 && ret == QTSUCCESS)
+		ret = QTEERRNO;
+
+	if(shm_unlink(q->name) != 0 && ret == QTSUCCESS)
+		ret = QTEERRNO;
+
+	free(q->name);
+	q->name = NULL;
+	q->segment = NULL;
+	return ret;
+}
+
+/*
+ * This procedure maps the queue in the shared segment of the given name,
+ * which another process created with fqshmcreate(). The handlers of this
+ * process start out unregistered. The procedure returns QTEINVALID if
+ * the segment does not hold a queue of this version. Otherwise, it
+ * returns an error code to indicate its status. The value of q must not
+ * be NULL. The value of name must not be NULL.
+ */
+enum qterror
+fqshmattach(struct fqshm* q, const char* name)
+{
+	struct stat st;
+	struct fqshmsegment* s = NULL;
+	void* mapped = MAP_FAILED;
+	enum qterror ret = QTSUCCESS;
+	int fd = -1;
+	int err = 0;
+
+	assert(q != NULL);
+	assert(name != NULL);
+	fd = shm_open(name, O_RDWR, 0);
+
+	if(fd == -1)
+		return QTEERRNO;
+
+	if(fstat(fd, &st) != 0)
+		ret = QTEERRNO;
+	else if(st.st_size < (off_t) sizeof(*s))
+		ret = QTEINVALID;
+	else
+		mapped = mmap(NULL, (size_t) st.st_size, PROT_READ
+				| PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if(ret == QTSUCCESS && mapped == MAP_FAILED)
+		ret = QTEERRNO;
+
+	/* close() must not hide the reason of the failure */
+	err = errno;
+	(void) close(fd);
+	errno = err;
+
+	if(ret != QTSUCCESS)
+		return ret;
+
+	s = mapped;
+
+	if(QTATOMIC_LOAD(&s->magic, QTATOMIC_ACQUIRE) != FQSHM_MAGIC
+			|| s->version != FQSHM_VERSION
+			|| s->size != (unsigned long) st.st_size) {
+		(void) munmap(mapped, (size_t) st.st_size);
+		return QTEINVALID;
+	}
+
+	q->segment = s;
+	q->size = (size_t) st.st_size;
+	q->name = NULL;
+	memset(q->handlers, 0, sizeof(q->handlers));
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure unmaps a queue mapped by fqshmattach(). The queue stays
+ * usable by the other processes. The procedure returns QTEINVALID if
+ * this process created the queue. Otherwise, it returns an error code
+ * to indicate its status. The value of q must not be NULL.
+ */
+enum qterror
+fqshmdetach(struct fqshm* q)
+{
+	enum qterror ret = QTSUCCESS;
+
+	assert(q != NULL);
+
+	if(q->name != NULL)
+		return QTEINVALID;
+
+	if(munmap(q->segment, q->size) != 0)
+		ret = QTEERRNO;
+
+	q->segment = NULL;
+	return ret;
+}
+
+/*
+ * This procedure registers func as the handler of this process for the
+ * elements with the identifier id, to be called with their payload, its
+ * length and arg. If the value of func is NULL, the handler is removed.
+ * The procedure returns QTEINVALID if the value of id is not below
+ * FQSHM_MAX_HANDLERS. Otherwise, it returns QTSUCCESS. The value of q
+ * must not be NULL.
+ */
+enum qterror
+fqshmregister(struct fqshm* q, unsigned int id,
+		void (*func)(const void*, size_t, void*), void* arg)
+{
+	assert(q != NULL);
+
+	if(id >= FQSHM_MAX_HANDLERS)
+		return QTEINVALID;
+
+	q->handlers[id].func = func;
+	q->handlers[id].arg = arg;
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure pushes an element for the handler with the identifier
+ * id onto the queue, copying len bytes of payload into the shared slot.
+ * If the queue is full, the procedure waits for room if the value of
+ * block is non-zero. The procedure returns QTEINVALID if the value of id
+ * is not below FQSHM_MAX_HANDLERS or the payload does not fit in a slot.
+ * Otherwise, it returns an error code to indicate its status. The value
+ * of q must not be NULL. The value of payload must not be NULL unless
+ * the value of len is 0.
+ */
+enum qterror
+fqshmpush(struct fqshm* q, unsigned int id, const void* payload, size_t len,
+		int block)
+{
+	struct fqshmsegment* s = NULL;
+	struct fqshmslot* slot = NULL;
+	enum qterror ret = QTSUCCESS;
+
+	assert(q != NULL);
+	assert(payload != NULL || len == 0);
+	s = q->segment;
+
+	if(id >= FQSHM_MAX_HANDLERS || len > s->payload)
+		return QTEINVALID;
+
+	ret = lock_segment(s, block);
+
+	if(ret != QTSUCCESS)
+		return ret;
+
+	/* the slots of running elements are not reused until they return */
+	while(s->count + s->busy == s->capacity) {
+		if(!block) {
+			(void) pthread_mutex_unlock(&s->lock);
+			return QTEFQFULL;
+		}
+
+		wait_segment(s, &s->notfull);
+	}
+
+	slot = slot_at(s, (s->head + s->count) % s->capacity);
+	slot->handler = id;
+	slot->length = len;
+	slot->running = 0;
+
+	if(len > 0)
+		memcpy((char*) slot + sizeof(*slot), payload, len);
+
+	++s->count;
+	(void) pthread_cond_signal(&s->notempty);
+	(void) pthread_mutex_unlock(&s->lock);
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure pops the oldest element of the queue and calls the
+ * handler of this process for it with the address of its payload in the
+ * shared slot, which is not copied. The slot is released once the
+ * handler returns or its thread is cancelled, and the payload must not
+ * be used afterwards. Other threads and processes run the elements
+ * pushed after it in the meantime, but the slots of the later elements
+ * are only reused once the earlier ones are released, and a process
+ * which dies while a handler runs keeps the slot of the element. If the
+ * queue is empty, the procedure waits for an element if the value of
+ * block is non-zero. The procedure returns QTEINVALID if this process
+ * has no handler for the element, which is then discarded. Otherwise,
+ * it returns an error code to indicate its status. The value of q must
+ * not be NULL.
+ */
+enum qterror
+fqshmrun(struct fqshm* q, int block)
+{
+	struct fqshmsegment* s = NULL;
+	struct fqshmclaim claim;
+	const struct fqshmhandler* h = NULL;
+	unsigned long id = 0;
+	size_t len = 0;
+	enum qterror ret = QTSUCCESS;
+
+	assert(q != NULL);
+	s = q->segment;
+	ret = lock_segment(s, block);
+
+	if(ret != QTSUCCESS)
+		return ret;
+
+	while(s->count == 0) {
+		if(!block) {
+			(void) pthread_mutex_unlock(&s->lock);
+			return QTEFQEMPTY;
+		}
+
+		wait_segment(s, &s->notempty);
+	}
+
+	claim.segment = s;
+	claim.slot = slot_at(s, s->head);
+	claim.slot->running = 1;
+	id = claim.slot->handler;
+	len = claim.slot->length <= s->payload ? claim.slot->length
+			: s->payload;
+	s->head = (s->head + 1) % s->capacity;
+	--s->count;
+	++s->busy;
+	(void) pthread_mutex_unlock(&s->lock);
+
+	if(id >= FQSHM_MAX_HANDLERS || q->handlers[id].func == NULL) {
+		release_slot(&claim);
+		return QTEINVALID;
+	}
+
+	h = &q->handlers[id];
+	pthread_cleanup_push(release_slot, &claim);
+	h->func((const char*) claim.slot + sizeof(*claim.slot), len, h->arg);
+	pthread_cleanup_pop(1);
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure initializes the lock and the condition variables of
+ * the segment s to be shared between processes. The lock is robust, so
+ * that a process which dies while holding it does not block the others.
+ * The procedure returns an error code to indicate its status. The value
+ * of s must not be NULL.
+ */
+static enum qterror
+init_sync(struct fqshmsegment* s)
+{
+	pthread_mutexattr_t mattr;
+	pthread_condattr_t cattr;
+	enum qterror ret = QTSUCCESS;
+
+	assert(s != NULL);
+
+	if(pthread_mutexattr_init(&mattr) != 0)
+		return QTEPTMAINIT;
+
+	if(pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED) != 0
+			|| pthread_mutexattr_setrobust(&mattr,
+				PTHREAD_MUTEX_ROBUST) != 0)
+		ret = QTEPTMAINIT;
+	else if(pthread_mutex_init(&s->lock, &mattr) != 0)
+		ret = QTEPTMINIT;
+
+	(void) pthread_mutexattr_destroy(&mattr);
+
+	if(ret != QTSUCCESS)
+		return ret;
+
+	if(pthread_condattr_init(&cattr) != 0) {
+		(void) pthread_mutex_destroy(&s->lock);
+		return QTEPTCINIT;
+	}
+
+	if(pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED) != 0
+			|| pthread_cond_init(&s->notempty, &cattr) != 0) {
+		ret = QTEPTCINIT;
+	} else if(pthread_cond_init(&s->notfull, &cattr) != 0) {
+		(void) pthread_cond_destroy(&s->notempty);
+		ret = QTEPTCINIT;
+	}
+
+	(void) pthread_condattr_destroy(&cattr);
+
+	if(ret != QTSUCCESS)
+		(void) pthread_mutex_destroy(&s->lock);
+
+	return ret;
+}
+
+/*
+ * This procedure returns the slot of index i of the segment s. The value
+ * of s must not be NULL.
+ */
+static struct fqshmslot*
+slot_at(struct fqshmsegment* s, unsigned long i)
+{
+	assert(s != NULL);
+	return (void*) ((char*) s + FQSHM_ROUND(sizeof(*s))
+			+ i * s->slot_size);
+}
+
+/*
+ * This procedure locks the segment s, or only tries to if the value of
+ * block is zero. A lock left by a dead process is taken over; the queue
+ * is consistent since it is only changed after an element is copied.
+ * The procedure returns an error code to indicate its status. The value
+ * of s must not be NULL.
+ */
+static enum qterror
+lock_segment(struct fqshmsegment* s, int block)
+{
+	int err = 0;
+
+	assert(s != NULL);
+	err = block ? pthread_mutex_lock(&s->lock)
+			: pthread_mutex_trylock(&s->lock);
+
+	if(err == EOWNERDEAD)
+		err = pthread_mutex_consistent(&s->lock);
+
+	if(err != 0)
+		return block ? QTEPTMLOCK : QTEPTMTRYLOCK;
+
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure is a cleanup handler which unlocks a segment when a
+ * waiting thread is cancelled. The variable arg is a pointer to the
+ * segment. The value of arg must not be NULL.
+ */
+static void
+release_segment(void* arg)
+{
+	struct fqshmsegment* s = arg;
+
+	assert(s != NULL);
+	(void) pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * This procedure releases the slot of an element whose handler returned
+ * or was cancelled, and frees it together with the released slots after
+ * it once no earlier slot is running, waking the pushers waiting for
+ * room. The variable arg is a pointer to the claim of the element. The
+ * value of arg must not be NULL.
+ */
+static void
+release_slot(void* arg)
+{
+	struct fqshmclaim* claim = arg;
+	struct fqshmsegment* s = NULL;
+	int freed = 0;
+
+	assert(claim != NULL);
+	s = claim->segment;
+
+	if(lock_segment(s, 1) != QTSUCCESS)
+		return;
+
+	claim->slot->running = 0;
+
+	while(s->busy > 0 && !slot_at(s, s->tail)->running) {
+		s->tail = (s->tail + 1) % s->capacity;
+		--s->busy;
+		freed = 1;
+	}
+
+	if(freed)
+		(void) pthread_cond_broadcast(&s->notfull);
+
+	(void) pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * This procedure waits on the condition variable cond of the locked
+ * segment s, taking over the lock if its owner died. The value of s must
+ * not be NULL. The value of cond must not be NULL.
+ */
+static void
+wait_segment(struct fqshmsegment* s, pthread_cond_t* cond)
+{
+	assert(s != NULL);
+	assert(cond != NULL);
+	pthread_cleanup_push(release_segment, s);
+
+	if(pthread_cond_wait(cond, &s->lock) == EOWNERDEAD)
+		(void) pthread_mutex_consistent(&s->lock);
+
+	pthread_cleanup_pop(0);
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FQSHM_H
+#define FQSHM_H
+
+#include <stddef.h>
+
+#include "qterror.h"
+
+/* the values which identify the layout of a shared queue */
+#define FQSHM_MAGIC 0x51545351UL /* "QTSQ" */
+#define FQSHM_VERSION 2UL
+
+/* the number of handlers which a process can register */
+#ifndef FQSHM_MAX_HANDLERS
+#define FQSHM_MAX_HANDLERS 64
+#endif
+
+struct fqshmsegment;
+
+/*
+ * This structure holds a handler registered by a process. The member
+ * func is called with the payload of an element, its length and the
+ * member arg.
+ */
+struct fqshmhandler {
+	void (* func)(const void*, size_t, void*);
+	void* arg;
+};
+
+/*
+ * This structure holds the view of one process on a function queue in a
+ * shared memory segment, which several processes push to and pop from.
+ * Function pointers mean nothing in another process, so each element
+ * holds the identifier of a handler and a payload of bytes, and each
+ * process registers its own handler for each identifier. The member
+ * segment points to the mapped segment of size bytes. The member name is
+ * the name of the segment if this process created it, or NULL. The
+ * member handlers is the registry of this process, indexed by
+ * identifier.
+ */
+struct fqshm {
+	struct fqshmsegment* segment;
+	size_t size;
+	char* name;
+	struct fqshmhandler handlers[FQSHM_MAX_HANDLERS];
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum qterror fqshmcreate(struct fqshm*, const char*, unsigned int, size_t);
+enum qterror fqshmdestroy(struct fqshm*);
+enum qterror fqshmattach(struct fqshm*, const char*);
+enum qterror fqshmdetach(struct fqshm*);
+enum qterror fqshmregister(struct fqshm*, unsigned int,
+		void (*)(const void*, size_t, void*), void*);
+enum qterror fqshmpush(struct fqshm*, unsigned int, const void*, size_t, int);
+enum qterror fqshmrun(struct fqshm*, int);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -22,31 +22,140 @@
 
 #include "function_queue_element.h"
 #include "function_queue.h"
+#include "fqcoalesce.h"
+#include "fqlock.h"
+#include "qtatomic.h"
+#include "qtprobes.h"
 #include "qterror.h"
 
 #include "fq/indexed_array_queue.h"
 #include "fq/linked_list_queue.h"
+#include "fq/sharded_queue.h"
+#include "fq/combining_queue.h"
 
-static void release_mutex(void*);
+/* the largest number of discarded elements reported at once */
+#ifndef FQDROP_BATCH
+#define FQDROP_BATCH 16
+#endif
+
+/* the largest number of procedures with a handler for their drops */
+#ifndef FQDROP_HANDLERS
+#define FQDROP_HANDLERS 16
+#endif
+
+/*
+ * This structure pairs a procedure which a module queues on behalf of
+ * its users with the handler which is told instead of the drop hook of
+ * the queue when an element of that procedure is discarded.
+ */
+struct fqdrophandler {
+	void (* func)(void*);
+	void (* dropped)(struct function_queue*, void*);
+};
+
+/*
+ * This structure is a popper which waits in fqpopvuntil() until its
+ * stop value is set. Such a popper waits on a condition variable of its
+ * own, so that fqwakepopper() can wake it alone. The member next is the
+ * next waiting popper of the queue q. The member stop points to the
+ * stop value of the popper, and the member wait is its condition
+ * variable. The member linked is non-zero while the popper is in the
+ * list of the queue; a popper whose condition variable could not be
+ * created waits on the one of the queue instead.
+ */
+struct fqwaiter {
+	struct fqwaiter* next;
+	struct function_queue* q;
+	const unsigned int* stop;
+	pthread_cond_t wait;
+	int linked;
+};
+
+/* the registered drop handlers, which are never changed once counted */
+static struct fqdrophandler drop_handlers[FQDROP_HANDLERS];
+static unsigned int ndrop_handlers = 0;
+static pthread_mutex_t drop_handlers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void release_popper(void*);
+static void release_push_wait(void*);
+static enum qterror push_or_overflow(struct function_queue*,
+		const struct function_queue_element*, unsigned int,
+		struct fqellnode*, unsigned int*, int, const struct timespec*,
+		int);
+static enum qterror count_rejected(struct function_queue*, enum qterror);
+static void stamp(const struct function_queue*,
+		struct function_queue_element*);
+static void signal_pushed(struct function_queue*, unsigned int);
+static enum qterror wait_not_full(struct function_queue*,
+		const struct timespec*, int*);
+static enum qterror drop_oldest(struct function_queue*, int,
+		struct function_queue_element*);
 static enum qterror peek_or_pop(struct function_queue*,
-		struct function_queue_element*, int, int);
+		struct function_queue_element*, unsigned int, unsigned int,
+		unsigned int*, int, int, const unsigned int*);
+static void release_pop_wait(void*);
+static void park_popper(struct function_queue*, struct fqwaiter*,
+		const unsigned int*);
+static void unpark_popper(struct fqwaiter*);
+static void wait_popper(struct fqwaiter*);
+static void wake_poppers(struct function_queue*, int);
+static enum qterror push_concurrent(struct function_queue*,
+		const struct function_queue_element*, unsigned int,
+		unsigned int*, int, const struct timespec*, int);
+static enum qterror wait_push_concurrent(struct function_queue*,
+		const struct function_queue_element*, const struct timespec*);
+static enum qterror take_concurrent(struct function_queue*,
+		struct function_queue_element*, unsigned int, unsigned int*,
+		int, int, const unsigned int*);
+static int stopped(const unsigned int*);
+static enum qterror take_some(struct function_queue*,
+		struct function_queue_element*, unsigned int, unsigned int*,
+		int, int);
+static void wake_concurrent(struct function_queue*, pthread_cond_t*,
+		unsigned int*, unsigned int);
 
 /*
  * This procedure initializes a function queue based on the given type.
  * The variable max_elements is the maximum number of elements which can
  * be stored in the queue. The variable type indicated which dispatch
- * table to use for internal queue procedures. The procedure returns an
- * error code to indicate its status. The value of q must not be NULL.
+ * table to use for internal queue procedures. The queue is guarded by a
+ * pthread mutex. The procedure returns an error code to indicate its
+ * status. The value of q must not be NULL.
  */
 enum qterror
 fqinit(struct function_queue* q, enum fqtype type, unsigned max_elements)
+{
+	return fqinitwithlock(q, type, max_elements, FQLOCK_MUTEX);
+}
+
+/*
+ * This procedure initializes a function queue as described for fqinit(),
+ * except that the queue is guarded by a lock of the type locktype. A
+ * spinning lock suits short critical sections with about as many
+ * threads as CPUs; a pthread mutex suits more threads than CPUs. The
+ * concurrent queue types only take the lock to wait. The procedure
+ * returns an error code to indicate its status. The value of q must not
+ * be NULL.
+ */
+enum qterror
+fqinitwithlock(struct function_queue* q, enum fqtype type,
+		unsigned max_elements, enum fqlocktype locktype)
 {
 	enum qterror ret = QTSUCCESS;
 
 	assert(q != NULL);
 	q->size = 0;
+	q->push_waiters = 0;
+	q->pop_waiters = 0;
 	q->max_elements = max_elements;
 	q->type = type;
+	q->overflow = FQOVERFLOW_REJECT;
+	q->coalesce = NULL;
+	q->codel = NULL;
+	q->ondrop = NULL;
+	q->waiters = NULL;
+	q->stamp_users = 0;
+	q->rejected = 0;
 
 	switch(q->type) {
 	case FQTYPE_IA:
@@ -55,16 +164,34 @@ fqinit(struct function_queue* q, enum fqtype type, unsigned max_elements)
 	case FQTYPE_LL:
 		q->dispatchtable = &fqdispatchtablell;
 		break;
+	case FQTYPE_SHARDED:
+		q->dispatchtable = &fqdispatchtablesharded;
+		break;
+	case FQTYPE_LLI:
+		q->dispatchtable = &fqdispatchtablelli;
+		break;
+	case FQTYPE_FC:
+		q->dispatchtable = &fqdispatchtablecombining;
+		break;
 	case FQTYPE_LAST:
 		return QTEINVALID;
 	}
 
-	if(pthread_mutex_init(&q->lock, NULL) != 0)
-		return QTEPTMINIT;
+	ret = fqlockinit(&q->lock, locktype);
+
+	if(ret != QTSUCCESS)
+		return ret;
 
 	if(pthread_cond_init(&q->wait, NULL) != 0) {
 		/* ignore more errors at this point */
-		(void) pthread_mutex_destroy(&q->lock);
+		(void) fqlockdestroy(&q->lock);
+		return QTEPTCINIT;
+	}
+
+	if(pthread_cond_init(&q->notfull, NULL) != 0) {
+		/* ignore more errors at this point */
+		(void) fqlockdestroy(&q->lock);
+		(void) pthread_cond_destroy(&q->wait);
 		return QTEPTCINIT;
 	}
 
@@ -74,8 +201,9 @@ fqinit(struct function_queue* q, enum fqtype type, unsigned max_elements)
 
 	if(ret != QTSUCCESS) {
 		/* ignore more errors at this point */
-		(void) pthread_mutex_destroy(&q->lock);
+		(void) fqlockdestroy(&q->lock);
 		(void) pthread_cond_destroy(&q->wait);
+		(void) pthread_cond_destroy(&q->notfull);
 	}
 
 	return ret;
@@ -92,65 +220,154 @@ fqdestroy(struct function_queue* q)
 {
 	assert(q != NULL);
 
-	if(pthread_mutex_destroy(&q->lock) != 0)
+	if(fqlockdestroy(&q->lock) != QTSUCCESS)
 		return QTEPTMDESTROY;
 
 	if(pthread_cond_destroy(&q->wait) != 0)
 		return QTEPTCDESTROY;
 
+	if(pthread_cond_destroy(&q->notfull) != 0)
+		return QTEPTCDESTROY;
+
+	if(q->coalesce != NULL) {
+		fqcoalescedestroy(q->coalesce);
+		free(q->coalesce);
+		q->coalesce = NULL;
+	}
+
+	free(q->codel);
+	q->codel = NULL;
 	assert(q->dispatchtable != NULL);
 	assert(q->dispatchtable->destroy != NULL);
 	return q->dispatchtable->destroy(&q->queue);
 }
 
 /*
- * This procedure pushes the given function pointer onto the queue. The 
+ * This procedure pushes the given function pointer onto the queue. The
  * function pointer is stored with the given argument arg so the value
  * can be passed to it. This procedure may block if the value of block
- * is non-zero. The procedure returns an error code to indicate its
- * status. The value of q must not be NULL.
+ * is non-zero. If the queue is full, the overflow policy of the queue
+ * decides the outcome; under FQOVERFLOW_REJECT a blocking push sleeps
+ * until room is available. The procedure returns an error code to
+ * indicate its status. The value of q must not be NULL.
  */
 enum qterror
 fqpush(struct function_queue* q, void (*func)(void*), void* arg, int block)
 {
-	enum qterror ret = QTSUCCESS;
-	int isfull = 0;
+	struct function_queue_element e;
+	unsigned int pushed = 0;
 
 	assert(q != NULL);
+	e.func = func;
+	e.arg = arg;
 
-	if(block) {
-		if(pthread_mutex_lock(&q->lock) != 0)
-			return QTEPTMLOCK;
-	} else {
-		if(pthread_mutex_trylock(&q->lock) != 0)
-			return QTEPTMTRYLOCK;
-	}
+	return push_or_overflow(q, &e, 1, NULL, &pushed, block, NULL, 1);
+}
+
+/*
+ * This procedure pushes the given function pointer onto the queue like
+ * a blocking fqpush(), except that a push waiting for room under
+ * FQOVERFLOW_REJECT gives up once the absolute time pointed to by
+ * abstime has passed. The time is measured against CLOCK_REALTIME. The
+ * procedure returns QTETIMEDOUT if the queue stayed full until then.
+ * Otherwise, it returns an error code to indicate its status. The value
+ * of q must not be NULL. The value of abstime must not be NULL.
+ */
+enum qterror
+fqpushtimed(struct function_queue* q, void (*func)(void*), void* arg,
+		const struct timespec* abstime)
+{
+	struct function_queue_element e;
+	unsigned int pushed = 0;
 
-	fqisfull(q, &isfull, 0);
+	assert(q != NULL);
+	assert(abstime != NULL);
+	e.func = func;
+	e.arg = arg;
 
-	if(isfull != 0) { /* overflow */
-		ret = QTEFQFULL;
-		goto unlock_queue_mutex;
-	}
+	return push_or_overflow(q, &e, 1, NULL, &pushed, 1, abstime, 1);
+}
+
+/*
+ * This procedure pushes the given function pointer onto the queue like
+ * fqpush(), except that the function is never called by the caller.
+ * Under FQOVERFLOW_CALLERRUNS, a full queue makes the procedure return
+ * QTEFQFULL instead, even if it may block. It is meant for a function
+ * which pushes itself back while it runs, which would otherwise call
+ * itself again from the same frame, without bound. This procedure may
+ * block if the value of block is non-zero. The procedure returns an
+ * error code to indicate its status. The value of q must not be NULL.
+ */
+enum qterror
+fqrequeue(struct function_queue* q, void (*func)(void*), void* arg,
+		int block)
+{
+	struct function_queue_element e;
+	unsigned int pushed = 0;
+
+	assert(q != NULL);
+	e.func = func;
+	e.arg = arg;
+
+	return push_or_overflow(q, &e, 1, NULL, &pushed, block, NULL, 0);
+}
+
+/*
+ * This procedure pushes the node pointed to by node onto an intrusive
+ * queue, storing the given function pointer and argument arg in it. The
+ * node belongs to the caller, usually embedded in the data which arg
+ * points to, and must stay valid until it has been popped; the queue
+ * never allocates or frees memory for it. A node discarded by
+ * FQOVERFLOW_DROPOLDEST or by shrinking the queue is unlinked without
+ * being run. This procedure may block if the value of block is
+ * non-zero. The procedure returns QTEINVALID if the queue does not
+ * accept nodes. Otherwise, it returns an error code to indicate its
+ * status. The value of q must not be NULL. The value of node must not
+ * be NULL.
+ */
+enum qterror
+fqpushnode(struct function_queue* q, struct fqellnode* node,
+		void (*func)(void*), void* arg, int block)
+{
+	unsigned int pushed = 0;
 
+	assert(q != NULL);
+	assert(node != NULL);
 	assert(q->dispatchtable != NULL);
-	assert(q->dispatchtable->push != NULL);
-	ret = q->dispatchtable->push(&q->queue, func, arg, block);
 
-	if(ret == QTSUCCESS) {
-		++q->size;
+	if(q->dispatchtable->pushnode == NULL
+			|| q->dispatchtable->concurrent)
+		return QTEINVALID;
 
-		/* Only signal if the queue was empty before */
-		if(q->size == 1)
-			(void) pthread_cond_signal(&q->wait);
-	}
+	node->element.func = func;
+	node->element.arg = arg;
 
-unlock_queue_mutex:
-	if(pthread_mutex_unlock(&q->lock) != 0)
-		if(ret != QTSUCCESS)
-			ret = QTEPTMUNLOCK;
+	return push_or_overflow(q, &node->element, 1, node, &pushed, block,
+			NULL, 1);
+}
 
-	return ret;
+/*
+ * This procedure pushes the n elements of the array pointed to by
+ * elements onto the queue in order while locking the queue only once.
+ * Each element is handled as described for fqpush(), so a blocking push
+ * may wait for room part way through the array. The number of elements
+ * which were queued, or run by the caller under FQOVERFLOW_CALLERRUNS,
+ * is stored in the integer pointed to by pushed. The remaining elements
+ * were not consumed. The procedure returns an error code to indicate
+ * its status. The value of q must not be NULL. The value of elements
+ * must not be NULL unless n is 0. The value of pushed must not be NULL.
+ */
+enum qterror
+fqpushv(struct function_queue* q,
+		const struct function_queue_element* elements, unsigned int n,
+		unsigned int* pushed, int block)
+{
+	assert(q != NULL);
+	assert(elements != NULL || n == 0);
+	assert(pushed != NULL);
+
+	return push_or_overflow(q, elements, n, NULL, pushed, block, NULL,
+			1);
 }
 
 /*
@@ -164,11 +381,133 @@ unlock_queue_mutex:
  */
 enum qterror
 fqpop(struct function_queue* q, struct function_queue_element* e, int block)
+{
+	unsigned int popped = 0;
+
+	assert(q != NULL);
+	assert(e != NULL);
+
+	return peek_or_pop(q, e, 1, 1, &popped, block, 1, NULL);
+}
+
+/*
+ * This procedure pops several function pointers from the queue while
+ * locking it only once. At most max elements are popped, and at most
+ * the share-th part of the elements in the queue, rounded up, so that
+ * one of share poppers does not take everything. The elements are
+ * copied in order to the array pointed to by e and their number is
+ * stored in the integer pointed to by popped. This procedure may block
+ * until at least one element is available if the value of block is
+ * non-zero. The procedure returns an error code to indicate its status.
+ * The value of q must not be NULL. The value of e must not be NULL. The
+ * value of popped must not be NULL. The values of max and share must
+ * not be 0.
+ */
+enum qterror
+fqpopv(struct function_queue* q, struct function_queue_element* e,
+		unsigned int max, unsigned int share, unsigned int* popped,
+		int block)
+{
+	assert(q != NULL);
+	assert(e != NULL);
+	assert(popped != NULL);
+
+	*popped = 0;
+
+	if(max == 0 || share == 0)
+		return QTEINVALID;
+
+	return peek_or_pop(q, e, max, share, popped, block, 1, NULL);
+}
+
+/*
+ * This procedure pops several function pointers from the queue like
+ * fqpopv() and blocks until at least one element is available, unless
+ * the value pointed to by stop is non-zero while the queue is empty. A
+ * popper which is blocked checks the value again whenever
+ * fqwakepoppers() is called. The procedure returns QTEFQEMPTY if it
+ * stopped without elements. Otherwise, it returns an error code to
+ * indicate its status. The value of q must not be NULL. The value of e
+ * must not be NULL. The value of popped must not be NULL. The value of
+ * stop must not be NULL. The values of max and share must not be 0.
+ */
+enum qterror
+fqpopvuntil(struct function_queue* q, struct function_queue_element* e,
+		unsigned int max, unsigned int share, unsigned int* popped,
+		const unsigned int* stop)
 {
 	assert(q != NULL);
 	assert(e != NULL);
+	assert(popped != NULL);
+	assert(stop != NULL);
+
+	*popped = 0;
+
+	if(max == 0 || share == 0)
+		return QTEINVALID;
+
+	return peek_or_pop(q, e, max, share, popped, 1, 1, stop);
+}
+
+/*
+ * This procedure wakes every popper blocked in the queue, so that the
+ * poppers in fqpopvuntil() check their stop values. The other poppers
+ * wait again. A stop value set before the call is always seen. This
+ * procedure blocks until the queue can be locked. The procedure returns
+ * an error code to indicate its status. The value of q must not be
+ * NULL.
+ */
+enum qterror
+fqwakepoppers(struct function_queue* q)
+{
+	struct fqlocknode locknode;
+
+	assert(q != NULL);
+
+	if(fqlockacquire(&q->lock, &locknode) != QTSUCCESS)
+		return QTEPTMLOCK;
+
+	wake_poppers(q, 1);
+
+	if(fqlockrelease(&q->lock) != QTSUCCESS)
+		return QTEPTMUNLOCK;
+
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure wakes the popper blocked in fqpopvuntil() with the
+ * stop value pointed to by stop, so that it checks the value, and no
+ * other popper if it can. A stop value set before the call is always
+ * seen. This procedure blocks until the queue can be locked. The
+ * procedure returns an error code to indicate its status. The value of
+ * q must not be NULL. The value of stop must not be NULL.
+ */
+enum qterror
+fqwakepopper(struct function_queue* q, const unsigned int* stop)
+{
+	struct fqlocknode locknode;
+	struct fqwaiter* w = NULL;
+
+	assert(q != NULL);
+	assert(stop != NULL);
+
+	if(fqlockacquire(&q->lock, &locknode) != QTSUCCESS)
+		return QTEPTMLOCK;
+
+	for(w = q->waiters; w != NULL && w->stop != stop; w = w->next)
+		;
+
+	/* a popper which is not listed waits on the queue's variable */
+	if(w != NULL)
+		fqlockwake(&q->lock, &w->wait, 0);
+	else
+		fqlockwake(&q->lock, &q->wait, 1);
 
-	return peek_or_pop(q, e, block, 1);
+	if(fqlockrelease(&q->lock) != QTSUCCESS)
+		return QTEPTMUNLOCK;
+
+	return QTSUCCESS;
 }
 
 /*
@@ -183,10 +522,12 @@ fqpop(struct function_queue* q, struct function_queue_element* e, int block)
 enum qterror
 fqpeek(struct function_queue* q, struct function_queue_element* e, int block)
 {
+	unsigned int peeked = 0;
+
 	assert(q != NULL);
 	assert(e != NULL);
 
-	return peek_or_pop(q, e, block, 0);
+	return peek_or_pop(q, e, 1, 1, &peeked, block, 0, NULL);
 }
 
 /*
@@ -221,124 +562,1263 @@ fqisfull(struct function_queue* q, int* isfull, int block)
 	return q->dispatchtable->isfull(&q->queue, isfull, block);
 }
 
+/*
+ * This procedure returns the number of elements in the given queue. The
+ * queue is not locked, so the result may be stale by the time it is
+ * used. The value of q must not be NULL.
+ */
+unsigned int
+fqsize(struct function_queue* q)
+{
+	assert(q != NULL);
+
+	if(q->dispatchtable->size != NULL)
+		return q->dispatchtable->size(&q->queue);
+
+	return QTATOMIC_LOAD(&q->size, QTATOMIC_RELAXED);
+}
+
+/*
+ * This procedure changes the maximum number of elements allowed in the
+ * queue to size. If the queue holds more elements than that, the least
+ * recently added elements are discarded, forgotten for coalescing and
+ * reported as described for fqdiscard(); concurrent queues truncate
+ * their sub-queues as they see fit. Pushers waiting for room are woken
+ * if the queue grows. This procedure may block if the value of block is
+ * non-zero. The procedure returns an error code to indicate its status.
+ * The value of q must not be NULL.
+ */
 enum qterror
 fqresize(struct function_queue* q, unsigned int size, int block)
 {
+	struct fqlocknode locknode;
+	struct function_queue_element* dropped = NULL;
 	enum qterror ret = QTSUCCESS;
+	unsigned int ndropped = 0;
+	unsigned int i = 0;
 
 	assert(q != NULL);
 
 	if(block) {
-		if(pthread_mutex_lock(&q->lock) != 0)
+		if(fqlockacquire(&q->lock, &locknode) != QTSUCCESS)
 			return QTEPTMLOCK;
 	} else {
-		if(pthread_mutex_trylock(&q->lock) != 0)
+		if(fqlocktryacquire(&q->lock, &locknode) != QTSUCCESS)
 			return QTEPTMTRYLOCK;
 	}
 
 	assert(q->dispatchtable != NULL);
 	assert(q->dispatchtable->resize != NULL);
-	ret = q->dispatchtable->resize(&q->queue, size, block);
 
-	if(q->size > size)
-		q->size = size;
+	/* the excess is popped so that it can be uncoalesced and reported */
+	if(q->size > size && !q->dispatchtable->concurrent) {
+		dropped = malloc((q->size - size) * sizeof(*dropped));
+
+		if(dropped == NULL)
+			ret = QTEMALLOC;
+
+		while(ret == QTSUCCESS && q->size > size) {
+			ret = q->dispatchtable->pop(&q->queue,
+					&dropped[ndropped], block);
+
+			if(ret != QTSUCCESS)
+				break;
+
+			if(q->coalesce != NULL)
+				fqcoalesceremove(q->coalesce,
+						dropped[ndropped].func,
+						dropped[ndropped].arg);
+
+			++ndropped;
+			--q->size;
+		}
+	}
+
+	if(ret == QTSUCCESS) {
+		ret = q->dispatchtable->resize(&q->queue, size, block);
+
+		/* wake every blocked pusher if there is more room now */
+		if(size > q->max_elements && QTATOMIC_LOAD(&q->push_waiters,
+					QTATOMIC_RELAXED) > 0)
+			fqlockwake(&q->lock, &q->notfull, 1);
 
-	q->max_elements = size;
+		q->max_elements = size;
+	}
 
-	if(pthread_mutex_unlock(&q->lock) != 0)
+	if(fqlockrelease(&q->lock) != QTSUCCESS)
 		if(ret != QTSUCCESS)
 			ret = QTEPTMUNLOCK;
 
+	for(i = 0; i < ndropped; ++i)
+		fqdiscard(q, dropped[i].func, dropped[i].arg);
+
+	free(dropped);
 	return ret;
 }
 
 /*
- * This procedure is a wrapper around the mutex unlock procedure so that
- * the mutex can be unlocked in a cleanup handler. The variable m is a
- * pointer to the mutex to unlock. The value of m must not be NULL.
+ * This procedure sets the policy which decides what a push does when
+ * the queue is full. The default policy is FQOVERFLOW_REJECT. Pushers
+ * which are waiting for room apply the new policy to their element. This
+ * procedure blocks until the queue can be locked. The procedure returns
+ * an error code to indicate its status. The value of q must not be
+ * NULL.
  */
-static void
-release_mutex(void* m)
+enum qterror
+fqsetoverflow(struct function_queue* q, enum fqoverflow overflow)
 {
-	(void) pthread_mutex_unlock((pthread_mutex_t*) m);
+	struct fqlocknode locknode;
+
+	assert(q != NULL);
+
+	if(overflow >= FQOVERFLOW_LAST)
+		return QTEINVALID;
+
+	if(fqlockacquire(&q->lock, &locknode) != QTSUCCESS)
+		return QTEPTMLOCK;
+
+	QTATOMIC_STORE(&q->overflow, overflow, QTATOMIC_RELAXED);
+
+	/* pushers waiting for room apply the new policy instead */
+	if(QTATOMIC_LOAD(&q->push_waiters, QTATOMIC_RELAXED) > 0)
+		fqlockwake(&q->lock, &q->notfull, 1);
+
+	if(fqlockrelease(&q->lock) != QTSUCCESS)
+		return QTEPTMUNLOCK;
+
+	return QTSUCCESS;
 }
 
 /*
- * This procedure is a helper for peeking and poping a function queue.
- * The function pointer and its information is stored in a function
- * queue element. The value of this function queue element is copied to
- * the address pointed to by the variable e. It is removed from the
- * queue if the value of do_pop is non-zero. This procedure may block if
- * the value of block is non-zero. The procedure returns an error code
- * to indicate its status. The value of q must not be NULL. The value of
- * e must not be NULL.
+ * This procedure turns coalescing of pushes on if the value of enable
+ * is non-zero, or off otherwise. While it is on, pushing a function
+ * pointer and argument which are already pending in the queue succeeds
+ * without adding another element, also when the queue is full. Elements
+ * which were pushed while it was off are not coalesced. Coalescing is
+ * only available for the indexed array and linked list types. This
+ * procedure blocks until the queue can be locked. The procedure returns
+ * an error code to indicate its status. The value of q must not be
+ * NULL.
  */
-static enum qterror
-peek_or_pop(struct function_queue* q, struct function_queue_element* e,
-		int block, int do_pop)
+enum qterror
+fqsetcoalesce(struct function_queue* q, int enable)
 {
-	volatile enum qterror ret = QTSUCCESS;
-	int isempty = 0;
+	struct fqlocknode locknode;
+	enum qterror ret = QTSUCCESS;
 
 	assert(q != NULL);
-	assert(e != NULL);
 
-	if(block) {
-		if(pthread_mutex_lock(&q->lock) != 0)
-			return QTEPTMLOCK;
-	} else {
-		if(pthread_mutex_trylock(&q->lock) != 0)
-			return QTEPTMTRYLOCK;
-	}
+	if(q->dispatchtable->concurrent || q->type == FQTYPE_LLI)
+		return QTEINVALID;
 
-	ret = fqisempty(q, &isempty, 0);
+	if(fqlockacquire(&q->lock, &locknode) != QTSUCCESS)
+		return QTEPTMLOCK;
 
-	if(ret != QTSUCCESS)
-		goto unlock_queue_mutex;
+	if(enable && q->coalesce == NULL) {
+		q->coalesce = malloc(sizeof(*q->coalesce));
 
-	if(isempty) {
-		if(!block) {
-			ret = QTEFQEMPTY;
-			goto unlock_queue_mutex;
+		if(q->coalesce == NULL) {
+			ret = QTEMALLOC;
+		} else {
+			ret = fqcoalesceinit(q->coalesce);
+
+			if(ret != QTSUCCESS) {
+				free(q->coalesce);
+				q->coalesce = NULL;
+			}
 		}
+	} else if(!enable && q->coalesce != NULL) {
+		fqcoalescedestroy(q->coalesce);
+		free(q->coalesce);
+		q->coalesce = NULL;
+	}
 
-		pthread_cleanup_push(release_mutex, &q->lock);
+	if(fqlockrelease(&q->lock) != QTSUCCESS)
+		if(ret == QTSUCCESS)
+			ret = QTEPTMUNLOCK;
 
-		do {
-			pthread_cond_wait(&q->wait, &q->lock);
-			ret = fqisempty(q, &isempty, 0);
+	return ret;
+}
 
-			if(ret != QTSUCCESS)
-				goto unlock_queue_mutex;
-		} while(isempty);
+/*
+ * This procedure puts the queue under a CoDel controller which sheds
+ * load while the time elements spend in the queue stays above target
+ * microseconds for interval microseconds, or removes the controller if
+ * the value of target is 0. Load is shed in the given mode, by making
+ * pushes fail with QTEFQFULL, also pushes which would block, or by
+ * dropping elements as they are popped, which are then never run but
+ * reported as described for fqdiscard(). While the controller is on,
+ * pushed elements are stamped with their enqueue time. Setting a
+ * controller again resets it. The controller is only available for the
+ * types which are not concurrent. This procedure blocks until the queue
+ * can be locked. The procedure returns an error code to indicate its
+ * status. The value of q must not be NULL.
+ */
+enum qterror
+fqsetcodel(struct function_queue* q, unsigned long target,
+		unsigned long interval, enum fqcodelmode mode)
+{
+	struct fqlocknode locknode;
+	enum qterror ret = QTSUCCESS;
 
-		pthread_cleanup_pop(0);
-	}
+	assert(q != NULL);
 
-	/*
-	 * NOTE: This cannot be an else because isempty could change if
-	 * we block.
-	 */
-	if(!isempty) {
-		assert(q->dispatchtable != NULL);
+	if(q->dispatchtable->concurrent || (target != 0 && interval == 0)
+			|| (mode != FQCODEL_REJECT && mode != FQCODEL_DROP))
+		return QTEINVALID;
 
-		if(do_pop) {
-			assert(q->dispatchtable->pop != NULL);
-			ret = q->dispatchtable->pop(&q->queue, e, block);
+	if(fqlockacquire(&q->lock, &locknode) != QTSUCCESS)
+		return QTEPTMLOCK;
 
-			if(ret == QTSUCCESS)
-				--q->size;
-		} else {
-			assert(q->dispatchtable->peek != NULL);
-			ret = q->dispatchtable->peek(&q->queue, e, block);
+	if(target != 0) {
+		if(q->codel == NULL) {
+			q->codel = malloc(sizeof(*q->codel));
+
+			if(q->codel == NULL)
+				ret = QTEMALLOC;
+			else
+				(void) fqsettimestamps(q, 1);
 		}
+
+		if(q->codel != NULL)
+			fqcodelinit(q->codel, target, interval, mode);
+	} else if(q->codel != NULL) {
+		free(q->codel);
+		q->codel = NULL;
+		(void) fqsettimestamps(q, 0);
 	}
 
-unlock_queue_mutex:
-	if(pthread_mutex_unlock(&q->lock) != 0)
-		if(ret != QTSUCCESS)
+	if(fqlockrelease(&q->lock) != QTSUCCESS)
+		if(ret == QTSUCCESS)
 			ret = QTEPTMUNLOCK;
 
 	return ret;
 }
 
+/*
+ * This procedure registers a user which needs the time at which each
+ * element was pushed if the value of enable is non-zero, or removes one
+ * otherwise. While the queue has users, pushed elements get the time on
+ * the monotonic clock in their member enqueued; otherwise it is zero.
+ * Each call which enables stamping must be paired with one which
+ * disables it. The procedure returns QTEINVALID if stamping is disabled
+ * more often than it was enabled. Otherwise, it returns QTSUCCESS. The
+ * value of q must not be NULL.
+ */
+enum qterror
+fqsettimestamps(struct function_queue* q, int enable)
+{
+	unsigned int users = 0;
+
+	assert(q != NULL);
+
+	if(enable) {
+		(void) QTATOMIC_FETCH_ADD(&q->stamp_users, 1,
+				QTATOMIC_RELAXED);
+		return QTSUCCESS;
+	}
+
+	users = QTATOMIC_LOAD(&q->stamp_users, QTATOMIC_RELAXED);
+
+	do {
+		if(users == 0)
+			return QTEINVALID;
+	} while(!QTATOMIC_CAS(&q->stamp_users, &users, users - 1,
+				QTATOMIC_RELAXED));
+
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure sets the procedure which is called with the function
+ * pointer and argument of each element which the queue discards without
+ * running it, so that the argument can be released. Elements are
+ * discarded by FQOVERFLOW_DROPOLDEST, by fqresize() and by a CoDel
+ * controller in FQCODEL_DROP mode. The procedure is called by the
+ * thread which discarded the element, without the queue locked.
+ * Elements of procedures with a handler registered by fqregisterdrop()
+ * go to that handler instead. If the value of ondrop is NULL, discarded
+ * elements are not reported. The procedure always succeeds. The value
+ * of q must not be NULL.
+ */
+enum qterror
+fqsetondrop(struct function_queue* q, void (*ondrop)(void (*)(void*), void*))
+{
+	assert(q != NULL);
+	QTATOMIC_STORE(&q->ondrop, ondrop, QTATOMIC_RELEASE);
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure registers dropped as the handler of the discarded
+ * elements of every queue whose function pointer is func. It is meant
+ * for the procedures which a module queues on behalf of its users,
+ * whose arguments only that module can release. The handler is called
+ * with the queue and the argument of the element instead of the drop
+ * hook of the queue. Registering the same pair again has no effect. The
+ * procedure returns QTEINVALID if func has another handler or if
+ * FQDROP_HANDLERS handlers are registered already. Otherwise, it returns
+ * an error code to indicate its status. The value of func must not be
+ * NULL. The value of dropped must not be NULL.
+ */
+enum qterror
+fqregisterdrop(void (*func)(void*),
+		void (*dropped)(struct function_queue*, void*))
+{
+	enum qterror ret = QTSUCCESS;
+	unsigned int i = 0;
+
+	assert(func != NULL);
+	assert(dropped != NULL);
+
+	if(pthread_mutex_lock(&drop_handlers_lock) != 0)
+		return QTEPTMLOCK;
+
+	for(i = 0; i < ndrop_handlers; ++i)
+		if(drop_handlers[i].func == func)
+			break;
+
+	if(i < ndrop_handlers) {
+		if(drop_handlers[i].dropped != dropped)
+			ret = QTEINVALID;
+	} else if(i == FQDROP_HANDLERS) {
+		ret = QTEINVALID;
+	} else {
+		drop_handlers[i].func = func;
+		drop_handlers[i].dropped = dropped;
+		QTATOMIC_STORE(&ndrop_handlers, i + 1, QTATOMIC_RELEASE);
+	}
+
+	(void) pthread_mutex_unlock(&drop_handlers_lock);
+	return ret;
+}
+
+/*
+ * This procedure reports the element with the function pointer func and
+ * the argument arg, which the queue q discarded without running it, to
+ * the handler registered for func, or else to the drop hook of the
+ * queue if it has one. It is called by the queue itself, and by drop
+ * handlers for the elements they wrapped. The queue lock must not be
+ * held by the calling thread. The value of q must not be NULL.
+ */
+void
+fqdiscard(struct function_queue* q, void (*func)(void*), void* arg)
+{
+	void (* ondrop)(void (*)(void*), void*) = NULL;
+	unsigned int n = 0;
+	unsigned int i = 0;
+
+	assert(q != NULL);
+	n = QTATOMIC_LOAD(&ndrop_handlers, QTATOMIC_ACQUIRE);
+
+	for(i = 0; i < n; ++i) {
+		if(drop_handlers[i].func == func) {
+			drop_handlers[i].dropped(q, arg);
+			return;
+		}
+	}
+
+	ondrop = QTATOMIC_LOAD(&q->ondrop, QTATOMIC_ACQUIRE);
+
+	if(ondrop != NULL)
+		ondrop(func, arg);
+}
+
+/*
+ * This procedure is a cleanup handler for a popper which is cancelled
+ * while waiting for an element. It removes the popper from the waiting
+ * poppers and releases the queue lock. The variable arg is a pointer to
+ * the waiting popper. The value of arg must not be NULL.
+ */
+static void
+release_popper(void* arg)
+{
+	struct fqwaiter* w = arg;
+	struct function_queue* q = w->q;
+
+	unpark_popper(w);
+	(void) fqlockrelease(&q->lock);
+}
+
+/*
+ * This procedure is a cleanup handler for a pusher which is cancelled
+ * while waiting for room in the queue. It removes the pusher from the
+ * count of waiters and releases the queue lock. The variable arg is a
+ * pointer to the function queue. The value of arg must not be NULL.
+ */
+static void
+release_push_wait(void* arg)
+{
+	struct function_queue* q = arg;
+
+	(void) QTATOMIC_FETCH_SUB(&q->push_waiters, 1, QTATOMIC_RELAXED);
+	(void) fqlockrelease(&q->lock);
+}
+
+/*
+ * This procedure is a helper for pushing onto a function queue. It
+ * pushes the n elements of the array pointed to by elements in order,
+ * each as described for fqpush(), while the queue is locked once. If
+ * the value of abstime is not NULL, a push waiting for room gives up at
+ * that absolute time. If the value of node is not NULL, it is the node
+ * holding the only element, which is linked into the queue instead of
+ * copied. The number of elements which were queued or run by the caller
+ * is stored in the integer pointed to by pushed. If the value of
+ * callerruns is zero, FQOVERFLOW_CALLERRUNS rejects a push into a full
+ * queue instead of running the elements in the caller. The
+ * procedure returns an error code to indicate its status. The value of
+ * q must not be NULL. The value of elements must not be NULL unless n
+ * is 0. The value of pushed must not be NULL.
+ */
+static enum qterror
+push_or_overflow(struct function_queue* q,
+		const struct function_queue_element* elements, unsigned int n,
+		struct fqellnode* node, unsigned int* pushed, int block,
+		const struct timespec* abstime, int callerruns)
+{
+	struct fqlocknode locknode;
+	struct function_queue_element dropped[FQDROP_BATCH];
+	enum qterror ret = QTSUCCESS;
+	unsigned int i = 0;
+	unsigned int j = 0;
+	unsigned int ndropped = 0;
+	unsigned int size_before = 0;
+	int isfull = 0;
+	int run_in_caller = 0;
+
+	assert(q != NULL);
+	assert(pushed != NULL);
+	*pushed = 0;
+
+	if(q->dispatchtable->concurrent)
+		return count_rejected(q, push_concurrent(q, elements, n,
+					pushed, block, abstime, callerruns));
+
+	/* the queue is unlocked to report each batch of dropped elements */
+	do {
+		if(block) {
+			if(fqlockacquire(&q->lock, &locknode) != QTSUCCESS) {
+				ret = QTEPTMLOCK;
+				break;
+			}
+		} else {
+			if(fqlocktryacquire(&q->lock, &locknode)
+					!= QTSUCCESS) {
+				ret = QTEPTMTRYLOCK;
+				break;
+			}
+		}
+
+		size_before = q->size;
+		ndropped = 0;
+
+		while(i < n && ndropped < FQDROP_BATCH) {
+			/* a pending duplicate takes the place of the new one */
+			if(q->coalesce != NULL && fqcoalescefind(q->coalesce,
+						elements[i].func,
+						elements[i].arg)) {
+				++i;
+				continue;
+			}
+
+			/* the controller sheds load before the queue is full */
+			if(q->codel != NULL && fqcodelreject(q->codel)) {
+				ret = QTEFQFULL;
+				break;
+			}
+
+			ret = fqisfull(q, &isfull, 0);
+
+			/* a policy set while waiting applies to the push */
+			while(ret == QTSUCCESS && isfull != 0
+					&& !run_in_caller) { /* overflow */
+				switch(q->overflow) {
+				case FQOVERFLOW_REJECT:
+					if(!block) {
+						ret = QTEFQFULL;
+						break;
+					}
+
+					/* poppers must run to make room */
+					signal_pushed(q, size_before);
+					ret = wait_not_full(q, abstime,
+							&isfull);
+					size_before = q->size;
+
+					if(ret == QTSUCCESS && isfull != 0
+							&& q->overflow
+							== FQOVERFLOW_REJECT)
+						ret = QTEFQFULL;
+
+					break;
+				case FQOVERFLOW_DROPOLDEST:
+					ret = drop_oldest(q, block,
+							&dropped[ndropped]);
+
+					if(ret == QTSUCCESS) {
+						++ndropped;
+						isfull = 0;
+					}
+
+					break;
+				case FQOVERFLOW_CALLERRUNS:
+					if(callerruns)
+						run_in_caller = 1;
+					else
+						ret = QTEFQFULL;
+
+					break;
+				case FQOVERFLOW_LAST:
+					ret = QTEINVALID;
+					break;
+				}
+			}
+
+			if(ret != QTSUCCESS || run_in_caller)
+				break;
+
+			assert(q->dispatchtable != NULL);
+
+			if(node != NULL) {
+				assert(n == 1);
+				assert(q->dispatchtable->pushnode != NULL);
+				stamp(q, &node->element);
+				ret = q->dispatchtable->pushnode(&q->queue,
+						node, block);
+			} else {
+				struct function_queue_element e = elements[i];
+
+				assert(q->dispatchtable->push != NULL);
+				stamp(q, &e);
+				ret = q->dispatchtable->push(&q->queue, &e,
+						block);
+			}
+
+			if(ret != QTSUCCESS)
+				break;
+
+			/* without an entry the element is just not coalesced */
+			if(q->coalesce != NULL)
+				(void) fqcoalesceadd(q->coalesce,
+						elements[i].func,
+						elements[i].arg);
+
+			++q->size;
+			QTPROBE3(fq_push, q, elements[i].func, q->size);
+			++i;
+		}
+
+		signal_pushed(q, size_before);
+
+		if(fqlockrelease(&q->lock) != QTSUCCESS)
+			if(ret != QTSUCCESS)
+				ret = QTEPTMUNLOCK;
+
+		for(j = 0; j < ndropped; ++j)
+			fqdiscard(q, dropped[j].func, dropped[j].arg);
+	} while(ret == QTSUCCESS && !run_in_caller && i < n);
+
+	/* the queue is not locked while the caller runs the functions */
+	if(ret == QTSUCCESS && run_in_caller)
+		for(; i < n; ++i)
+			elements[i].func(elements[i].arg);
+
+	*pushed = i;
+	return count_rejected(q, ret);
+}
+
+/*
+ * This procedure counts a push which finished with the error code ret
+ * in the rejected pushes of q if the queue had no room for it. The
+ * procedure returns the value of ret. The value of q must not be NULL.
+ */
+static enum qterror
+count_rejected(struct function_queue* q, enum qterror ret)
+{
+	assert(q != NULL);
+
+	if(ret == QTEFQFULL || ret == QTETIMEDOUT)
+		(void) QTATOMIC_FETCH_ADD(&q->rejected, 1UL,
+				QTATOMIC_RELAXED);
+
+	return ret;
+}
+
+/*
+ * This procedure sets the time at which the element pointed to by e is
+ * pushed if a user of the queue needs time stamps. Otherwise, the time
+ * is set to zero, so that stale values are never read. The value of q
+ * must not be NULL. The value of e must not be NULL.
+ */
+static void
+stamp(const struct function_queue* q, struct function_queue_element* e)
+{
+	assert(q != NULL);
+	assert(e != NULL);
+
+	if(QTATOMIC_LOAD(&q->stamp_users, QTATOMIC_RELAXED) != 0
+			&& clock_gettime(CLOCK_MONOTONIC, &e->enqueued) == 0)
+		return;
+
+	e->enqueued.tv_sec = 0;
+	e->enqueued.tv_nsec = 0;
+}
+
+/*
+ * This procedure wakes the poppers which may be waiting for elements
+ * pushed since the queue held size_before elements. Poppers only wait
+ * while the queue is empty, so nothing is signaled otherwise. The queue
+ * lock must be held by the calling thread. The value of q must not
+ * be NULL.
+ */
+static void
+signal_pushed(struct function_queue* q, unsigned int size_before)
+{
+	assert(q != NULL);
+
+	/* Only signal if the queue was empty before */
+	if(size_before != 0 || q->size == 0)
+		return;
+
+	wake_poppers(q, q->size > 1);
+}
+
+/*
+ * This procedure waits until the queue has room or the absolute time
+ * pointed to by abstime has passed. The queue lock must be held by
+ * the calling thread. The integer pointed to by isfull is updated with
+ * the state of the queue after waiting. If abstime is NULL, the
+ * procedure waits without a time limit. The procedure returns
+ * QTETIMEDOUT if the queue is still full at the time limit. Otherwise,
+ * it returns an error code to indicate its status. The value of q must
+ * not be NULL. The value of isfull must not be NULL.
+ */
+static enum qterror
+wait_not_full(struct function_queue* q, const struct timespec* abstime,
+		int* isfull)
+{
+	volatile enum qterror ret = QTSUCCESS;
+	enum fqoverflow overflow = q->overflow;
+	volatile int err = 0;
+
+	assert(q != NULL);
+	assert(isfull != NULL);
+
+	(void) QTATOMIC_FETCH_ADD(&q->push_waiters, 1, QTATOMIC_RELAXED);
+	pthread_cleanup_push(release_push_wait, q);
+
+	while(ret == QTSUCCESS && *isfull != 0 && err == 0
+			&& q->overflow == overflow) {
+		if(abstime == NULL)
+			err = fqlockwait(&q->lock, &q->notfull, NULL);
+		else
+			err = fqlockwait(&q->lock, &q->notfull,
+					abstime);
+
+		ret = fqisfull(q, isfull, 0);
+	}
+
+	pthread_cleanup_pop(0);
+	(void) QTATOMIC_FETCH_SUB(&q->push_waiters, 1, QTATOMIC_RELAXED);
+
+	if(ret == QTSUCCESS && *isfull != 0 && err == ETIMEDOUT)
+		ret = QTETIMEDOUT;
+
+	return ret;
+}
+
+/*
+ * This procedure discards the least recently added element of the
+ * queue to make room for a new one, and stores it in the element
+ * pointed to by e so that it can be reported with fqdiscard() once the
+ * queue is unlocked. The queue lock must be held by the calling thread
+ * unless the queue is concurrent, in which case the procedure may block
+ * on the queue data if the value of block is non-zero. The procedure
+ * returns QTEFQFULL if there is no element to discard. Otherwise, it
+ * returns an error code to indicate its status. The value of q must not
+ * be NULL. The value of e must not be NULL.
+ */
+static enum qterror
+drop_oldest(struct function_queue* q, int block,
+		struct function_queue_element* e)
+{
+	enum qterror ret = QTSUCCESS;
+
+	assert(q != NULL);
+	assert(e != NULL);
+	assert(q->dispatchtable != NULL);
+	assert(q->dispatchtable->pop != NULL);
+	ret = q->dispatchtable->pop(&q->queue, e, block);
+
+	if(ret == QTEFQEMPTY)
+		return QTEFQFULL;
+
+	if(ret == QTSUCCESS && q->coalesce != NULL)
+		fqcoalesceremove(q->coalesce, e->func, e->arg);
+
+	if(ret == QTSUCCESS && !q->dispatchtable->concurrent)
+		--q->size;
+
+	return ret;
+}
+
+/*
+ * This procedure is a helper for peeking and poping a function queue.
+ * The function pointer and its information is stored in a function
+ * queue element. The value of this function queue element is copied to
+ * the address pointed to by the variable e. It is removed from the
+ * queue if the value of do_pop is non-zero. When popping, up to max
+ * elements are copied to the array pointed to by e, limited to the
+ * share-th part of the elements in the queue, rounded up. The number of
+ * elements copied is stored in the integer pointed to by count. The
+ * value of share is ignored for concurrent queues, which do not know
+ * their size without sweeping it. This procedure may block if the
+ * value of block is non-zero, but stops waiting while the value pointed
+ * to by stop is non-zero if stop is not NULL. The procedure
+ * returns an error code to indicate its status. The value of q must not
+ * be NULL. The value of e must not be NULL. The value of count must not
+ * be NULL. The values of max and share must not be 0.
+ */
+static enum qterror
+peek_or_pop(struct function_queue* q, struct function_queue_element* e,
+		unsigned int max, unsigned int share, unsigned int* count,
+		int block, int do_pop, const unsigned int* stop)
+{
+	struct fqlocknode locknode;
+	struct fqwaiter waiter;
+	struct function_queue_element dropped[FQDROP_BATCH];
+	volatile enum qterror ret = QTSUCCESS;
+	volatile unsigned int ndropped = 0;
+	unsigned int i = 0;
+	int isempty = 0;
+
+	assert(q != NULL);
+	assert(e != NULL);
+	assert(count != NULL);
+	assert(max > 0);
+	assert(share > 0);
+
+	*count = 0;
+
+	if(q->dispatchtable->concurrent)
+		return take_concurrent(q, e, do_pop ? max : 1, count, block,
+				do_pop, stop);
+
+	if(block) {
+		if(fqlockacquire(&q->lock, &locknode) != QTSUCCESS)
+			return QTEPTMLOCK;
+	} else {
+		if(fqlocktryacquire(&q->lock, &locknode) != QTSUCCESS)
+			return QTEPTMTRYLOCK;
+	}
+
+	ret = fqisempty(q, &isempty, 0);
+
+	if(ret != QTSUCCESS)
+		goto unlock_queue_lock;
+
+	if(isempty) {
+		if(!block) {
+			ret = QTEFQEMPTY;
+			goto unlock_queue_lock;
+		}
+
+		QTPROBE1(fq_park, q);
+		pthread_cleanup_push(release_popper, &waiter);
+		/* nothing in between can act on a cancellation */
+		park_popper(q, &waiter, stop);
+
+		while(ret == QTSUCCESS && isempty) {
+			if(stopped(stop)) {
+				ret = QTEFQEMPTY;
+				break;
+			}
+
+			wait_popper(&waiter);
+			ret = fqisempty(q, &isempty, 0);
+		}
+
+		pthread_cleanup_pop(0);
+		unpark_popper(&waiter);
+		QTPROBE1(fq_unpark, q);
+
+		if(ret != QTSUCCESS)
+			goto unlock_queue_lock;
+	}
+
+	/*
+	 * NOTE: This cannot be an else because isempty could change if
+	 * we block.
+	 */
+	if(!isempty) {
+		assert(q->dispatchtable != NULL);
+
+		if(do_pop) {
+			unsigned int limit = q->size / share
+					+ (q->size % share != 0);
+			unsigned int n = 0;
+			struct timespec now;
+
+			if(limit > max)
+				limit = max;
+
+			if(q->codel != NULL)
+				(void) clock_gettime(CLOCK_MONOTONIC, &now);
+
+			assert(q->dispatchtable->pop != NULL);
+
+			while(n < limit) {
+				ret = q->dispatchtable->pop(&q->queue, &e[n],
+						block);
+
+				if(ret != QTSUCCESS)
+					break;
+
+				if(q->coalesce != NULL)
+					fqcoalesceremove(q->coalesce,
+							e[n].func, e[n].arg);
+
+				--q->size;
+				QTPROBE3(fq_pop, q, e[n].func, q->size);
+
+				/* the last element is never dropped */
+				if(q->codel != NULL && ndropped < FQDROP_BATCH
+						&& fqcodeldequeue(q->codel,
+							&e[n].enqueued, &now,
+							q->size))
+					dropped[ndropped++] = e[n];
+				else
+					++n;
+			}
+
+			/* the elements already popped are still returned */
+			if(n > 0)
+				ret = QTSUCCESS;
+
+			if(n + ndropped > 0 && QTATOMIC_LOAD(
+						&q->push_waiters,
+						QTATOMIC_RELAXED) > 0) {
+				fqlockwake(&q->lock, &q->notfull,
+						n + ndropped > 1);
+			}
+
+			*count = n;
+		} else {
+			assert(q->dispatchtable->peek != NULL);
+			ret = q->dispatchtable->peek(&q->queue, e, block);
+
+			if(ret == QTSUCCESS)
+				*count = 1;
+		}
+	}
+
+unlock_queue_lock:
+	if(fqlockrelease(&q->lock) != QTSUCCESS)
+		if(ret != QTSUCCESS)
+			ret = QTEPTMUNLOCK;
+
+	for(i = 0; i < ndropped; ++i)
+		fqdiscard(q, dropped[i].func, dropped[i].arg);
+
+	return ret;
+}
+
+/*
+ * This procedure is a cleanup handler for a popper of a concurrent
+ * queue which is cancelled while waiting for an element. It removes the
+ * popper from the waiting poppers and their count and releases the
+ * queue lock. The variable arg is a pointer to the waiting popper. The
+ * value of arg must not be NULL.
+ */
+static void
+release_pop_wait(void* arg)
+{
+	struct fqwaiter* w = arg;
+	struct function_queue* q = w->q;
+
+	(void) QTATOMIC_FETCH_SUB(&q->pop_waiters, 1, QTATOMIC_RELAXED);
+	unpark_popper(w);
+	(void) fqlockrelease(&q->lock);
+}
+
+/*
+ * This procedure prepares the popper w to wait for an element of the
+ * queue q. If the value of stop is not NULL, the popper waits until the
+ * value it points to is set, on a condition variable of its own, and is
+ * listed in the queue for fqwakepopper(). The queue lock must be held
+ * by the calling thread. The value of q must not be NULL. The value of
+ * w must not be NULL.
+ */
+static void
+park_popper(struct function_queue* q, struct fqwaiter* w,
+		const unsigned int* stop)
+{
+	assert(q != NULL);
+	assert(w != NULL);
+	w->next = NULL;
+	w->q = q;
+	w->stop = stop;
+	w->linked = 0;
+
+	if(stop == NULL || pthread_cond_init(&w->wait, NULL) != 0)
+		return;
+
+	w->next = q->waiters;
+	q->waiters = w;
+	w->linked = 1;
+}
+
+/*
+ * This procedure removes the popper w, which stopped waiting, from the
+ * list of its queue. The queue lock must be held by the calling thread.
+ * The value of w must not be NULL.
+ */
+static void
+unpark_popper(struct fqwaiter* w)
+{
+	struct fqwaiter** it = NULL;
+
+	assert(w != NULL);
+
+	if(!w->linked)
+		return;
+
+	for(it = &w->q->waiters; *it != w; it = &(*it)->next)
+		assert(*it != NULL);
+
+	*it = w->next;
+	w->linked = 0;
+	(void) pthread_cond_destroy(&w->wait);
+}
+
+/*
+ * This procedure waits for the popper w until it is woken. The queue
+ * lock must be held by the calling thread, and is held again when the
+ * procedure returns. The value of w must not be NULL.
+ */
+static void
+wait_popper(struct fqwaiter* w)
+{
+	assert(w != NULL);
+	(void) fqlockwait(&w->q->lock, w->linked ? &w->wait : &w->q->wait,
+			NULL);
+}
+
+/*
+ * This procedure wakes a popper waiting for an element of the queue q,
+ * or every such popper if the value of all is non-zero. Since a popper
+ * waiting until a stop value is set waits on a condition variable of
+ * its own, one of them is woken as well as a popper waiting on the
+ * queue's. The queue lock must be held by the calling thread. The value
+ * of q must not be NULL.
+ */
+static void
+wake_poppers(struct function_queue* q, int all)
+{
+	struct fqwaiter* w = NULL;
+
+	assert(q != NULL);
+	fqlockwake(&q->lock, &q->wait, all);
+
+	for(w = q->waiters; w != NULL; w = all ? w->next : NULL)
+		fqlockwake(&q->lock, &w->wait, 0);
+}
+
+/*
+ * This procedure is the counterpart of push_or_overflow() for concurrent
+ * queues. The elements are pushed without taking the queue lock,
+ * which is only taken to wait for room or to wake waiting poppers. The
+ * procedure returns an error code to indicate its status. The value of
+ * q must not be NULL. The value of elements must not be NULL unless n
+ * is 0. The value of pushed must not be NULL.
+ */
+static enum qterror
+push_concurrent(struct function_queue* q,
+		const struct function_queue_element* elements, unsigned int n,
+		unsigned int* pushed, int block, const struct timespec* abstime,
+		int callerruns)
+{
+	enum qterror ret = QTSUCCESS;
+	unsigned int i = 0;
+	unsigned int signaled = 0;
+	int run_in_caller = 0;
+
+	assert(q != NULL);
+	assert(pushed != NULL);
+
+	while(i < n) {
+		struct function_queue_element e = elements[i];
+		struct function_queue_element dropped;
+
+		assert(q->dispatchtable->push != NULL);
+		stamp(q, &e);
+		ret = q->dispatchtable->push(&q->queue, &e, block);
+
+		if(ret == QTEFQFULL) { /* overflow */
+			switch(QTATOMIC_LOAD(&q->overflow, QTATOMIC_RELAXED)) {
+			case FQOVERFLOW_REJECT:
+				if(block) {
+					/* poppers must run to make room */
+					wake_concurrent(q, &q->wait,
+							&q->pop_waiters,
+							i - signaled);
+					signaled = i;
+					ret = wait_push_concurrent(q,
+							&elements[i], abstime);
+				}
+
+				/* the push is retried under a new policy */
+				if(ret == QTEFQFULL && QTATOMIC_LOAD(
+							&q->overflow,
+							QTATOMIC_RELAXED)
+						!= FQOVERFLOW_REJECT)
+					continue;
+
+				break;
+			case FQOVERFLOW_DROPOLDEST:
+				ret = drop_oldest(q, block, &dropped);
+
+				if(ret == QTSUCCESS) {
+					fqdiscard(q, dropped.func,
+							dropped.arg);
+					continue;
+				}
+
+				break;
+			case FQOVERFLOW_CALLERRUNS:
+				if(!callerruns)
+					break;
+
+				ret = QTSUCCESS;
+				run_in_caller = 1;
+				break;
+			case FQOVERFLOW_LAST:
+				ret = QTEINVALID;
+				break;
+			}
+		}
+
+		if(ret != QTSUCCESS || run_in_caller)
+			break;
+
+		QTPROBE3(fq_push, q, elements[i].func, fqsize(q));
+		++i;
+	}
+
+	wake_concurrent(q, &q->wait, &q->pop_waiters, i - signaled);
+
+	/* the caller runs the functions which did not fit */
+	if(ret == QTSUCCESS && run_in_caller)
+		for(; i < n; ++i)
+			elements[i].func(elements[i].arg);
+
+	*pushed = i;
+	return ret;
+}
+
+/*
+ * This procedure pushes the element pointed to by e onto a concurrent
+ * queue, waiting for room until the absolute time pointed to by abstime
+ * has passed. If abstime is NULL, the procedure waits without a time
+ * limit. Pushers register as waiters before their final attempt, so a
+ * popper which makes room afterwards always wakes them. The procedure
+ * returns QTETIMEDOUT if the queue is still full at the time limit.
+ * Otherwise, it returns an error code to indicate its status. The value
+ * of q must not be NULL. The value of e must not be NULL.
+ */
+static enum qterror
+wait_push_concurrent(struct function_queue* q,
+		const struct function_queue_element* e,
+		const struct timespec* abstime)
+{
+	struct fqlocknode locknode;
+	volatile enum qterror ret = QTSUCCESS;
+	enum fqoverflow overflow = FQOVERFLOW_REJECT;
+	volatile int err = 0;
+
+	assert(q != NULL);
+	assert(e != NULL);
+
+	if(fqlockacquire(&q->lock, &locknode) != QTSUCCESS)
+		return QTEPTMLOCK;
+
+	(void) QTATOMIC_FETCH_ADD(&q->push_waiters, 1, QTATOMIC_SEQ_CST);
+	QTATOMIC_FENCE(QTATOMIC_SEQ_CST);
+	pthread_cleanup_push(release_push_wait, q);
+
+	do {
+		struct function_queue_element stamped = *e;
+
+		stamp(q, &stamped);
+		ret = q->dispatchtable->push(&q->queue, &stamped, 1);
+
+		if(ret != QTEFQFULL || err != 0 || q->overflow != overflow)
+			break;
+
+		if(abstime == NULL)
+			err = fqlockwait(&q->lock, &q->notfull, NULL);
+		else
+			err = fqlockwait(&q->lock, &q->notfull,
+					abstime);
+	} while(1);
+
+	pthread_cleanup_pop(0);
+	(void) QTATOMIC_FETCH_SUB(&q->push_waiters, 1, QTATOMIC_RELAXED);
+	(void) fqlockrelease(&q->lock);
+
+	if(ret == QTEFQFULL && err == ETIMEDOUT)
+		ret = QTETIMEDOUT;
+
+	return ret;
+}
+
+/*
+ * This procedure is the counterpart of peek_or_pop() for concurrent
+ * queues. Elements are taken without locking the queue, whose lock is
+ * only held to wait for an element or to wake waiting pushers. Poppers
+ * register as waiters before their final attempt, so a pusher which
+ * adds an element afterwards always wakes them. The procedure returns
+ * an error code to indicate its status. The value of q must not be
+ * NULL. The value of e must not be NULL. The value of count must not be
+ * NULL.
+ */
+static enum qterror
+take_concurrent(struct function_queue* q, struct function_queue_element* e,
+		unsigned int max, unsigned int* count, int block, int do_pop,
+		const unsigned int* stop)
+{
+	struct fqlocknode locknode;
+	struct fqwaiter waiter;
+	volatile enum qterror ret = QTSUCCESS;
+
+	assert(q != NULL);
+	assert(e != NULL);
+	assert(count != NULL);
+	ret = take_some(q, e, max, count, block, do_pop);
+
+	if(ret == QTEFQEMPTY && block) {
+		if(fqlockacquire(&q->lock, &locknode) != QTSUCCESS)
+			return QTEPTMLOCK;
+
+		(void) QTATOMIC_FETCH_ADD(&q->pop_waiters, 1,
+				QTATOMIC_SEQ_CST);
+		QTATOMIC_FENCE(QTATOMIC_SEQ_CST);
+		QTPROBE1(fq_park, q);
+		pthread_cleanup_push(release_pop_wait, &waiter);
+		park_popper(q, &waiter, stop);
+
+		while((ret = take_some(q, e, max, count, block, do_pop))
+				== QTEFQEMPTY && !stopped(stop))
+			wait_popper(&waiter);
+
+		pthread_cleanup_pop(0);
+		unpark_popper(&waiter);
+		QTPROBE1(fq_unpark, q);
+		(void) QTATOMIC_FETCH_SUB(&q->pop_waiters, 1,
+				QTATOMIC_RELAXED);
+		(void) fqlockrelease(&q->lock);
+	}
+
+	if(ret == QTSUCCESS && do_pop)
+		wake_concurrent(q, &q->notfull, &q->push_waiters, *count);
+
+	return ret;
+}
+
+/*
+ * This procedure pops up to max elements from a concurrent queue into
+ * the array pointed to by e, or peeks at one element if the value of
+ * do_pop is zero. The number of elements copied is stored in the
+ * integer pointed to by count. The procedure returns QTEFQEMPTY if no
+ * element was copied. Otherwise, it returns an error code to indicate
+ * its status. The value of q must not be NULL. The value of e must not
+ * be NULL. The value of count must not be NULL.
+ */
+static enum qterror
+take_some(struct function_queue* q, struct function_queue_element* e,
+		unsigned int max, unsigned int* count, int block, int do_pop)
+{
+	enum qterror ret = QTSUCCESS;
+	unsigned int n = 0;
+
+	assert(q != NULL);
+	assert(e != NULL);
+	assert(count != NULL);
+	assert(q->dispatchtable != NULL);
+
+	if(do_pop) {
+		assert(q->dispatchtable->pop != NULL);
+
+		do {
+			ret = q->dispatchtable->pop(&q->queue, &e[n], block);
+
+			if(ret != QTSUCCESS)
+				break;
+
+			QTPROBE3(fq_pop, q, e[n].func, fqsize(q));
+		} while(++n < max);
+
+		/* the elements already popped are still returned */
+		if(n > 0)
+			ret = QTSUCCESS;
+	} else {
+		assert(q->dispatchtable->peek != NULL);
+		ret = q->dispatchtable->peek(&q->queue, e, block);
+
+		if(ret == QTSUCCESS)
+			n = 1;
+	}
+
+	*count = n;
+	return ret;
+}
+
+/*
+ * This procedure wakes up to n threads waiting on the condition
+ * variable cond of a concurrent queue if the counter of waiters pointed
+ * to by waiters is not 0. The full fence pairs with the one taken by a
+ * waiter after registering, so either the waiter sees the change which
+ * was just made or this procedure sees the waiter. The queue lock must
+ * not be held by the calling thread. The value of q must not be NULL.
+ * The value of cond must not be NULL. The value of waiters must not be
+ * NULL.
+ */
+static void
+wake_concurrent(struct function_queue* q, pthread_cond_t* cond,
+		unsigned int* waiters, unsigned int n)
+{
+	struct fqlocknode locknode;
+
+	assert(q != NULL);
+	assert(cond != NULL);
+	assert(waiters != NULL);
+
+	if(n == 0)
+		return;
+
+	QTATOMIC_FENCE(QTATOMIC_SEQ_CST);
+
+	if(QTATOMIC_LOAD(waiters, QTATOMIC_RELAXED) == 0)
+		return;
+
+	if(fqlockacquire(&q->lock, &locknode) != QTSUCCESS)
+		return;
+
+	if(cond == &q->wait)
+		wake_poppers(q, n > 1);
+	else
+		fqlockwake(&q->lock, cond, n > 1);
+
+	(void) fqlockrelease(&q->lock);
+}
+
+/*
+ * This procedure returns non-zero if a popper which waits until the
+ * value pointed to by stop is non-zero should stop waiting. It returns
+ * zero if the value of stop is NULL.
+ */
+static int
+stopped(const unsigned int* stop)
+{
+	return stop != NULL && QTATOMIC_LOAD(stop, QTATOMIC_SEQ_CST) != 0;
+}
@@ -19,10 +19,15 @@
 #define FUNCTION_QUEUE_H
 
 #include <pthread.h>
+#include <time.h>
 
 #include "fq/indexed_array_queue.h"
 #include "fq/linked_list_queue.h"
+#include "fq/sharded_queue.h"
+#include "fq/combining_queue.h"
+#include "fqlock.h"
 #include "function_queue_element.h"
+#include "fqcodel.h"
 #include "qterror.h"
 
 /*
@@ -33,11 +38,35 @@
 enum fqtype {
 	FQTYPE_IA, /* indexed array */
 	FQTYPE_LL, /* linked list */
+	FQTYPE_SHARDED, /* sub-queues with their own locks */
+	FQTYPE_LLI, /* intrusive linked list of caller-owned nodes */
+	FQTYPE_FC, /* indexed array with flat-combined requests */
 
 	FQTYPE_LAST /* not an actual type */
 };
 
+/*
+ * This contains the constants which describe what a push does when the
+ * queue is full. With FQOVERFLOW_REJECT, a blocking push waits for room
+ * and a non-blocking push fails with QTEFQFULL. With
+ * FQOVERFLOW_DROPOLDEST, the least recently added element is discarded
+ * to make room and reported as described for fqdiscard(). With
+ * FQOVERFLOW_CALLERRUNS, the pushing thread calls the function itself
+ * instead of queueing it. FQOVERFLOW_LAST is not a real policy, but a
+ * marker of the final constant.
+ */
+enum fqoverflow {
+	FQOVERFLOW_REJECT, /* wait if blocking, otherwise fail */
+	FQOVERFLOW_DROPOLDEST, /* discard the oldest element */
+	FQOVERFLOW_CALLERRUNS, /* run the function in the caller */
+
+	FQOVERFLOW_LAST /* not an actual policy */
+};
+
 struct function_queue;
+struct fqcoalesce;
+struct fqcodel;
+struct fqwaiter;
 union fqvariant;
 
 /*
@@ -47,12 +76,21 @@ union fqvariant;
  * member should clean up any resources which were in use. The push, pop
  * and peek procedures should provide their expected functionality.
  * The procedures which these members point to should not interact with
- * any member of the function queue object except the member queue.
+ * any member of the function queue object except the member queue. The
+ * pushnode procedure links a node owned by the caller into the queue; it
+ * is NULL for types which store their own elements. The size procedure
+ * counts the elements of a concurrent queue without locking it; it is
+ * NULL for the other types, whose size the function queue keeps. The
+ * concurrent
+ * member is non-zero if the procedures synchronize access to
+ * the queue data themselves, in which case they are called without the
+ * queue lock, which is then only used for waiting.
  */
 struct fqdispatchtable {
 	enum qterror (* init)(union fqvariant*, unsigned);
 	enum qterror (* destroy)(union fqvariant*);
-	enum qterror (* push)(union fqvariant*, void (*)(void*), void*, int);
+	enum qterror (* push)(union fqvariant*,
+			const struct function_queue_element*, int);
 	enum qterror (* pop)(union fqvariant*,
 			struct function_queue_element*, int);
 	enum qterror (* peek)(union fqvariant*,
@@ -60,11 +98,16 @@ struct fqdispatchtable {
 	enum qterror (* resize)(union fqvariant*, unsigned int, int);
 	enum qterror (* isempty)(union fqvariant*, int*, int);
 	enum qterror (* isfull)(union fqvariant*, int*, int);
+	enum qterror (* pushnode)(union fqvariant*, struct fqellnode*, int);
+	unsigned int (* size)(union fqvariant*);
+	int concurrent;
 };
 
 union fqvariant { /* union types of queue data */
 	struct fqindexedarray ia; /* indexed array queue */
 	struct fqlinkedlist ll; /* indexed array queue */
+	struct fqsharded sharded; /* sharded queue */
+	struct fqcombining combining; /* flat-combining queue */
 };
 
 struct function_queue {
@@ -72,12 +115,30 @@ struct function_queue {
 	/* table of procedures for manipulating the queue data */
 	const struct fqdispatchtable* dispatchtable;
 	/* lock for managing the thread safety of the queue data */
-	pthread_mutex_t lock;
-	/* condition variable for signaling full and empty events */
+	struct fqlock lock;
+	/* condition variable for signaling empty events */
 	pthread_cond_t wait;
+	/* condition variable for signaling not full events */
+	pthread_cond_t notfull;
 	enum fqtype type; /* the type identifier of the queue */
+	enum fqoverflow overflow; /* the policy for pushing when full */
 	unsigned int max_elements; /* the maximum size of the queue */
-	unsigned int size; /* the true size of the queue */
+	/* the true size of the queue, unless it is concurrent */
+	unsigned int size;
+	unsigned int push_waiters; /* the number of blocked pushers */
+	unsigned int pop_waiters; /* the number of blocked concurrent poppers */
+	/* the number of users which need elements to be time stamped */
+	unsigned int stamp_users;
+	/* the number of pushes refused because the queue was full */
+	unsigned long rejected;
+	/* the index of pending elements if pushes are coalesced, or NULL */
+	struct fqcoalesce* coalesce;
+	/* the controller which sheds load by sojourn time, or NULL */
+	struct fqcodel* codel;
+	/* the procedure told about discarded elements, or NULL */
+	void (* ondrop)(void (*)(void*), void*);
+	/* the poppers which wait until a stop value is set */
+	struct fqwaiter* waiters;
 };
 
 #ifdef __cplusplus
@@ -85,13 +146,42 @@ extern "C" {
 #endif
 
 enum qterror fqinit(struct function_queue*, enum fqtype, unsigned);
+enum qterror fqinitwithlock(struct function_queue*, enum fqtype, unsigned,
+		enum fqlocktype);
 enum qterror fqdestroy(struct function_queue*);
 enum qterror fqpush(struct function_queue*, void (*)(void*), void*, int);
+enum qterror fqpushtimed(struct function_queue*, void (*)(void*), void*,
+		const struct timespec*);
+enum qterror fqrequeue(struct function_queue*, void (*)(void*), void*,
+		int);
+enum qterror fqpushnode(struct function_queue*, struct fqellnode*,
+		void (*)(void*), void*, int);
+enum qterror fqpushv(struct function_queue*,
+		const struct function_queue_element*, unsigned int,
+		unsigned int*, int);
 enum qterror fqpop(struct function_queue*, struct function_queue_element*, int);
+enum qterror fqpopv(struct function_queue*, struct function_queue_element*,
+		unsigned int, unsigned int, unsigned int*, int);
+enum qterror fqpopvuntil(struct function_queue*,
+		struct function_queue_element*, unsigned int, unsigned int,
+		unsigned int*, const unsigned int*);
+enum qterror fqwakepoppers(struct function_queue*);
+enum qterror fqwakepopper(struct function_queue*, const unsigned int*);
 enum qterror fqpeek(struct function_queue*, struct function_queue_element*, int);
 enum qterror fqisempty(struct function_queue*, int*, int);
 enum qterror fqisfull(struct function_queue*, int*, int);
+unsigned int fqsize(struct function_queue*);
 enum qterror fqresize(struct function_queue*, unsigned int, int);
+enum qterror fqsetoverflow(struct function_queue*, enum fqoverflow);
+enum qterror fqsetcoalesce(struct function_queue*, int);
+enum qterror fqsettimestamps(struct function_queue*, int);
+enum qterror fqsetcodel(struct function_queue*, unsigned long, unsigned long,
+		enum fqcodelmode);
+enum qterror fqsetondrop(struct function_queue*,
+		void (*)(void (*)(void*), void*));
+enum qterror fqregisterdrop(void (*)(void*),
+		void (*)(struct function_queue*, void*));
+void fqdiscard(struct function_queue*, void (*)(void*), void*);
 
 #ifdef __cplusplus
 }
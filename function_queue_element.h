@@ -2,14 +2,19 @@
 #ifndef FUCNTION_QUEUE_ELEMENT_H
 #define FUCNTION_QUEUE_ELEMENT_H
 
+#include <time.h>
+
 /*
  * This stucture holds a function pointer func and a corresponding
  * argument arg. Through this, a procedure can be "bound" to an argument
- * for when it is called.
+ * for when it is called. The member enqueued is the time on the
+ * monotonic clock at which the element was pushed, or zero if the queue
+ * was not stamping elements; it is set by the queue.
  */
 struct function_queue_element {
 	void (* func)(void*);
 	void* arg;
+	struct timespec enqueued;
 };
 
 
@@ -0,0 +1,732 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* syscall() is an extension */
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+
+#include "qtaio.h"
+#include "qtpool.h"
+#include "function_queue.h"
+#include "qtatomic.h"
+#include "qterror.h"
+
+/* the largest number of completions which are pushed at once */
+#ifndef QTAIO_BATCH
+#define QTAIO_BATCH 32
+#endif
+
+/* the largest length of one read or write */
+#define QTAIO_MAX_LEN 0x7ffff000UL
+
+/* the longest pause in milliseconds after the ring failed to be entered */
+#ifndef QTAIO_BACKOFF_MAX
+#define QTAIO_BACKOFF_MAX 1000UL
+#endif
+
+/*
+ * This contains the constants which describe the operation of a
+ * request.
+ */
+enum qtaioop {
+	QTAIO_READ,
+	QTAIO_WRITE,
+	QTAIO_FSYNC
+};
+
+/*
+ * This structure holds one asynchronous operation. The member callback
+ * is called with the result of the operation and the member arg. The
+ * members fd, rbuf or wbuf, len and offset are the arguments of the
+ * operation op. The member result is the number of bytes transferred,
+ * 0 for a successful fsync, or the negated errno value of a failure.
+ */
+struct qtaiorequest {
+	void (* callback)(long, void*);
+	void* arg;
+	void* rbuf;
+	const void* wbuf;
+	size_t len;
+	off_t offset;
+	long result;
+	int fd;
+	enum qtaioop op;
+};
+
+/*
+ * This structure holds the mappings of an io_uring. The member fd is the
+ * descriptor of the ring. The members sq_map, cq_map and sqes are the
+ * mappings of the submission ring, the completion ring and the
+ * submission entries, of the sizes in the matching size members; the
+ * two rings may share one mapping. The other members point into the
+ * mappings as described in io_uring_setup(2).
+ */
+struct qtaioring {
+	int fd;
+	void* sq_map;
+	size_t sq_size;
+	void* cq_map;
+	size_t cq_size;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+	unsigned int* sq_head;
+	unsigned int* sq_tail;
+	unsigned int* sq_array;
+	unsigned int sq_mask;
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	struct io_uring_cqe* cqes;
+	unsigned int cq_mask;
+};
+
+static enum qterror queue_request(struct qtaio*, struct qtaiorequest*);
+static enum qterror setup_ring(struct qtaio*, unsigned int);
+static void teardown_ring(struct qtaioring*);
+static enum qterror submit_ring(struct qtaio*, struct qtaiorequest*);
+static int enter_ring(const struct qtaioring*, unsigned int, unsigned int,
+		unsigned int);
+static void* reap(void*);
+static void run_blocking(void*);
+static void drop_blocking(struct function_queue*, void*);
+static void complete(void*);
+static void drop_complete(struct function_queue*, void*);
+
+/*
+ * This procedure initializes a context for asynchronous file I/O whose
+ * completions are pushed onto the function queue fq. It sets up an
+ * io_uring with room for the given number of operations in flight. If
+ * the kernel has no usable io_uring, or if the value of entries is 0,
+ * the context falls back to running each operation as a blocking call
+ * in a task on the queue. If the queue drops a completion, the thread
+ * which dropped it calls the callback, and a dropped operation which
+ * had not started completes with -ECANCELED, so that every callback is
+ * called once. The procedure returns an error code to indicate its
+ * status. The value of aio must not be NULL. The value of fq must not
+ * be NULL.
+ */
+enum qterror
+qtaioinit(struct qtaio* aio, struct function_queue* fq, unsigned int entries)
+{
+	assert(aio != NULL);
+	assert(fq != NULL);
+
+	if(fqregisterdrop(run_blocking, drop_blocking) != QTSUCCESS
+			|| fqregisterdrop(complete, drop_complete)
+			!= QTSUCCESS)
+		return QTEINVALID;
+
+	aio->fq = fq;
+	aio->ring = NULL;
+	aio->inflight = 0;
+	aio->capacity = 0;
+
+	if(pthread_mutex_init(&aio->lock, NULL) != 0)
+		return QTEPTMINIT;
+
+	if(pthread_cond_init(&aio->idle, NULL) != 0) {
+		(void) pthread_mutex_destroy(&aio->lock);
+		return QTEPTCINIT;
+	}
+
+	if(entries == 0 || setup_ring(aio, entries) != QTSUCCESS)
+		return QTSUCCESS;
+
+	if(pthread_create(&aio->reaper, NULL, reap, aio) != 0) {
+		teardown_ring(aio->ring);
+		aio->ring = NULL;
+	}
+
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure waits until no operation is in flight on the ring and
+ * destroys the given context. No operation may be started while or
+ * after it is destroyed. Completions which were already pushed onto the
+ * function queue still run. The procedure returns QTEERRNO if the thread
+ * collecting completions could not be stopped, in which case the context
+ * is left intact. Otherwise, it returns an error code to indicate its
+ * status. The value of aio must not be NULL.
+ */
+enum qterror
+qtaiodestroy(struct qtaio* aio)
+{
+	struct qtaioring* r = NULL;
+	enum qterror ret = QTSUCCESS;
+
+	assert(aio != NULL);
+	r = aio->ring;
+
+	if(r != NULL) {
+		unsigned int tail = 0;
+		unsigned int index = 0;
+
+		if(pthread_mutex_lock(&aio->lock) != 0)
+			return QTEPTMLOCK;
+
+		while(aio->inflight > 0)
+			(void) pthread_cond_wait(&aio->idle, &aio->lock);
+
+		/* a completion without a request stops the reaper */
+		tail = *r->sq_tail;
+		index = tail & r->sq_mask;
+		memset(&r->sqes[index], 0, sizeof(r->sqes[index]));
+		r->sqes[index].opcode = IORING_OP_NOP;
+		r->sqes[index].user_data = 0;
+		r->sq_array[index] = index;
+		QTATOMIC_STORE(r->sq_tail, tail + 1, QTATOMIC_RELEASE);
+
+		if(enter_ring(r, 1, 0, 0) != 1) {
+			QTATOMIC_STORE(r->sq_tail, tail, QTATOMIC_RELAXED);
+			ret = QTEERRNO;
+		}
+
+		(void) pthread_mutex_unlock(&aio->lock);
+
+		if(ret != QTSUCCESS)
+			return ret;
+
+		(void) pthread_join(aio->reaper, NULL);
+		teardown_ring(r);
+		aio->ring = NULL;
+	}
+
+	if(pthread_cond_destroy(&aio->idle) != 0)
+		ret = QTEPTCDESTROY;
+
+	if(pthread_mutex_destroy(&aio->lock) != 0)
+		ret = QTEPTMDESTROY;
+
+	return ret;
+}
+
+/*
+ * This procedure starts reading at most len bytes at the offset offset
+ * of the file fd into buf. When the read completes, callback is pushed
+ * onto the function queue and called by a worker with the number of
+ * bytes read, or the negated errno value of the failure, and arg. The
+ * buffer must stay valid until then. The procedure returns an error
+ * code to indicate whether the read was started. The value of aio must
+ * not be NULL. The value of buf must not be NULL. The value of callback
+ * must not be NULL.
+ */
+enum qterror
+qtaioread(struct qtaio* aio, int fd, void* buf, size_t len, off_t offset,
+		void (*callback)(long, void*), void* arg)
+{
+	struct qtaiorequest* req = NULL;
+
+	assert(aio != NULL);
+	assert(buf != NULL);
+	assert(callback != NULL);
+	req = malloc(sizeof(*req));
+
+	if(req == NULL)
+		return QTEMALLOC;
+
+	req->op = QTAIO_READ;
+	req->fd = fd;
+	req->rbuf = buf;
+	req->wbuf = NULL;
+	req->len = len;
+	req->offset = offset;
+	req->callback = callback;
+	req->arg = arg;
+	return queue_request(aio, req);
+}
+
+/*
+ * This procedure starts writing at most len bytes from buf at the offset
+ * offset of the file fd. When the write completes, callback is pushed
+ * onto the function queue and called by a worker with the number of
+ * bytes written, or the negated errno value of the failure, and arg. The
+ * buffer must stay valid until then. The procedure returns an error
+ * code to indicate whether the write was started. The value of aio must
+ * not be NULL. The value of buf must not be NULL. The value of callback
+ * must not be NULL.
+ */
+enum qterror
+qtaiowrite(struct qtaio* aio, int fd, const void* buf, size_t len,
+		off_t offset, void (*callback)(long, void*), void* arg)
+{
+	struct qtaiorequest* req = NULL;
+
+	assert(aio != NULL);
+	assert(buf != NULL);
+	assert(callback != NULL);
+	req = malloc(sizeof(*req));
+
+	if(req == NULL)
+		return QTEMALLOC;
+
+	req->op = QTAIO_WRITE;
+	req->fd = fd;
+	req->rbuf = NULL;
+	req->wbuf = buf;
+	req->len = len;
+	req->offset = offset;
+	req->callback = callback;
+	req->arg = arg;
+	return queue_request(aio, req);
+}
+
+/*
+ * This procedure starts flushing the file fd to its storage device. When
+ * the flush completes, callback is pushed onto the function queue and
+ * called by a worker with 0, or the negated errno value of the failure,
+ * and arg. The procedure returns an error code to indicate whether the
+ * flush was started. The value of aio must not be NULL. The value of
+ * callback must not be NULL.
+ */
+enum qterror
+qtaiofsync(struct qtaio* aio, int fd, void (*callback)(long, void*),
+		void* arg)
+{
+	struct qtaiorequest* req = NULL;
+
+	assert(aio != NULL);
+	assert(callback != NULL);
+	req = malloc(sizeof(*req));
+
+	if(req == NULL)
+		return QTEMALLOC;
+
+	req->op = QTAIO_FSYNC;
+	req->fd = fd;
+	req->rbuf = NULL;
+	req->wbuf = NULL;
+	req->len = 0;
+	req->offset = 0;
+	req->callback = callback;
+	req->arg = arg;
+	return queue_request(aio, req);
+}
+
+/*
+ * This procedure submits the request req to the ring, or queues it as a
+ * blocking task if there is no ring or the ring cannot take it. The
+ * request is freed if it could not be started. The procedure returns an
+ * error code to indicate its status. The value of aio must not be NULL.
+ * The value of req must not be NULL.
+ */
+static enum qterror
+queue_request(struct qtaio* aio, struct qtaiorequest* req)
+{
+	enum qterror ret = QTSUCCESS;
+
+	assert(aio != NULL);
+	assert(req != NULL);
+
+	if(aio->ring != NULL && submit_ring(aio, req) == QTSUCCESS)
+		return QTSUCCESS;
+
+	ret = fqpush(aio->fq, run_blocking, req, 1);
+
+	if(ret != QTSUCCESS)
+		free(req);
+
+	return ret;
+}
+
+/*
+ * This procedure creates an io_uring with room for entries submissions
+ * and maps its rings. The ring is only used if the kernel supports the
+ * read and write operations, which came with IORING_FEAT_RW_CUR_POS. The
+ * procedure returns an error code to indicate its status. The value of
+ * aio must not be NULL.
+ */
+static enum qterror
+setup_ring(struct qtaio* aio, unsigned int entries)
+{
+	struct io_uring_params p;
+	struct qtaioring* r = NULL;
+	void* map = NULL;
+
+	assert(aio != NULL);
+	r = malloc(sizeof(*r));
+
+	if(r == NULL)
+		return QTEMALLOC;
+
+	memset(&p, 0, sizeof(p));
+	r->fd = (int) syscall(SYS_io_uring_setup, entries, &p);
+
+	if(r->fd < 0) {
+		free(r);
+		return QTEERRNO;
+	}
+
+	if((p.features & IORING_FEAT_RW_CUR_POS) == 0) {
+		(void) close(r->fd);
+		free(r);
+		return QTEINVALID;
+	}
+
+	r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_size = p.cq_off.cqes + p.cq_entries
+			* sizeof(struct io_uring_cqe);
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if((p.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+		if(r->cq_size > r->sq_size)
+			r->sq_size = r->cq_size;
+
+		r->cq_size = r->sq_size;
+	}
+
+	r->sq_map = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, r->fd, (off_t) IORING_OFF_SQ_RING);
+	r->cq_map = MAP_FAILED;
+	map = MAP_FAILED;
+
+	if(r->sq_map != MAP_FAILED) {
+		if((p.features & IORING_FEAT_SINGLE_MMAP) != 0)
+			r->cq_map = r->sq_map;
+		else
+			r->cq_map = mmap(NULL, r->cq_size, PROT_READ
+					| PROT_WRITE, MAP_SHARED, r->fd,
+					(off_t) IORING_OFF_CQ_RING);
+	}
+
+	if(r->cq_map != MAP_FAILED)
+		map = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED, r->fd, (off_t) IORING_OFF_SQES);
+
+	if(map == MAP_FAILED) {
+		if(r->cq_map != MAP_FAILED && r->cq_map != r->sq_map)
+			(void) munmap(r->cq_map, r->cq_size);
+
+		if(r->sq_map != MAP_FAILED)
+			(void) munmap(r->sq_map, r->sq_size);
+
+		(void) close(r->fd);
+		free(r);
+		return QTEERRNO;
+	}
+
+	r->sqes = map;
+	r->sq_head = (void*) ((char*) r->sq_map + p.sq_off.head);
+	r->sq_tail = (void*) ((char*) r->sq_map + p.sq_off.tail);
+	r->sq_array = (void*) ((char*) r->sq_map + p.sq_off.array);
+	r->sq_mask = *(unsigned int*) (void*) ((char*) r->sq_map
+			+ p.sq_off.ring_mask);
+	r->cq_head = (void*) ((char*) r->cq_map + p.cq_off.head);
+	r->cq_tail = (void*) ((char*) r->cq_map + p.cq_off.tail);
+	r->cqes = (void*) ((char*) r->cq_map + p.cq_off.cqes);
+	r->cq_mask = *(unsigned int*) (void*) ((char*) r->cq_map
+			+ p.cq_off.ring_mask);
+	/* the completion ring has room for all of them */
+	aio->capacity = p.sq_entries;
+	aio->ring = r;
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure unmaps and closes the ring r and frees it. The value of
+ * r must not be NULL.
+ */
+static void
+teardown_ring(struct qtaioring* r)
+{
+	assert(r != NULL);
+	(void) munmap(r->sqes, r->sqes_size);
+
+	if(r->cq_map != r->sq_map)
+		(void) munmap(r->cq_map, r->cq_size);
+
+	(void) munmap(r->sq_map, r->sq_size);
+	(void) close(r->fd);
+	free(r);
+}
+
+/*
+ * This procedure adds the request req to the submission ring and submits
+ * it. The procedure returns QTEFQFULL if the ring has no room for
+ * another operation in flight, or QTEERRNO if the kernel did not take
+ * the submission. Otherwise, it returns QTSUCCESS. The value of aio must
+ * not be NULL. The value of req must not be NULL.
+ */
+static enum qterror
+submit_ring(struct qtaio* aio, struct qtaiorequest* req)
+{
+	struct qtaioring* r = NULL;
+	struct io_uring_sqe* sqe = NULL;
+	unsigned int tail = 0;
+	unsigned int index = 0;
+	size_t len = 0;
+
+	assert(aio != NULL);
+	assert(req != NULL);
+	r = aio->ring;
+	len = req->len < QTAIO_MAX_LEN ? req->len : QTAIO_MAX_LEN;
+
+	if(pthread_mutex_lock(&aio->lock) != 0)
+		return QTEPTMLOCK;
+
+	if(aio->inflight >= aio->capacity) {
+		(void) pthread_mutex_unlock(&aio->lock);
+		return QTEFQFULL;
+	}
+
+	/* the kernel only reads the ring when it is entered */
+	tail = *r->sq_tail;
+	index = tail & r->sq_mask;
+	sqe = &r->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = req->fd;
+	sqe->user_data = (unsigned long) req;
+
+	switch(req->op) {
+	case QTAIO_READ:
+		sqe->opcode = IORING_OP_READ;
+		sqe->addr = (unsigned long) req->rbuf;
+		sqe->len = (unsigned int) len;
+		sqe->off = (unsigned long) req->offset;
+		break;
+	case QTAIO_WRITE:
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->addr = (unsigned long) req->wbuf;
+		sqe->len = (unsigned int) len;
+		sqe->off = (unsigned long) req->offset;
+		break;
+	case QTAIO_FSYNC:
+		sqe->opcode = IORING_OP_FSYNC;
+		break;
+	}
+
+	r->sq_array[index] = index;
+	QTATOMIC_STORE(r->sq_tail, tail + 1, QTATOMIC_RELEASE);
+	++aio->inflight;
+
+	if(enter_ring(r, 1, 0, 0) != 1) {
+		QTATOMIC_STORE(r->sq_tail, tail, QTATOMIC_RELAXED);
+		--aio->inflight;
+		(void) pthread_mutex_unlock(&aio->lock);
+		return QTEERRNO;
+	}
+
+	(void) pthread_mutex_unlock(&aio->lock);
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure enters the ring r to submit to_submit entries and to
+ * wait for min_complete completions, retrying if it is interrupted. It
+ * returns the number of submitted entries, or -1 with errno set.
+ */
+static int
+enter_ring(const struct qtaioring* r, unsigned int to_submit,
+		unsigned int min_complete, unsigned int flags)
+{
+	long ret = 0;
+
+	assert(r != NULL);
+
+	do {
+		ret = syscall(SYS_io_uring_enter, r->fd, to_submit,
+				min_complete, flags, NULL, 0UL);
+	} while(ret == -1 && errno == EINTR);
+
+	return (int) ret;
+}
+
+/*
+ * This procedure is the body of the thread which collects completions
+ * from the ring. It pushes the completions it finds onto the function
+ * queue at once, or runs them itself if the queue does not take them,
+ * so that none is lost. It exits when it finds a completion without a
+ * request. If the ring cannot be entered, the thread pauses before it
+ * tries again, twice as long after each failure in a row, up to
+ * QTAIO_BACKOFF_MAX milliseconds. The variable arg is a pointer to the
+ * context. The value of arg must not be NULL.
+ */
+static void*
+reap(void* arg)
+{
+	struct function_queue_element elements[QTAIO_BATCH];
+	struct qtaio* aio = arg;
+	struct qtaioring* r = NULL;
+	unsigned long backoff = 0;
+	int stop = 0;
+
+	assert(aio != NULL);
+	r = aio->ring;
+
+	while(!stop) {
+		unsigned int head = 0;
+		unsigned int tail = 0;
+		unsigned int n = 0;
+		unsigned int pushed = 0;
+		unsigned int i = 0;
+
+		/* an error such as EBADF would otherwise recur at once */
+		if(enter_ring(r, 0, 1, IORING_ENTER_GETEVENTS) < 0) {
+			struct timespec pause;
+
+			backoff = backoff == 0 ? 1 : backoff * 2;
+
+			if(backoff > QTAIO_BACKOFF_MAX)
+				backoff = QTAIO_BACKOFF_MAX;
+
+			pause.tv_sec = (time_t) (backoff / 1000);
+			pause.tv_nsec = (long) (backoff % 1000) * 1000000L;
+			(void) nanosleep(&pause, NULL);
+			continue;
+		}
+
+		backoff = 0;
+
+		head = *r->cq_head;
+		tail = QTATOMIC_LOAD(r->cq_tail, QTATOMIC_ACQUIRE);
+
+		for(; head != tail && n < QTAIO_BATCH; ++head) {
+			const struct io_uring_cqe* cqe =
+					&r->cqes[head & r->cq_mask];
+			struct qtaiorequest* req =
+					(struct qtaiorequest*) (unsigned long)
+					cqe->user_data;
+
+			if(req == NULL) {
+				stop = 1;
+				continue;
+			}
+
+			req->result = cqe->res;
+			elements[n].func = complete;
+			elements[n].arg = req;
+			++n;
+		}
+
+		QTATOMIC_STORE(r->cq_head, head, QTATOMIC_RELEASE);
+
+		if(n == 0)
+			continue;
+
+		(void) fqpushv(aio->fq, elements, n, &pushed, 1);
+
+		for(i = pushed; i < n; ++i)
+			complete(elements[i].arg);
+
+		(void) pthread_mutex_lock(&aio->lock);
+		aio->inflight -= n;
+
+		if(aio->inflight == 0)
+			(void) pthread_cond_broadcast(&aio->idle);
+
+		(void) pthread_mutex_unlock(&aio->lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * This procedure is the task which runs an operation with a blocking
+ * call when there is no ring. The call is made inside a blocking region,
+ * so the pool can start a spare worker in the meantime. The variable arg
+ * is a pointer to the request. The value of arg must not be NULL.
+ */
+static void
+run_blocking(void* arg)
+{
+	struct qtaiorequest* req = arg;
+	ssize_t n = 0;
+	int err = 0;
+
+	assert(req != NULL);
+	/* this fails harmlessly if the caller is not a pool worker */
+	(void) qtblockingbegin();
+
+	switch(req->op) {
+	case QTAIO_READ:
+		n = pread(req->fd, req->rbuf, req->len, req->offset);
+		break;
+	case QTAIO_WRITE:
+		n = pwrite(req->fd, req->wbuf, req->len, req->offset);
+		break;
+	case QTAIO_FSYNC:
+		n = fsync(req->fd);
+		break;
+	}
+
+	err = errno;
+	(void) qtblockingend();
+	req->result = n < 0 ? -(long) err : (long) n;
+	complete(req);
+}
+
+/*
+ * This procedure is the drop handler of the operations queued as
+ * blocking tasks. The operation is not started, and the request
+ * completes with -ECANCELED. The variable q is the queue which dropped
+ * the task, and the variable arg is a pointer to the request. The value
+ * of q must not be NULL. The value of arg must not be NULL.
+ */
+static void
+drop_blocking(struct function_queue* q, void* arg)
+{
+	struct qtaiorequest* req = arg;
+
+	/* suppress unused variable warning */
+	(void) q;
+
+	assert(req != NULL);
+	req->result = -(long) ECANCELED;
+	complete(req);
+}
+
+/*
+ * This procedure calls the callback of a finished request with its
+ * result and frees the request. The variable arg is a pointer to the
+ * request. The value of arg must not be NULL.
+ */
+static void
+complete(void* arg)
+{
+	struct qtaiorequest* req = arg;
+
+	assert(req != NULL);
+	req->callback(req->result, req->arg);
+	free(req);
+}
+
+/*
+ * This procedure is the drop handler of completions. The operation has
+ * finished already, so the completion is run by the calling thread
+ * instead. The variable q is the queue which dropped the completion,
+ * and the variable arg is a pointer to the request. The value of q must
+ * not be NULL. The value of arg must not be NULL.
+ */
+static void
+drop_complete(struct function_queue* q, void* arg)
+{
+	/* suppress unused variable warning */
+	(void) q;
+
+	assert(arg != NULL);
+	complete(arg);
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef QTAIO_H
+#define QTAIO_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "function_queue.h"
+#include "qterror.h"
+
+struct qtaioring;
+
+/*
+ * This structure holds a context for asynchronous file I/O whose
+ * completions are pushed onto a function queue. The operations are
+ * submitted to an io_uring if the kernel provides one. Otherwise, each
+ * operation is queued as a task which makes the blocking call inside a
+ * blocking region of the pool. The member fq is the function queue. The
+ * member ring points to the io_uring, or is NULL if it is not used. The
+ * member lock guards the submission queue and the member inflight, which
+ * is the number of operations submitted to the ring and not yet
+ * completed; at most capacity operations are in flight. The member idle
+ * is signaled when no operation is in flight. The member reaper is the
+ * thread which collects the completions of the ring.
+ */
+struct qtaio {
+	struct function_queue* fq;
+	struct qtaioring* ring;
+	pthread_mutex_t lock;
+	pthread_cond_t idle;
+	unsigned int inflight;
+	unsigned int capacity;
+	pthread_t reaper;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum qterror qtaioinit(struct qtaio*, struct function_queue*, unsigned int);
+enum qterror qtaiodestroy(struct qtaio*);
+enum qterror qtaioread(struct qtaio*, int, void*, size_t, off_t,
+		void (*)(long, void*), void*);
+enum qterror qtaiowrite(struct qtaio*, int, const void*, size_t, off_t,
+		void (*)(long, void*), void*);
+enum qterror qtaiofsync(struct qtaio*, int, void (*)(long, void*), void*);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
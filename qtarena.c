@@ -0,0 +1,425 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "qtarena.h"
+#include "function_queue.h"
+#include "qtatomic.h"
+#include "qterror.h"
+
+/*
+ * This union has the strictest alignment of the types an argument block
+ * may hold.
+ */
+union qtarenaalign {
+	long l;
+	double d;
+	long double ld;
+	void* p;
+	void (* f)(void);
+};
+
+/* the size of s rounded up to the alignment of a block */
+#define QTARENA_ROUND(s) (((s) + sizeof(union qtarenaalign) - 1) \
+		/ sizeof(union qtarenaalign) * sizeof(union qtarenaalign))
+
+/*
+ * This structure holds a chunk of an arena. The member arena is the
+ * arena of the chunk, or NULL for a chunk which holds one oversized
+ * block. The members prev and next link the chunk into the list of all
+ * chunks, and the member next_free links it into the list of free
+ * chunks. The member size is the usable size of the chunk, of which
+ * used bytes are allocated. The member refs counts the blocks which have
+ * not been freed, plus one while the chunk is the current chunk of a
+ * producer.
+ */
+struct qtarenachunk {
+	struct qtarena* arena;
+	struct qtarenachunk* prev;
+	struct qtarenachunk* next;
+	struct qtarenachunk* next_free;
+	size_t size;
+	size_t used;
+	unsigned long refs;
+};
+
+/*
+ * This structure is the header in front of each block. The member chunk
+ * is the chunk of the block. The member func is the task which
+ * qtarenapush() runs with the block.
+ */
+struct qtarenablock {
+	struct qtarenachunk* chunk;
+	void (* func)(void*);
+};
+
+/* the sizes of the headers of a chunk and of a block */
+#define QTARENA_CHUNK_HEADER QTARENA_ROUND(sizeof(struct qtarenachunk))
+#define QTARENA_BLOCK_HEADER QTARENA_ROUND(sizeof(struct qtarenablock))
+
+static struct qtarenachunk* take_chunk(struct qtarena*);
+static struct qtarenachunk* new_chunk(struct qtarena*, size_t);
+static void release_chunk(struct qtarenachunk*);
+static void recycle_chunk(struct qtarenachunk*);
+static void drop_current(void*);
+static struct qtarenablock* block_of(void*);
+static void run_task(void*);
+static void drop_task(struct function_queue*, void*);
+
+/*
+ * This procedure initializes an arena whose chunks hold chunk_size
+ * bytes, or QTARENA_CHUNK_SIZE bytes if the value of chunk_size is 0. At
+ * most max_free free chunks are kept for reuse. The procedure returns an
+ * error code to indicate its status. The value of a must not be NULL.
+ */
+enum qterror
+qtarenainit(struct qtarena* a, size_t chunk_size, unsigned int max_free)
+{
+	assert(a != NULL);
+
+	if(fqregisterdrop(run_task, drop_task) != QTSUCCESS)
+		return QTEINVALID;
+
+	if(chunk_size == 0)
+		chunk_size = QTARENA_CHUNK_SIZE;
+
+	a->chunk_size = QTARENA_ROUND(chunk_size);
+	a->chunks = NULL;
+	a->free = NULL;
+	a->nfree = 0;
+	a->max_free = max_free;
+
+	if(pthread_mutex_init(&a->lock, NULL) != 0)
+		return QTEPTMINIT;
+
+	if(pthread_key_create(&a->key, drop_current) != 0) {
+		(void) pthread_mutex_destroy(&a->lock);
+		return QTEPTKCREATE;
+	}
+
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure destroys an arena and frees all of its chunks. Every
+ * block must have been freed, and no producer may allocate from the
+ * arena while or after it is destroyed. The procedure returns an error
+ * code to indicate its status. The value of a must not be NULL.
+ */
+enum qterror
+qtarenadestroy(struct qtarena* a)
+{
+	enum qterror ret = QTSUCCESS;
+
+	assert(a != NULL);
+	(void) pthread_key_delete(a->key);
+
+	while(a->chunks != NULL) {
+		struct qtarenachunk* c = a->chunks;
+
+		a->chunks = c->next;
+		free(c);
+	}
+
+	a->free = NULL;
+	a->nfree = 0;
+
+	if(pthread_mutex_destroy(&a->lock) != 0)
+		ret = QTEPTMDESTROY;
+
+	return ret;
+}
+
+/*
+ * This procedure allocates a block of size bytes from the current chunk
+ * of the calling thread and stores its address in the object pointed to
+ * by block. The block is aligned for any type. A block larger than a
+ * chunk gets a chunk of its own. The block must be freed with
+ * qtarenafree() or passed to qtarenapush(). The procedure returns an
+ * error code to indicate its status. The value of a must not be NULL.
+ * The value of block must not be NULL.
+ */
+enum qterror
+qtarenaalloc(struct qtarena* a, size_t size, void** block)
+{
+	struct qtarenachunk* c = NULL;
+	struct qtarenablock* b = NULL;
+	size_t need = 0;
+
+	assert(a != NULL);
+	assert(block != NULL);
+	need = QTARENA_BLOCK_HEADER + QTARENA_ROUND(size);
+
+	if(need > a->chunk_size) {
+		c = new_chunk(NULL, need);
+
+		if(c == NULL)
+			return QTEMALLOC;
+
+		c->used = need;
+		b = (void*) ((char*) c + QTARENA_CHUNK_HEADER);
+		b->chunk = c;
+		b->func = NULL;
+		*block = (char*) b + QTARENA_BLOCK_HEADER;
+		return QTSUCCESS;
+	}
+
+	c = pthread_getspecific(a->key);
+
+	if(c != NULL && c->size - c->used < need) {
+		(void) pthread_setspecific(a->key, NULL);
+		release_chunk(c);
+		c = NULL;
+	}
+
+	if(c == NULL) {
+		c = take_chunk(a);
+
+		if(c == NULL)
+			return QTEMALLOC;
+
+		if(pthread_setspecific(a->key, c) != 0) {
+			release_chunk(c);
+			return QTEPTSETSPECIFIC;
+		}
+	}
+
+	/* the producer's reference keeps the count above zero */
+	(void) QTATOMIC_FETCH_ADD(&c->refs, 1UL, QTATOMIC_RELAXED);
+	b = (void*) ((char*) c + QTARENA_CHUNK_HEADER + c->used);
+	c->used += need;
+	b->chunk = c;
+	b->func = NULL;
+	*block = (char*) b + QTARENA_BLOCK_HEADER;
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure frees a block allocated by qtarenaalloc(). It may be
+ * called by any thread. The chunk of the block is recycled once all of
+ * its blocks are freed. The value of block must not be NULL.
+ */
+void
+qtarenafree(void* block)
+{
+	assert(block != NULL);
+	release_chunk(block_of(block)->chunk);
+}
+
+/*
+ * This procedure pushes a task onto the function queue fq which calls
+ * func with the block allocated by qtarenaalloc() and frees the block
+ * after func returns. If the queue drops the task, func and the block
+ * are reported as described for fqdiscard() and the block is freed
+ * afterwards. If the value of block is non-zero, the procedure waits
+ * for room in the queue. The block is not freed if the push fails. The
+ * procedure returns an error code to indicate its status. The value of
+ * fq must not be NULL. The value of func must not be NULL. The value of
+ * arg must not be NULL.
+ */
+enum qterror
+qtarenapush(struct function_queue* fq, void (*func)(void*), void* arg,
+		int block)
+{
+	assert(fq != NULL);
+	assert(func != NULL);
+	assert(arg != NULL);
+	block_of(arg)->func = func;
+	return fqpush(fq, run_task, arg, block);
+}
+
+/*
+ * This procedure takes a free chunk of the arena a, or allocates a new
+ * one if there is none. The chunk holds the reference of the producer.
+ * The procedure returns NULL if the allocation fails. The value of a
+ * must not be NULL.
+ */
+static struct qtarenachunk*
+take_chunk(struct qtarena* a)
+{
+	struct qtarenachunk* c = NULL;
+
+	assert(a != NULL);
+
+	if(pthread_mutex_lock(&a->lock) != 0)
+		return NULL;
+
+	c = a->free;
+
+	if(c != NULL) {
+		a->free = c->next_free;
+		--a->nfree;
+	}
+
+	(void) pthread_mutex_unlock(&a->lock);
+
+	if(c == NULL)
+		return new_chunk(a, a->chunk_size);
+
+	c->used = 0;
+	QTATOMIC_STORE(&c->refs, 1UL, QTATOMIC_RELAXED);
+	return c;
+}
+
+/*
+ * This procedure allocates a chunk with size usable bytes. A chunk of
+ * the arena a is added to its list of chunks; a chunk without an arena
+ * is freed as soon as its block is. The procedure returns NULL if the
+ * allocation fails.
+ */
+static struct qtarenachunk*
+new_chunk(struct qtarena* a, size_t size)
+{
+	struct qtarenachunk* c = malloc(QTARENA_CHUNK_HEADER + size);
+
+	if(c == NULL)
+		return NULL;
+
+	c->arena = a;
+	c->prev = NULL;
+	c->next = NULL;
+	c->next_free = NULL;
+	c->size = size;
+	c->used = 0;
+	c->refs = 1;
+
+	if(a == NULL)
+		return c;
+
+	if(pthread_mutex_lock(&a->lock) != 0) {
+		free(c);
+		return NULL;
+	}
+
+	c->next = a->chunks;
+
+	if(a->chunks != NULL)
+		a->chunks->prev = c;
+
+	a->chunks = c;
+	(void) pthread_mutex_unlock(&a->lock);
+	return c;
+}
+
+/*
+ * This procedure drops a reference to the chunk c and recycles the
+ * chunk if it was the last. The value of c must not be NULL.
+ */
+static void
+release_chunk(struct qtarenachunk* c)
+{
+	assert(c != NULL);
+
+	if(QTATOMIC_FETCH_SUB(&c->refs, 1UL, QTATOMIC_ACQ_REL) == 1)
+		recycle_chunk(c);
+}
+
+/*
+ * This procedure returns the unreferenced chunk c to the free list of
+ * its arena, or frees it if the list is full or it has no arena. The
+ * value of c must not be NULL.
+ */
+static void
+recycle_chunk(struct qtarenachunk* c)
+{
+	struct qtarena* a = NULL;
+
+	assert(c != NULL);
+	a = c->arena;
+
+	if(a == NULL) {
+		free(c);
+		return;
+	}
+
+	if(pthread_mutex_lock(&a->lock) != 0)
+		return;
+
+	if(a->nfree < a->max_free) {
+		c->next_free = a->free;
+		a->free = c;
+		++a->nfree;
+		c = NULL;
+	} else {
+		if(c->prev != NULL)
+			c->prev->next = c->next;
+		else
+			a->chunks = c->next;
+
+		if(c->next != NULL)
+			c->next->prev = c->prev;
+	}
+
+	(void) pthread_mutex_unlock(&a->lock);
+	free(c);
+}
+
+/*
+ * This procedure drops the reference of an exiting producer thread to
+ * its current chunk. The variable arg is a pointer to the chunk.
+ */
+static void
+drop_current(void* arg)
+{
+	if(arg != NULL)
+		release_chunk(arg);
+}
+
+/*
+ * This procedure returns the header of the block pointed to by block.
+ * The value of block must not be NULL.
+ */
+static struct qtarenablock*
+block_of(void* block)
+{
+	assert(block != NULL);
+	return (void*) ((char*) block - QTARENA_BLOCK_HEADER);
+}
+
+/*
+ * This procedure is the task pushed by qtarenapush(). It calls the
+ * function of the block with the block and frees the block. The
+ * variable arg is a pointer to the block. The value of arg must not be
+ * NULL.
+ */
+static void
+run_task(void* arg)
+{
+	assert(arg != NULL);
+	block_of(arg)->func(arg);
+	qtarenafree(arg);
+}
+
+/*
+ * This procedure is the drop handler of the tasks pushed by
+ * qtarenapush(). It reports the function of the block with the block as
+ * described for fqdiscard() and frees the block. The variable q is the
+ * queue which dropped the task, and the variable arg is a pointer to
+ * the block. The value of q must not be NULL. The value of arg must not
+ * be NULL.
+ */
+static void
+drop_task(struct function_queue* q, void* arg)
+{
+	assert(q != NULL);
+	assert(arg != NULL);
+	fqdiscard(q, block_of(arg)->func, arg);
+	qtarenafree(arg);
+}
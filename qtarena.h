@@ -0,0 +1,67 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef QTARENA_H
+#define QTARENA_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "function_queue.h"
+#include "qterror.h"
+
+/* the default size of a chunk of an arena */
+#ifndef QTARENA_CHUNK_SIZE
+#define QTARENA_CHUNK_SIZE 65536
+#endif
+
+struct qtarenachunk;
+
+/*
+ * This structure holds an arena for the arguments of tasks. Each
+ * producer thread allocates from its own chunk by bumping a pointer, and
+ * a chunk is recycled once every block allocated from it has been freed,
+ * so a steady stream of tasks does not call malloc() or free(). The
+ * member key holds the current chunk of each producer thread. The member
+ * chunk_size is the usable size of each chunk. The member lock guards
+ * the other members. The member chunks points to the list of all chunks
+ * of the arena. The member free points to the list of chunks ready for
+ * reuse, of which there are nfree and at most max_free.
+ */
+struct qtarena {
+	pthread_key_t key;
+	size_t chunk_size;
+	pthread_mutex_t lock;
+	struct qtarenachunk* chunks;
+	struct qtarenachunk* free;
+	unsigned int nfree;
+	unsigned int max_free;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum qterror qtarenainit(struct qtarena*, size_t, unsigned int);
+enum qterror qtarenadestroy(struct qtarena*);
+enum qterror qtarenaalloc(struct qtarena*, size_t, void**);
+void qtarenafree(void*);
+enum qterror qtarenapush(struct function_queue*, void (*)(void*), void*, int);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,47 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef QTATOMIC_H
+#define QTATOMIC_H
+
+/*
+ * These macros wrap the atomic operations of the compiler, since C90
+ * has none of its own. They are only for use inside the library. Each
+ * operation takes one of the QTATOMIC_* memory orders.
+ */
+#if defined(__ATOMIC_SEQ_CST)
+
+#define QTATOMIC_RELAXED __ATOMIC_RELAXED
+#define QTATOMIC_ACQUIRE __ATOMIC_ACQUIRE
+#define QTATOMIC_RELEASE __ATOMIC_RELEASE
+#define QTATOMIC_ACQ_REL __ATOMIC_ACQ_REL
+#define QTATOMIC_SEQ_CST __ATOMIC_SEQ_CST
+
+#define QTATOMIC_LOAD(p, o) __atomic_load_n((p), (o))
+#define QTATOMIC_STORE(p, v, o) __atomic_store_n((p), (v), (o))
+#define QTATOMIC_FETCH_ADD(p, v, o) __atomic_fetch_add((p), (v), (o))
+#define QTATOMIC_FETCH_SUB(p, v, o) __atomic_fetch_sub((p), (v), (o))
+#define QTATOMIC_EXCHANGE(p, v, o) __atomic_exchange_n((p), (v), (o))
+#define QTATOMIC_CAS(p, e, v, o) \
+	__atomic_compare_exchange_n((p), (e), (v), 0, (o), QTATOMIC_RELAXED)
+#define QTATOMIC_FENCE(o) __atomic_thread_fence(o)
+
+#else
+#error "qthreads requires a compiler with __atomic builtins"
+#endif
+
+#endif
+
@@ -46,6 +46,9 @@ static struct {
 	{ QTEPTCDESTROY, "An error occurred while destroying a condition variable, check errno for more information" },
 	{ QTEINVALID, "An invalid value was encountered" },
 	{ QTEPTMINIT, "An error occurred while initializing the mutex" },
+	{ QTETIMEDOUT, "The operation timed out" },
+	{ QTEPTKCREATE, "An error occurred while creating a thread-specific data key" },
+	{ QTEPTSETSPECIFIC, "An error occurred while setting thread-specific data" },
 };
 
 /*
@@ -36,6 +36,9 @@ enum qterror {
 	QTEPTCDESTROY, /* an error occurred in pthread_cond_destroy */
 	QTEINVALID, /* an invalid value was encountered */
 	QTEPTMINIT, /*an error occurred in pthread_mutex_init */
+	QTETIMEDOUT, /* the operation timed out */
+	QTEPTKCREATE, /* an error occurred in pthread_key_create */
+	QTEPTSETSPECIFIC, /* an error occurred in pthread_setspecific */
 
 	QTELAST /* the last error code; not a valid error */
 };
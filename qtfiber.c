@@ -0,0 +1,653 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* MAP_ANONYMOUS is an extension */
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "qtfiber.h"
+#include "function_queue.h"
+#include "qtatomic.h"
+#include "qterror.h"
+
+/*
+ * This contains the constants which describe why a fiber gave up its
+ * worker.
+ */
+enum qtfiberstate {
+	QTFIBER_RUNNING,
+	QTFIBER_YIELDED,
+	QTFIBER_PARKED,
+	QTFIBER_DONE
+};
+
+/*
+ * This structure holds a fiber. The member context is the saved context
+ * of the fiber, and the member caller points to the context of the
+ * worker which resumed it last. The member pool is the pool of the
+ * fiber. The member func is called with the member arg on the stack
+ * pointed to by the member stack, which lies in the mapping map of the
+ * size map_size above a guard page. The member park_lock is the lock
+ * which the worker releases once the fiber is parked. The member next
+ * points to the next fiber in a list. The member state tells why the
+ * fiber gave up its worker.
+ */
+struct qtfiber {
+	ucontext_t context;
+	ucontext_t* caller;
+	struct qtfiberpool* pool;
+	void (* func)(void*);
+	void* arg;
+	void* stack;
+	void* map;
+	size_t map_size;
+	pthread_mutex_t* park_lock;
+	struct qtfiber* next;
+	enum qtfiberstate state;
+};
+
+static void create_fiber_key(void);
+static struct qtfiber* current_fiber(void);
+static struct qtfiber* take_fiber(struct qtfiberpool*);
+static void release_fiber(struct qtfiberpool*, struct qtfiber*);
+static void free_fiber(struct qtfiber*);
+static enum qterror prepare_context(struct qtfiber*);
+static void fiber_main(void);
+static void switch_out(struct qtfiber*, enum qtfiberstate);
+static void run_fiber(void*);
+static void drop_fiber(struct function_queue*, void*);
+static void make_ready(struct qtfiberpool*, struct qtfiber*);
+static void add_ready(struct qtfiberpool*, struct qtfiber*);
+static struct qtfiber* take_ready(struct qtfiberpool*);
+
+/* the key of the fiber running on each thread */
+static pthread_key_t fiber_key;
+static pthread_once_t fiber_key_once = PTHREAD_ONCE_INIT;
+static int fiber_key_error = 0;
+
+/*
+ * This procedure initializes a pool of fibers which run on the workers
+ * of the function queue fq. Each fiber gets a stack of stack_size bytes,
+ * rounded up to whole pages, or of QTFIBER_STACK_SIZE bytes if the value
+ * of stack_size is 0. The stacks of at most max_free finished fibers are
+ * kept for reuse. The procedure returns an error code to indicate its
+ * status. The value of fp must not be NULL. The value of fq must not be
+ * NULL.
+ */
+enum qterror
+qtfiberinit(struct qtfiberpool* fp, struct function_queue* fq,
+		size_t stack_size, unsigned int max_free)
+{
+	size_t page = 0;
+
+	assert(fp != NULL);
+	assert(fq != NULL);
+
+	if(pthread_once(&fiber_key_once, create_fiber_key) != 0)
+		return QTEPTONCE;
+
+	if(fiber_key_error != 0)
+		return QTEPTKCREATE;
+
+	if(fqregisterdrop(run_fiber, drop_fiber) != QTSUCCESS)
+		return QTEINVALID;
+
+	page = (size_t) sysconf(_SC_PAGESIZE);
+
+	if(stack_size == 0)
+		stack_size = QTFIBER_STACK_SIZE;
+
+	fp->fq = fq;
+	fp->stack_size = (stack_size + page - 1) / page * page;
+	fp->free = NULL;
+	fp->ready = NULL;
+	fp->nfree = 0;
+	fp->max_free = max_free;
+	fp->live = 0;
+
+	if(pthread_mutex_init(&fp->lock, NULL) != 0)
+		return QTEPTMINIT;
+
+	if(pthread_cond_init(&fp->idle, NULL) != 0) {
+		(void) pthread_mutex_destroy(&fp->lock);
+		return QTEPTCINIT;
+	}
+
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure waits until every fiber of the given pool has finished
+ * and destroys the pool. The workers of the function queue must keep
+ * running until then. The procedure returns an error code to indicate
+ * its status. The value of fp must not be NULL.
+ */
+enum qterror
+qtfiberdestroy(struct qtfiberpool* fp)
+{
+	enum qterror ret = QTSUCCESS;
+
+	assert(fp != NULL);
+
+	if(pthread_mutex_lock(&fp->lock) != 0)
+		return QTEPTMLOCK;
+
+	while(fp->live > 0)
+		(void) pthread_cond_wait(&fp->idle, &fp->lock);
+
+	(void) pthread_mutex_unlock(&fp->lock);
+
+	while(fp->free != NULL) {
+		struct qtfiber* f = fp->free;
+
+		fp->free = f->next;
+		free_fiber(f);
+	}
+
+	fp->nfree = 0;
+
+	if(pthread_cond_destroy(&fp->idle) != 0)
+		ret = QTEPTCDESTROY;
+
+	if(pthread_mutex_destroy(&fp->lock) != 0)
+		ret = QTEPTMDESTROY;
+
+	return ret;
+}
+
+/*
+ * This procedure starts a fiber of the pool fp which calls func with arg
+ * and pushes it onto the function queue. If the value of block is
+ * non-zero, the procedure waits for room in the queue. The procedure
+ * returns an error code to indicate its status. The value of fp must
+ * not be NULL. The value of func must not be NULL.
+ */
+enum qterror
+qtfiberspawn(struct qtfiberpool* fp, void (*func)(void*), void* arg,
+		int block)
+{
+	struct qtfiber* f = NULL;
+	enum qterror ret = QTSUCCESS;
+
+	assert(fp != NULL);
+	assert(func != NULL);
+	f = take_fiber(fp);
+
+	if(f == NULL)
+		return QTEMALLOC;
+
+	if(pthread_mutex_lock(&fp->lock) != 0) {
+		free_fiber(f);
+		return QTEPTMLOCK;
+	}
+
+	++fp->live;
+	(void) pthread_mutex_unlock(&fp->lock);
+	f->func = func;
+	f->arg = arg;
+	ret = prepare_context(f);
+
+	if(ret == QTSUCCESS)
+		ret = fqpush(fp->fq, run_fiber, f, block);
+
+	if(ret != QTSUCCESS)
+		release_fiber(fp, f);
+
+	return ret;
+}
+
+/*
+ * This procedure gives up the worker of the calling fiber and pushes the
+ * fiber back onto the function queue, so that the tasks queued before
+ * it run first. The fiber may resume on another worker. The procedure
+ * returns QTEINVALID if the caller is not a fiber. Otherwise, it returns
+ * QTSUCCESS.
+ */
+enum qterror
+qtfiberyield(void)
+{
+	struct qtfiber* f = current_fiber();
+
+	if(f == NULL)
+		return QTEINVALID;
+
+	switch_out(f, QTFIBER_YIELDED);
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure initializes a mutex for fibers. The procedure returns
+ * an error code to indicate its status. The value of m must not be NULL.
+ */
+enum qterror
+qtfibermutexinit(struct qtfibermutex* m)
+{
+	assert(m != NULL);
+	m->head = NULL;
+	m->tail = NULL;
+	m->locked = 0;
+
+	if(pthread_mutex_init(&m->lock, NULL) != 0)
+		return QTEPTMINIT;
+
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure destroys a mutex for fibers. The mutex must not be
+ * owned. The procedure returns an error code to indicate its status.
+ * The value of m must not be NULL.
+ */
+enum qterror
+qtfibermutexdestroy(struct qtfibermutex* m)
+{
+	assert(m != NULL);
+
+	if(pthread_mutex_destroy(&m->lock) != 0)
+		return QTEPTMDESTROY;
+
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure locks a mutex for fibers. If another fiber owns it, the
+ * calling fiber gives up its worker until the mutex is handed to it. The
+ * procedure returns QTEINVALID if the caller is not a fiber. Otherwise,
+ * it returns an error code to indicate its status. The value of m must
+ * not be NULL.
+ */
+enum qterror
+qtfibermutexlock(struct qtfibermutex* m)
+{
+	struct qtfiber* f = NULL;
+
+	assert(m != NULL);
+	f = current_fiber();
+
+	if(f == NULL)
+		return QTEINVALID;
+
+	if(pthread_mutex_lock(&m->lock) != 0)
+		return QTEPTMLOCK;
+
+	if(!m->locked) {
+		m->locked = 1;
+		(void) pthread_mutex_unlock(&m->lock);
+		return QTSUCCESS;
+	}
+
+	f->next = NULL;
+
+	if(m->tail == NULL)
+		m->head = f;
+	else
+		m->tail->next = f;
+
+	m->tail = f;
+	/* the worker releases the lock once the fiber is switched out */
+	f->park_lock = &m->lock;
+	switch_out(f, QTFIBER_PARKED);
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure unlocks a mutex for fibers which the calling fiber
+ * owns. If fibers wait for it, the mutex is handed to the first of them,
+ * which is made runnable. The procedure returns QTEINVALID if the caller
+ * is not a fiber or the mutex is not locked. Otherwise, it returns an
+ * error code to indicate its status. The value of m must not be NULL.
+ */
+enum qterror
+qtfibermutexunlock(struct qtfibermutex* m)
+{
+	struct qtfiber* waiter = NULL;
+
+	assert(m != NULL);
+
+	if(current_fiber() == NULL)
+		return QTEINVALID;
+
+	if(pthread_mutex_lock(&m->lock) != 0)
+		return QTEPTMLOCK;
+
+	if(!m->locked) {
+		(void) pthread_mutex_unlock(&m->lock);
+		return QTEINVALID;
+	}
+
+	waiter = m->head;
+
+	if(waiter == NULL) {
+		m->locked = 0;
+	} else {
+		m->head = waiter->next;
+
+		if(m->head == NULL)
+			m->tail = NULL;
+	}
+
+	(void) pthread_mutex_unlock(&m->lock);
+
+	if(waiter != NULL)
+		make_ready(waiter->pool, waiter);
+
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure creates the key of the fiber running on each thread.
+ * The error of the creation is kept in fiber_key_error.
+ */
+static void
+create_fiber_key(void)
+{
+	fiber_key_error = pthread_key_create(&fiber_key, NULL);
+}
+
+/*
+ * This procedure returns the fiber running on the calling thread, or
+ * NULL if the caller is not a fiber.
+ */
+static struct qtfiber*
+current_fiber(void)
+{
+	if(pthread_once(&fiber_key_once, create_fiber_key) != 0
+			|| fiber_key_error != 0)
+		return NULL;
+
+	return pthread_getspecific(fiber_key);
+}
+
+/*
+ * This procedure takes a finished fiber of the pool fp for reuse, or
+ * allocates a new one. The lowest page of each stack is a guard page
+ * which catches an overflow. The procedure returns NULL if the
+ * allocation fails. The value of fp must not be NULL.
+ */
+static struct qtfiber*
+take_fiber(struct qtfiberpool* fp)
+{
+	struct qtfiber* f = NULL;
+	size_t page = 0;
+
+	assert(fp != NULL);
+
+	if(pthread_mutex_lock(&fp->lock) == 0) {
+		f = fp->free;
+
+		if(f != NULL) {
+			fp->free = f->next;
+			--fp->nfree;
+		}
+
+		(void) pthread_mutex_unlock(&fp->lock);
+	}
+
+	if(f != NULL)
+		return f;
+
+	f = malloc(sizeof(*f));
+
+	if(f == NULL)
+		return NULL;
+
+	page = (size_t) sysconf(_SC_PAGESIZE);
+	f->map_size = fp->stack_size + page;
+	f->map = mmap(NULL, f->map_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if(f->map == MAP_FAILED) {
+		free(f);
+		return NULL;
+	}
+
+	(void) mprotect(f->map, page, PROT_NONE);
+	f->stack = (char*) f->map + page;
+	f->pool = fp;
+	return f;
+}
+
+/*
+ * This procedure returns the finished fiber f to the pool fp, which
+ * keeps it for reuse if it has room. The value of fp must not be NULL.
+ * The value of f must not be NULL.
+ */
+static void
+release_fiber(struct qtfiberpool* fp, struct qtfiber* f)
+{
+	assert(fp != NULL);
+	assert(f != NULL);
+
+	if(pthread_mutex_lock(&fp->lock) != 0)
+		return;
+
+	if(fp->nfree < fp->max_free) {
+		f->next = fp->free;
+		fp->free = f;
+		++fp->nfree;
+		f = NULL;
+	}
+
+	if(--fp->live == 0)
+		(void) pthread_cond_broadcast(&fp->idle);
+
+	(void) pthread_mutex_unlock(&fp->lock);
+
+	if(f != NULL)
+		free_fiber(f);
+}
+
+/*
+ * This procedure frees the fiber f and its stack. The value of f must
+ * not be NULL.
+ */
+static void
+free_fiber(struct qtfiber* f)
+{
+	assert(f != NULL);
+	(void) munmap(f->map, f->map_size);
+	free(f);
+}
+
+/*
+ * This procedure sets up the context of the fiber f to start in
+ * fiber_main() on its own stack. The procedure returns an error code to
+ * indicate its status. The value of f must not be NULL.
+ */
+static enum qterror
+prepare_context(struct qtfiber* f)
+{
+	assert(f != NULL);
+
+	if(getcontext(&f->context) != 0)
+		return QTEERRNO;
+
+	f->context.uc_stack.ss_sp = f->stack;
+	f->context.uc_stack.ss_size = f->pool->stack_size;
+	f->context.uc_link = NULL;
+	f->state = QTFIBER_RUNNING;
+	makecontext(&f->context, fiber_main, 0);
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure is the entry of each fiber. It calls the function of
+ * the fiber and switches back to the worker for good.
+ */
+static void
+fiber_main(void)
+{
+	struct qtfiber* f = current_fiber();
+
+	assert(f != NULL);
+	f->func(f->arg);
+	f->state = QTFIBER_DONE;
+	(void) setcontext(f->caller);
+}
+
+/*
+ * This procedure switches from the fiber f back to the worker which
+ * resumed it and returns once the fiber is resumed. The value of state
+ * tells the worker why. The value of f must not be NULL.
+ */
+static void
+switch_out(struct qtfiber* f, enum qtfiberstate state)
+{
+	assert(f != NULL);
+	f->state = state;
+	(void) swapcontext(&f->context, f->caller);
+	f->state = QTFIBER_RUNNING;
+}
+
+/*
+ * This procedure is the task which resumes a fiber until it gives up
+ * the worker. A yielding fiber is pushed back onto the function queue,
+ * or resumed again at once if the queue is full. A parked fiber has its
+ * lock released, and a finished fiber is returned to its pool. Then the
+ * fibers which became runnable while the queue was full are resumed.
+ * Cancellation is disabled while a fiber runs, since its stack cannot
+ * be unwound. The variable arg is a pointer to the fiber. The value of
+ * arg must not be NULL.
+ */
+static void
+run_fiber(void* arg)
+{
+	struct qtfiber* f = arg;
+
+	assert(f != NULL);
+
+	while(f != NULL) {
+		struct qtfiberpool* fp = f->pool;
+		ucontext_t caller;
+		int cancel = 0;
+		int ignored = 0;
+
+		(void) pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel);
+		f->caller = &caller;
+		(void) pthread_setspecific(fiber_key, f);
+		(void) swapcontext(&caller, &f->context);
+		(void) pthread_setspecific(fiber_key, NULL);
+		(void) pthread_setcancelstate(cancel, &ignored);
+
+		switch(f->state) {
+		case QTFIBER_YIELDED:
+			if(fqrequeue(fp->fq, run_fiber, f, 0) != QTSUCCESS)
+				continue;
+
+			break;
+		case QTFIBER_PARKED:
+			(void) pthread_mutex_unlock(f->park_lock);
+			break;
+		case QTFIBER_DONE:
+			release_fiber(fp, f);
+			break;
+		case QTFIBER_RUNNING:
+			break;
+		}
+
+		f = take_ready(fp);
+	}
+}
+
+/*
+ * This procedure is the drop handler of fibers. A fiber cannot be
+ * discarded once it has started, so it is resumed by the calling thread,
+ * or put on the ready list of its pool if the caller is a fiber itself,
+ * which its worker drains once the caller gives it up. The variable q is
+ * the queue which dropped the fiber, and the variable arg is a pointer
+ * to the fiber. The value of q must not be NULL. The value of arg must
+ * not be NULL.
+ */
+static void
+drop_fiber(struct function_queue* q, void* arg)
+{
+	struct qtfiber* f = arg;
+
+	/* suppress unused variable warning */
+	(void) q;
+
+	assert(f != NULL);
+
+	if(current_fiber() == NULL)
+		run_fiber(f);
+	else
+		add_ready(f->pool, f);
+}
+
+/*
+ * This procedure pushes the parked fiber f of the pool fp onto the
+ * function queue. If the queue is full, the fiber is put on the ready
+ * list of the pool instead, which the calling fiber's worker drains
+ * once the caller gives it up. The value of fp must not be NULL. The
+ * value of f must not be NULL.
+ */
+static void
+make_ready(struct qtfiberpool* fp, struct qtfiber* f)
+{
+	assert(fp != NULL);
+	assert(f != NULL);
+
+	if(fqrequeue(fp->fq, run_fiber, f, 0) == QTSUCCESS)
+		return;
+
+	add_ready(fp, f);
+}
+
+/*
+ * This procedure puts the fiber f on the ready list of the pool fp. The
+ * value of fp must not be NULL. The value of f must not be NULL.
+ */
+static void
+add_ready(struct qtfiberpool* fp, struct qtfiber* f)
+{
+	assert(fp != NULL);
+	assert(f != NULL);
+	(void) pthread_mutex_lock(&fp->lock);
+	f->next = fp->ready;
+	QTATOMIC_STORE(&fp->ready, f, QTATOMIC_RELAXED);
+	(void) pthread_mutex_unlock(&fp->lock);
+}
+
+/*
+ * This procedure takes a fiber from the ready list of the pool fp. It
+ * returns NULL if the list is empty. The value of fp must not be NULL.
+ */
+static struct qtfiber*
+take_ready(struct qtfiberpool* fp)
+{
+	struct qtfiber* f = NULL;
+
+	assert(fp != NULL);
+
+	if(QTATOMIC_LOAD(&fp->ready, QTATOMIC_RELAXED) == NULL)
+		return NULL;
+
+	(void) pthread_mutex_lock(&fp->lock);
+	f = fp->ready;
+
+	if(f != NULL)
+		QTATOMIC_STORE(&fp->ready, f->next, QTATOMIC_RELAXED);
+
+	(void) pthread_mutex_unlock(&fp->lock);
+	return f;
+}
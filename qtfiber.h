@@ -0,0 +1,90 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef QTFIBER_H
+#define QTFIBER_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "function_queue.h"
+#include "qterror.h"
+
+/* the default size of the stack of a fiber */
+#ifndef QTFIBER_STACK_SIZE
+#define QTFIBER_STACK_SIZE 65536
+#endif
+
+struct qtfiber;
+
+/*
+ * This structure holds a pool of fibers which run on the workers of a
+ * function queue. Each fiber runs a function on its own small stack and
+ * may give up its worker with qtfiberyield() or while it waits for a
+ * qtfibermutex, so the worker runs other tasks in the meantime. The
+ * member fq is the function queue onto which runnable fibers are
+ * pushed. The member stack_size is the usable size of each stack. The
+ * member lock guards the other members. The member free points to the
+ * list of finished fibers whose stacks are kept for reuse, of which
+ * there are nfree and at most max_free. The member ready points to the
+ * list of fibers which became runnable while the queue was full. The
+ * member live is the number of fibers which have not finished, and the
+ * member idle is signaled when it drops to 0.
+ */
+struct qtfiberpool {
+	struct function_queue* fq;
+	size_t stack_size;
+	pthread_mutex_t lock;
+	pthread_cond_t idle;
+	struct qtfiber* free;
+	struct qtfiber* ready;
+	unsigned int nfree;
+	unsigned int max_free;
+	unsigned long live;
+};
+
+/*
+ * This structure holds a mutex for fibers. A fiber which waits for it
+ * gives up its worker instead of blocking the thread. The member lock
+ * guards the other members. The member locked is non-zero while a fiber
+ * owns the mutex. The members head and tail point to the first and the
+ * last fiber waiting for it; the mutex is handed to them in order.
+ */
+struct qtfibermutex {
+	pthread_mutex_t lock;
+	struct qtfiber* head;
+	struct qtfiber* tail;
+	int locked;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum qterror qtfiberinit(struct qtfiberpool*, struct function_queue*, size_t,
+		unsigned int);
+enum qterror qtfiberdestroy(struct qtfiberpool*);
+enum qterror qtfiberspawn(struct qtfiberpool*, void (*)(void*), void*, int);
+enum qterror qtfiberyield(void);
+enum qterror qtfibermutexinit(struct qtfibermutex*);
+enum qterror qtfibermutexdestroy(struct qtfibermutex*);
+enum qterror qtfibermutexlock(struct qtfibermutex*);
+enum qterror qtfibermutexunlock(struct qtfibermutex*);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
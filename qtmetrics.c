@@ -0,0 +1,405 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "qtmetrics.h"
+#include "qtatomic.h"
+#include "qterror.h"
+
+/*
+ * This is the number of times a reader tries to read a consistent copy
+ * of the values before it assumes that the writer died while writing.
+ */
+#ifndef QTMETRICS_RETRIES
+#define QTMETRICS_RETRIES 1000
+#endif
+
+static void* publish_loop(void*);
+
+/*
+ * This procedure creates the shared memory object with the given name,
+ * or reuses it if it exists, and maps a metrics page into it with all
+ * values set to zero. The name follows the rules of shm_open(), so it
+ * should start with a slash. The procedure returns QTEERRNO if the
+ * object could not be created or mapped, with errno set by the failing
+ * call. Otherwise, it returns an error code to indicate its status. The
+ * value of m must not be NULL. The value of name must not be NULL.
+ */
+enum qterror
+qtmetricsinit(struct qtmetrics* m, const char* name)
+{
+	struct qtmetricspage* page = NULL;
+	void* mapped = NULL;
+	int fd = -1;
+	int err = 0;
+
+	assert(m != NULL);
+	assert(name != NULL);
+	m->name = malloc(strlen(name) + 1);
+
+	if(m->name == NULL)
+		return QTEMALLOC;
+
+	strcpy(m->name, name);
+	fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+
+	if(fd == -1) {
+		free(m->name);
+		return QTEERRNO;
+	}
+
+	if(ftruncate(fd, (off_t) sizeof(*page)) == 0)
+		mapped = mmap(NULL, sizeof(*page), PROT_READ | PROT_WRITE,
+				MAP_SHARED, fd, 0);
+	else
+		mapped = MAP_FAILED;
+
+	/* close() must not hide the reason of the failure */
+	err = errno;
+	(void) close(fd);
+	errno = err;
+
+	if(mapped == MAP_FAILED) {
+		(void) shm_unlink(name);
+		free(m->name);
+		return QTEERRNO;
+	}
+
+	if(pthread_mutex_init(&m->lock, NULL) != 0) {
+		(void) munmap(mapped, sizeof(*page));
+		(void) shm_unlink(name);
+		free(m->name);
+		return QTEPTMINIT;
+	}
+
+	if(pthread_cond_init(&m->wake, NULL) != 0) {
+		(void) pthread_mutex_destroy(&m->lock);
+		(void) munmap(mapped, sizeof(*page));
+		(void) shm_unlink(name);
+		free(m->name);
+		return QTEPTCINIT;
+	}
+
+	page = mapped;
+	m->page = page;
+	m->collect = NULL;
+	m->arg = NULL;
+	m->interval = 0;
+	m->running = 0;
+	m->stopping = 0;
+
+	/* a reused page is not valid until it is reset */
+	QTATOMIC_STORE(&page->magic, 0UL, QTATOMIC_RELAXED);
+	QTATOMIC_FENCE(QTATOMIC_RELEASE);
+	page->version = QTMETRICS_VERSION;
+	page->size = sizeof(*page);
+	page->sequence = 0;
+	memset(&page->values, 0, sizeof(page->values));
+	QTATOMIC_STORE(&page->magic, QTMETRICS_MAGIC, QTATOMIC_RELEASE);
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure stops the publisher of the given metrics page if it is
+ * running, unmaps the page and removes the shared memory object. Readers
+ * which are attached keep their mapping. The procedure returns an error
+ * code to indicate its status. The value of m must not be NULL.
+ */
+enum qterror
+qtmetricsdestroy(struct qtmetrics* m)
+{
+	enum qterror ret = QTSUCCESS;
+
+	assert(m != NULL);
+	ret = qtmetricsstop(m);
+
+	if(ret != QTSUCCESS)
+		return ret;
+
+	if(munmap(m->page, sizeof(*m->page)) != 0)
+		ret = QTEERRNO;
+
+	if(shm_unlink(m->name) != 0 && ret == QTSUCCESS)
+		ret = QTEERRNO;
+
+	free(m->name);
+
+	if(pthread_cond_destroy(&m->wake) != 0 && ret == QTSUCCESS)
+		ret = QTEPTCDESTROY;
+
+	if(pthread_mutex_destroy(&m->lock) != 0 && ret == QTSUCCESS)
+		ret = QTEPTMDESTROY;
+
+	return ret;
+}
+
+/*
+ * This procedure writes the values pointed to by v to the metrics page
+ * under its sequence lock. Readers never block the writer; they retry
+ * until they have read the values of one write. Only one thread may
+ * write to a page at a time, so this must not be called while the
+ * publisher is running. The value of m must not be NULL. The value of v
+ * must not be NULL.
+ */
+void
+qtmetricspublish(struct qtmetrics* m, const struct qtmetricsvalues* v)
+{
+	struct qtmetricspage* page = NULL;
+	unsigned long sequence = 0;
+
+	assert(m != NULL);
+	assert(v != NULL);
+	page = m->page;
+	sequence = QTATOMIC_LOAD(&page->sequence, QTATOMIC_RELAXED);
+	QTATOMIC_STORE(&page->sequence, sequence + 1, QTATOMIC_RELAXED);
+	QTATOMIC_FENCE(QTATOMIC_RELEASE);
+	QTATOMIC_STORE(&page->values.depth, v->depth, QTATOMIC_RELAXED);
+	QTATOMIC_STORE(&page->values.executed, v->executed,
+			QTATOMIC_RELAXED);
+	QTATOMIC_STORE(&page->values.idle, v->idle, QTATOMIC_RELAXED);
+	QTATOMIC_STORE(&page->values.rejected, v->rejected,
+			QTATOMIC_RELAXED);
+	QTATOMIC_STORE(&page->values.threads, v->threads, QTATOMIC_RELAXED);
+	QTATOMIC_STORE(&page->sequence, sequence + 2, QTATOMIC_RELEASE);
+}
+
+/*
+ * This procedure starts a thread which publishes to the metrics page
+ * every interval milliseconds. Each time, it calls collect with arg and
+ * a pointer to the values to fill in, then writes them to the page. The
+ * collect function runs on the publisher thread, away from the threads
+ * it observes. The procedure returns QTEINVALID if a publisher is
+ * already running. Otherwise, it returns an error code to indicate its
+ * status. The value of m must not be NULL. The value of collect must
+ * not be NULL. The value of interval must be greater than 0.
+ */
+enum qterror
+qtmetricsstart(struct qtmetrics* m,
+		void (*collect)(void*, struct qtmetricsvalues*), void* arg,
+		unsigned long interval)
+{
+	assert(m != NULL);
+	assert(collect != NULL);
+
+	if(m->running || interval == 0)
+		return QTEINVALID;
+
+	m->collect = collect;
+	m->arg = arg;
+	m->interval = interval;
+	m->stopping = 0;
+
+	if(pthread_create(&m->publisher, NULL, publish_loop, m) != 0)
+		return QTEPTCREATE;
+
+	m->running = 1;
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure stops the publisher of the metrics page and waits for
+ * it to exit. Stopping a page without a publisher does nothing. The
+ * procedure returns an error code to indicate its status. The value of
+ * m must not be NULL.
+ */
+enum qterror
+qtmetricsstop(struct qtmetrics* m)
+{
+	assert(m != NULL);
+
+	if(!m->running)
+		return QTSUCCESS;
+
+	if(pthread_mutex_lock(&m->lock) != 0)
+		return QTEPTMLOCK;
+
+	m->stopping = 1;
+	(void) pthread_cond_signal(&m->wake);
+
+	if(pthread_mutex_unlock(&m->lock) != 0)
+		return QTEPTMUNLOCK;
+
+	(void) pthread_join(m->publisher, NULL);
+	m->running = 0;
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure maps the metrics page of the shared memory object with
+ * the given name read-only and stores its address in the variable
+ * pointed to by page. The page must not be written to. The procedure
+ * returns QTEINVALID if the object is too small to hold a page, or
+ * QTEERRNO if it could not be opened or mapped. Otherwise, it returns
+ * QTSUCCESS. The value of name must not be NULL. The value of page must
+ * not be NULL.
+ */
+enum qterror
+qtmetricsattach(const char* name, struct qtmetricspage** page)
+{
+	struct stat st;
+	void* mapped = MAP_FAILED;
+	enum qterror ret = QTSUCCESS;
+	int fd = -1;
+	int err = 0;
+
+	assert(name != NULL);
+	assert(page != NULL);
+	fd = shm_open(name, O_RDONLY, 0);
+
+	if(fd == -1)
+		return QTEERRNO;
+
+	if(fstat(fd, &st) != 0)
+		ret = QTEERRNO;
+	else if(st.st_size < (off_t) sizeof(**page))
+		ret = QTEINVALID;
+	else
+		mapped = mmap(NULL, sizeof(**page), PROT_READ, MAP_SHARED,
+				fd, 0);
+
+	if(ret == QTSUCCESS && mapped == MAP_FAILED)
+		ret = QTEERRNO;
+
+	/* close() must not hide the reason of the failure */
+	err = errno;
+	(void) close(fd);
+	errno = err;
+
+	if(ret == QTSUCCESS)
+		*page = mapped;
+
+	return ret;
+}
+
+/*
+ * This procedure unmaps a metrics page mapped by qtmetricsattach(). The
+ * procedure returns QTEERRNO if it could not be unmapped. Otherwise, it
+ * returns QTSUCCESS. The value of page must not be NULL.
+ */
+enum qterror
+qtmetricsdetach(struct qtmetricspage* page)
+{
+	assert(page != NULL);
+
+	if(munmap(page, sizeof(*page)) != 0)
+		return QTEERRNO;
+
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure copies a consistent set of the values of the metrics
+ * page to the structure pointed to by v without blocking the writer.
+ * The procedure returns QTEINVALID if the page is not ready or has an
+ * older or unknown layout, or QTETIMEDOUT if the values kept changing
+ * or were left half written. Otherwise, it returns QTSUCCESS. The value
+ * of page must not be NULL. The value of v must not be NULL.
+ */
+enum qterror
+qtmetricsread(const struct qtmetricspage* page, struct qtmetricsvalues* v)
+{
+	unsigned long before = 0;
+	unsigned long after = 0;
+	unsigned int tries = 0;
+
+	assert(page != NULL);
+	assert(v != NULL);
+
+	if(QTATOMIC_LOAD(&page->magic, QTATOMIC_ACQUIRE) != QTMETRICS_MAGIC
+			|| page->version < QTMETRICS_VERSION
+			|| page->size < sizeof(*page))
+		return QTEINVALID;
+
+	for(tries = 0; tries < QTMETRICS_RETRIES; ++tries) {
+		before = QTATOMIC_LOAD(&page->sequence, QTATOMIC_ACQUIRE);
+
+		if((before & 1) != 0) {
+			(void) sched_yield();
+			continue;
+		}
+
+		v->depth = QTATOMIC_LOAD(&page->values.depth,
+				QTATOMIC_RELAXED);
+		v->executed = QTATOMIC_LOAD(&page->values.executed,
+				QTATOMIC_RELAXED);
+		v->idle = QTATOMIC_LOAD(&page->values.idle, QTATOMIC_RELAXED);
+		v->rejected = QTATOMIC_LOAD(&page->values.rejected,
+				QTATOMIC_RELAXED);
+		v->threads = QTATOMIC_LOAD(&page->values.threads,
+				QTATOMIC_RELAXED);
+		QTATOMIC_FENCE(QTATOMIC_ACQUIRE);
+		after = QTATOMIC_LOAD(&page->sequence, QTATOMIC_RELAXED);
+
+		if(before == after)
+			return QTSUCCESS;
+	}
+
+	return QTETIMEDOUT;
+}
+
+/*
+ * This procedure is the body of the publisher thread. It collects and
+ * publishes the values, then sleeps for the interval or until it is
+ * told to stop. The variable arg is a pointer to the metrics page. The
+ * value of arg must not be NULL.
+ */
+static void*
+publish_loop(void* arg)
+{
+	struct qtmetrics* m = arg;
+	struct qtmetricsvalues v;
+	struct timespec abstime;
+
+	assert(m != NULL);
+	(void) pthread_mutex_lock(&m->lock);
+
+	while(!m->stopping) {
+		(void) pthread_mutex_unlock(&m->lock);
+		memset(&v, 0, sizeof(v));
+		m->collect(m->arg, &v);
+		qtmetricspublish(m, &v);
+		(void) clock_gettime(CLOCK_REALTIME, &abstime);
+		abstime.tv_sec += (time_t) (m->interval / 1000);
+		abstime.tv_nsec += (long) (m->interval % 1000) * 1000000L;
+
+		if(abstime.tv_nsec >= 1000000000L) {
+			++abstime.tv_sec;
+			abstime.tv_nsec -= 1000000000L;
+		}
+
+		(void) pthread_mutex_lock(&m->lock);
+
+		while(!m->stopping && pthread_cond_timedwait(&m->wake,
+					&m->lock, &abstime) != ETIMEDOUT)
+			;
+	}
+
+	(void) pthread_mutex_unlock(&m->lock);
+	return NULL;
+}
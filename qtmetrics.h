@@ -0,0 +1,105 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef QTMETRICS_H
+#define QTMETRICS_H
+
+#include <pthread.h>
+
+#include "qterror.h"
+
+/* the first member of every metrics page, "QTMP" */
+#define QTMETRICS_MAGIC 0x51544d50UL
+
+/* the version of the layout of struct qtmetricspage */
+#define QTMETRICS_VERSION 1UL
+
+/*
+ * This structure holds the counters of a thread pool and its function
+ * queue. The member depth is the number of queued elements. The member
+ * executed is the number of tasks the workers have run. The member idle
+ * is the number of workers waiting for a task. The member rejected is
+ * the number of pushes refused because the queue was full. The member
+ * threads is the number of running workers.
+ */
+struct qtmetricsvalues {
+	unsigned long depth;
+	unsigned long executed;
+	unsigned long idle;
+	unsigned long rejected;
+	unsigned long threads;
+};
+
+/*
+ * This structure is the layout of a metrics page in shared memory. The
+ * member magic is QTMETRICS_MAGIC once the page is ready, and the member
+ * version is the QTMETRICS_VERSION of the writer. The member size is the
+ * size of the page in bytes. Later versions only append members, so a
+ * reader can use the members it knows if the size is large enough. The
+ * member sequence is the sequence lock of the member values: it is odd
+ * while the values are written and changes with every write.
+ */
+struct qtmetricspage {
+	unsigned long magic;
+	unsigned long version;
+	unsigned long size;
+	unsigned long sequence;
+	struct qtmetricsvalues values;
+};
+
+/*
+ * This structure holds the writer side of a metrics page. The member
+ * page points to the page mapped from the shared memory object named by
+ * the member name. A publisher thread, if started, calls the member
+ * collect with the member arg every interval milliseconds and writes
+ * the values to the page. The member lock guards the member stopping
+ * and is used with the member wake to interrupt the sleep of the
+ * publisher. The member running is non-zero while there is a publisher
+ * thread.
+ */
+struct qtmetrics {
+	struct qtmetricspage* page;
+	char* name;
+	void (* collect)(void*, struct qtmetricsvalues*);
+	void* arg;
+	unsigned long interval;
+	pthread_t publisher;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	int running;
+	int stopping;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum qterror qtmetricsinit(struct qtmetrics*, const char*);
+enum qterror qtmetricsdestroy(struct qtmetrics*);
+void qtmetricspublish(struct qtmetrics*, const struct qtmetricsvalues*);
+enum qterror qtmetricsstart(struct qtmetrics*,
+		void (*)(void*, struct qtmetricsvalues*), void*,
+		unsigned long);
+enum qterror qtmetricsstop(struct qtmetrics*);
+enum qterror qtmetricsattach(const char*, struct qtmetricspage**);
+enum qterror qtmetricsdetach(struct qtmetricspage*);
+enum qterror qtmetricsread(const struct qtmetricspage*,
+		struct qtmetricsvalues*);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -15,40 +15,1223 @@
  * limitations under the License.
  */
 
+/* pthread_setname_np() is an extension */
+#define _GNU_SOURCE
+
 #include "qtpool.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <errno.h>
+#include <time.h>
 #include <pthread.h>
 #include <assert.h>
 
-#include "qterror.h"
+#include "qtatomic.h"
+#include "qtprobes.h"
+#include "qterror.h"
+
+/*
+ * This is the largest number of elements which a worker pops from the
+ * function queue at once.
+ */
+#ifndef QTPOOL_BATCH_MAX
+#define QTPOOL_BATCH_MAX 16
+#endif
+
+/*
+ * This is the largest number of spare workers which a pool starts for
+ * workers blocked in tasks.
+ */
+#ifndef QTPOOL_MAX_SPARES
+#define QTPOOL_MAX_SPARES 64
+#endif
+
+/*
+ * This is the number of tasks which the inbox of each worker holds.
+ */
+#ifndef QTPOOL_INBOX_SIZE
+#define QTPOOL_INBOX_SIZE 64
+#endif
+
+/*
+ * This macro hints that the memory at the address p will be read soon.
+ * It does nothing if the compiler has no way to prefetch memory.
+ */
+#if defined(__GNUC__)
+#define QTPREFETCH(p) __builtin_prefetch(p)
+#else
+#define QTPREFETCH(p) ((void) (p))
+#endif
+
+/*
+ * This structure holds the elements which a worker has popped but not
+ * yet finished running. The member fq points to the function queue the
+ * elements came from. The member elements is the array of popped
+ * elements. The member next is the index of the first element which has
+ * not started running. The member count is the number of popped
+ * elements.
+ */
+struct qtbatch {
+	struct function_queue* fq;
+	struct function_queue_element elements[QTPOOL_BATCH_MAX];
+	unsigned int next;
+	unsigned int count;
+};
+
+/*
+ * This structure holds a spare worker. The member pool is the pool of
+ * the worker. The member thread is its thread. The member next is the
+ * next spare worker of the pool.
+ */
+struct qtspare {
+	struct qtpool* pool;
+	pthread_t thread;
+	struct qtspare* next;
+};
+
+/*
+ * This is the prefix of the names of the workers of a pool which has
+ * none in its attributes.
+ */
+#ifndef QTPOOL_NAME
+#define QTPOOL_NAME "qtpool"
+#endif
+
+/* the size of the name of a thread, including its terminator */
+#define QTPOOL_NAME_MAX 16
+
+/*
+ * This structure identifies a worker for its teardown. The member pool
+ * is the pool of the worker, and the member index is its index. The
+ * member blocked counts the blocking regions the worker is in, which
+ * are left when it exits. The member retired is non-zero once the
+ * worker is a spare worker which retired.
+ */
+struct qtworker {
+	struct qtpool* pool;
+	size_t index;
+	unsigned int blocked;
+	int retired;
+};
+
+/*
+ * This structure holds the private inbox of a worker. The member pool
+ * is the pool of the worker. The member fq points to the queue of the
+ * tasks submitted to the worker alone, which is allocated by the first
+ * submission, or is NULL. The member pending is set when a task is
+ * submitted and cleared by the worker before it drains the inbox. The
+ * member idle is non-zero while the worker waits for tasks, so that a
+ * submitter knows to wake it. The member started is non-zero while the
+ * thread of the worker runs, and is guarded by the spare lock of the
+ * pool.
+ */
+struct qtinbox {
+	struct qtpool* pool;
+	struct function_queue* fq;
+	unsigned int pending;
+	unsigned int idle;
+	int started;
+};
+
+/* the heap index of a task with a deadline which is not in the heap */
+#define QTPOOL_NOT_HEAPED ((size_t) -1)
+
+/*
+ * This structure holds a task with a deadline whose token is in the
+ * function queue of a pool. The members func and arg are the task,
+ * which runs only if it starts before the time deadline on the monotonic
+ * clock. Otherwise, the member expired is called with arg instead,
+ * unless it is NULL. The member pool is the pool of the task. The member
+ * index is the position of the task in the deadline heap of the pool,
+ * or QTPOOL_NOT_HEAPED. The member pushing is non-zero until the token
+ * has been pushed, and the member taken is set if the token was taken
+ * meanwhile, in which case the pusher frees the structure.
+ */
+struct qtdeadline {
+	void (* func)(void*);
+	void* arg;
+	void (* expired)(void*);
+	struct timespec deadline;
+	struct qtpool* pool;
+	size_t index;
+	int pushing;
+	int taken;
+};
+
+/*
+ * This structure holds a task run once by every worker. The members
+ * func and arg are the task. The member lock guards the other members.
+ * The member remaining is the number of workers which have not finished
+ * the task, and the member done is signaled when it drops to 0. The
+ * member refs counts the workers and the waiter which still use the
+ * structure.
+ */
+struct qtbroadcast {
+	void (* func)(void*);
+	void* arg;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	size_t remaining;
+	size_t refs;
+};
+
+static void create_worker_key(void);
+static void run_worker(struct qtpool*, size_t, const struct qtspare*,
+		struct qtinbox*);
+static void finish_worker(void*);
+static void name_worker(const struct qtpool*, size_t);
+static enum qterror make_attr(const struct qtpool*, pthread_attr_t*);
+static void run_tasks(struct qtpool*, const struct qtspare*,
+		struct qtinbox*);
+static void run_inbox(struct qtpool*, struct qtinbox*);
+static enum qterror open_inbox(struct qtpool*, struct qtinbox*,
+		struct function_queue**);
+static void discard_inbox(struct qtpool*, struct qtinbox*);
+static int is_started(struct qtpool*, size_t);
+static void run_broadcast(void*);
+static void drop_broadcast(struct function_queue*, void*);
+static void poll_reactor(struct qtpool*);
+static void run_deadline(void*);
+static void drop_deadline(struct function_queue*, void*);
+static void resolve_deadlines(struct qtbatch*);
+static int take_deadline(struct qtdeadline*,
+		struct function_queue_element*);
+static void claim_deadline(struct qtdeadline*, struct qtdeadline*, int);
+static void heap_deadline(struct qtpool*, struct qtdeadline*);
+static void unheap_deadline(struct qtpool*, size_t);
+static void sift_deadline(struct qtpool*, size_t);
+static int before(const struct timespec*, const struct timespec*);
+static void release_broadcast(struct qtbroadcast*, int);
+static void* run_spare(void*);
+static enum qterror start_spare(struct qtpool*);
+static int retire_spare(struct qtpool*, const struct qtspare*);
+static int update_surplus(struct qtpool*);
+static void leave_idle(void*);
+static unsigned int batch_max(const struct qtpool*);
+static void discard_batch(void*);
+static const struct qtbatchhandler* find_batch_handler(const struct qtpool*,
+		void (*)(void*));
+static void run_group(const struct qtpool*, struct qtbatch*,
+		const struct qtbatchhandler*);
+static void profile_run(const struct qtpool*,
+		const struct function_queue_element*, size_t,
+		const struct timespec*);
+
+/* the key of the pool of each worker thread */
+static pthread_key_t worker_key;
+static pthread_once_t worker_key_once = PTHREAD_ONCE_INIT;
+static int worker_key_error = 0;
+
+/*
+ * This procedure is the start routine of the workers of a pool. The
+ * argument is a pointer to the inbox of the worker in an initialized
+ * qtpool object. This procedure does not return unless the value of arg
+ * NULL.
+ */
+static void*
+get_and_run(void* arg)
+{
+	struct qtinbox* inbox = arg;
+
+	if(inbox == NULL)
+		return NULL;
+
+	run_worker(inbox->pool, (size_t) (inbox - inbox->pool->inboxes), NULL,
+			inbox);
+	return NULL;
+}
+
+/*
+ * This procedure is the start routine of the spare workers of a pool.
+ * It returns once the spare worker is no longer needed. The variable
+ * arg is a pointer to the spare worker. The value of arg must not be
+ * NULL.
+ */
+static void*
+run_spare(void* arg)
+{
+	const struct qtspare* spare = arg;
+
+	assert(spare != NULL);
+	run_worker(spare->pool, spare->pool->max_threads, spare, NULL);
+	return NULL;
+}
+
+/*
+ * This procedure names the calling worker of index index of the pool
+ * tq, calls the init hook of the pool and runs tasks like run_tasks().
+ * The teardown hook is called when the worker returns or is cancelled.
+ * The value of tq must not be NULL.
+ */
+static void
+run_worker(struct qtpool* tq, size_t index, const struct qtspare* spare,
+		struct qtinbox* inbox)
+{
+	struct qtworker self;
+
+	assert(tq != NULL);
+	self.pool = tq;
+	self.index = index;
+	self.blocked = 0;
+	self.retired = 0;
+	name_worker(tq, index);
+
+	if(tq->attr.init != NULL)
+		tq->attr.init(index, tq->attr.arg);
+
+	pthread_cleanup_push(finish_worker, &self);
+	(void) pthread_setspecific(worker_key, &self);
+	run_tasks(tq, spare, inbox);
+
+	/* only a spare worker which retired stops running tasks */
+	self.retired = 1;
+	pthread_cleanup_pop(1);
+}
+
+/*
+ * This procedure is a cleanup handler which leaves the blocking regions
+ * of an exiting worker and calls the teardown hook of the worker. A
+ * spare worker which retired then tells qtstop() that it no longer uses
+ * the pool. The variable arg is a pointer to the identity of the
+ * worker. The value of arg must not be NULL.
+ */
+static void
+finish_worker(void* arg)
+{
+	struct qtworker* self = arg;
+
+	assert(self != NULL);
+	(void) pthread_setspecific(worker_key, NULL);
+
+	/* a worker cancelled inside a region never leaves it itself */
+	if(self->blocked != 0
+			&& pthread_mutex_lock(&self->pool->spare_lock) == 0) {
+		int wake = 0;
+
+		self->pool->blocked -= self->blocked;
+		self->blocked = 0;
+		wake = update_surplus(self->pool);
+		(void) pthread_mutex_unlock(&self->pool->spare_lock);
+
+		if(wake)
+			(void) fqwakepoppers(self->pool->fq);
+	}
+
+	if(self->pool->attr.teardown != NULL)
+		self->pool->attr.teardown(self->index, self->pool->attr.arg);
+
+	if(self->retired
+			&& pthread_mutex_lock(&self->pool->spare_lock) == 0) {
+		--self->pool->unlisted;
+		(void) pthread_cond_broadcast(&self->pool->spare_done);
+		(void) pthread_mutex_unlock(&self->pool->spare_lock);
+	}
+}
+
+/*
+ * This procedure names the calling worker of index index of the pool tq
+ * after the prefix of the pool and its index, or as a spare worker if
+ * the index is the size of the pool. The value of tq must not be NULL.
+ */
+static void
+name_worker(const struct qtpool* tq, size_t index)
+{
+	char name[QTPOOL_NAME_MAX];
+	const char* prefix = NULL;
+
+	assert(tq != NULL);
+	prefix = tq->attr.name != NULL ? tq->attr.name : QTPOOL_NAME;
+
+	if(index < tq->max_threads)
+		(void) snprintf(name, sizeof(name), "%s-%lu", prefix,
+				(unsigned long) index);
+	else
+		(void) snprintf(name, sizeof(name), "%s-spare", prefix);
+
+	(void) pthread_setname_np(pthread_self(), name);
+}
+
+/*
+ * This procedure initializes the thread attributes attr from the worker
+ * attributes of the pool tq. The attributes must be destroyed if the
+ * procedure succeeds. The procedure returns QTEINVALID if the system
+ * rejects an attribute. Otherwise, it returns an error code to indicate
+ * its status. The value of tq must not be NULL. The value of attr must
+ * not be NULL.
+ */
+static enum qterror
+make_attr(const struct qtpool* tq, pthread_attr_t* attr)
+{
+	struct sched_param param;
+
+	assert(tq != NULL);
+	assert(attr != NULL);
+
+	if(pthread_attr_init(attr) != 0)
+		return QTEPTCREATE;
+
+	if(tq->attr.stack_size != 0 && pthread_attr_setstacksize(attr,
+				tq->attr.stack_size) != 0)
+		goto invalid;
+
+	if(tq->attr.guard_size != QTPOOL_DEFAULT_GUARD
+			&& pthread_attr_setguardsize(attr,
+				tq->attr.guard_size) != 0)
+		goto invalid;
+
+	if(tq->attr.sched_policy != -1) {
+		param.sched_priority = tq->attr.sched_priority;
+
+		if(pthread_attr_setinheritsched(attr,
+					PTHREAD_EXPLICIT_SCHED) != 0
+				|| pthread_attr_setschedpolicy(attr,
+					tq->attr.sched_policy) != 0
+				|| pthread_attr_setschedparam(attr,
+					&param) != 0)
+			goto invalid;
+	}
+
+	return QTSUCCESS;
+
+invalid:
+	(void) pthread_attr_destroy(attr);
+	return QTEINVALID;
+}
+
+/*
+ * This procedure repeatedly retrives functions from the function queue
+ * and executes them. Each pass pops a batch of functions while locking
+ * the queue once and prefetches the argument of the next function while
+ * the current one runs. Consecutive calls to a function with a batch
+ * handler are passed to the handler in one call. The size of a batch is
+ * limited to a fair share of the queue so that one worker does not take
+ * work which idle workers could run, and to one element unless the
+ * queue has a drop hook, as described for batch_max(). If the pool has
+ * a profiler, each run is timed and recorded. Before each pass, the
+ * tasks submitted to the inbox of the worker are run, the reactor of
+ * the pool is polled as described for poll_reactor(), and a worker
+ * waiting for tasks stops waiting when one is submitted. This runs until the calling
+ * thread is cancelled, or for the spare worker spare until it is
+ * retired. The value of spare is NULL for the other workers, and the
+ * value of inbox is NULL for spare workers. The value of tq must not be
+ * NULL.
+ */
+static void
+run_tasks(struct qtpool* tq, const struct qtspare* spare,
+		struct qtinbox* inbox)
+{
+	struct qtbatch batch;
+	unsigned int share = 0;
+
+	assert(tq != NULL);
+	batch.fq = tq->fq;
+	batch.next = 0;
+	batch.count = 0;
+	share = tq->max_threads < UINT_MAX ? (unsigned int) tq->max_threads
+			: UINT_MAX;
+
+	do {
+		volatile enum qterror popped = QTSUCCESS;
+
+		pthread_testcancel();
+
+		if(spare != NULL && retire_spare(tq, spare))
+			return;
+
+		if(inbox != NULL)
+			run_inbox(tq, inbox);
+
+		poll_reactor(tq);
+		(void) QTATOMIC_FETCH_ADD(&tq->idle, 1U, QTATOMIC_RELAXED);
+		pthread_cleanup_push(leave_idle, tq);
+
+		if(inbox != NULL) {
+			QTATOMIC_STORE(&inbox->idle, 1U, QTATOMIC_SEQ_CST);
+			popped = fqpopvuntil(tq->fq, batch.elements,
+					batch_max(tq), share, &batch.count,
+					&inbox->pending);
+			QTATOMIC_STORE(&inbox->idle, 0U, QTATOMIC_RELAXED);
+		} else {
+			/* an idle spare worker wakes up to retire */
+			popped = fqpopvuntil(tq->fq, batch.elements,
+					batch_max(tq), share, &batch.count,
+					&tq->surplus);
+		}
+
+		pthread_cleanup_pop(1);
+
+		if(popped != QTSUCCESS)
+			continue;
+
+		resolve_deadlines(&batch);
+		pthread_cleanup_push(discard_batch, &batch);
+
+		for(batch.next = 0; batch.next < batch.count;) {
+			struct function_queue_element* fqe =
+					&batch.elements[batch.next];
+			const struct qtbatchhandler* handler =
+					find_batch_handler(tq, fqe->func);
+			struct timespec start;
+
+			if(handler != NULL) {
+				run_group(tq, &batch, handler);
+				continue;
+			}
+
+			if(++batch.next < batch.count)
+				QTPREFETCH(batch.elements[batch.next].arg);
+
+			QTPROBE3(task_begin, tq, fqe->func, fqe->arg);
+
+			if(tq->profile != NULL)
+				(void) clock_gettime(CLOCK_MONOTONIC, &start);
+
+			fqe->func(fqe->arg);
+
+			if(tq->profile != NULL)
+				profile_run(tq, fqe, 1, &start);
+
+			QTPROBE2(task_end, tq, fqe->func);
+		}
+
+		(void) QTATOMIC_FETCH_ADD(&tq->executed,
+				(unsigned long) batch.count, QTATOMIC_RELAXED);
+		pthread_cleanup_pop(0);
+	} while(1);
+}
+
+/*
+ * This procedure creates the key of the pool of each worker thread. The
+ * error of the creation is kept in worker_key_error.
+ */
+static void
+create_worker_key(void)
+{
+	worker_key_error = pthread_key_create(&worker_key, NULL);
+}
+
+/*
+ * This procedure runs the tasks in the inbox of a worker of the pool
+ * tq until the inbox is empty. The value of tq must not be NULL. The
+ * value of inbox must not be NULL.
+ */
+static void
+run_inbox(struct qtpool* tq, struct qtinbox* inbox)
+{
+	struct function_queue_element e;
+	struct function_queue* fq = NULL;
+
+	assert(tq != NULL);
+	assert(inbox != NULL);
+
+	if(QTATOMIC_LOAD(&inbox->pending, QTATOMIC_RELAXED) == 0)
+		return;
+
+	/* a task submitted from now on sets it again */
+	QTATOMIC_STORE(&inbox->pending, 0U, QTATOMIC_SEQ_CST);
+
+	/* the queue is allocated before the first task sets the flag */
+	fq = QTATOMIC_LOAD(&inbox->fq, QTATOMIC_ACQUIRE);
+
+	while(fq != NULL && fqpop(fq, &e, 0) == QTSUCCESS) {
+		QTPROBE3(task_begin, tq, e.func, e.arg);
+		e.func(e.arg);
+		QTPROBE2(task_end, tq, e.func);
+		(void) QTATOMIC_FETCH_ADD(&tq->executed, 1UL,
+				QTATOMIC_RELAXED);
+	}
+}
+
+/*
+ * This procedure stores the address of the queue of the inbox of a
+ * worker of the pool tq in the variable pointed to by out, and
+ * allocates the queue under the spare lock of the pool if it has none
+ * yet, so that a pool which never uses its inboxes does not pay for
+ * them. The procedure returns an error code to indicate its status. The
+ * value of tq must not be NULL. The value of inbox must not be NULL.
+ * The value of out must not be NULL.
+ */
+static enum qterror
+open_inbox(struct qtpool* tq, struct qtinbox* inbox,
+		struct function_queue** out)
+{
+	struct function_queue* fq = NULL;
+	enum qterror ret = QTSUCCESS;
+
+	assert(tq != NULL);
+	assert(inbox != NULL);
+	assert(out != NULL);
+	*out = QTATOMIC_LOAD(&inbox->fq, QTATOMIC_ACQUIRE);
+
+	if(*out != NULL)
+		return QTSUCCESS;
+
+	if(pthread_mutex_lock(&tq->spare_lock) != 0)
+		return QTEPTMLOCK;
+
+	fq = inbox->fq;
+
+	if(fq == NULL) {
+		fq = malloc(sizeof(*fq));
+
+		if(fq == NULL) {
+			ret = QTEMALLOC;
+		} else if((ret = fqinit(fq, FQTYPE_IA, QTPOOL_INBOX_SIZE))
+				!= QTSUCCESS) {
+			free(fq);
+			fq = NULL;
+		} else {
+			QTATOMIC_STORE(&inbox->fq, fq, QTATOMIC_RELEASE);
+		}
+	}
+
+	(void) pthread_mutex_unlock(&tq->spare_lock);
+	*out = fq;
+	return ret;
+}
+
+/*
+ * This procedure discards the tasks left in the inbox of a worker of
+ * the pool tq whose thread has exited, as described for fqdiscard() on
+ * the function queue of the pool, so that no broadcast waits for them.
+ * The value of tq must not be NULL. The value of inbox must not be NULL.
+ */
+static void
+discard_inbox(struct qtpool* tq, struct qtinbox* inbox)
+{
+	struct function_queue_element e;
+
+	assert(tq != NULL);
+	assert(inbox != NULL);
+	QTATOMIC_STORE(&inbox->pending, 0U, QTATOMIC_RELAXED);
+
+	if(inbox->fq == NULL)
+		return;
+
+	while(fqpop(inbox->fq, &e, 0) == QTSUCCESS)
+		fqdiscard(tq->fq, e.func, e.arg);
+}
+
+/*
+ * This procedure returns non-zero if the thread of the worker of index
+ * index of the pool tq runs. The value of tq must not be NULL.
+ */
+static int
+is_started(struct qtpool* tq, size_t index)
+{
+	int started = 0;
+
+	assert(tq != NULL);
+
+	if(pthread_mutex_lock(&tq->spare_lock) != 0)
+		return 0;
+
+	started = tq->inboxes[index].started;
+	(void) pthread_mutex_unlock(&tq->spare_lock);
+	return started;
+}
+
+/*
+ * This procedure is the task which qtbroadcast() submits to each
+ * worker. The variable arg is a pointer to the broadcast. The value of
+ * arg must not be NULL.
+ */
+static void
+run_broadcast(void* arg)
+{
+	struct qtbroadcast* b = arg;
+
+	assert(b != NULL);
+	b->func(b->arg);
+	release_broadcast(b, 1);
+}
+
+/*
+ * This procedure is the drop handler of the tasks which qtbroadcast()
+ * submits. A worker which did not run the task is done with it. The
+ * variable arg is a pointer to the broadcast. The value of arg must not
+ * be NULL.
+ */
+static void
+drop_broadcast(struct function_queue* q, void* arg)
+{
+	(void) q;
+	assert(arg != NULL);
+	release_broadcast(arg, 1);
+}
+
+/*
+ * This procedure is the token which qtpushdeadline() pushes for a task
+ * with a deadline. Workers resolve tokens as soon as they pop them, so
+ * it is only called when a token is run otherwise, such as by a pusher
+ * under FQOVERFLOW_CALLERRUNS. It runs the queued task with the earliest
+ * deadline, or sheds it if the deadline has passed. The variable arg is
+ * a pointer to the task of the token. The value of arg must not be
+ * NULL.
+ */
+static void
+run_deadline(void* arg)
+{
+	struct function_queue_element e;
+
+	assert(arg != NULL);
+
+	if(take_deadline(arg, &e))
+		e.func(e.arg);
+}
+
+/*
+ * This procedure is the drop handler of the tokens of tasks with
+ * deadlines. The task of the dropped token is shed: its expired
+ * procedure is called, or else it is reported as described for
+ * fqdiscard(). The variable q is the queue which dropped the token, and
+ * the variable arg is a pointer to the task of the token. The value of
+ * q must not be NULL. The value of arg must not be NULL.
+ */
+static void
+drop_deadline(struct function_queue* q, void* arg)
+{
+	struct qtdeadline d;
+
+	assert(q != NULL);
+	assert(arg != NULL);
+	claim_deadline(arg, &d, 0);
+
+	if(d.expired != NULL)
+		d.expired(d.arg);
+	else
+		fqdiscard(q, d.func, d.arg);
+}
+
+/*
+ * This procedure replaces the tokens of tasks with deadlines among the
+ * elements of the batch, which has just been popped, with the queued
+ * tasks with the earliest deadlines, or with their expired procedures
+ * if their deadlines have passed. Shed tasks without an expired
+ * procedure are removed from the batch. The value of batch must not be
+ * NULL.
+ */
+static void
+resolve_deadlines(struct qtbatch* batch)
+{
+	unsigned int n = 0;
+	unsigned int i = 0;
+
+	assert(batch != NULL);
+
+	for(i = 0; i < batch->count; ++i) {
+		struct function_queue_element e = batch->elements[i];
+
+		if(e.func == run_deadline && !take_deadline(e.arg, &e))
+			continue;
+
+		batch->elements[n++] = e;
+	}
+
+	batch->count = n;
+}
+
+/*
+ * This procedure takes the queued task with the earliest deadline in
+ * place of the task d, whose token is being run, and stores the
+ * procedure to call in the element pointed to by e: the task if its
+ * deadline has not passed, or else its expired procedure. The procedure
+ * returns 0 if the task is shed without an expired procedure, so that
+ * there is nothing to call, or non-zero otherwise. The value of d must
+ * not be NULL. The value of e must not be NULL.
+ */
+static int
+take_deadline(struct qtdeadline* d, struct function_queue_element* e)
+{
+	struct qtdeadline task;
+	struct timespec now;
+
+	assert(d != NULL);
+	assert(e != NULL);
+	claim_deadline(d, &task, 1);
+	(void) clock_gettime(CLOCK_MONOTONIC, &now);
+	e->arg = task.arg;
+
+	if(!before(&task.deadline, &now))
+		e->func = task.func;
+	else if(task.expired != NULL)
+		e->func = task.expired;
+	else
+		return 0;
+
+	return 1;
+}
+
+/*
+ * This procedure takes the task d, whose token was popped or dropped,
+ * out of the deadline heap of its pool and copies it to the structure
+ * pointed to by task. If the value of earliest is non-zero and the
+ * heap holds a task with an earlier deadline, that task is copied
+ * instead and d takes its place, so that tasks run in the order of
+ * their deadlines however their tokens are queued. The structure d is
+ * freed unless its pusher still uses it. The value of d must not be
+ * NULL. The value of task must not be NULL.
+ */
+static void
+claim_deadline(struct qtdeadline* d, struct qtdeadline* task, int earliest)
+{
+	struct qtpool* tq = NULL;
+	struct qtdeadline* first = d;
+	int release = 0;
+
+	assert(d != NULL);
+	assert(task != NULL);
+	tq = d->pool;
+	(void) pthread_mutex_lock(&tq->deadline_lock);
+
+	if(earliest && tq->ndeadlines > 0 && tq->deadlines[0] != d
+			&& before(&tq->deadlines[0]->deadline, &d->deadline))
+		first = tq->deadlines[0];
+
+	*task = *first;
+
+	/* the earlier task hands its place in the heap to d */
+	if(first != d) {
+		first->func = d->func;
+		first->arg = d->arg;
+		first->expired = d->expired;
+		first->deadline = d->deadline;
+		sift_deadline(tq, first->index);
+	}
+
+	if(d->index != QTPOOL_NOT_HEAPED)
+		unheap_deadline(tq, d->index);
+
+	if(d->pushing)
+		d->taken = 1;
+	else
+		release = 1;
+
+	(void) pthread_mutex_unlock(&tq->deadline_lock);
+
+	if(release)
+		free(d);
+}
+
+/*
+ * This procedure adds the task d to the deadline heap of the pool tq. If
+ * the heap cannot grow, the task is left out of it and runs when its
+ * own token is popped. The deadline lock of the pool must be held by
+ * the calling thread. The value of tq must not be NULL. The value of d
+ * must not be NULL.
+ */
+static void
+heap_deadline(struct qtpool* tq, struct qtdeadline* d)
+{
+	assert(tq != NULL);
+	assert(d != NULL);
+
+	if(tq->ndeadlines == tq->deadlines_size) {
+		size_t size = tq->deadlines_size > 0
+				? tq->deadlines_size * 2 : 16;
+		struct qtdeadline** deadlines = realloc(tq->deadlines,
+				size * sizeof(*deadlines));
+
+		if(deadlines == NULL)
+			return;
+
+		tq->deadlines = deadlines;
+		tq->deadlines_size = size;
+	}
+
+	d->index = tq->ndeadlines++;
+	tq->deadlines[d->index] = d;
+	sift_deadline(tq, d->index);
+}
+
+/*
+ * This procedure removes the task at the position index from the
+ * deadline heap of the pool tq. The deadline lock of the pool must be
+ * held by the calling thread. The value of tq must not be NULL. The
+ * value of index must be less than the number of tasks in the heap.
+ */
+static void
+unheap_deadline(struct qtpool* tq, size_t index)
+{
+	struct qtdeadline* last = NULL;
+
+	assert(tq != NULL);
+	assert(index < tq->ndeadlines);
+	tq->deadlines[index]->index = QTPOOL_NOT_HEAPED;
+	last = tq->deadlines[--tq->ndeadlines];
+
+	if(index == tq->ndeadlines)
+		return;
+
+	tq->deadlines[index] = last;
+	last->index = index;
+	sift_deadline(tq, index);
+}
+
+/*
+ * This procedure moves the task at the position index of the deadline
+ * heap of the pool tq up or down until the heap is ordered again. The
+ * deadline lock of the pool must be held by the calling thread. The
+ * value of tq must not be NULL. The value of index must be less than
+ * the number of tasks in the heap.
+ */
+static void
+sift_deadline(struct qtpool* tq, size_t index)
+{
+	struct qtdeadline* d = NULL;
+
+	assert(tq != NULL);
+	assert(index < tq->ndeadlines);
+	d = tq->deadlines[index];
+
+	while(index > 0 && before(&d->deadline,
+				&tq->deadlines[(index - 1) / 2]->deadline)) {
+		tq->deadlines[index] = tq->deadlines[(index - 1) / 2];
+		tq->deadlines[index]->index = index;
+		index = (index - 1) / 2;
+	}
+
+	while(2 * index + 1 < tq->ndeadlines) {
+		size_t child = 2 * index + 1;
+
+		if(child + 1 < tq->ndeadlines
+				&& before(&tq->deadlines[child + 1]->deadline,
+					&tq->deadlines[child]->deadline))
+			++child;
+
+		if(!before(&tq->deadlines[child]->deadline, &d->deadline))
+			break;
+
+		tq->deadlines[index] = tq->deadlines[child];
+		tq->deadlines[index]->index = index;
+		index = child;
+	}
+
+	tq->deadlines[index] = d;
+	d->index = index;
+}
+
+/*
+ * This procedure returns non-zero if the time a is before the time b.
+ * The value of a must not be NULL. The value of b must not be NULL.
+ */
+static int
+before(const struct timespec* a, const struct timespec* b)
+{
+	assert(a != NULL);
+	assert(b != NULL);
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec
+			&& a->tv_nsec < b->tv_nsec);
+}
+
+/*
+ * This procedure drops a reference to the broadcast b, and also counts
+ * a worker as finished if the value of finished is non-zero. The last
+ * reference frees the broadcast. The value of b must not be NULL.
+ */
+static void
+release_broadcast(struct qtbroadcast* b, int finished)
+{
+	int last = 0;
+
+	assert(b != NULL);
+	(void) pthread_mutex_lock(&b->lock);
+
+	if(finished && --b->remaining == 0)
+		(void) pthread_cond_broadcast(&b->done);
+
+	last = --b->refs == 0;
+	(void) pthread_mutex_unlock(&b->lock);
+
+	if(last) {
+		(void) pthread_cond_destroy(&b->done);
+		(void) pthread_mutex_destroy(&b->lock);
+		free(b);
+	}
+}
+
+/*
+ * This procedure starts a spare worker of the pool tq which
+ * qtblockingbegin() has counted, both as a spare worker and as
+ * unlisted, and adds it to the list of spare workers. The thread is
+ * created without holding the spare lock. A spare worker which cannot
+ * be started is no longer counted. The procedure returns an error code
+ * to indicate its status. The value of tq must not be NULL.
+ */
+static enum qterror
+start_spare(struct qtpool* tq)
+{
+	pthread_attr_t attr;
+	struct qtspare* spare = NULL;
+	enum qterror ret = QTSUCCESS;
+
+	assert(tq != NULL);
+	spare = malloc(sizeof(*spare));
+
+	if(spare == NULL) {
+		ret = QTEMALLOC;
+	} else if((ret = make_attr(tq, &attr)) == QTSUCCESS) {
+		spare->pool = tq;
+
+		/* the spare cannot retire before it is listed */
+		if(pthread_create(&spare->thread, &attr, run_spare, spare)
+				!= 0)
+			ret = QTEPTCREATE;
+
+		(void) pthread_attr_destroy(&attr);
+	}
+
+	(void) pthread_mutex_lock(&tq->spare_lock);
+
+	if(ret == QTSUCCESS) {
+		spare->next = tq->spares;
+		tq->spares = spare;
+	} else {
+		free(spare);
+		--tq->nspares;
+		(void) QTATOMIC_FETCH_SUB(&tq->running, 1U, QTATOMIC_RELAXED);
+		(void) update_surplus(tq);
+	}
+
+	--tq->unlisted;
+	(void) pthread_cond_broadcast(&tq->spare_done);
+	(void) pthread_mutex_unlock(&tq->spare_lock);
+	return ret;
+}
+
+/*
+ * This procedure polls the reactor of the pool tq without waiting if
+ * the pool has one and its function queue is empty, so that an idle
+ * worker queues the callbacks of ready descriptors itself. If another
+ * thread is polling the reactor, the worker does not poll. The worker
+ * cannot be cancelled while it polls, so that the reactor is not left
+ * locked. The value of tq must not be NULL.
+ */
+static void
+poll_reactor(struct qtpool* tq)
+{
+	int cancel = 0;
+	int ignored = 0;
+
+	assert(tq != NULL);
+
+	if(tq->reactor == NULL || fqsize(tq->fq) != 0)
+		return;
+
+	(void) pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel);
+	(void) qtreactorpoll(tq->reactor, 0, NULL);
+	(void) pthread_setcancelstate(cancel, &ignored);
+}
+
+/*
+ * This procedure checks if the spare worker spare of the pool tq is no
+ * longer needed because the pool has more runnable workers than its
+ * size. If so, the spare worker is removed from the pool and its thread
+ * is detached, and the procedure returns non-zero. The spare worker is
+ * counted as unlisted until it exits. A spare worker which
+ * qtstop() has already taken from the pool is left for it to stop. The
+ * value of tq must not be NULL. The value of spare must not be NULL.
+ */
+static int
+retire_spare(struct qtpool* tq, const struct qtspare* spare)
+{
+	struct qtspare** it = NULL;
+	struct qtspare* retired = NULL;
+
+	assert(tq != NULL);
+	assert(spare != NULL);
+
+	if(pthread_mutex_lock(&tq->spare_lock) != 0)
+		return 0;
+
+	if(QTATOMIC_LOAD(&tq->running, QTATOMIC_RELAXED)
+			> tq->max_threads + tq->blocked) {
+		for(it = &tq->spares; *it != NULL; it = &(*it)->next) {
+			if(*it == spare) {
+				retired = *it;
+				*it = retired->next;
+				break;
+			}
+		}
+	}
+
+	if(retired != NULL) {
+		--tq->nspares;
+		++tq->unlisted;
+		(void) QTATOMIC_FETCH_SUB(&tq->running, 1U, QTATOMIC_RELAXED);
+		(void) update_surplus(tq);
+		(void) pthread_detach(pthread_self());
+		free(retired);
+	}
+
+	(void) pthread_mutex_unlock(&tq->spare_lock);
+	return retired != NULL;
+}
+
+/*
+ * This procedure sets the member surplus of the pool tq to tell if one
+ * of its spare workers is no longer needed. The spare lock of the pool
+ * must be held. The procedure returns non-zero if a spare worker became
+ * unneeded, in which case the caller should wake the idle spare workers
+ * with fqwakepoppers() once the lock is released. The value of tq must
+ * not be NULL.
+ */
+static int
+update_surplus(struct qtpool* tq)
+{
+	unsigned int surplus = 0;
+
+	assert(tq != NULL);
+	surplus = tq->nspares > 0 && QTATOMIC_LOAD(&tq->running,
+			QTATOMIC_RELAXED) > tq->max_threads + tq->blocked;
+
+	if(QTATOMIC_EXCHANGE(&tq->surplus, surplus, QTATOMIC_SEQ_CST)
+			== surplus)
+		return 0;
+
+	return surplus != 0;
+}
+
+/*
+ * This procedure removes a worker which stopped waiting for tasks from
+ * the idle workers, including when it is cancelled while it waits. The
+ * variable arg is a pointer to the pool of the worker. The value of arg
+ * must not be NULL.
+ */
+static void
+leave_idle(void* arg)
+{
+	struct qtpool* tq = arg;
+
+	assert(tq != NULL);
+	(void) QTATOMIC_FETCH_SUB(&tq->idle, 1U, QTATOMIC_RELAXED);
+}
+
+/*
+ * This procedure returns the number of elements which a worker of the
+ * pool tq pops at once. The elements of a batch which a cancelled
+ * worker has not started running are lost unless the function queue
+ * reports them to its drop hook, so without one a worker pops a single
+ * element and leaves the others queued. The value of tq must not be
+ * NULL.
+ */
+static unsigned int
+batch_max(const struct qtpool* tq)
+{
+	assert(tq != NULL);
+
+	if(QTATOMIC_LOAD(&tq->fq->ondrop, QTATOMIC_ACQUIRE) == NULL)
+		return 1;
+
+	return QTPOOL_BATCH_MAX;
+}
+
+/*
+ * This procedure is a cleanup handler for a worker which is cancelled
+ * while running a batch. The elements of the batch which have not
+ * started running are reported in order as dropped, as described for
+ * fqdiscard(). They are not pushed back onto the function queue, where
+ * they would run after elements pushed later than them. The variable
+ * arg is a pointer to the batch of the worker. The value of arg must
+ * not be NULL.
+ */
+static void
+discard_batch(void* arg)
+{
+	struct qtbatch* batch = arg;
+
+	assert(batch != NULL);
+
+	while(batch->next < batch->count) {
+		const struct function_queue_element* e =
+			&batch->elements[batch->next++];
+
+		fqdiscard(batch->fq, e->func, e->arg);
+	}
+}
 
 /*
- * This procedure repeatedly retrives a function from the function queue
- * and executes it. This runs until the calling thread is cancelled. The
- * argument is a pointer to an initialized qtpool object. This procedure
- * does not return unless the value of arg NULL.
+ * This procedure looks up the batch handler registered for the function
+ * func. It returns NULL if there is none. The value of tq must not be
+ * NULL.
  */
-static void*
-get_and_run(void* arg)
+static const struct qtbatchhandler*
+find_batch_handler(const struct qtpool* tq, void (*func)(void*))
 {
-	struct function_queue_element fqe;
-	struct qtpool* tq = NULL;
+	size_t i = 0;
 
-	if(arg == NULL)
-		return NULL;
+	assert(tq != NULL);
+
+	for(i = 0; i < tq->nbatch_handlers; ++i)
+		if(tq->batch_handlers[i].func == func)
+			return &tq->batch_handlers[i];
+
+	return NULL;
+}
+
+/*
+ * This procedure passes the arguments of the run of consecutive calls
+ * to the function of handler which starts at the next element of the
+ * batch to its batch handler in one call. The variable tq is the pool
+ * of the calling worker. The whole run counts as started
+ * before the handler is called, so it is not queued again if the worker
+ * is cancelled in the handler. The value of batch must not be NULL. The
+ * value of handler must not be NULL.
+ */
+static void
+run_group(const struct qtpool* tq, struct qtbatch* batch,
+		const struct qtbatchhandler* handler)
+{
+	void* args[QTPOOL_BATCH_MAX];
+	struct timespec start;
+	unsigned int first = 0;
+	size_t n = 0;
 
-	tq = arg;
+	assert(tq != NULL);
+	assert(batch != NULL);
+	assert(handler != NULL);
+	assert(batch->next < batch->count);
+	first = batch->next;
 
 	do {
-		pthread_testcancel();
+		args[n++] = batch->elements[batch->next++].arg;
+	} while(batch->next < batch->count
+			&& batch->elements[batch->next].func == handler->func);
 
-		if(fqpop(tq->fq, &fqe, 1) == QTSUCCESS)
-			fqe.func(fqe.arg);
+	QTPROBE3(batch_begin, tq, handler->func, n);
 
-	} while(1);
+	if(tq->profile != NULL)
+		(void) clock_gettime(CLOCK_MONOTONIC, &start);
+
+	handler->handler(args, n);
+
+	if(tq->profile != NULL)
+		profile_run(tq, &batch->elements[first], n, &start);
+
+	QTPROBE3(batch_end, tq, handler->func, n);
+}
+
+/*
+ * This procedure records a run of the n elements pointed to by elements
+ * which started at the time pointed to by start and ends now in the
+ * profiler of the pool tq. A failure to record is ignored so that it
+ * cannot stop the worker. The value of tq must not be NULL, and the
+ * pool must have a profiler. The value of elements must not be NULL.
+ * The value of start must not be NULL.
+ */
+static void
+profile_run(const struct qtpool* tq,
+		const struct function_queue_element* elements, size_t n,
+		const struct timespec* start)
+{
+	struct timespec end;
+
+	assert(tq != NULL);
+	assert(tq->profile != NULL);
+	(void) clock_gettime(CLOCK_MONOTONIC, &end);
+	(void) qtprofilerecord(tq->profile, elements, n, start, &end);
 }
 
 /*
@@ -60,23 +1243,95 @@ get_and_run(void* arg)
 enum qterror
 qtinit(struct qtpool* tq, struct qtpool_startup_info* tqsi)
 {
+	size_t i = 0;
+
 	assert(tq != NULL);
 	assert(tqsi != NULL);
 
+	if(pthread_once(&worker_key_once, create_worker_key) != 0)
+		return QTEPTONCE;
+
+	if(worker_key_error != 0)
+		return QTEPTKCREATE;
+
+	if(fqregisterdrop(run_deadline, drop_deadline) != QTSUCCESS
+			|| fqregisterdrop(run_broadcast, drop_broadcast)
+			!= QTSUCCESS)
+		return QTEINVALID;
+
 	tq->fq = tqsi->fq;
 	tq->max_threads = tqsi->max_threads;
+	tq->batch_handlers = NULL;
+	tq->nbatch_handlers = 0;
+	tq->profile = NULL;
+	tq->reactor = NULL;
+	tq->executed = 0;
+	tq->idle = 0;
+	tq->running = 0;
+	tq->spares = NULL;
+	tq->nspares = 0;
+	tq->blocked = 0;
+	tq->surplus = 0;
+	tq->stopping = 0;
+	tq->unlisted = 0;
+	tq->broadcasting = 0;
+	tq->deadlines = NULL;
+	tq->ndeadlines = 0;
+	tq->deadlines_size = 0;
+	qtworkerattrinit(&tq->attr);
+
+	if(pthread_mutex_init(&tq->spare_lock, NULL) != 0)
+		return QTEPTMINIT;
+
+	if(pthread_cond_init(&tq->spare_done, NULL) != 0) {
+		(void) pthread_mutex_destroy(&tq->spare_lock);
+		return QTEPTCINIT;
+	}
+
 	tq->threads = malloc(tq->max_threads * sizeof(pthread_t));
 
-	if(tq->threads == NULL)
+	if(tq->threads == NULL) {
+		(void) pthread_cond_destroy(&tq->spare_done);
+		(void) pthread_mutex_destroy(&tq->spare_lock);
 		return QTEMALLOC;
+	}
 
 	tq->start_errors.errors = calloc(tq->max_threads, sizeof(int));
 
 	if(tq->start_errors.errors == NULL){
 		free(tq->threads);
+		(void) pthread_cond_destroy(&tq->spare_done);
+		(void) pthread_mutex_destroy(&tq->spare_lock);
+		return QTEMALLOC;
+	}
+
+	tq->inboxes = malloc(tq->max_threads * sizeof(struct qtinbox));
+
+	if(tq->inboxes == NULL) {
+		free(tq->start_errors.errors);
+		free(tq->threads);
+		(void) pthread_cond_destroy(&tq->spare_done);
+		(void) pthread_mutex_destroy(&tq->spare_lock);
 		return QTEMALLOC;
 	}
 
+	for(i = 0; i < tq->max_threads; ++i) {
+		tq->inboxes[i].pool = tq;
+		tq->inboxes[i].fq = NULL;
+		tq->inboxes[i].pending = 0;
+		tq->inboxes[i].idle = 0;
+		tq->inboxes[i].started = 0;
+	}
+
+	if(pthread_mutex_init(&tq->deadline_lock, NULL) != 0) {
+		free(tq->inboxes);
+		free(tq->start_errors.errors);
+		free(tq->threads);
+		(void) pthread_cond_destroy(&tq->spare_done);
+		(void) pthread_mutex_destroy(&tq->spare_lock);
+		return QTEPTMINIT;
+	}
+
 	return QTSUCCESS;
 }
 
@@ -89,9 +1344,25 @@ qtinit(struct qtpool* tq, struct qtpool_startup_info* tqsi)
 enum qterror
 qtdestroy(struct qtpool* tq)
 {
+	size_t i = 0;
+
 	assert(tq != NULL);
+
+	for(i = 0; i < tq->max_threads; ++i) {
+		if(tq->inboxes[i].fq != NULL) {
+			(void) fqdestroy(tq->inboxes[i].fq);
+			free(tq->inboxes[i].fq);
+		}
+	}
+
+	free(tq->inboxes);
 	free(tq->start_errors.errors);
 	free(tq->threads);
+	free(tq->batch_handlers);
+	free(tq->deadlines);
+	(void) pthread_mutex_destroy(&tq->deadline_lock);
+	(void) pthread_cond_destroy(&tq->spare_done);
+	(void) pthread_mutex_destroy(&tq->spare_lock);
 	return QTSUCCESS;
 }
 
@@ -105,6 +1376,7 @@ qtdestroy(struct qtpool* tq)
 enum qterror
 qtstart(struct qtpool* tq, int* started)
 {
+	pthread_attr_t attr;
 	enum qterror ret = QTSUCCESS;
 	unsigned int i = 0;
 
@@ -113,48 +1385,118 @@ qtstart(struct qtpool* tq, int* started)
 	if(started != NULL)
 		*started = 0;
 
+	ret = make_attr(tq, &attr);
+
+	if(ret != QTSUCCESS)
+		return ret;
+
+	(void) pthread_mutex_lock(&tq->spare_lock);
+	tq->stopping = 0;
+	(void) pthread_mutex_unlock(&tq->spare_lock);
+
 	for(i = 0; i < tq->max_threads; ++i) {
-		if(pthread_create(&tq->threads[i], NULL, get_and_run,
-					tq) != 0) {
-			if(tq->start_errors.errors != NULL)
-				tq->start_errors.errors[i] = errno;
+		int pc = pthread_create(&tq->threads[i], &attr, get_and_run,
+				&tq->inboxes[i]);
+
+		if(pc != 0 && tq->start_errors.errors != NULL)
+			tq->start_errors.errors[i] = errno;
 
+		(void) pthread_mutex_lock(&tq->spare_lock);
+		tq->inboxes[i].started = pc == 0;
+		(void) pthread_mutex_unlock(&tq->spare_lock);
+
+		if(pc != 0) {
 			ret = QTEPTCREATE;
 		} else {
+			QTPROBE2(thread_create, tq, i);
+			(void) QTATOMIC_FETCH_ADD(&tq->running, 1U,
+					QTATOMIC_RELAXED);
+
 			if(started != NULL)
 				++*started;
 		}
 	}
 
+	(void) pthread_attr_destroy(&attr);
 	return ret;
 }
 
 /*
- * This procedure stops the threads in a given pool. The threads are
- * stopped by canceling them. If the value of join is not zero, the
- * threads are joined and the procedure blocks until all the threads
- * have terminated. Otherwise, the threads are detached and the
- * procedure does not block. This procedure always succeeds. The value
- * of tq must not be NULL.
+ * This procedure stops the threads in a given pool, including its spare
+ * workers. It first waits for the spare workers which are starting or
+ * retiring, so that none of them uses the pool once the procedure
+ * returns, and for the broadcasts which are being submitted. The
+ * threads are stopped by canceling them. A worker which is
+ * cancelled while it runs a task stops without running the rest of its
+ * batch; those tasks are reported to the drop hook of the function
+ * queue, and a worker only pops more than one task at a time if the
+ * queue has one. If the value of join is not zero, the threads are
+ * joined and the procedure blocks until all the threads have
+ * terminated, and the tasks left in the inboxes of the workers are
+ * discarded as described for fqdiscard() on the function queue.
+ * Otherwise, the threads are detached and the procedure does not block.
+ * This procedure always succeeds. The value of tq must
+ * not be NULL.
  */
 enum qterror
 qtstop(struct qtpool* tq, int join)
 {
+	struct qtspare* spares = NULL;
 	unsigned int i = 0;
 
 	assert(tq != NULL);
+	(void) pthread_mutex_lock(&tq->spare_lock);
+	tq->stopping = 1;
+
+	while(tq->unlisted > 0 || tq->broadcasting > 0)
+		(void) pthread_cond_wait(&tq->spare_done, &tq->spare_lock);
+
+	spares = tq->spares;
+	tq->spares = NULL;
+	tq->nspares = 0;
+	(void) update_surplus(tq);
+	(void) pthread_mutex_unlock(&tq->spare_lock);
+
+	while(spares != NULL) {
+		struct qtspare* next = spares->next;
+
+		if(pthread_cancel(spares->thread) == 0 && join)
+			(void) pthread_join(spares->thread, NULL);
+		else
+			(void) pthread_detach(spares->thread);
+
+		free(spares);
+		spares = next;
+	}
 
 	for(i = 0; i < tq->max_threads; ++i) {
-		int pc = pthread_cancel(tq->threads[i]);
+		int started = 0;
+		int pc = 0;
+
+		(void) pthread_mutex_lock(&tq->spare_lock);
+		started = tq->inboxes[i].started;
+		tq->inboxes[i].started = 0;
+		(void) pthread_mutex_unlock(&tq->spare_lock);
+
+		/* a worker whose thread failed to start has nothing to stop */
+		if(!started)
+			continue;
+
+		pc = pthread_cancel(tq->threads[i]);
 
 		if(join) {
-			if(pc == 0)
+			if(pc == 0) {
 				(void) pthread_join(tq->threads[i], NULL);
-			else
+				discard_inbox(tq, &tq->inboxes[i]);
+			} else {
 				(void) pthread_detach(tq->threads[i]);
+			}
 		}
+
+		QTPROBE2(thread_exit, tq, i);
 	}
 
+	QTATOMIC_STORE(&tq->running, 0U, QTATOMIC_RELAXED);
 	return QTSUCCESS;
 }
 
@@ -178,3 +1520,491 @@ qtstart_get_e(struct qtpool* tq, size_t n, int* out)
 	return QTSUCCESS;
 }
 
+
+/*
+ * This procedure registers handler as the batch handler of the function
+ * func. A worker which pops consecutive calls to func then calls
+ * handler once with the array of their arguments and its length
+ * instead of calling func for each of them. Workers only pop several
+ * calls at once if the function queue has a drop hook, as described
+ * for qtstop(). Registering a handler for a function which has one
+ * replaces it. If the value of handler is NULL, the batch handler of
+ * func is removed. Batch handlers must be registered before the pool is
+ * started. The procedure returns an error code to indicate its status.
+ * The value of tq must not be NULL. The value of func must not be NULL.
+ */
+enum qterror
+qtsetbatch(struct qtpool* tq, void (*func)(void*),
+		void (*handler)(void**, size_t))
+{
+	struct qtbatchhandler* handlers = NULL;
+	size_t i = 0;
+
+	assert(tq != NULL);
+	assert(func != NULL);
+
+	for(i = 0; i < tq->nbatch_handlers; ++i)
+		if(tq->batch_handlers[i].func == func)
+			break;
+
+	if(i < tq->nbatch_handlers) {
+		if(handler != NULL)
+			tq->batch_handlers[i].handler = handler;
+		else
+			tq->batch_handlers[i] =
+					tq->batch_handlers[--tq->nbatch_handlers];
+
+		return QTSUCCESS;
+	}
+
+	if(handler == NULL)
+		return QTSUCCESS;
+
+	handlers = realloc(tq->batch_handlers, (tq->nbatch_handlers + 1)
+			* sizeof(*handlers));
+
+	if(handlers == NULL)
+		return QTEMALLOC;
+
+	handlers[tq->nbatch_handlers].func = func;
+	handlers[tq->nbatch_handlers].handler = handler;
+	tq->batch_handlers = handlers;
+	++tq->nbatch_handlers;
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure sets the profiler which records the tasks run by the
+ * pool to p, or stops profiling if the value of p is NULL. While the
+ * pool has a profiler, the function queue stamps pushed elements with
+ * their enqueue time so that the time spent waiting in the queue is
+ * recorded as well. The profiler must be set before the pool is started
+ * and must be removed before the pool is destroyed if the function
+ * queue outlives the pool. The procedure returns an error code to
+ * indicate its status. The value of tq must not be NULL.
+ */
+enum qterror
+qtsetprofile(struct qtpool* tq, struct qtprofile* p)
+{
+	enum qterror ret = QTSUCCESS;
+
+	assert(tq != NULL);
+
+	if(p != NULL && tq->profile == NULL)
+		ret = fqsettimestamps(tq->fq, 1);
+	else if(p == NULL && tq->profile != NULL)
+		ret = fqsettimestamps(tq->fq, 0);
+
+	if(ret == QTSUCCESS)
+		tq->profile = p;
+
+	return ret;
+}
+
+/*
+ * This procedure sets the reactor which the idle workers of the pool tq
+ * poll to r, or stops them polling if the value of r is NULL. Before a
+ * worker waits for tasks, it polls the reactor without waiting if the
+ * function queue of the pool is empty, so that the callbacks of ready
+ * descriptors are queued without waking the polling thread of the
+ * reactor. One worker polls at a time. Workers which already wait for
+ * tasks do not poll, so the polling thread should still be started
+ * unless tasks arrive often. The reactor must be set before the pool is
+ * started and must outlive it. This procedure always succeeds. The
+ * value of tq must not be NULL.
+ */
+enum qterror
+qtsetreactor(struct qtpool* tq, struct qtreactor* r)
+{
+	assert(tq != NULL);
+	tq->reactor = r;
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure initializes the worker attributes attr to the defaults
+ * of the system, without hooks. The value of attr must not be NULL.
+ */
+void
+qtworkerattrinit(struct qtworkerattr* attr)
+{
+	assert(attr != NULL);
+	attr->stack_size = 0;
+	attr->guard_size = QTPOOL_DEFAULT_GUARD;
+	attr->sched_policy = -1;
+	attr->sched_priority = 0;
+	attr->name = NULL;
+	attr->init = NULL;
+	attr->teardown = NULL;
+	attr->arg = NULL;
+}
+
+/*
+ * This procedure sets the attributes of the worker threads of the pool
+ * tq to a copy of attr. The string of the name must outlive the pool.
+ * The attributes must be set before the pool is started. The procedure
+ * returns QTEINVALID, and keeps the previous attributes, if the system
+ * rejects one of them. Otherwise, it returns an error code to indicate
+ * its status. The value of tq must not be NULL. The value of attr must
+ * not be NULL.
+ */
+enum qterror
+qtsetworkerattr(struct qtpool* tq, const struct qtworkerattr* attr)
+{
+	struct qtworkerattr previous;
+	pthread_attr_t checked;
+	enum qterror ret = QTSUCCESS;
+
+	assert(tq != NULL);
+	assert(attr != NULL);
+	previous = tq->attr;
+	tq->attr = *attr;
+	ret = make_attr(tq, &checked);
+
+	if(ret != QTSUCCESS) {
+		tq->attr = previous;
+		return ret;
+	}
+
+	(void) pthread_attr_destroy(&checked);
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure fills in the values pointed to by v with the counters
+ * of the pool pointed to by arg and of its function queue. It reads the
+ * counters without locking, so it is suitable as the collect function of
+ * qtmetricsstart(). The value of arg must not be NULL. The value of v
+ * must not be NULL.
+ */
+void
+qtpoolmetrics(void* arg, struct qtmetricsvalues* v)
+{
+	struct qtpool* tq = arg;
+
+	assert(tq != NULL);
+	assert(v != NULL);
+	v->depth = fqsize(tq->fq);
+	v->executed = QTATOMIC_LOAD(&tq->executed, QTATOMIC_RELAXED);
+	v->idle = QTATOMIC_LOAD(&tq->idle, QTATOMIC_RELAXED);
+	v->rejected = QTATOMIC_LOAD(&tq->fq->rejected, QTATOMIC_RELAXED);
+	v->threads = QTATOMIC_LOAD(&tq->running, QTATOMIC_RELAXED);
+}
+
+/*
+ * This procedure marks the start of a region of a task in which the
+ * calling worker may block, for example on I/O or on a lock. While
+ * workers are inside such regions, the pool starts spare workers, up to
+ * QTPOOL_MAX_SPARES, so that the number of workers which can run tasks
+ * stays at the size of the pool. A spare worker exits once it is no
+ * longer needed. Each call must be paired with a call to
+ * qtblockingend() by the same task, and regions must not be nested.
+ * The procedure returns QTEINVALID if the calling thread is not a
+ * worker of a pool. Otherwise, it returns an error code to indicate its
+ * status; an error only means that no spare worker could be started,
+ * and qtblockingend() must still be called.
+ */
+enum qterror
+qtblockingbegin(void)
+{
+	struct qtworker* self = NULL;
+	struct qtpool* tq = NULL;
+	int start = 0;
+
+	if(pthread_once(&worker_key_once, create_worker_key) != 0
+			|| worker_key_error != 0)
+		return QTEINVALID;
+
+	self = pthread_getspecific(worker_key);
+
+	if(self == NULL)
+		return QTEINVALID;
+
+	tq = self->pool;
+
+	if(pthread_mutex_lock(&tq->spare_lock) != 0)
+		return QTEPTMLOCK;
+
+	++self->blocked;
+	++tq->blocked;
+
+	if(!tq->stopping && tq->nspares < QTPOOL_MAX_SPARES
+			&& QTATOMIC_LOAD(&tq->running, QTATOMIC_RELAXED)
+			< tq->max_threads + tq->blocked) {
+		/* the spare is counted now and started without the lock */
+		++tq->nspares;
+		++tq->unlisted;
+		(void) QTATOMIC_FETCH_ADD(&tq->running, 1U, QTATOMIC_RELAXED);
+		start = 1;
+	}
+
+	(void) update_surplus(tq);
+	(void) pthread_mutex_unlock(&tq->spare_lock);
+	return start ? start_spare(tq) : QTSUCCESS;
+}
+
+/*
+ * This procedure marks the end of a region started by qtblockingbegin().
+ * Spare workers which are no longer needed exit after their current
+ * tasks, and idle ones are woken to exit. The procedure returns
+ * QTEINVALID if the calling thread is not a worker of a pool or is not
+ * in a region. Otherwise, it returns an error code to indicate its
+ * status.
+ */
+enum qterror
+qtblockingend(void)
+{
+	struct qtworker* self = NULL;
+	struct qtpool* tq = NULL;
+	enum qterror ret = QTSUCCESS;
+	int wake = 0;
+
+	if(pthread_once(&worker_key_once, create_worker_key) != 0
+			|| worker_key_error != 0)
+		return QTEINVALID;
+
+	self = pthread_getspecific(worker_key);
+
+	if(self == NULL)
+		return QTEINVALID;
+
+	tq = self->pool;
+
+	if(pthread_mutex_lock(&tq->spare_lock) != 0)
+		return QTEPTMLOCK;
+
+	if(self->blocked == 0) {
+		ret = QTEINVALID;
+	} else {
+		--self->blocked;
+		--tq->blocked;
+		wake = update_surplus(tq);
+	}
+
+	(void) pthread_mutex_unlock(&tq->spare_lock);
+
+	if(wake)
+		(void) fqwakepoppers(tq->fq);
+
+	return ret;
+}
+
+/*
+ * This procedure pushes a task which calls func with arg onto the inbox
+ * of the worker of index worker in the pool tq, so that only that
+ * worker runs it. The worker runs the tasks of its inbox in order,
+ * before it pops more tasks from the function queue, and is woken if it
+ * waits for tasks. If the value of block is non-zero, the procedure
+ * waits for room in the inbox; a worker must not wait for room in its
+ * own inbox. The procedure returns QTEINVALID if there is no worker of
+ * that index. Otherwise, it returns an error code to indicate its
+ * status. The value of tq must not be NULL. The value of func must not
+ * be NULL.
+ */
+enum qterror
+qtsubmitto(struct qtpool* tq, size_t worker, void (*func)(void*), void* arg,
+		int block)
+{
+	struct qtinbox* inbox = NULL;
+	struct function_queue* fq = NULL;
+	enum qterror ret = QTSUCCESS;
+
+	assert(tq != NULL);
+	assert(func != NULL);
+
+	if(worker >= tq->max_threads)
+		return QTEINVALID;
+
+	inbox = &tq->inboxes[worker];
+	ret = open_inbox(tq, inbox, &fq);
+
+	if(ret == QTSUCCESS)
+		ret = fqpush(fq, func, arg, block);
+
+	if(ret != QTSUCCESS)
+		return ret;
+
+	/* either the worker sees the task or this sees it waiting */
+	QTATOMIC_STORE(&inbox->pending, 1U, QTATOMIC_SEQ_CST);
+
+	/* the worker waits alone on its pending flag */
+	if(QTATOMIC_LOAD(&inbox->idle, QTATOMIC_SEQ_CST) != 0)
+		ret = fqwakepopper(tq->fq, &inbox->pending);
+
+	return ret;
+}
+
+/*
+ * This procedure runs func with arg exactly once on every running worker
+ * of the pool tq through their inboxes, for example to flush or
+ * reconfigure their thread local state. Spare workers and workers whose
+ * thread failed to start do not run it. If the value of wait is
+ * non-zero, the procedure blocks until every running worker has run it,
+ * which a worker of the pool must not do, or until the pool is stopped
+ * and joined and the workers which did not run it have discarded it. A
+ * worker of the pool does not wait for room
+ * in the inboxes either. The procedure returns QTEINVALID if a worker
+ * of the pool waits, or if the pool is not running. Otherwise, it
+ * returns an error code to indicate its status; if the task could not
+ * be submitted to some worker, the other workers still run it. The
+ * value of tq must not be NULL. The value of func must not be NULL.
+ */
+enum qterror
+qtbroadcast(struct qtpool* tq, void (*func)(void*), void* arg, int wait)
+{
+	const struct qtworker* self = NULL;
+	struct qtbroadcast* b = NULL;
+	enum qterror ret = QTSUCCESS;
+	size_t started = 0;
+	size_t i = 0;
+	int worker = 0;
+
+	assert(tq != NULL);
+	assert(func != NULL);
+	self = pthread_getspecific(worker_key);
+	worker = self != NULL && self->pool == tq;
+
+	if(wait && worker)
+		return QTEINVALID;
+
+	b = malloc(sizeof(*b));
+
+	if(b == NULL)
+		return QTEMALLOC;
+
+	b->func = func;
+	b->arg = arg;
+	b->remaining = tq->max_threads;
+	b->refs = tq->max_threads + (wait != 0);
+
+	if(pthread_mutex_init(&b->lock, NULL) != 0) {
+		free(b);
+		return QTEPTMINIT;
+	}
+
+	if(pthread_cond_init(&b->done, NULL) != 0) {
+		(void) pthread_mutex_destroy(&b->lock);
+		free(b);
+		return QTEPTCINIT;
+	}
+
+	if(pthread_mutex_lock(&tq->spare_lock) != 0) {
+		ret = QTEPTMLOCK;
+	} else {
+		/* qtstop() waits until the task is in the inboxes */
+		for(i = 0; !tq->stopping && i < tq->max_threads; ++i)
+			if(tq->inboxes[i].started)
+				++started;
+
+		if(started == 0)
+			ret = QTEINVALID;
+		else
+			++tq->broadcasting;
+
+		(void) pthread_mutex_unlock(&tq->spare_lock);
+	}
+
+	if(ret != QTSUCCESS) {
+		(void) pthread_cond_destroy(&b->done);
+		(void) pthread_mutex_destroy(&b->lock);
+		free(b);
+		return ret;
+	}
+
+	for(i = 0; i < tq->max_threads; ++i) {
+		enum qterror err = QTEINVALID;
+
+		if(is_started(tq, i)) {
+			err = qtsubmitto(tq, i, run_broadcast, b, !worker);
+
+			if(err != QTSUCCESS)
+				ret = err;
+		}
+
+		/* a worker which did not get the task is done with it */
+		if(err != QTSUCCESS)
+			release_broadcast(b, 1);
+	}
+
+	(void) pthread_mutex_lock(&tq->spare_lock);
+	--tq->broadcasting;
+	(void) pthread_cond_broadcast(&tq->spare_done);
+	(void) pthread_mutex_unlock(&tq->spare_lock);
+
+	if(wait) {
+		(void) pthread_mutex_lock(&b->lock);
+
+		while(b->remaining > 0)
+			(void) pthread_cond_wait(&b->done, &b->lock);
+
+		(void) pthread_mutex_unlock(&b->lock);
+		release_broadcast(b, 0);
+	}
+
+	return ret;
+}
+
+/*
+ * This procedure pushes a task which calls func with arg onto the
+ * function queue of the pool tq, to run only if a worker starts it
+ * before the absolute time deadline on the monotonic clock. A task
+ * whose deadline has passed is shed instead, and expired is called with
+ * arg if it is not NULL, so that no worker spends time on work which is
+ * no longer wanted. The task is also shed this way if the queue drops
+ * it. A token is queued for the task, and the worker which pops any
+ * such token runs the queued task with the earliest deadline, so the
+ * tasks with deadlines run in the order of their deadlines. Profilers,
+ * probes and batch handlers see func, or expired for a shed task. If
+ * the value of block is non-zero, the procedure waits for room in the
+ * queue. The procedure returns an error code to indicate its status.
+ * The value of tq must not be NULL. The value of func must not be NULL.
+ * The value of deadline must not be NULL.
+ */
+enum qterror
+qtpushdeadline(struct qtpool* tq, void (*func)(void*), void* arg,
+		const struct timespec* deadline, void (*expired)(void*),
+		int block)
+{
+	struct qtdeadline* d = NULL;
+	enum qterror ret = QTSUCCESS;
+	int taken = 0;
+
+	assert(tq != NULL);
+	assert(func != NULL);
+	assert(deadline != NULL);
+	d = malloc(sizeof(*d));
+
+	if(d == NULL)
+		return QTEMALLOC;
+
+	d->func = func;
+	d->arg = arg;
+	d->expired = expired;
+	d->deadline = *deadline;
+	d->pool = tq;
+	d->index = QTPOOL_NOT_HEAPED;
+	d->pushing = 1;
+	d->taken = 0;
+
+	/* the task only joins the heap once its token is queued */
+	ret = fqpush(tq->fq, run_deadline, d, block);
+
+	if(ret != QTSUCCESS) {
+		free(d);
+		return ret;
+	}
+
+	(void) pthread_mutex_lock(&tq->deadline_lock);
+	d->pushing = 0;
+	taken = d->taken;
+
+	if(!taken)
+		heap_deadline(tq, d);
+
+	(void) pthread_mutex_unlock(&tq->deadline_lock);
+
+	if(taken)
+		free(d);
+
+	return ret;
+}
@@ -19,8 +19,12 @@
 #define THREADING_QUEUE_H
 
 #include <pthread.h>
+#include <time.h>
 
 #include "function_queue.h"
+#include "qtmetrics.h"
+#include "qtprofile.h"
+#include "qtreactor.h"
 
 /*
  * This structure holds the list of errors which occurred durring the
@@ -42,6 +46,50 @@ struct qtpool_startup_info {
 	size_t max_threads;
 };
 
+/* the guard size which leaves the default of the system in place */
+#define QTPOOL_DEFAULT_GUARD ((size_t) -1)
+
+/*
+ * This structure holds the attributes of the worker threads of a pool.
+ * It is initialized to the defaults of the system by qtworkerattrinit().
+ * The member stack_size is the size of the stack of each worker, or 0
+ * for the default. The member guard_size is the size of the guard area
+ * below it, or QTPOOL_DEFAULT_GUARD for the default. If the member
+ * sched_policy is not -1, the workers run with that scheduling policy
+ * and the priority sched_priority instead of inheriting them. The
+ * member name is the prefix of the names of the workers, which are
+ * truncated to the limit of the system. The member init is called by
+ * each worker with its index and the member arg before it runs any
+ * task, and the member teardown is called likewise when the worker
+ * exits or is cancelled. Spare workers are given the size of the pool
+ * as their index. The members init and teardown may be NULL.
+ */
+struct qtworkerattr {
+	size_t stack_size;
+	size_t guard_size;
+	int sched_policy;
+	int sched_priority;
+	const char* name;
+	void (* init)(size_t, void*);
+	void (* teardown)(size_t, void*);
+	void* arg;
+};
+
+/*
+ * This structure pairs a function with the handler which runs a group of
+ * its calls at once. The member func is the function which is pushed
+ * onto the queue. The member handler is called with the array of the
+ * arguments of consecutive queued calls to func and their number.
+ */
+struct qtbatchhandler {
+	void (* func)(void*);
+	void (* handler)(void**, size_t);
+};
+
+struct qtspare;
+struct qtinbox;
+struct qtdeadline;
+
 /*
  * This structure holds the actual pool information and data. The member
  * start_errors holds information about the errors which occurred while
@@ -49,13 +97,58 @@ struct qtpool_startup_info {
  * structure which the pool uses. The member threads holds the address
  * of the array of threads which are used in the pool. The member
  * max_threads is the maximum number of threads which will be started
- * for the pool.
+ * for the pool. The member batch_handlers holds the address of the array
+ * of nbatch_handlers registered batch handlers. The member profile
+ * points to the profiler which records the tasks run by the pool, or is
+ * NULL. The member reactor points to the reactor which the idle
+ * workers poll, or is NULL. The members executed, idle and running
+ * count the tasks which were run, the workers waiting for tasks and the
+ * started workers. The member spares is the list of the nspares spare workers which stand in
+ * for the blocked workers inside blocking regions. The member blocked
+ * counts the workers inside blocking regions. The member surplus is
+ * non-zero while a spare worker is no longer needed, which wakes the
+ * idle spare workers so that one of them exits. The member stopping is
+ * non-zero while the pool is stopped, so that no more spare workers are
+ * started. The member unlisted counts the spare workers which are
+ * starting or retiring and so are not in the list, and the member
+ * broadcasting counts the calls to qtbroadcast() which are submitting
+ * their task; qtstop() waits for both with the condition variable
+ * spare_done. The member spare_lock guards the spares, the members
+ * blocked, surplus, stopping, unlisted and broadcasting, and whether
+ * each worker is started. The member inboxes holds the address of the array of the
+ * private inboxes of the workers. The member attr holds the attributes
+ * of the worker threads. The member deadlines holds the address of the
+ * heap of the ndeadlines queued tasks with deadlines, earliest first,
+ * which has room for deadlines_size tasks. The member deadline_lock
+ * guards the heap and the tasks in it.
  */
 struct qtpool {
 	struct qtstart_errors_info start_errors;
 	struct function_queue* fq;
 	pthread_t* threads;
 	size_t max_threads;
+	struct qtbatchhandler* batch_handlers;
+	size_t nbatch_handlers;
+	struct qtprofile* profile;
+	struct qtreactor* reactor;
+	unsigned long executed;
+	unsigned int idle;
+	unsigned int running;
+	pthread_mutex_t spare_lock;
+	struct qtspare* spares;
+	unsigned int nspares;
+	unsigned int blocked;
+	unsigned int surplus;
+	int stopping;
+	unsigned int unlisted;
+	unsigned int broadcasting;
+	pthread_cond_t spare_done;
+	struct qtinbox* inboxes;
+	struct qtworkerattr attr;
+	struct qtdeadline** deadlines;
+	size_t ndeadlines;
+	size_t deadlines_size;
+	pthread_mutex_t deadline_lock;
 };
 
 #ifdef __cplusplus
@@ -68,6 +161,19 @@ enum qterror qtdestroy(struct qtpool*);
 enum qterror qtstart(struct qtpool*, int*);
 enum qterror qtstop(struct qtpool*, int);
 enum qterror qtstart_get_e(struct qtpool*, size_t, int*);
+enum qterror qtsetbatch(struct qtpool*, void (*)(void*),
+		void (*)(void**, size_t));
+enum qterror qtsetprofile(struct qtpool*, struct qtprofile*);
+enum qterror qtsetreactor(struct qtpool*, struct qtreactor*);
+void qtworkerattrinit(struct qtworkerattr*);
+enum qterror qtsetworkerattr(struct qtpool*, const struct qtworkerattr*);
+void qtpoolmetrics(void*, struct qtmetricsvalues*);
+enum qterror qtblockingbegin(void);
+enum qterror qtblockingend(void);
+enum qterror qtsubmitto(struct qtpool*, size_t, void (*)(void*), void*, int);
+enum qterror qtbroadcast(struct qtpool*, void (*)(void*), void*, int);
+enum qterror qtpushdeadline(struct qtpool*, void (*)(void*), void*,
+		const struct timespec*, void (*)(void*), int);
 
 #ifdef __cplusplus
 }
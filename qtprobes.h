@@ -0,0 +1,55 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef QTPROBES_H
+#define QTPROBES_H
+
+/*
+ * These macros mark static probe points for tracers such as bpftrace
+ * and perf. They are only for use inside the library. If QT_USDT is
+ * defined, each point is a USDT probe in the provider qthreads, which
+ * is a single nop until a tracer attaches to it. This needs the header
+ * sys/sdt.h from SystemTap, and is turned on with 'make USDT=1'.
+ * Otherwise, the points compile to nothing. The probes are:
+ *
+ * fq_push(q, func, depth)       an element was added to a queue
+ * fq_pop(q, func, depth)        an element was removed from a queue
+ * fq_park(q)                    a thread waits for an element
+ * fq_unpark(q)                  a thread stopped waiting for an element
+ * task_begin(pool, func, arg)   a worker calls a function
+ * task_end(pool, func)          the function returned
+ * batch_begin(pool, func, n)    a worker calls a batch handler
+ * batch_end(pool, func, n)      the batch handler returned
+ * thread_create(pool, index)    a worker thread was started
+ * thread_exit(pool, index)      a worker thread was stopped
+ *
+ * The depth is the number of elements in the queue afterwards. For the
+ * concurrent queue types, it is counted as described for fqsize(), so
+ * it may include changes by other threads.
+ */
+#if defined(QT_USDT)
+#include <sys/sdt.h>
+
+#define QTPROBE1(name, a) DTRACE_PROBE1(qthreads, name, a)
+#define QTPROBE2(name, a, b) DTRACE_PROBE2(qthreads, name, a, b)
+#define QTPROBE3(name, a, b, c) DTRACE_PROBE3(qthreads, name, a, b, c)
+#else
+#define QTPROBE1(name, a) ((void) 0)
+#define QTPROBE2(name, a, b) ((void) 0)
+#define QTPROBE3(name, a, b, c) ((void) 0)
+#endif
+
+#endif
@@ -0,0 +1,484 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <time.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "qtprofile.h"
+#include "function_queue_element.h"
+#include "qterror.h"
+
+/* the number of entries a thread table starts with; a power of two */
+#define QTPROFILE_MIN_CAPACITY 16
+
+/*
+ * This structure holds the statistics recorded by one thread. It is a
+ * hash table keyed by the function, with linear probing, which is kept
+ * at most half full; an entry whose function is NULL is free. The
+ * member owner is the profiler the table belongs to, and the member
+ * next is the next table of the profiler. The member lock is only
+ * contended while the tables are merged. The member entries is a
+ * pointer to the array of capacity entries, where the value of capacity
+ * is a power of two. The member count is the number of entries in use.
+ */
+struct qtprofiletable {
+	struct qtprofile* owner;
+	struct qtprofiletable* next;
+	pthread_mutex_t lock;
+	struct qtprofilestats* entries;
+	unsigned int capacity;
+	unsigned int count;
+};
+
+static enum qterror get_table(struct qtprofile*, struct qtprofiletable**);
+static void free_table(struct qtprofiletable*);
+static enum qterror find_entry(struct qtprofilestats**, unsigned int*,
+		unsigned int*, void (*)(void*), struct qtprofilestats**);
+static unsigned int home_slot(void (*)(void*), unsigned int);
+static unsigned long elapsed_nsec(const struct timespec*,
+		const struct timespec*);
+static int compare_total_run(const void*, const void*);
+
+/*
+ * This procedure initializes a profiler without any statistics. The
+ * procedure returns an error code to indicate its status. The value of
+ * p must not be NULL.
+ */
+enum qterror
+qtprofileinit(struct qtprofile* p)
+{
+	assert(p != NULL);
+	p->tables = NULL;
+
+	if(pthread_mutex_init(&p->lock, NULL) != 0)
+		return QTEPTMINIT;
+
+	/* the tables outlive their threads until they are merged */
+	if(pthread_key_create(&p->key, NULL) != 0) {
+		/* ignore more errors at this point */
+		(void) pthread_mutex_destroy(&p->lock);
+		return QTEPTKCREATE;
+	}
+
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure destroys the given profiler and the tables of all
+ * threads. No thread may record statistics while or after it is
+ * destroyed. The procedure returns an error code to indicate its
+ * status. The value of p must not be NULL.
+ */
+enum qterror
+qtprofiledestroy(struct qtprofile* p)
+{
+	enum qterror ret = QTSUCCESS;
+
+	assert(p != NULL);
+
+	if(pthread_mutex_lock(&p->lock) != 0)
+		return QTEPTMLOCK;
+
+	while(p->tables != NULL) {
+		struct qtprofiletable* t = p->tables;
+
+		p->tables = t->next;
+		free_table(t);
+	}
+
+	(void) pthread_mutex_unlock(&p->lock);
+	(void) pthread_key_delete(p->key);
+
+	if(pthread_mutex_destroy(&p->lock) != 0)
+		ret = QTEPTMDESTROY;
+
+	return ret;
+}
+
+/*
+ * This procedure records one run of the function of the first of the n
+ * given elements, which all share it, in the table of the calling
+ * thread. The run started at the time pointed to by start and ended at
+ * the time pointed to by end, both on the monotonic clock. The queue
+ * wait of each element with an enqueue timestamp is measured up to the
+ * start. The procedure returns an error code to indicate its status.
+ * The value of p must not be NULL. The value of elements must not be
+ * NULL. The value of n must be greater than 0. The values of start and
+ * end must not be NULL.
+ */
+enum qterror
+qtprofilerecord(struct qtprofile* p,
+		const struct function_queue_element* elements, size_t n,
+		const struct timespec* start, const struct timespec* end)
+{
+	struct qtprofiletable* t = NULL;
+	struct qtprofilestats* s = NULL;
+	enum qterror ret = QTSUCCESS;
+	unsigned long run = 0;
+	size_t i = 0;
+
+	assert(p != NULL);
+	assert(elements != NULL);
+	assert(n > 0);
+	assert(start != NULL);
+	assert(end != NULL);
+	ret = get_table(p, &t);
+
+	if(ret != QTSUCCESS)
+		return ret;
+
+	run = elapsed_nsec(start, end);
+
+	if(pthread_mutex_lock(&t->lock) != 0)
+		return QTEPTMLOCK;
+
+	ret = find_entry(&t->entries, &t->capacity, &t->count,
+			elements[0].func, &s);
+
+	if(ret == QTSUCCESS) {
+		s->calls += n;
+		s->total_run += run;
+
+		if(run > s->max_run)
+			s->max_run = run;
+
+		for(i = 0; i < n; ++i) {
+			const struct timespec* e = &elements[i].enqueued;
+
+			if(e->tv_sec == 0 && e->tv_nsec == 0)
+				continue;
+
+			s->total_wait += elapsed_nsec(e, start);
+			++s->waited;
+		}
+	}
+
+	(void) pthread_mutex_unlock(&t->lock);
+	return ret;
+}
+
+/*
+ * This procedure merges the tables of all threads into a new array of
+ * statistics, one element per function, sorted by the total run time
+ * from the largest. The address of the array is stored in the variable
+ * pointed to by stats and its length in the variable pointed to by n.
+ * The array must be freed with free(). The procedure returns an error
+ * code to indicate its status. The value of p must not be NULL. The
+ * value of stats must not be NULL. The value of n must not be NULL.
+ */
+enum qterror
+qtprofilesnapshot(struct qtprofile* p, struct qtprofilestats** stats,
+		size_t* n)
+{
+	struct qtprofilestats* merged = NULL;
+	struct qtprofilestats* out = NULL;
+	struct qtprofiletable* t = NULL;
+	enum qterror ret = QTSUCCESS;
+	unsigned int capacity = QTPROFILE_MIN_CAPACITY;
+	unsigned int count = 0;
+	unsigned int i = 0;
+	size_t j = 0;
+
+	assert(p != NULL);
+	assert(stats != NULL);
+	assert(n != NULL);
+	merged = calloc(capacity, sizeof(*merged));
+
+	if(merged == NULL)
+		return QTEMALLOC;
+
+	if(pthread_mutex_lock(&p->lock) != 0) {
+		free(merged);
+		return QTEPTMLOCK;
+	}
+
+	for(t = p->tables; t != NULL && ret == QTSUCCESS; t = t->next) {
+		if(pthread_mutex_lock(&t->lock) != 0) {
+			ret = QTEPTMLOCK;
+			break;
+		}
+
+		for(i = 0; i < t->capacity && ret == QTSUCCESS; ++i) {
+			const struct qtprofilestats* from = &t->entries[i];
+			struct qtprofilestats* to = NULL;
+
+			if(from->func == NULL)
+				continue;
+
+			ret = find_entry(&merged, &capacity, &count,
+					from->func, &to);
+
+			if(ret != QTSUCCESS)
+				break;
+
+			to->calls += from->calls;
+			to->total_run += from->total_run;
+			to->total_wait += from->total_wait;
+			to->waited += from->waited;
+
+			if(from->max_run > to->max_run)
+				to->max_run = from->max_run;
+		}
+
+		(void) pthread_mutex_unlock(&t->lock);
+	}
+
+	(void) pthread_mutex_unlock(&p->lock);
+
+	if(ret == QTSUCCESS && count > 0) {
+		out = malloc(count * sizeof(*out));
+
+		if(out == NULL)
+			ret = QTEMALLOC;
+	}
+
+	if(ret != QTSUCCESS) {
+		free(merged);
+		return ret;
+	}
+
+	for(i = 0; i < capacity; ++i)
+		if(merged[i].func != NULL)
+			out[j++] = merged[i];
+
+	free(merged);
+
+	if(count > 0)
+		qsort(out, count, sizeof(*out), compare_total_run);
+
+	*stats = out;
+	*n = count;
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure gets the table of the calling thread, creating it the
+ * first time the thread asks for it. The address of the table is
+ * stored in the variable pointed to by out. The procedure returns an
+ * error code to indicate its status. The value of p must not be NULL.
+ * The value of out must not be NULL.
+ */
+static enum qterror
+get_table(struct qtprofile* p, struct qtprofiletable** out)
+{
+	struct qtprofiletable* t = NULL;
+
+	assert(p != NULL);
+	assert(out != NULL);
+	t = pthread_getspecific(p->key);
+
+	if(t != NULL) {
+		*out = t;
+		return QTSUCCESS;
+	}
+
+	t = malloc(sizeof(*t));
+
+	if(t == NULL)
+		return QTEMALLOC;
+
+	t->entries = calloc(QTPROFILE_MIN_CAPACITY, sizeof(*t->entries));
+
+	if(t->entries == NULL) {
+		free(t);
+		return QTEMALLOC;
+	}
+
+	if(pthread_mutex_init(&t->lock, NULL) != 0) {
+		free(t->entries);
+		free(t);
+		return QTEPTMINIT;
+	}
+
+	t->owner = p;
+	t->capacity = QTPROFILE_MIN_CAPACITY;
+	t->count = 0;
+
+	if(pthread_setspecific(p->key, t) != 0) {
+		free_table(t);
+		return QTEPTSETSPECIFIC;
+	}
+
+	if(pthread_mutex_lock(&p->lock) != 0) {
+		(void) pthread_setspecific(p->key, NULL);
+		free_table(t);
+		return QTEPTMLOCK;
+	}
+
+	t->next = p->tables;
+	p->tables = t;
+	(void) pthread_mutex_unlock(&p->lock);
+	*out = t;
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure frees the thread table t. The value of t must not be
+ * NULL.
+ */
+static void
+free_table(struct qtprofiletable* t)
+{
+	assert(t != NULL);
+	(void) pthread_mutex_destroy(&t->lock);
+	free(t->entries);
+	free(t);
+}
+
+/*
+ * This procedure finds the entry of the function func in the hash table
+ * pointed to by entries, adding a zeroed entry if there is none. The
+ * table has the capacity pointed to by capacity and the number of used
+ * entries pointed to by count; it is doubled first if it would be more
+ * than half full. The address of the entry is stored in the variable
+ * pointed to by out. The procedure returns an error code to indicate
+ * its status. No argument may be NULL.
+ */
+static enum qterror
+find_entry(struct qtprofilestats** entries, unsigned int* capacity,
+		unsigned int* count, void (*func)(void*),
+		struct qtprofilestats** out)
+{
+	unsigned int mask = 0;
+	unsigned int i = 0;
+
+	assert(entries != NULL);
+	assert(capacity != NULL);
+	assert(count != NULL);
+	assert(func != NULL);
+	assert(out != NULL);
+
+	if((*count + 1) * 2 > *capacity) {
+		struct qtprofilestats* old = *entries;
+		unsigned int old_capacity = *capacity;
+		unsigned int j = 0;
+
+		*entries = calloc(old_capacity * 2, sizeof(**entries));
+
+		if(*entries == NULL) {
+			*entries = old;
+			return QTEMALLOC;
+		}
+
+		*capacity = old_capacity * 2;
+		mask = *capacity - 1;
+
+		for(j = 0; j < old_capacity; ++j) {
+			if(old[j].func == NULL)
+				continue;
+
+			for(i = home_slot(old[j].func, mask);
+					(*entries)[i].func != NULL;
+					i = (i + 1) & mask)
+				;
+
+			(*entries)[i] = old[j];
+		}
+
+		free(old);
+	}
+
+	mask = *capacity - 1;
+
+	for(i = home_slot(func, mask); (*entries)[i].func != NULL;
+			i = (i + 1) & mask)
+		if((*entries)[i].func == func)
+			break;
+
+	if((*entries)[i].func == NULL) {
+		(*entries)[i].func = func;
+		++*count;
+	}
+
+	*out = &(*entries)[i];
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure calculates the slot where the probe sequence of the
+ * function func starts in a table whose capacity minus one is mask. The
+ * bytes of the pointer are hashed with FNV-1a, since a function pointer
+ * cannot be converted to an integer portably.
+ */
+static unsigned int
+home_slot(void (*func)(void*), unsigned int mask)
+{
+	const unsigned char* bytes = (const unsigned char*) &func;
+	unsigned long hash = 2166136261UL;
+	size_t i = 0;
+
+	for(i = 0; i < sizeof(func); ++i)
+		hash = ((hash ^ bytes[i]) * 16777619UL) & 0xffffffffUL;
+
+	return (unsigned int) hash & mask;
+}
+
+/*
+ * This procedure calculates the number of nanoseconds from the time
+ * pointed to by from to the time pointed to by to. The result is 0 if
+ * to is earlier than from and saturates instead of overflowing. The
+ * value of from must not be NULL. The value of to must not be NULL.
+ */
+static unsigned long
+elapsed_nsec(const struct timespec* from, const struct timespec* to)
+{
+	unsigned long sec = 0;
+	long nsec = 0;
+
+	assert(from != NULL);
+	assert(to != NULL);
+
+	if(to->tv_sec < from->tv_sec)
+		return 0;
+
+	sec = (unsigned long) (to->tv_sec - from->tv_sec);
+	nsec = to->tv_nsec - from->tv_nsec;
+
+	if(nsec < 0) {
+		if(sec == 0)
+			return 0;
+
+		--sec;
+		nsec += 1000000000L;
+	}
+
+	if(sec > (~0UL - (unsigned long) nsec) / 1000000000UL)
+		return ~0UL;
+
+	return sec * 1000000000UL + (unsigned long) nsec;
+}
+
+/*
+ * This procedure compares two statistics for qsort() so that the larger
+ * total run time comes first. The values of a and b must not be NULL.
+ */
+static int
+compare_total_run(const void* a, const void* b)
+{
+	const struct qtprofilestats* x = a;
+	const struct qtprofilestats* y = b;
+
+	assert(a != NULL);
+	assert(b != NULL);
+
+	if(x->total_run > y->total_run)
+		return -1;
+
+	return x->total_run < y->total_run;
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef QTPROFILE_H
+#define QTPROFILE_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "function_queue_element.h"
+#include "qterror.h"
+
+struct qtprofiletable;
+
+/*
+ * This structure holds the aggregated statistics of one task function.
+ * The member func is the function. The member calls is the number of
+ * calls to it. The members total_run and max_run are the sum and the
+ * largest of the run times of the calls in nanoseconds; calls passed to
+ * a batch handler together count as one run. The member total_wait is
+ * the sum of the times in nanoseconds which the calls spent in the
+ * queue, and the member waited is the number of calls it covers.
+ */
+struct qtprofilestats {
+	void (* func)(void*);
+	unsigned long calls;
+	unsigned long total_run;
+	unsigned long max_run;
+	unsigned long total_wait;
+	unsigned long waited;
+};
+
+/*
+ * This structure holds a profiler for the tasks run by thread pools.
+ * Each thread which records statistics gets its own table, so recording
+ * never contends with other workers; the tables are merged when the
+ * statistics are read. The member key is the key of the table of each
+ * thread. The member lock guards the list of tables pointed to by the
+ * member tables.
+ */
+struct qtprofile {
+	pthread_key_t key;
+	pthread_mutex_t lock;
+	struct qtprofiletable* tables;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum qterror qtprofileinit(struct qtprofile*);
+enum qterror qtprofiledestroy(struct qtprofile*);
+enum qterror qtprofilerecord(struct qtprofile*,
+		const struct function_queue_element*, size_t,
+		const struct timespec*, const struct timespec*);
+enum qterror qtprofilesnapshot(struct qtprofile*, struct qtprofilestats**,
+		size_t*);
+enum qterror qtprofilereport(struct qtprofile*, FILE*, size_t);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
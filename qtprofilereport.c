@@ -0,0 +1,91 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* dladdr() is an extension */
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <dlfcn.h>
+
+#include "qtprofile.h"
+#include "qterror.h"
+
+/*
+ * This procedure writes the statistics of at most top functions, from
+ * the one with the largest total run time, as a table to out. A value
+ * of 0 for top writes all of them. The functions are named by their
+ * symbols if the dynamic linker knows them, which needs the program to
+ * be linked with -rdynamic for symbols outside of shared objects, and by
+ * their addresses otherwise. Times are printed in microseconds. The
+ * procedure returns an error code to indicate its status. The value of
+ * p must not be NULL. The value of out must not be NULL.
+ */
+enum qterror
+qtprofilereport(struct qtprofile* p, FILE* out, size_t top)
+{
+	struct qtprofilestats* stats = NULL;
+	enum qterror ret = QTSUCCESS;
+	size_t n = 0;
+	size_t i = 0;
+
+	assert(p != NULL);
+	assert(out != NULL);
+	ret = qtprofilesnapshot(p, &stats, &n);
+
+	if(ret != QTSUCCESS)
+		return ret;
+
+	if(top == 0 || top > n)
+		top = n;
+
+	if(fprintf(out, "%12s %14s %12s %12s %12s  %s\n", "calls",
+				"total_us", "avg_us", "max_us",
+				"avg_wait_us", "function") < 0)
+		ret = QTEERRNO;
+
+	for(i = 0; i < top && ret == QTSUCCESS; ++i) {
+		const struct qtprofilestats* s = &stats[i];
+		void* addr = NULL;
+		Dl_info info;
+		int printed = 0;
+
+		/* a function pointer cannot be converted to void* portably */
+		memcpy(&addr, &s->func, sizeof(addr) < sizeof(s->func) ?
+				sizeof(addr) : sizeof(s->func));
+		printed = fprintf(out, "%12lu %14lu %12lu %12lu %12lu  ",
+				s->calls, s->total_run / 1000,
+				s->total_run / 1000 / s->calls,
+				s->max_run / 1000, s->waited == 0 ? 0 :
+				s->total_wait / 1000 / s->waited);
+
+		if(printed >= 0) {
+			if(dladdr(addr, &info) != 0 && info.dli_sname != NULL)
+				printed = fprintf(out, "%s\n", info.dli_sname);
+			else
+				printed = fprintf(out, "%p\n", addr);
+		}
+
+		if(printed < 0)
+			ret = QTEERRNO;
+	}
+
+	free(stats);
+	return ret;
+}
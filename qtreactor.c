@@ -0,0 +1,653 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "qtreactor.h"
+#include "function_queue.h"
+#include "qtatomic.h"
+#include "qterror.h"
+
+/* the largest number of events which one poll pushes at once */
+#ifndef QTREACTOR_EVENTS
+#define QTREACTOR_EVENTS 64
+#endif
+
+/*
+ * This structure holds a watched file descriptor. The member reactor is
+ * the reactor which watches it. The member next is the next watch in the
+ * list which holds it. The member callback is called with the
+ * descriptor fd, the events which occurred and the member arg. The
+ * member events is the set of events to wait for, and the member revents
+ * is the set of events passed to the queued callback. The member pending
+ * is non-zero while the callback is queued or running, and the member
+ * removed is non-zero once the watch has been removed.
+ */
+struct qtreactorwatch {
+	struct qtreactor* reactor;
+	struct qtreactorwatch* next;
+	void (* callback)(int, unsigned int, void*);
+	void* arg;
+	int fd;
+	unsigned int events;
+	unsigned int revents;
+	int pending;
+	int removed;
+};
+
+static enum qterror poll_events(struct qtreactor*, int, unsigned int*);
+static void* poll_loop(void*);
+static void dispatch(void*);
+static void drop_dispatch(struct function_queue*, void*);
+static void finish_dispatch(struct qtreactorwatch*);
+static enum qterror arm(struct qtreactorwatch*, int);
+static void unlink_watch(struct qtreactor*, struct qtreactorwatch*);
+static void free_watches(struct qtreactorwatch*);
+static void wake(struct qtreactor*);
+
+/*
+ * This procedure initializes a reactor without any watched descriptors
+ * which pushes the callbacks of ready descriptors onto the function
+ * queue fq. The procedure returns QTEERRNO if the epoll instance or the
+ * eventfd could not be created, with errno set by the failing call.
+ * Otherwise, it returns an error code to indicate its status. The value
+ * of r must not be NULL. The value of fq must not be NULL.
+ */
+enum qterror
+qtreactorinit(struct qtreactor* r, struct function_queue* fq)
+{
+	struct epoll_event ev;
+	int err = 0;
+
+	assert(r != NULL);
+	assert(fq != NULL);
+
+	if(fqregisterdrop(dispatch, drop_dispatch) != QTSUCCESS)
+		return QTEINVALID;
+
+	r->fq = fq;
+	r->watches = NULL;
+	r->graveyard = NULL;
+	r->running = 0;
+	r->stopping = 0;
+	r->epfd = epoll_create1(EPOLL_CLOEXEC);
+
+	if(r->epfd == -1)
+		return QTEERRNO;
+
+	r->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	/* no watch has a NULL address */
+	ev.data.ptr = NULL;
+
+	if(r->wakefd == -1 || epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wakefd,
+				&ev) != 0) {
+		/* close() must not hide the reason of the failure */
+		err = errno;
+
+		if(r->wakefd != -1)
+			(void) close(r->wakefd);
+
+		(void) close(r->epfd);
+		errno = err;
+		return QTEERRNO;
+	}
+
+	if(pthread_mutex_init(&r->lock, NULL) != 0) {
+		(void) close(r->wakefd);
+		(void) close(r->epfd);
+		return QTEPTMINIT;
+	}
+
+	if(pthread_mutex_init(&r->poll_lock, NULL) != 0) {
+		(void) pthread_mutex_destroy(&r->lock);
+		(void) close(r->wakefd);
+		(void) close(r->epfd);
+		return QTEPTMINIT;
+	}
+
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure stops the polling thread of the given reactor if it is
+ * running and destroys the reactor with all of its watches. No callback
+ * of the reactor may be queued or running. The procedure returns an
+ * error code to indicate its status. The value of r must not be NULL.
+ */
+enum qterror
+qtreactordestroy(struct qtreactor* r)
+{
+	enum qterror ret = QTSUCCESS;
+
+	assert(r != NULL);
+	ret = qtreactorstop(r);
+
+	if(ret != QTSUCCESS)
+		return ret;
+
+	free_watches(r->watches);
+	free_watches(r->graveyard);
+	r->watches = NULL;
+	r->graveyard = NULL;
+	(void) close(r->wakefd);
+	(void) close(r->epfd);
+
+	if(pthread_mutex_destroy(&r->poll_lock) != 0)
+		ret = QTEPTMDESTROY;
+
+	if(pthread_mutex_destroy(&r->lock) != 0)
+		ret = QTEPTMDESTROY;
+
+	return ret;
+}
+
+/*
+ * This procedure starts watching the file descriptor fd for the events
+ * in the set events. When one of them occurs, callback is pushed onto
+ * the function queue and called by a worker with fd, the events which
+ * occurred and arg. The descriptor is not watched again until the
+ * callback returns. The address of the new watch is stored in the
+ * variable pointed to by out. The descriptor must be removed from the
+ * reactor before it is closed. The procedure returns QTEERRNO if epoll
+ * rejects the descriptor. Otherwise, it returns an error code to
+ * indicate its status. The value of r must not be NULL. The value of
+ * callback must not be NULL. The value of out must not be NULL.
+ */
+enum qterror
+qtreactoradd(struct qtreactor* r, int fd, unsigned int events,
+		void (*callback)(int, unsigned int, void*), void* arg,
+		struct qtreactorwatch** out)
+{
+	struct qtreactorwatch* w = NULL;
+	enum qterror ret = QTSUCCESS;
+
+	assert(r != NULL);
+	assert(callback != NULL);
+	assert(out != NULL);
+	w = malloc(sizeof(*w));
+
+	if(w == NULL)
+		return QTEMALLOC;
+
+	w->reactor = r;
+	w->callback = callback;
+	w->arg = arg;
+	w->fd = fd;
+	w->events = events;
+	w->revents = 0;
+	w->pending = 0;
+	w->removed = 0;
+
+	if(pthread_mutex_lock(&r->lock) != 0) {
+		free(w);
+		return QTEPTMLOCK;
+	}
+
+	/* the poller cannot see the watch before it is in the list */
+	ret = arm(w, EPOLL_CTL_ADD);
+
+	if(ret == QTSUCCESS) {
+		w->next = r->watches;
+		r->watches = w;
+	}
+
+	(void) pthread_mutex_unlock(&r->lock);
+
+	if(ret != QTSUCCESS)
+		free(w);
+	else
+		*out = w;
+
+	return ret;
+}
+
+/*
+ * This procedure changes the set of events which the watch w waits for
+ * to events. If the callback of the watch is queued or running, the new
+ * set is used once it returns. The procedure returns QTEINVALID if the
+ * watch has been removed. Otherwise, it returns an error code to
+ * indicate its status. The value of r must not be NULL. The value of w
+ * must not be NULL.
+ */
+enum qterror
+qtreactormodify(struct qtreactor* r, struct qtreactorwatch* w,
+		unsigned int events)
+{
+	enum qterror ret = QTSUCCESS;
+
+	assert(r != NULL);
+	assert(w != NULL);
+
+	if(pthread_mutex_lock(&r->lock) != 0)
+		return QTEPTMLOCK;
+
+	if(w->removed) {
+		ret = QTEINVALID;
+	} else {
+		w->events = events;
+
+		if(!w->pending)
+			ret = arm(w, EPOLL_CTL_MOD);
+	}
+
+	(void) pthread_mutex_unlock(&r->lock);
+	return ret;
+}
+
+/*
+ * This procedure stops watching the descriptor of the watch w and frees
+ * the watch. A queued callback of the watch is not called, but one which
+ * is already running may still be running when this returns. This may
+ * be called from the callback of the watch itself. The watch must not be
+ * used afterwards. The procedure returns QTEINVALID if the watch has
+ * already been removed. Otherwise, it returns an error code to indicate
+ * its status. The value of r must not be NULL. The value of w must not
+ * be NULL.
+ */
+enum qterror
+qtreactorremove(struct qtreactor* r, struct qtreactorwatch* w)
+{
+	struct epoll_event ev;
+	enum qterror ret = QTSUCCESS;
+
+	assert(r != NULL);
+	assert(w != NULL);
+	/* older kernels need an event even though it is not used */
+	memset(&ev, 0, sizeof(ev));
+
+	if(pthread_mutex_lock(&r->lock) != 0)
+		return QTEPTMLOCK;
+
+	if(w->removed) {
+		ret = QTEINVALID;
+	} else {
+		w->removed = 1;
+		(void) epoll_ctl(r->epfd, EPOLL_CTL_DEL, w->fd, &ev);
+		unlink_watch(r, w);
+
+		/*
+		 * A poll may still hold an event of the watch, so the
+		 * poller frees it once that poll is over. A queued or
+		 * running callback frees it itself.
+		 */
+		if(!w->pending) {
+			w->next = r->graveyard;
+			r->graveyard = w;
+			wake(r);
+		}
+	}
+
+	(void) pthread_mutex_unlock(&r->lock);
+	return ret;
+}
+
+/*
+ * This procedure waits for at most timeout milliseconds for ready
+ * descriptors, or indefinitely if the value of timeout is -1, and pushes
+ * the callbacks of all of them onto the function queue at once. Only one
+ * thread polls at a time, so workers can take turns polling with a
+ * timeout of 0 instead of leaving it to the thread of qtreactorstart().
+ * With a timeout of 0, the procedure does not wait for room in the
+ * function queue either, and the descriptors whose callbacks do not fit
+ * are armed again. The number of callbacks which were pushed is stored in the integer
+ * pointed to by dispatched if the value of dispatched is not NULL. The
+ * procedure returns QTEPTMTRYLOCK if another thread is polling.
+ * Otherwise, it returns an error code to indicate its status. The value
+ * of r must not be NULL.
+ */
+enum qterror
+qtreactorpoll(struct qtreactor* r, int timeout, unsigned int* dispatched)
+{
+	enum qterror ret = QTSUCCESS;
+
+	assert(r != NULL);
+
+	if(dispatched != NULL)
+		*dispatched = 0;
+
+	if(pthread_mutex_trylock(&r->poll_lock) != 0)
+		return QTEPTMTRYLOCK;
+
+	ret = poll_events(r, timeout, dispatched);
+	(void) pthread_mutex_unlock(&r->poll_lock);
+	return ret;
+}
+
+/*
+ * This procedure starts a thread which polls the reactor until it is
+ * stopped. The procedure returns QTEINVALID if the thread is already
+ * running. Otherwise, it returns an error code to indicate its status.
+ * The value of r must not be NULL.
+ */
+enum qterror
+qtreactorstart(struct qtreactor* r)
+{
+	assert(r != NULL);
+
+	if(r->running)
+		return QTEINVALID;
+
+	QTATOMIC_STORE(&r->stopping, 0, QTATOMIC_RELAXED);
+
+	if(pthread_create(&r->thread, NULL, poll_loop, r) != 0)
+		return QTEPTCREATE;
+
+	r->running = 1;
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure stops the polling thread of the reactor and waits for
+ * it to exit. Stopping a reactor without a polling thread does nothing.
+ * The procedure always succeeds. The value of r must not be NULL.
+ */
+enum qterror
+qtreactorstop(struct qtreactor* r)
+{
+	assert(r != NULL);
+
+	if(!r->running)
+		return QTSUCCESS;
+
+	QTATOMIC_STORE(&r->stopping, 1, QTATOMIC_RELEASE);
+	wake(r);
+	(void) pthread_join(r->thread, NULL);
+	r->running = 0;
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure is the body of qtreactorpoll() for a thread which holds
+ * the poll lock. The removed watches which no earlier poll can refer to
+ * any more are freed first. The callbacks are pushed without waiting
+ * for room in the function queue if the value of timeout is 0. The procedure returns an error code to
+ * indicate its status. The value of r must not be NULL.
+ */
+static enum qterror
+poll_events(struct qtreactor* r, int timeout, unsigned int* dispatched)
+{
+	struct epoll_event events[QTREACTOR_EVENTS];
+	struct function_queue_element elements[QTREACTOR_EVENTS];
+	struct qtreactorwatch* dead = NULL;
+	enum qterror ret = QTSUCCESS;
+	unsigned int n = 0;
+	unsigned int pushed = 0;
+	unsigned int i = 0;
+	int ready = 0;
+	int j = 0;
+
+	assert(r != NULL);
+	(void) pthread_mutex_lock(&r->lock);
+	dead = r->graveyard;
+	r->graveyard = NULL;
+	(void) pthread_mutex_unlock(&r->lock);
+	free_watches(dead);
+	ready = epoll_wait(r->epfd, events, QTREACTOR_EVENTS, timeout);
+
+	if(ready == -1)
+		return errno == EINTR ? QTSUCCESS : QTEERRNO;
+
+	(void) pthread_mutex_lock(&r->lock);
+
+	for(j = 0; j < ready; ++j) {
+		struct qtreactorwatch* w = events[j].data.ptr;
+		eventfd_t value = 0;
+
+		/* the wake-up of a stop is left for the polling thread */
+		if(w == NULL) {
+			if(!QTATOMIC_LOAD(&r->stopping, QTATOMIC_ACQUIRE))
+				(void) eventfd_read(r->wakefd, &value);
+
+			continue;
+		}
+
+		if(w->removed)
+			continue;
+
+		w->pending = 1;
+		w->revents = 0;
+
+		if((events[j].events & EPOLLIN) != 0)
+			w->revents |= QTREACTOR_READ;
+
+		if((events[j].events & EPOLLOUT) != 0)
+			w->revents |= QTREACTOR_WRITE;
+
+		if((events[j].events & (EPOLLERR | EPOLLHUP)) != 0)
+			w->revents |= QTREACTOR_ERROR;
+
+		elements[n].func = dispatch;
+		elements[n].arg = w;
+		++n;
+	}
+
+	(void) pthread_mutex_unlock(&r->lock);
+
+	if(n > 0)
+		ret = fqpushv(r->fq, elements, n, &pushed, timeout != 0);
+
+	if(pushed < n) {
+		/* the watches which were not queued are armed again */
+		(void) pthread_mutex_lock(&r->lock);
+
+		for(i = pushed; i < n; ++i) {
+			struct qtreactorwatch* w = elements[i].arg;
+
+			w->pending = 0;
+
+			if(w->removed) {
+				w->next = r->graveyard;
+				r->graveyard = w;
+			} else {
+				(void) arm(w, EPOLL_CTL_MOD);
+			}
+		}
+
+		(void) pthread_mutex_unlock(&r->lock);
+	}
+
+	if(dispatched != NULL)
+		*dispatched = pushed;
+
+	return ret;
+}
+
+/*
+ * This procedure is the body of the polling thread. It polls until the
+ * reactor is stopped or polling fails. The variable arg is a pointer to
+ * the reactor. The value of arg must not be NULL.
+ */
+static void*
+poll_loop(void* arg)
+{
+	struct qtreactor* r = arg;
+	enum qterror ret = QTSUCCESS;
+
+	assert(r != NULL);
+
+	while(ret != QTEERRNO
+			&& !QTATOMIC_LOAD(&r->stopping, QTATOMIC_ACQUIRE)) {
+		if(pthread_mutex_lock(&r->poll_lock) != 0)
+			break;
+
+		/* a stop may have come while another thread polled */
+		if(!QTATOMIC_LOAD(&r->stopping, QTATOMIC_ACQUIRE))
+			ret = poll_events(r, -1, NULL);
+
+		(void) pthread_mutex_unlock(&r->poll_lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * This procedure is the function which is queued for a ready watch. It
+ * calls the callback of the watch unless the watch was removed, then
+ * arms the descriptor again, or frees the watch if it was removed in
+ * the meantime. The variable arg is a pointer to the watch. The value of
+ * arg must not be NULL.
+ */
+static void
+dispatch(void* arg)
+{
+	struct qtreactorwatch* w = arg;
+	struct qtreactor* r = NULL;
+	unsigned int revents = 0;
+	int removed = 0;
+
+	assert(w != NULL);
+	r = w->reactor;
+	(void) pthread_mutex_lock(&r->lock);
+	removed = w->removed;
+	revents = w->revents;
+	(void) pthread_mutex_unlock(&r->lock);
+
+	if(!removed)
+		w->callback(w->fd, revents, w->arg);
+
+	finish_dispatch(w);
+}
+
+/*
+ * This procedure is the drop handler of the functions queued for ready
+ * watches. The callback is not called, but the descriptor is armed
+ * again, so that an event which is still pending is reported by a later
+ * poll. The variable q is the queue which dropped the function, and the
+ * variable arg is a pointer to the watch. The value of q must not be
+ * NULL. The value of arg must not be NULL.
+ */
+static void
+drop_dispatch(struct function_queue* q, void* arg)
+{
+	/* suppress unused variable warning */
+	(void) q;
+
+	assert(arg != NULL);
+	finish_dispatch(arg);
+}
+
+/*
+ * This procedure clears the pending flag of the watch w once its queued
+ * function is done with it, then arms the descriptor again, or frees the
+ * watch if it was removed in the meantime. The value of w must not be
+ * NULL.
+ */
+static void
+finish_dispatch(struct qtreactorwatch* w)
+{
+	struct qtreactor* r = NULL;
+	int removed = 0;
+
+	assert(w != NULL);
+	r = w->reactor;
+	(void) pthread_mutex_lock(&r->lock);
+	removed = w->removed;
+	w->pending = 0;
+
+	/* the descriptor may have been closed by the callback */
+	if(!removed)
+		(void) arm(w, EPOLL_CTL_MOD);
+
+	(void) pthread_mutex_unlock(&r->lock);
+
+	if(removed)
+		free(w);
+}
+
+/*
+ * This procedure registers or re-registers the descriptor of the watch w
+ * for one event of its set with the epoll operation op. The procedure
+ * returns QTEERRNO if epoll fails. Otherwise, it returns QTSUCCESS. The
+ * value of w must not be NULL.
+ */
+static enum qterror
+arm(struct qtreactorwatch* w, int op)
+{
+	struct epoll_event ev;
+
+	assert(w != NULL);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLONESHOT;
+
+	if((w->events & QTREACTOR_READ) != 0)
+		ev.events |= EPOLLIN;
+
+	if((w->events & QTREACTOR_WRITE) != 0)
+		ev.events |= EPOLLOUT;
+
+	ev.data.ptr = w;
+
+	if(epoll_ctl(w->reactor->epfd, op, w->fd, &ev) != 0)
+		return QTEERRNO;
+
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure removes the watch w from the list of registered
+ * watches of r. The value of r must not be NULL. The value of w must not
+ * be NULL.
+ */
+static void
+unlink_watch(struct qtreactor* r, struct qtreactorwatch* w)
+{
+	struct qtreactorwatch** it = NULL;
+
+	assert(r != NULL);
+	assert(w != NULL);
+
+	for(it = &r->watches; *it != NULL; it = &(*it)->next) {
+		if(*it == w) {
+			*it = w->next;
+			break;
+		}
+	}
+}
+
+/*
+ * This procedure frees the list of watches which starts at w.
+ */
+static void
+free_watches(struct qtreactorwatch* w)
+{
+	while(w != NULL) {
+		struct qtreactorwatch* next = w->next;
+
+		free(w);
+		w = next;
+	}
+}
+
+/*
+ * This procedure wakes the thread which is polling the reactor r, if
+ * any. The value of r must not be NULL.
+ */
+static void
+wake(struct qtreactor* r)
+{
+	assert(r != NULL);
+	(void) eventfd_write(r->wakefd, 1);
+}
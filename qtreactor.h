@@ -0,0 +1,79 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef QTREACTOR_H
+#define QTREACTOR_H
+
+#include <pthread.h>
+
+#include "function_queue.h"
+#include "qterror.h"
+
+/* the events of a descriptor which a callback can wait for or get */
+#define QTREACTOR_READ 1U /* the descriptor is readable */
+#define QTREACTOR_WRITE 2U /* the descriptor is writable */
+#define QTREACTOR_ERROR 4U /* an error or hang up; always reported */
+
+struct qtreactorwatch;
+
+/*
+ * This structure holds a reactor which watches file descriptors with
+ * epoll and pushes the callback of each descriptor which becomes ready
+ * onto a function queue, so that the workers of a pool run it. Each
+ * descriptor is disarmed while its callback is queued or running, so
+ * one callback runs for it at a time. The member fq is the function
+ * queue. The member epfd is the epoll instance, and the member wakefd is
+ * an eventfd which wakes the polling thread. The member lock guards the
+ * watches, the list of registered watches pointed to by the member
+ * watches and the list of removed watches pointed to by the member
+ * graveyard which the polling thread frees. The member poll_lock is held
+ * by the thread which polls. The member thread is the polling thread
+ * started by qtreactorstart(), and the member running is non-zero while
+ * it runs. The member stopping tells it to exit.
+ */
+struct qtreactor {
+	struct function_queue* fq;
+	int epfd;
+	int wakefd;
+	pthread_mutex_t lock;
+	pthread_mutex_t poll_lock;
+	struct qtreactorwatch* watches;
+	struct qtreactorwatch* graveyard;
+	pthread_t thread;
+	int running;
+	int stopping;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum qterror qtreactorinit(struct qtreactor*, struct function_queue*);
+enum qterror qtreactordestroy(struct qtreactor*);
+enum qterror qtreactoradd(struct qtreactor*, int, unsigned int,
+		void (*)(int, unsigned int, void*), void*,
+		struct qtreactorwatch**);
+enum qterror qtreactormodify(struct qtreactor*, struct qtreactorwatch*,
+		unsigned int);
+enum qterror qtreactorremove(struct qtreactor*, struct qtreactorwatch*);
+enum qterror qtreactorpoll(struct qtreactor*, int, unsigned int*);
+enum qterror qtreactorstart(struct qtreactor*);
+enum qterror qtreactorstop(struct qtreactor*);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
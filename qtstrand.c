@@ -0,0 +1,388 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "qtstrand.h"
+#include "function_queue_element.h"
+#include "function_queue.h"
+#include "qterror.h"
+
+/*
+ * This is the largest number of functions of a strand which a thread
+ * runs in a row while the strand cannot be pushed back onto the
+ * function queue without waiting.
+ */
+#ifndef QTSTRAND_RUN_MAX
+#define QTSTRAND_RUN_MAX 16
+#endif
+
+/*
+ * This structure is a linked list node for a function pending on a
+ * strand.
+ */
+struct qtstrandtask {
+	struct function_queue_element element; /* the function to run */
+	struct qtstrandtask* next; /* the address of the next node */
+};
+
+/*
+ * This structure holds an active strand. The member set is a pointer to
+ * the set the strand belongs to. The member bucket is a pointer to the
+ * bucket which holds the strand. The member next is the address of the
+ * next strand in the bucket. The member key is the key of the strand.
+ * The members head and tail point to the first and last pending
+ * functions of the strand.
+ */
+struct qtstrand {
+	struct qtstrandset* set;
+	struct qtstrandbucket* bucket;
+	struct qtstrand* next;
+	unsigned long key;
+	struct qtstrandtask* head;
+	struct qtstrandtask* tail;
+};
+
+static struct qtstrandbucket* find_bucket(struct qtstrandset*,
+		unsigned long);
+static void run_strand(void*);
+static void drop_strand(struct function_queue*, void*);
+static void unlink_strand(struct qtstrand*);
+static void free_tasks(struct qtstrandtask*);
+
+/*
+ * This procedure initializes the strand set s. Strands are run by
+ * pushing them onto the function queue fq. The value of nbuckets is the
+ * number of buckets, each with its own lock, which the active strands
+ * are spread over. The procedure returns an error code to indicate its
+ * status. The value of s must not be NULL. The value of fq must not be
+ * NULL.
+ */
+enum qterror
+qtstrandinit(struct qtstrandset* s, struct function_queue* fq,
+		size_t nbuckets)
+{
+	size_t i = 0;
+
+	assert(s != NULL);
+	assert(fq != NULL);
+
+	if(nbuckets == 0)
+		return QTEINVALID;
+
+	if(fqregisterdrop(run_strand, drop_strand) != QTSUCCESS)
+		return QTEINVALID;
+
+	s->fq = fq;
+	s->nbuckets = nbuckets;
+	s->buckets = malloc(nbuckets * sizeof(*s->buckets));
+
+	if(s->buckets == NULL)
+		return QTEMALLOC;
+
+	for(i = 0; i < nbuckets; ++i) {
+		s->buckets[i].strands = NULL;
+
+		if(pthread_mutex_init(&s->buckets[i].lock, NULL) != 0) {
+			/* ignore more errors at this point */
+			while(i-- > 0)
+				(void) pthread_mutex_destroy(
+						&s->buckets[i].lock);
+
+			free(s->buckets);
+			return QTEPTMINIT;
+		}
+	}
+
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure destroys the given strand set. The functions still
+ * pending on any strand are discarded. No strand of the set may be
+ * queued or running when it is destroyed. The procedure returns an
+ * error code to indicate its status. The value of s must not be NULL.
+ */
+enum qterror
+qtstranddestroy(struct qtstrandset* s)
+{
+	enum qterror ret = QTSUCCESS;
+	size_t i = 0;
+
+	assert(s != NULL);
+
+	for(i = 0; i < s->nbuckets; ++i) {
+		struct qtstrand* strand = s->buckets[i].strands;
+
+		while(strand != NULL) {
+			struct qtstrand* next = strand->next;
+
+			free_tasks(strand->head);
+			free(strand);
+			strand = next;
+		}
+
+		if(pthread_mutex_destroy(&s->buckets[i].lock) != 0)
+			ret = QTEPTMDESTROY;
+	}
+
+	free(s->buckets);
+	s->buckets = NULL;
+	return ret;
+}
+
+/*
+ * This procedure pushes the given function pointer onto the strand with
+ * the given key. The function is called with the argument arg after
+ * every function pushed earlier with the same key has returned. If the
+ * strand was idle, it is pushed onto the function queue, which may
+ * block if the value of block is non-zero. If that push fails while
+ * other functions joined the strand, the strand is pushed again for
+ * them, blocking if necessary, before the error is returned; the
+ * calling thread only runs them if that push fails as well, as it does
+ * under FQOVERFLOW_CALLERRUNS. If the queue drops the strand, the
+ * functions pending on it are discarded and reported as described for
+ * fqdiscard(). The procedure returns an error code to indicate its
+ * status. The value of s must not be NULL.
+ */
+enum qterror
+qtstrandpush(struct qtstrandset* s, unsigned long key, void (*func)(void*),
+		void* arg, int block)
+{
+	struct qtstrandbucket* bucket = NULL;
+	struct qtstrandtask* task = NULL;
+	struct qtstrand* strand = NULL;
+	enum qterror ret = QTSUCCESS;
+	int idle = 0;
+
+	assert(s != NULL);
+	task = malloc(sizeof(*task));
+
+	if(task == NULL)
+		return QTEMALLOC;
+
+	task->element.func = func;
+	task->element.arg = arg;
+	task->next = NULL;
+	bucket = find_bucket(s, key);
+
+	if(pthread_mutex_lock(&bucket->lock) != 0) {
+		free(task);
+		return QTEPTMLOCK;
+	}
+
+	for(strand = bucket->strands; strand != NULL; strand = strand->next)
+		if(strand->key == key)
+			break;
+
+	if(strand == NULL) {
+		strand = malloc(sizeof(*strand));
+
+		if(strand == NULL) {
+			(void) pthread_mutex_unlock(&bucket->lock);
+			free(task);
+			return QTEMALLOC;
+		}
+
+		strand->set = s;
+		strand->bucket = bucket;
+		strand->key = key;
+		strand->head = task;
+		strand->tail = task;
+		strand->next = bucket->strands;
+		bucket->strands = strand;
+		idle = 1;
+	} else {
+		/* a running strand may have taken its last function already */
+		if(strand->tail == NULL)
+			strand->head = task;
+		else
+			strand->tail->next = task;
+
+		strand->tail = task;
+	}
+
+	(void) pthread_mutex_unlock(&bucket->lock);
+
+	/* a strand which is already queued or running picks the task up */
+	if(!idle)
+		return QTSUCCESS;
+
+	ret = fqpush(s->fq, run_strand, strand, block);
+
+	if(ret == QTSUCCESS)
+		return QTSUCCESS;
+
+	/* the strand was never queued, so the task is still its head */
+	(void) pthread_mutex_lock(&bucket->lock);
+	assert(strand->head == task);
+	strand->head = task->next;
+	idle = strand->head == NULL;
+
+	if(idle) {
+		strand->tail = NULL;
+		unlink_strand(strand);
+	}
+
+	(void) pthread_mutex_unlock(&bucket->lock);
+	free(task);
+
+	if(idle)
+		free(strand);
+	else if(fqrequeue(s->fq, run_strand, strand, 1) != QTSUCCESS)
+		run_strand(strand);
+
+	return ret;
+}
+
+/*
+ * This procedure finds the bucket which holds the strand with the given
+ * key. The value of s must not be NULL.
+ */
+static struct qtstrandbucket*
+find_bucket(struct qtstrandset* s, unsigned long key)
+{
+	assert(s != NULL);
+
+	key ^= key >> 16;
+	key *= 0x45d9f3bUL;
+	key ^= key >> 16;
+	return &s->buckets[key % s->nbuckets];
+}
+
+/*
+ * This procedure runs the function at the head of a strand. If more
+ * functions are pending afterwards, the strand is pushed back onto the
+ * function queue so other strands get a turn. If that push fails, the
+ * calling thread keeps running the strand, but after QTSTRAND_RUN_MAX
+ * functions in a row it waits to push the strand back instead, unless
+ * FQOVERFLOW_CALLERRUNS refuses that as well. The strand is freed once
+ * it has no functions left. The variable arg is a pointer to the
+ * strand. The value of arg must not be NULL.
+ */
+static void
+run_strand(void* arg)
+{
+	struct qtstrand* strand = arg;
+	struct qtstrandbucket* bucket = NULL;
+	unsigned int ran = 0;
+
+	assert(strand != NULL);
+	bucket = strand->bucket;
+
+	do {
+		struct function_queue_element e;
+		struct qtstrandtask* task = NULL;
+		int done = 0;
+
+		(void) pthread_mutex_lock(&bucket->lock);
+		task = strand->head;
+		assert(task != NULL);
+		strand->head = task->next;
+
+		if(strand->head == NULL)
+			strand->tail = NULL;
+
+		(void) pthread_mutex_unlock(&bucket->lock);
+		e = task->element;
+		free(task);
+		e.func(e.arg);
+		(void) pthread_mutex_lock(&bucket->lock);
+		done = strand->head == NULL;
+
+		if(done)
+			unlink_strand(strand);
+
+		(void) pthread_mutex_unlock(&bucket->lock);
+
+		if(done) {
+			free(strand);
+			return;
+		}
+
+		if(ran < QTSTRAND_RUN_MAX)
+			++ran;
+	} while(fqrequeue(strand->set->fq, run_strand, strand,
+				ran == QTSTRAND_RUN_MAX) != QTSUCCESS);
+}
+
+/*
+ * This procedure is the drop handler of strands. The strand is removed
+ * from its set, so that later functions with its key start a new one,
+ * and the functions pending on it are reported as described for
+ * fqdiscard() and freed. The variable q is the queue which dropped the
+ * strand, and the variable arg is a pointer to the strand. The value of
+ * q must not be NULL. The value of arg must not be NULL.
+ */
+static void
+drop_strand(struct function_queue* q, void* arg)
+{
+	struct qtstrand* strand = arg;
+	struct qtstrandtask* task = NULL;
+
+	assert(q != NULL);
+	assert(strand != NULL);
+	(void) pthread_mutex_lock(&strand->bucket->lock);
+	task = strand->head;
+	unlink_strand(strand);
+	(void) pthread_mutex_unlock(&strand->bucket->lock);
+	free(strand);
+
+	while(task != NULL) {
+		struct qtstrandtask* next = task->next;
+
+		fqdiscard(q, task->element.func, task->element.arg);
+		free(task);
+		task = next;
+	}
+}
+
+/*
+ * This procedure removes the given strand from its bucket. The bucket
+ * mutex must be locked by the calling thread. The value of strand must
+ * not be NULL.
+ */
+static void
+unlink_strand(struct qtstrand* strand)
+{
+	struct qtstrand** it = NULL;
+
+	assert(strand != NULL);
+
+	for(it = &strand->bucket->strands; *it != NULL; it = &(*it)->next) {
+		if(*it == strand) {
+			*it = strand->next;
+			break;
+		}
+	}
+}
+
+/*
+ * This procedure frees every node of the list of pending functions
+ * starting at task.
+ */
+static void
+free_tasks(struct qtstrandtask* task)
+{
+	while(task != NULL) {
+		struct qtstrandtask* next = task->next;
+
+		free(task);
+		task = next;
+	}
+}
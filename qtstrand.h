@@ -0,0 +1,69 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef QTSTRAND_H
+#define QTSTRAND_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "function_queue.h"
+#include "qterror.h"
+
+struct qtstrand;
+
+/*
+ * This structure holds one bucket of the table of active strands. The
+ * member lock guards the strands in the bucket and their pending
+ * functions. The member strands is a pointer to the first strand in the
+ * bucket.
+ */
+struct qtstrandbucket {
+	pthread_mutex_t lock;
+	struct qtstrand* strands;
+};
+
+/*
+ * This structure holds a set of keyed serial executors. Functions which
+ * are pushed with the same key run one at a time and in the order they
+ * were pushed, while functions with different keys may run in parallel
+ * on the threads which pop the function queue. A strand only exists
+ * while it has functions pending or running. The member fq is a pointer
+ * to the function queue which runs the strands. The member buckets is a
+ * pointer to the array of buckets of active strands. The member
+ * nbuckets is the number of buckets.
+ */
+struct qtstrandset {
+	struct function_queue* fq;
+	struct qtstrandbucket* buckets;
+	size_t nbuckets;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum qterror qtstrandinit(struct qtstrandset*, struct function_queue*,
+		size_t);
+enum qterror qtstranddestroy(struct qtstrandset*);
+enum qterror qtstrandpush(struct qtstrandset*, unsigned long,
+		void (*)(void*), void*, int);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
+
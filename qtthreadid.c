@@ -0,0 +1,78 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "qtthreadid.h"
+#include "qtatomic.h"
+#include "qterror.h"
+
+static void create_key(void);
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+static int key_error = 0;
+static unsigned int next_id = 0;
+
+/*
+ * This procedure retrieves a small number which identifies the calling
+ * thread and stores it at the address pointed to by id. Numbers are
+ * handed out in order starting at 0 the first time each thread asks,
+ * so they suit indexing per-thread slots or picking a starting point
+ * which differs between threads. Numbers are not reused after a thread
+ * exits. The procedure returns an error code to indicate its status.
+ * The value of id must not be NULL.
+ */
+enum qterror
+qtthreadid(unsigned int* id)
+{
+	void* value = NULL;
+
+	assert(id != NULL);
+
+	if(pthread_once(&key_once, create_key) != 0)
+		return QTEPTONCE;
+
+	if(key_error)
+		return QTEPTKCREATE;
+
+	value = pthread_getspecific(key);
+
+	if(value == NULL) {
+		/* store the number plus one so that NULL means unset */
+		*id = QTATOMIC_FETCH_ADD(&next_id, 1, QTATOMIC_RELAXED);
+		value = (void*) ((size_t) *id + 1);
+
+		if(pthread_setspecific(key, value) != 0)
+			return QTEPTSETSPECIFIC;
+	} else {
+		*id = (unsigned int) ((size_t) value - 1);
+	}
+
+	return QTSUCCESS;
+}
+
+/*
+ * This procedure creates the key which holds the number of each thread.
+ * It is called once through pthread_once().
+ */
+static void
+create_key(void)
+{
+	key_error = pthread_key_create(&key, NULL) != 0;
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef QTTHREADID_H
+#define QTTHREADID_H
+
+#include "qterror.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum qterror qtthreadid(unsigned int*);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
+
@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <pthread.h>
+
+#include "tinytest/tinytest.h"
+#include "../fqbuffer.h"
+#include "../function_queue.h"
+
+#define TEST_SIZE 8
+#define TEST_THREADS 16
+
+struct fqbuffer buffer;
+int slots[TEST_SIZE * 2];
+int ran = 0;
+int reentered = 0;
+int pushed = 0;
+pthread_mutex_t pushed_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void count_run(void* arg)
+{
+	(void) arg;
+	++ran;
+}
+
+void push_again(void* arg)
+{
+	++ran;
+	++reentered;
+	fqbufferpush(&buffer, count_run, arg, 1);
+}
+
+void push_and_exit_run(void* arg)
+{
+	(void) arg;
+}
+
+void* push_and_exit(void* arg)
+{
+	struct fqbuffer* b = arg;
+	int i = 0;
+
+	for(i = 0; i < TEST_SIZE / 2; ++i)
+		fqbufferpush(b, push_and_exit_run, NULL, 1);
+
+	pthread_mutex_lock(&pushed_lock);
+	++pushed;
+	pthread_mutex_unlock(&pushed_lock);
+	return NULL;
+}
+
+void flush_in_batches()
+{
+	struct function_queue q;
+	struct function_queue_element e;
+	int i = 0;
+
+	puts("Testing flushing a producer buffer in batches...");
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_IA, TEST_SIZE * 2));
+	ASSERT_EQUALS(QTSUCCESS, fqbufferinit(&buffer, &q, TEST_SIZE, 0));
+
+	for(i = 0; i < TEST_SIZE - 1; ++i)
+		ASSERT_EQUALS(QTSUCCESS, fqbufferpush(&buffer, count_run,
+					&slots[i], 0));
+
+	ASSERT_EQUALS(0U, q.size);
+	ASSERT_EQUALS(QTSUCCESS, fqbufferpush(&buffer, count_run, &slots[i],
+				0));
+	ASSERT_EQUALS((unsigned int) TEST_SIZE, q.size);
+	ASSERT_EQUALS(QTSUCCESS, fqbufferpush(&buffer, count_run,
+				&slots[TEST_SIZE], 0));
+	ASSERT_EQUALS(QTSUCCESS, fqbufferflush(&buffer, 0));
+
+	for(i = 0; i <= TEST_SIZE; ++i) {
+		ASSERT_EQUALS(QTSUCCESS, fqpop(&q, &e, 0));
+		ASSERT_EQUALS((void*) &slots[i], e.arg);
+	}
+
+	ASSERT_EQUALS(QTEFQEMPTY, fqpop(&q, &e, 0));
+	ASSERT_EQUALS(QTSUCCESS, fqbufferdestroy(&buffer));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+void caller_runs_reentry()
+{
+	struct function_queue q;
+	struct function_queue_element e;
+	int i = 0;
+
+	puts("Testing a function run by a flush pushing through the buffer...");
+	ran = 0;
+	reentered = 0;
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_IA, 1));
+	ASSERT_EQUALS(QTSUCCESS, fqsetoverflow(&q, FQOVERFLOW_CALLERRUNS));
+	ASSERT_EQUALS(QTSUCCESS, fqbufferinit(&buffer, &q, TEST_SIZE, 0));
+
+	/* all but the first element run in the flushing thread */
+	for(i = 0; i < TEST_SIZE; ++i)
+		ASSERT_EQUALS(QTSUCCESS, fqbufferpush(&buffer, push_again,
+					&slots[i], 1));
+
+	/* the buffer is full, so they push straight onto the queue */
+	ASSERT_EQUALS(TEST_SIZE - 1, reentered);
+	ASSERT_EQUALS((TEST_SIZE - 1) * 2, ran);
+	ASSERT_EQUALS(QTSUCCESS, fqbufferflush(&buffer, 1));
+	ASSERT_EQUALS(QTSUCCESS, fqpop(&q, &e, 0));
+	ASSERT_EQUALS((void*) &slots[0], e.arg);
+	ASSERT_EQUALS(QTEFQEMPTY, fqpop(&q, &e, 0));
+	ASSERT_EQUALS(QTSUCCESS, fqbufferdestroy(&buffer));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+void destroy_while_exiting()
+{
+	struct function_queue q;
+	pthread_t threads[TEST_THREADS];
+	int i = 0;
+	int done = 0;
+
+	puts("Testing destroying a producer buffer while threads exit...");
+	pushed = 0;
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_IA,
+				TEST_THREADS * TEST_SIZE));
+	ASSERT_EQUALS(QTSUCCESS, fqbufferinit(&buffer, &q, TEST_SIZE, 0));
+
+	for(i = 0; i < TEST_THREADS; ++i)
+		ASSERT_EQUALS(0, pthread_create(&threads[i], NULL,
+					push_and_exit, &buffer));
+
+	while(!done) {
+		pthread_mutex_lock(&pushed_lock);
+		done = pushed == TEST_THREADS;
+		pthread_mutex_unlock(&pushed_lock);
+	}
+
+	/* each element is flushed by its thread or by the destruction */
+	ASSERT_EQUALS(QTSUCCESS, fqbufferdestroy(&buffer));
+
+	for(i = 0; i < TEST_THREADS; ++i)
+		ASSERT_EQUALS(0, pthread_join(threads[i], NULL));
+
+	ASSERT_EQUALS((unsigned int) (TEST_THREADS * TEST_SIZE / 2), q.size);
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+int main(int argc, char** argv)
+{
+	(void) argc;
+	(void) argv;
+
+	RUN(flush_in_batches);
+	RUN(caller_runs_reentry);
+	RUN(destroy_while_exiting);
+	return TEST_REPORT();
+}
@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "tinytest/tinytest.h"
+#include "../fqlock.h"
+#include "../function_queue.h"
+
+#define TEST_THREADS 4
+#define TEST_ITERATIONS 10000
+
+enum fqlocktype current_type = FQLOCK_MUTEX;
+struct fqlock lock;
+long counter = 0;
+
+void* increment(void* arg)
+{
+	struct fqlocknode node;
+	int i = 0;
+
+	(void) arg;
+
+	for(i = 0; i < TEST_ITERATIONS; ++i) {
+		fqlockacquire(&lock, &node);
+		++counter;
+		fqlockrelease(&lock);
+	}
+
+	return NULL;
+}
+
+void nothing(void* arg)
+{
+	(void) arg;
+}
+
+void exclusive()
+{
+	pthread_t threads[TEST_THREADS];
+	int i = 0;
+
+	printf("Testing that lock type %d is exclusive...\n", current_type);
+	counter = 0;
+	ASSERT_EQUALS(QTSUCCESS, fqlockinit(&lock, current_type));
+
+	for(i = 0; i < TEST_THREADS; ++i)
+		ASSERT_EQUALS(0, pthread_create(&threads[i], NULL, increment,
+					NULL));
+
+	for(i = 0; i < TEST_THREADS; ++i)
+		ASSERT_EQUALS(0, pthread_join(threads[i], NULL));
+
+	ASSERT_EQUALS((long) TEST_THREADS * TEST_ITERATIONS, counter);
+	ASSERT_EQUALS(QTSUCCESS, fqlockdestroy(&lock));
+}
+
+void try_acquire()
+{
+	struct fqlocknode node;
+	struct fqlocknode other;
+
+	printf("Testing trying to take lock type %d...\n", current_type);
+	ASSERT_EQUALS(QTSUCCESS, fqlockinit(&lock, current_type));
+	ASSERT_EQUALS(QTSUCCESS, fqlocktryacquire(&lock, &node));
+	ASSERT_EQUALS(QTEPTMTRYLOCK, fqlocktryacquire(&lock, &other));
+	ASSERT_EQUALS(QTSUCCESS, fqlockrelease(&lock));
+	ASSERT_EQUALS(QTSUCCESS, fqlocktryacquire(&lock, &other));
+	ASSERT_EQUALS(QTSUCCESS, fqlockrelease(&lock));
+	ASSERT_EQUALS(QTSUCCESS, fqlockdestroy(&lock));
+}
+
+void wait_timeout()
+{
+	struct fqlocknode node;
+	struct timespec t;
+	pthread_cond_t cond;
+
+	printf("Testing a timed wait under lock type %d...\n", current_type);
+	ASSERT_EQUALS(0, pthread_cond_init(&cond, NULL));
+	ASSERT_EQUALS(QTSUCCESS, fqlockinit(&lock, current_type));
+	ASSERT_EQUALS(QTSUCCESS, fqlockacquire(&lock, &node));
+	clock_gettime(CLOCK_REALTIME, &t);
+	t.tv_nsec += 10000000L;
+
+	if(t.tv_nsec >= 1000000000L) {
+		++t.tv_sec;
+		t.tv_nsec -= 1000000000L;
+	}
+
+	/* the lock is held again when the wait times out */
+	ASSERT_EQUALS(ETIMEDOUT, fqlockwait(&lock, &cond, &t));
+	ASSERT_EQUALS(QTEPTMTRYLOCK, fqlocktryacquire(&lock, &node));
+	ASSERT_EQUALS(QTSUCCESS, fqlockrelease(&lock));
+	ASSERT_EQUALS(QTSUCCESS, fqlockdestroy(&lock));
+	ASSERT_EQUALS(0, pthread_cond_destroy(&cond));
+}
+
+void queue_with_lock()
+{
+	struct function_queue q;
+	struct function_queue_element e;
+
+	printf("Testing a queue guarded by lock type %d...\n", current_type);
+	ASSERT_EQUALS(QTSUCCESS, fqinitwithlock(&q, FQTYPE_IA, 2,
+				current_type));
+	ASSERT_EQUALS(QTSUCCESS, fqpush(&q, nothing, NULL, 0));
+	ASSERT_EQUALS(QTSUCCESS, fqpop(&q, &e, 0));
+	ASSERT_EQUALS(QTEFQEMPTY, fqpop(&q, &e, 0));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+int main(int argc, char** argv)
+{
+	(void) argc;
+	(void) argv;
+
+	for(; current_type < FQLOCK_LAST; ++current_type) {
+		RUN(exclusive);
+		RUN(try_acquire);
+		RUN(wait_timeout);
+		RUN(queue_with_lock);
+	}
+
+	return TEST_REPORT();
+}
@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "tinytest/tinytest.h"
+#include "../fqshm.h"
+
+#define TEST_CAPACITY 2
+#define TEST_PAYLOAD 16
+
+char name[64];
+char order[8];
+size_t ran = 0;
+int in_segment = 0;
+int released = 0;
+int waiting = 0;
+pthread_mutex_t count_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t count_cond = PTHREAD_COND_INITIALIZER;
+
+void sleep_ms(long ms)
+{
+	struct timespec t;
+
+	t.tv_sec = ms / 1000;
+	t.tv_nsec = ms % 1000 * 1000000L;
+	nanosleep(&t, NULL);
+}
+
+/* the argument is the queue whose segment must hold the payload */
+void note_payload(const void* payload, size_t len, void* arg)
+{
+	struct fqshm* q = arg;
+	const char* p = payload;
+	const char* s = (const char*) q->segment;
+
+	if(p >= s && p + len <= s + q->size)
+		++in_segment;
+
+	if(len > 0 && ran < sizeof(order) - 1)
+		order[ran] = p[0];
+
+	++ran;
+}
+
+/* the handler keeps its slot until it is released by the test */
+void hold_slot(const void* payload, size_t len, void* arg)
+{
+	(void) payload;
+	(void) len;
+	(void) arg;
+	pthread_mutex_lock(&count_lock);
+	waiting = 1;
+	pthread_cond_broadcast(&count_cond);
+
+	while(!released)
+		pthread_cond_wait(&count_cond, &count_lock);
+
+	pthread_mutex_unlock(&count_lock);
+}
+
+void* release_later(void* arg)
+{
+	(void) arg;
+	sleep_ms(50);
+	pthread_mutex_lock(&count_lock);
+	released = 1;
+	pthread_cond_broadcast(&count_cond);
+	pthread_mutex_unlock(&count_lock);
+	return NULL;
+}
+
+void* run_one(void* arg)
+{
+	fqshmrun(arg, 1);
+	return NULL;
+}
+
+void push_and_run()
+{
+	struct fqshm q;
+
+	puts("Testing running shared elements in place and in order...");
+	ran = 0;
+	in_segment = 0;
+	memset(order, 0, sizeof(order));
+	ASSERT_EQUALS(QTSUCCESS, fqshmcreate(&q, name, 4, TEST_PAYLOAD));
+	ASSERT_EQUALS(QTSUCCESS, fqshmregister(&q, 1, note_payload, &q));
+	ASSERT_EQUALS(QTEINVALID, fqshmregister(&q, FQSHM_MAX_HANDLERS,
+				note_payload, &q));
+	ASSERT_EQUALS(QTSUCCESS, fqshmpush(&q, 1, "a", 1, 0));
+	ASSERT_EQUALS(QTSUCCESS, fqshmpush(&q, 1, "b", 1, 0));
+	ASSERT_EQUALS(QTSUCCESS, fqshmpush(&q, 1, "c", 1, 0));
+	ASSERT_EQUALS(QTEINVALID, fqshmpush(&q, 1, order,
+				TEST_PAYLOAD + 1, 0));
+
+	/* an element without a handler is discarded */
+	ASSERT_EQUALS(QTSUCCESS, fqshmpush(&q, 2, NULL, 0, 0));
+
+	ASSERT_EQUALS(QTSUCCESS, fqshmrun(&q, 0));
+	ASSERT_EQUALS(QTSUCCESS, fqshmrun(&q, 0));
+	ASSERT_EQUALS(QTSUCCESS, fqshmrun(&q, 0));
+	ASSERT_EQUALS(QTEINVALID, fqshmrun(&q, 0));
+	ASSERT_EQUALS(QTEFQEMPTY, fqshmrun(&q, 0));
+	ASSERT_EQUALS((size_t) 3, ran);
+	ASSERT_EQUALS(0, strcmp(order, "abc"));
+	ASSERT_EQUALS(3, in_segment);
+	ASSERT_EQUALS(QTSUCCESS, fqshmdestroy(&q));
+}
+
+void running_slot_kept()
+{
+	struct fqshm q;
+	pthread_t thread;
+
+	puts("Testing that the slot of a running element is not reused...");
+	ran = 0;
+	released = 0;
+	waiting = 0;
+	ASSERT_EQUALS(QTSUCCESS, fqshmcreate(&q, name, TEST_CAPACITY,
+				TEST_PAYLOAD));
+	ASSERT_EQUALS(QTSUCCESS, fqshmregister(&q, 0, hold_slot, NULL));
+	ASSERT_EQUALS(QTSUCCESS, fqshmregister(&q, 1, note_payload, &q));
+	ASSERT_EQUALS(QTSUCCESS, fqshmpush(&q, 0, NULL, 0, 0));
+	ASSERT_EQUALS(QTSUCCESS, fqshmpush(&q, 1, "b", 1, 0));
+	ASSERT_EQUALS(0, pthread_create(&thread, NULL, run_one, &q));
+	pthread_mutex_lock(&count_lock);
+
+	while(!waiting)
+		pthread_cond_wait(&count_cond, &count_lock);
+
+	pthread_mutex_unlock(&count_lock);
+
+	/* a later element finishes first, but its slot waits for the first */
+	ASSERT_EQUALS(QTSUCCESS, fqshmrun(&q, 0));
+	ASSERT_EQUALS((size_t) 1, ran);
+	ASSERT_EQUALS(QTEFQFULL, fqshmpush(&q, 1, "c", 1, 0));
+
+	pthread_mutex_lock(&count_lock);
+	released = 1;
+	pthread_cond_broadcast(&count_cond);
+	pthread_mutex_unlock(&count_lock);
+	ASSERT_EQUALS(0, pthread_join(thread, NULL));
+
+	ASSERT_EQUALS(QTSUCCESS, fqshmpush(&q, 1, "c", 1, 0));
+	ASSERT_EQUALS(QTSUCCESS, fqshmpush(&q, 1, "d", 1, 0));
+	ASSERT_EQUALS(QTEFQFULL, fqshmpush(&q, 1, "e", 1, 0));
+	ASSERT_EQUALS(QTSUCCESS, fqshmrun(&q, 0));
+	ASSERT_EQUALS(QTSUCCESS, fqshmrun(&q, 0));
+	ASSERT_EQUALS((size_t) 3, ran);
+	ASSERT_EQUALS(QTSUCCESS, fqshmdestroy(&q));
+}
+
+void blocked_push()
+{
+	struct fqshm q;
+	pthread_t thread;
+	pthread_t releaser;
+
+	puts("Testing that a blocked push waits for a slot to be released...");
+	ran = 0;
+	released = 0;
+	waiting = 0;
+	ASSERT_EQUALS(QTSUCCESS, fqshmcreate(&q, name, 1, TEST_PAYLOAD));
+	ASSERT_EQUALS(QTSUCCESS, fqshmregister(&q, 0, hold_slot, NULL));
+	ASSERT_EQUALS(QTSUCCESS, fqshmregister(&q, 1, note_payload, &q));
+	ASSERT_EQUALS(QTSUCCESS, fqshmpush(&q, 0, NULL, 0, 0));
+	ASSERT_EQUALS(0, pthread_create(&thread, NULL, run_one, &q));
+	pthread_mutex_lock(&count_lock);
+
+	while(!waiting)
+		pthread_cond_wait(&count_cond, &count_lock);
+
+	pthread_mutex_unlock(&count_lock);
+	ASSERT_EQUALS(QTEFQFULL, fqshmpush(&q, 1, "b", 1, 0));
+
+	/* the handler is released while the push waits */
+	ASSERT_EQUALS(0, pthread_create(&releaser, NULL, release_later,
+				NULL));
+	ASSERT_EQUALS(QTSUCCESS, fqshmpush(&q, 1, "b", 1, 1));
+	ASSERT_EQUALS(0, pthread_join(releaser, NULL));
+	ASSERT_EQUALS(0, pthread_join(thread, NULL));
+	ASSERT_EQUALS(QTSUCCESS, fqshmrun(&q, 1));
+	ASSERT_EQUALS((size_t) 1, ran);
+	ASSERT_EQUALS(QTSUCCESS, fqshmdestroy(&q));
+}
+
+void other_process()
+{
+	struct fqshm q;
+	struct fqshm other;
+	pid_t child = 0;
+	int status = 0;
+
+	puts("Testing pushing from another process...");
+	ran = 0;
+	in_segment = 0;
+	memset(order, 0, sizeof(order));
+	ASSERT_EQUALS(QTSUCCESS, fqshmcreate(&q, name, TEST_CAPACITY,
+				TEST_PAYLOAD));
+	ASSERT_EQUALS(QTSUCCESS, fqshmregister(&q, 1, note_payload, &q));
+	child = fork();
+	ASSERT("fork failed", child != -1);
+
+	if(child == 0) {
+		/* the child maps the segment on its own and fills it twice */
+		if(fqshmattach(&other, name) != QTSUCCESS
+				|| fqshmpush(&other, 1, "x", 1, 1) != QTSUCCESS
+				|| fqshmpush(&other, 1, "y", 1, 1) != QTSUCCESS
+				|| fqshmpush(&other, 1, "z", 1, 1) != QTSUCCESS
+				|| fqshmdetach(&other) != QTSUCCESS)
+			_exit(1);
+
+		_exit(0);
+	}
+
+	ASSERT_EQUALS(QTSUCCESS, fqshmrun(&q, 1));
+	ASSERT_EQUALS(QTSUCCESS, fqshmrun(&q, 1));
+	ASSERT_EQUALS(QTSUCCESS, fqshmrun(&q, 1));
+	ASSERT_EQUALS(child, waitpid(child, &status, 0));
+	ASSERT("the child failed", WIFEXITED(status)
+			&& WEXITSTATUS(status) == 0);
+	ASSERT_EQUALS(0, strcmp(order, "xyz"));
+	ASSERT_EQUALS(3, in_segment);
+	ASSERT_EQUALS(QTSUCCESS, fqshmdestroy(&q));
+	ASSERT_EQUALS(QTEERRNO, fqshmattach(&other, name));
+}
+
+int main(int argc, char** argv)
+{
+	(void) argc;
+	(void) argv;
+
+	sprintf(name, "/fqshm_test_%ld", (long) getpid());
+	RUN(push_and_run);
+	RUN(running_slot_kept);
+	RUN(blocked_push);
+	RUN(other_process);
+	return TEST_REPORT();
+}
@@ -0,0 +1,634 @@
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "tinytest/tinytest.h"
+#include "../function_queue.h"
+
+#define TEST_SIZE 8
+
+enum fqtype current_type = FQTYPE_IA;
+int slots[TEST_SIZE * 2];
+int ran = 0;
+int dropped = 0;
+void* last_dropped = NULL;
+
+void count_run(void* arg)
+{
+	(void) arg;
+	++ran;
+}
+
+void count_drop(void (*func)(void*), void* arg)
+{
+	(void) func;
+	++dropped;
+	last_dropped = arg;
+}
+
+void sleep_ms(long ms)
+{
+	struct timespec t;
+
+	t.tv_sec = ms / 1000;
+	t.tv_nsec = ms % 1000 * 1000000L;
+	nanosleep(&t, NULL);
+}
+
+void push_pop_in_order()
+{
+	struct function_queue q;
+	struct function_queue_element e;
+	int i = 0;
+
+	printf("Testing push and pop order of type %d...\n", current_type);
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, current_type, TEST_SIZE));
+
+	for(i = 0; i < TEST_SIZE; ++i)
+		ASSERT_EQUALS(QTSUCCESS, fqpush(&q, count_run, &slots[i], 0));
+
+	ASSERT_EQUALS(QTEFQFULL, fqpush(&q, count_run, &slots[i], 0));
+
+	for(i = 0; i < TEST_SIZE; ++i) {
+		ASSERT_EQUALS(QTSUCCESS, fqpop(&q, &e, 0));
+		ASSERT_EQUALS((void*) &slots[i], e.arg);
+	}
+
+	ASSERT_EQUALS(QTEFQEMPTY, fqpop(&q, &e, 0));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+void queue_size()
+{
+	struct function_queue q;
+	struct function_queue_element e;
+	int i = 0;
+
+	printf("Testing the size of a queue of type %d...\n", current_type);
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, current_type, TEST_SIZE));
+	ASSERT_EQUALS(0U, fqsize(&q));
+
+	for(i = 0; i < TEST_SIZE; ++i)
+		ASSERT_EQUALS(QTSUCCESS, fqpush(&q, count_run, &slots[i], 0));
+
+	ASSERT_EQUALS((unsigned int) TEST_SIZE, fqsize(&q));
+	ASSERT_EQUALS(QTSUCCESS, fqpop(&q, &e, 0));
+	ASSERT_EQUALS(TEST_SIZE - 1U, fqsize(&q));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+void push_pop_nodes()
+{
+	struct function_queue q;
+	struct function_queue_element e;
+	struct fqellnode nodes[TEST_SIZE + 1];
+	int i = 0;
+
+	puts("Testing push and pop order of intrusive nodes...");
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_LLI, TEST_SIZE));
+
+	for(i = 0; i < TEST_SIZE; ++i)
+		ASSERT_EQUALS(QTSUCCESS, fqpushnode(&q, &nodes[i], count_run,
+					&slots[i], 0));
+
+	ASSERT_EQUALS(QTEFQFULL, fqpushnode(&q, &nodes[i], count_run,
+				&slots[i], 0));
+
+	for(i = 0; i < TEST_SIZE; ++i) {
+		ASSERT_EQUALS(QTSUCCESS, fqpop(&q, &e, 0));
+		ASSERT_EQUALS((void*) &slots[i], e.arg);
+	}
+
+	ASSERT_EQUALS(QTEFQEMPTY, fqpop(&q, &e, 0));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+void overflow_reject()
+{
+	struct function_queue q;
+	int i = 0;
+
+	puts("Testing FQOVERFLOW_REJECT...");
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_IA, TEST_SIZE));
+
+	for(i = 0; i < TEST_SIZE; ++i)
+		ASSERT_EQUALS(QTSUCCESS, fqpush(&q, count_run, &slots[i], 0));
+
+	ASSERT_EQUALS(QTEFQFULL, fqpush(&q, count_run, &slots[i], 0));
+	ASSERT_EQUALS(1UL, q.rejected);
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+void overflow_drop_oldest()
+{
+	struct function_queue q;
+	struct function_queue_element e;
+	int i = 0;
+
+	printf("Testing FQOVERFLOW_DROPOLDEST of type %d...\n", current_type);
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, current_type, TEST_SIZE));
+	ASSERT_EQUALS(QTSUCCESS, fqsetoverflow(&q, FQOVERFLOW_DROPOLDEST));
+
+	for(i = 0; i < TEST_SIZE + 2; ++i)
+		ASSERT_EQUALS(QTSUCCESS, fqpush(&q, count_run, &slots[i], 0));
+
+	/* a sharded queue drops the oldest element of one sub-queue */
+	for(i = 2; i < TEST_SIZE + 2; ++i) {
+		ASSERT_EQUALS(QTSUCCESS, fqpop(&q, &e, 0));
+
+		if(current_type != FQTYPE_SHARDED)
+			ASSERT_EQUALS((void*) &slots[i], e.arg);
+	}
+
+	ASSERT_EQUALS(QTEFQEMPTY, fqpop(&q, &e, 0));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+void overflow_drop_reported()
+{
+	struct function_queue q;
+	struct function_queue_element e[TEST_SIZE * 5];
+	unsigned int pushed = 0;
+	int args[TEST_SIZE * 5];
+	unsigned int i = 0;
+
+	puts("Testing reports of elements dropped by FQOVERFLOW_DROPOLDEST...");
+	dropped = 0;
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_IA, TEST_SIZE));
+	ASSERT_EQUALS(QTSUCCESS, fqsetoverflow(&q, FQOVERFLOW_DROPOLDEST));
+	ASSERT_EQUALS(QTSUCCESS, fqsetondrop(&q, count_drop));
+
+	for(i = 0; i < TEST_SIZE * 5; ++i) {
+		e[i].func = count_run;
+		e[i].arg = &args[i];
+	}
+
+	/* more elements are dropped than are reported at once */
+	ASSERT_EQUALS(QTSUCCESS, fqpushv(&q, e, TEST_SIZE * 5, &pushed, 0));
+	ASSERT_EQUALS(TEST_SIZE * 5U, pushed);
+	ASSERT_EQUALS(TEST_SIZE * 4, dropped);
+	ASSERT_EQUALS((void*) &args[TEST_SIZE * 4 - 1], last_dropped);
+	ASSERT_EQUALS(TEST_SIZE, (int) q.size);
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+struct blocked_push {
+	struct function_queue* q;
+	enum qterror ret;
+};
+
+void* push_blocked(void* arg)
+{
+	struct blocked_push* p = arg;
+
+	p->ret = fqpush(p->q, count_run, &slots[TEST_SIZE], 1);
+	return NULL;
+}
+
+void overflow_policy_change()
+{
+	struct function_queue q;
+	struct function_queue_element e;
+	struct blocked_push p;
+	pthread_t thread;
+	int i = 0;
+
+	printf("Testing a policy change for a waiting push of type %d...\n",
+			current_type);
+	ran = 0;
+	dropped = 0;
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, current_type, TEST_SIZE));
+	ASSERT_EQUALS(QTSUCCESS, fqsetondrop(&q, count_drop));
+
+	for(i = 0; i < TEST_SIZE; ++i)
+		ASSERT_EQUALS(QTSUCCESS, fqpush(&q, count_run, &slots[i], 0));
+
+	/* the waiting pusher runs its function under the new policy */
+	p.q = &q;
+	p.ret = QTELAST;
+	ASSERT_EQUALS(0, pthread_create(&thread, NULL, push_blocked, &p));
+	sleep_ms(50);
+	ASSERT_EQUALS(QTSUCCESS, fqsetoverflow(&q, FQOVERFLOW_CALLERRUNS));
+	ASSERT_EQUALS(0, pthread_join(thread, NULL));
+	ASSERT_EQUALS(QTSUCCESS, p.ret);
+	ASSERT_EQUALS(1, ran);
+
+	/* or drops the oldest element to make room */
+	ASSERT_EQUALS(QTSUCCESS, fqsetoverflow(&q, FQOVERFLOW_REJECT));
+	ASSERT_EQUALS(0, pthread_create(&thread, NULL, push_blocked, &p));
+	sleep_ms(50);
+	ASSERT_EQUALS(QTSUCCESS, fqsetoverflow(&q, FQOVERFLOW_DROPOLDEST));
+	ASSERT_EQUALS(0, pthread_join(thread, NULL));
+	ASSERT_EQUALS(QTSUCCESS, p.ret);
+	ASSERT_EQUALS(1, dropped);
+
+	for(i = 0; i < TEST_SIZE; ++i)
+		ASSERT_EQUALS(QTSUCCESS, fqpop(&q, &e, 0));
+
+	ASSERT_EQUALS(QTEFQEMPTY, fqpop(&q, &e, 0));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+struct blocked_pop {
+	struct function_queue* q;
+	struct function_queue_element e;
+	enum qterror ret;
+};
+
+void* pop_blocked(void* arg)
+{
+	struct blocked_pop* p = arg;
+
+	p->ret = fqpop(p->q, &p->e, 1);
+	return NULL;
+}
+
+void blocking_push_pop()
+{
+	struct function_queue q;
+	struct function_queue_element e;
+	struct blocked_push push;
+	struct blocked_pop pop;
+	pthread_t thread;
+	int i = 0;
+
+	printf("Testing blocking push and pop of type %d...\n", current_type);
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, current_type, TEST_SIZE));
+
+	for(i = 0; i < TEST_SIZE; ++i)
+		ASSERT_EQUALS(QTSUCCESS, fqpush(&q, count_run, &slots[i], 0));
+
+	/* a push into a full queue waits until an element is popped */
+	push.q = &q;
+	push.ret = QTELAST;
+	ASSERT_EQUALS(0, pthread_create(&thread, NULL, push_blocked, &push));
+	sleep_ms(50);
+	ASSERT_EQUALS(QTELAST, push.ret);
+	ASSERT_EQUALS(QTSUCCESS, fqpop(&q, &e, 0));
+	ASSERT_EQUALS(0, pthread_join(thread, NULL));
+	ASSERT_EQUALS(QTSUCCESS, push.ret);
+
+	for(i = 0; i < TEST_SIZE; ++i)
+		ASSERT_EQUALS(QTSUCCESS, fqpop(&q, &e, 0));
+
+	/* a pop from an empty queue waits until an element is pushed */
+	pop.q = &q;
+	pop.ret = QTELAST;
+	ASSERT_EQUALS(0, pthread_create(&thread, NULL, pop_blocked, &pop));
+	sleep_ms(50);
+	ASSERT_EQUALS(QTELAST, pop.ret);
+	ASSERT_EQUALS(QTSUCCESS, fqpush(&q, count_run, &slots[0], 0));
+	ASSERT_EQUALS(0, pthread_join(thread, NULL));
+	ASSERT_EQUALS(QTSUCCESS, pop.ret);
+	ASSERT_EQUALS((void*) &slots[0], pop.e.arg);
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+void pop_batch()
+{
+	struct function_queue q;
+	struct function_queue_element e[TEST_SIZE];
+	unsigned int popped = 0;
+	int i = 0;
+
+	printf("Testing popping batches of type %d...\n", current_type);
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, current_type, TEST_SIZE));
+
+	for(i = 0; i < 6; ++i)
+		ASSERT_EQUALS(QTSUCCESS, fqpush(&q, count_run, &slots[i], 0));
+
+	ASSERT_EQUALS(QTEINVALID, fqpopv(&q, e, 0, 1, &popped, 0));
+	ASSERT_EQUALS(QTSUCCESS, fqpopv(&q, e, 4, 1, &popped, 0));
+	ASSERT_EQUALS(4U, popped);
+
+	for(i = 0; i < 4; ++i)
+		ASSERT_EQUALS((void*) &slots[i], e[i].arg);
+
+	/* one of two poppers takes half of the elements, rounded up */
+	ASSERT_EQUALS(QTSUCCESS, fqpopv(&q, e, 4, 2, &popped, 0));
+	ASSERT_EQUALS(1U, popped);
+	ASSERT_EQUALS((void*) &slots[4], e[0].arg);
+	ASSERT_EQUALS(QTSUCCESS, fqpopv(&q, e, 4, 2, &popped, 0));
+	ASSERT_EQUALS(1U, popped);
+	ASSERT_EQUALS((void*) &slots[5], e[0].arg);
+	ASSERT_EQUALS(QTEFQEMPTY, fqpopv(&q, e, 4, 1, &popped, 0));
+	ASSERT_EQUALS(0U, popped);
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+struct stopped_pop {
+	struct function_queue* q;
+	struct function_queue_element e[TEST_SIZE];
+	unsigned int popped;
+	unsigned int stop;
+	enum qterror ret;
+};
+
+void* pop_until_stopped(void* arg)
+{
+	struct stopped_pop* p = arg;
+
+	p->ret = fqpopvuntil(p->q, p->e, TEST_SIZE, 1, &p->popped, &p->stop);
+	return NULL;
+}
+
+void pop_batch_stopped()
+{
+	struct function_queue q;
+	struct stopped_pop pop;
+	pthread_t thread;
+
+	printf("Testing stopping a batch popper of type %d...\n",
+			current_type);
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, current_type, TEST_SIZE));
+
+	/* a waiting popper takes what is pushed while it is not stopped */
+	pop.q = &q;
+	pop.stop = 0;
+	pop.ret = QTELAST;
+	ASSERT_EQUALS(0, pthread_create(&thread, NULL, pop_until_stopped,
+				&pop));
+	sleep_ms(50);
+	ASSERT_EQUALS(QTSUCCESS, fqwakepoppers(&q));
+	sleep_ms(50);
+	ASSERT_EQUALS(QTELAST, pop.ret);
+	ASSERT_EQUALS(QTSUCCESS, fqpush(&q, count_run, &slots[0], 0));
+	ASSERT_EQUALS(0, pthread_join(thread, NULL));
+	ASSERT_EQUALS(QTSUCCESS, pop.ret);
+	ASSERT_EQUALS(1U, pop.popped);
+	ASSERT_EQUALS((void*) &slots[0], pop.e[0].arg);
+
+	/* a stopped popper returns empty-handed once it is woken */
+	pop.ret = QTELAST;
+	ASSERT_EQUALS(0, pthread_create(&thread, NULL, pop_until_stopped,
+				&pop));
+	sleep_ms(50);
+	ASSERT_EQUALS(QTELAST, pop.ret);
+	pop.stop = 1;
+	ASSERT_EQUALS(QTSUCCESS, fqwakepopper(&q, &pop.stop));
+	ASSERT_EQUALS(0, pthread_join(thread, NULL));
+	ASSERT_EQUALS(QTEFQEMPTY, pop.ret);
+	ASSERT_EQUALS(0U, pop.popped);
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+void overflow_caller_runs()
+{
+	struct function_queue q;
+	struct function_queue_element e;
+	int i = 0;
+
+	printf("Testing FQOVERFLOW_CALLERRUNS of type %d...\n", current_type);
+	ran = 0;
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, current_type, TEST_SIZE));
+	ASSERT_EQUALS(QTSUCCESS, fqsetoverflow(&q, FQOVERFLOW_CALLERRUNS));
+
+	for(i = 0; i < TEST_SIZE; ++i)
+		ASSERT_EQUALS(QTSUCCESS, fqpush(&q, count_run, &slots[i], 0));
+
+	ASSERT_EQUALS(0, ran);
+	ASSERT_EQUALS(QTSUCCESS, fqpush(&q, count_run, &slots[i], 0));
+	ASSERT_EQUALS(1, ran);
+
+	/* a function pushing itself back is never run in the caller */
+	ASSERT_EQUALS(QTEFQFULL, fqrequeue(&q, count_run, &slots[i], 1));
+	ASSERT_EQUALS(1, ran);
+
+	for(i = 0; i < TEST_SIZE; ++i) {
+		ASSERT_EQUALS(QTSUCCESS, fqpop(&q, &e, 0));
+		ASSERT_EQUALS((void*) &slots[i], e.arg);
+	}
+
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+void coalesce()
+{
+	struct function_queue q;
+	struct function_queue_element e;
+
+	puts("Testing coalescing of pending pushes...");
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_IA, TEST_SIZE));
+	ASSERT_EQUALS(QTSUCCESS, fqsetcoalesce(&q, 1));
+	ASSERT_EQUALS(QTSUCCESS, fqpush(&q, count_run, &slots[0], 0));
+	ASSERT_EQUALS(QTSUCCESS, fqpush(&q, count_run, &slots[1], 0));
+	ASSERT_EQUALS(QTSUCCESS, fqpush(&q, count_run, &slots[0], 0));
+	ASSERT_EQUALS(2U, q.size);
+	ASSERT_EQUALS(QTSUCCESS, fqpop(&q, &e, 0));
+	ASSERT_EQUALS((void*) &slots[0], e.arg);
+	/* a popped element is not pending any more */
+	ASSERT_EQUALS(QTSUCCESS, fqpush(&q, count_run, &slots[0], 0));
+	ASSERT_EQUALS(2U, q.size);
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+	/* concurrent queues cannot look up pending elements */
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_SHARDED, TEST_SIZE));
+	ASSERT_EQUALS(QTEINVALID, fqsetcoalesce(&q, 1));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+void resize_coalesced()
+{
+	struct function_queue q;
+	struct function_queue_element e;
+	int i = 0;
+
+	printf("Testing shrinking a coalescing queue of type %d...\n",
+			current_type);
+	ran = 0;
+	dropped = 0;
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, current_type, TEST_SIZE));
+	ASSERT_EQUALS(QTSUCCESS, fqsetcoalesce(&q, 1));
+	ASSERT_EQUALS(QTSUCCESS, fqsetondrop(&q, count_drop));
+
+	for(i = 0; i < TEST_SIZE; ++i)
+		ASSERT_EQUALS(QTSUCCESS, fqpush(&q, count_run, &slots[i], 0));
+
+	/* the oldest elements are discarded and reported */
+	ASSERT_EQUALS(QTSUCCESS, fqresize(&q, TEST_SIZE / 2, 1));
+	ASSERT_EQUALS(TEST_SIZE / 2, dropped);
+	ASSERT_EQUALS((void*) &slots[TEST_SIZE / 2 - 1], last_dropped);
+	ASSERT_EQUALS(TEST_SIZE / 2U, q.size);
+
+	/* a discarded element is not pending any more */
+	ASSERT_EQUALS(QTSUCCESS, fqpop(&q, &e, 0));
+	ASSERT_EQUALS((void*) &slots[TEST_SIZE / 2], e.arg);
+	ASSERT_EQUALS(QTSUCCESS, fqpush(&q, count_run, &slots[0], 0));
+	ASSERT_EQUALS(TEST_SIZE / 2U, q.size);
+
+	for(i = TEST_SIZE / 2 + 1; i < TEST_SIZE; ++i) {
+		ASSERT_EQUALS(QTSUCCESS, fqpop(&q, &e, 0));
+		ASSERT_EQUALS((void*) &slots[i], e.arg);
+	}
+
+	ASSERT_EQUALS(QTSUCCESS, fqpop(&q, &e, 0));
+	ASSERT_EQUALS((void*) &slots[0], e.arg);
+	e.func(e.arg);
+	ASSERT_EQUALS(1, ran);
+	ASSERT_EQUALS(QTEFQEMPTY, fqpop(&q, &e, 0));
+
+	/* the queue keeps its order when it grows again */
+	ASSERT_EQUALS(QTSUCCESS, fqresize(&q, TEST_SIZE, 1));
+
+	for(i = 0; i < TEST_SIZE; ++i)
+		ASSERT_EQUALS(QTSUCCESS, fqpush(&q, count_run, &slots[i], 0));
+
+	for(i = 0; i < TEST_SIZE; ++i) {
+		ASSERT_EQUALS(QTSUCCESS, fqpop(&q, &e, 0));
+		ASSERT_EQUALS((void*) &slots[i], e.arg);
+	}
+
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+void codel_drop()
+{
+	struct function_queue q;
+	struct function_queue_element e;
+	int i = 0;
+
+	puts("Testing CoDel dropping elements...");
+	dropped = 0;
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_IA, TEST_SIZE));
+	ASSERT_EQUALS(QTSUCCESS, fqsetcodel(&q, 1000, 5000, FQCODEL_DROP));
+	ASSERT_EQUALS(QTSUCCESS, fqsetondrop(&q, count_drop));
+
+	for(i = 0; i < TEST_SIZE; ++i)
+		ASSERT_EQUALS(QTSUCCESS, fqpush(&q, count_run, &slots[i], 0));
+
+	/* the first late element starts the interval */
+	sleep_ms(10);
+	ASSERT_EQUALS(QTSUCCESS, fqpop(&q, &e, 0));
+	ASSERT_EQUALS((void*) &slots[0], e.arg);
+	/* the interval has passed, so one element is shed */
+	sleep_ms(10);
+	ASSERT_EQUALS(QTSUCCESS, fqpop(&q, &e, 0));
+	ASSERT_EQUALS((void*) &slots[2], e.arg);
+	ASSERT_EQUALS(1UL, q.codel->shed);
+	/* the shed element is reported once the queue is unlocked */
+	ASSERT_EQUALS(1, dropped);
+	ASSERT_EQUALS((void*) &slots[1], last_dropped);
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+void codel_reject()
+{
+	struct function_queue q;
+	struct function_queue_element e;
+	int i = 0;
+
+	puts("Testing CoDel rejecting pushes...");
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_IA, TEST_SIZE));
+	ASSERT_EQUALS(QTSUCCESS, fqsetcodel(&q, 1000, 5000, FQCODEL_REJECT));
+
+	for(i = 0; i < TEST_SIZE; ++i)
+		ASSERT_EQUALS(QTSUCCESS, fqpush(&q, count_run, &slots[i], 0));
+
+	sleep_ms(10);
+	ASSERT_EQUALS(QTSUCCESS, fqpop(&q, &e, 0));
+	sleep_ms(10);
+	/* nothing is dropped, but the next push is refused */
+	ASSERT_EQUALS(QTSUCCESS, fqpop(&q, &e, 0));
+	ASSERT_EQUALS((void*) &slots[1], e.arg);
+	ASSERT_EQUALS(QTEFQFULL, fqpush(&q, count_run, &slots[0], 0));
+	ASSERT_EQUALS(QTSUCCESS, fqpush(&q, count_run, &slots[0], 0));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+void sharded_contended()
+{
+	struct function_queue q;
+	struct function_queue_element e;
+	unsigned int i = 0;
+
+	puts("Testing non-blocking sharded queue under contention...");
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_SHARDED, TEST_SIZE * 4));
+	ASSERT_EQUALS(QTSUCCESS, fqpush(&q, count_run, &slots[0], 0));
+
+	for(i = 0; i < q.queue.sharded.nshards; ++i)
+		pthread_mutex_lock(&q.queue.sharded.shards[i].shard.lock);
+
+	/* a locked sub-queue is not a full or empty one */
+	ASSERT_EQUALS(QTEPTMTRYLOCK, fqpush(&q, count_run, &slots[1], 0));
+	ASSERT_EQUALS(QTEPTMTRYLOCK, fqpop(&q, &e, 0));
+	ASSERT_EQUALS(0UL, q.rejected);
+
+	for(i = 0; i < q.queue.sharded.nshards; ++i)
+		pthread_mutex_unlock(&q.queue.sharded.shards[i].shard.lock);
+
+	ASSERT_EQUALS(QTSUCCESS, fqpop(&q, &e, 0));
+	ASSERT_EQUALS((void*) &slots[0], e.arg);
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+void sharded_capacity()
+{
+	struct function_queue q;
+	unsigned int sizes[] = { 1, 3, TEST_SIZE + 2 };
+	unsigned int i = 0;
+	unsigned int j = 0;
+
+	puts("Testing the capacity of sharded queues...");
+
+	for(i = 0; i < sizeof(sizes) / sizeof(*sizes); ++i) {
+		ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_SHARDED, sizes[i]));
+
+		for(j = 0; j < sizes[i]; ++j)
+			ASSERT_EQUALS(QTSUCCESS, fqpush(&q, count_run,
+						&slots[0], 0));
+
+		ASSERT_EQUALS(QTEFQFULL, fqpush(&q, count_run, &slots[0], 0));
+		ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+	}
+
+	/* a resized queue holds exactly its new maximum */
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_SHARDED, TEST_SIZE));
+	ASSERT_EQUALS(QTSUCCESS, fqresize(&q, TEST_SIZE + 3, 1));
+
+	for(j = 0; j < TEST_SIZE + 3; ++j)
+		ASSERT_EQUALS(QTSUCCESS, fqpush(&q, count_run, &slots[0], 0));
+
+	ASSERT_EQUALS(QTEFQFULL, fqpush(&q, count_run, &slots[0], 0));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+int main(int argc, char** argv)
+{
+	(void) argc;
+	(void) argv;
+
+	for(; current_type < FQTYPE_LAST; ++current_type) {
+		if(current_type != FQTYPE_LLI) {
+			RUN(push_pop_in_order);
+			RUN(queue_size);
+		}
+	}
+
+	RUN(push_pop_nodes);
+	RUN(overflow_reject);
+
+	for(current_type = 0; current_type < FQTYPE_LAST; ++current_type) {
+		if(current_type != FQTYPE_LLI) {
+			RUN(overflow_drop_oldest);
+			RUN(overflow_caller_runs);
+			RUN(overflow_policy_change);
+			RUN(blocking_push_pop);
+			RUN(pop_batch_stopped);
+		}
+	}
+
+	for(current_type = FQTYPE_IA; current_type <= FQTYPE_LL; ++current_type)
+		RUN(pop_batch);
+
+	RUN(overflow_drop_reported);
+
+	RUN(coalesce);
+
+	for(current_type = FQTYPE_IA; current_type <= FQTYPE_LL; ++current_type)
+		RUN(resize_coalesced);
+
+	RUN(codel_drop);
+	RUN(codel_reject);
+	RUN(sharded_contended);
+	RUN(sharded_capacity);
+	return TEST_REPORT();
+}
@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "tinytest/tinytest.h"
+#include "../qtaio.h"
+#include "../qtpool.h"
+#include "../function_queue.h"
+
+#define TEST_SIZE 16
+#define TEST_DATA "qthread"
+#define TEST_LENGTH 7
+
+int completed = 0;
+long results[3];
+pthread_mutex_t count_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void sleep_ms(long ms)
+{
+	struct timespec t;
+
+	t.tv_sec = ms / 1000;
+	t.tv_nsec = ms % 1000 * 1000000L;
+	nanosleep(&t, NULL);
+}
+
+int get_completed()
+{
+	int n = 0;
+
+	pthread_mutex_lock(&count_lock);
+	n = completed;
+	pthread_mutex_unlock(&count_lock);
+	return n;
+}
+
+void wait_completed(int n)
+{
+	while(get_completed() < n)
+		sleep_ms(1);
+}
+
+/* the argument is the index of the result of the operation */
+void record(long result, void* arg)
+{
+	pthread_mutex_lock(&count_lock);
+	results[(size_t) arg] = result;
+	++completed;
+	pthread_mutex_unlock(&count_lock);
+}
+
+/* the operations are started one at a time, so they complete in order */
+void write_read_file(unsigned int entries)
+{
+	struct function_queue q;
+	struct qtpool_startup_info si;
+	struct qtpool tq;
+	struct qtaio aio;
+	char path[] = "/tmp/qtaio_testXXXXXX";
+	char buf[TEST_LENGTH + 1];
+	int started = 0;
+	int fd = -1;
+
+	completed = 0;
+	memset(buf, 0, sizeof(buf));
+	fd = mkstemp(path);
+	ASSERT("no temporary file", fd != -1);
+	unlink(path);
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_IA, TEST_SIZE));
+	si.fq = &q;
+	si.max_threads = 2;
+	ASSERT_EQUALS(QTSUCCESS, qtinit(&tq, &si));
+	ASSERT_EQUALS(QTSUCCESS, qtstart(&tq, &started));
+	ASSERT_EQUALS(QTSUCCESS, qtaioinit(&aio, &q, entries));
+
+	if(entries != 0 && aio.ring == NULL) {
+		puts("io_uring is unavailable, skipping...");
+	} else {
+		ASSERT_EQUALS(QTSUCCESS, qtaiowrite(&aio, fd, TEST_DATA,
+					TEST_LENGTH, 0, record, (void*) 0));
+		wait_completed(1);
+		ASSERT_EQUALS((long) TEST_LENGTH, results[0]);
+		ASSERT_EQUALS(QTSUCCESS, qtaiofsync(&aio, fd, record,
+					(void*) 1));
+		wait_completed(2);
+		ASSERT_EQUALS(0L, results[1]);
+		ASSERT_EQUALS(QTSUCCESS, qtaioread(&aio, fd, buf, sizeof(buf),
+					0, record, (void*) 2));
+		wait_completed(3);
+		ASSERT_EQUALS((long) TEST_LENGTH, results[2]);
+		ASSERT_EQUALS(0, strcmp(TEST_DATA, buf));
+	}
+
+	ASSERT_EQUALS(QTSUCCESS, qtaiodestroy(&aio));
+	ASSERT_EQUALS(QTSUCCESS, qtstop(&tq, 1));
+	ASSERT_EQUALS(QTSUCCESS, qtdestroy(&tq));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+	close(fd);
+}
+
+void blocking_fallback()
+{
+	puts("Testing file I/O run as blocking tasks...");
+	write_read_file(0);
+}
+
+void ring()
+{
+	puts("Testing file I/O submitted to an io_uring...");
+	write_read_file(TEST_SIZE);
+}
+
+/* a bad descriptor fails the operation instead of the submission */
+void bad_descriptor()
+{
+	struct function_queue q;
+	struct function_queue_element e;
+	struct qtaio aio;
+	char buf[TEST_LENGTH];
+
+	puts("Testing file I/O on a bad descriptor...");
+	completed = 0;
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_IA, TEST_SIZE));
+	ASSERT_EQUALS(QTSUCCESS, qtaioinit(&aio, &q, 0));
+	ASSERT_EQUALS(QTSUCCESS, qtaioread(&aio, -1, buf, sizeof(buf), 0,
+				record, (void*) 0));
+
+	/* outside of a pool, the task is run by hand */
+	while(fqpop(&q, &e, 0) == QTSUCCESS)
+		e.func(e.arg);
+
+	ASSERT_EQUALS(1, completed);
+	ASSERT("the read did not fail", results[0] < 0);
+	ASSERT_EQUALS(QTSUCCESS, qtaiodestroy(&aio));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+int main(int argc, char** argv)
+{
+	(void) argc;
+	(void) argv;
+
+	RUN(blocking_fallback);
+	RUN(ring);
+	RUN(bad_descriptor);
+	return TEST_REPORT();
+}
@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "tinytest/tinytest.h"
+#include "../qtarena.h"
+#include "../qtpool.h"
+#include "../function_queue.h"
+
+#define TEST_SIZE 16
+#define TEST_TASKS 100
+#define TEST_CHUNK 256
+#define TEST_BLOCK 100
+
+int sum = 0;
+int ran = 0;
+pthread_mutex_t count_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void sleep_ms(long ms)
+{
+	struct timespec t;
+
+	t.tv_sec = ms / 1000;
+	t.tv_nsec = ms % 1000 * 1000000L;
+	nanosleep(&t, NULL);
+}
+
+int get_ran()
+{
+	int n = 0;
+
+	pthread_mutex_lock(&count_lock);
+	n = ran;
+	pthread_mutex_unlock(&count_lock);
+	return n;
+}
+
+/* the argument is a block which holds a number */
+void add(void* arg)
+{
+	pthread_mutex_lock(&count_lock);
+	sum += *(int*) arg;
+	++ran;
+	pthread_mutex_unlock(&count_lock);
+}
+
+void alloc_and_reuse()
+{
+	struct qtarena a;
+	void* b[5];
+
+	puts("Testing allocating and reusing the chunks of an arena...");
+	ASSERT_EQUALS(QTSUCCESS, qtarenainit(&a, TEST_CHUNK, 1));
+
+	/* two blocks fit in a chunk */
+	ASSERT_EQUALS(QTSUCCESS, qtarenaalloc(&a, TEST_BLOCK, &b[0]));
+	ASSERT_EQUALS(QTSUCCESS, qtarenaalloc(&a, TEST_BLOCK, &b[1]));
+	ASSERT("the blocks are not in order", (char*) b[1] > (char*) b[0]);
+	ASSERT_EQUALS((size_t) 0, (size_t) b[1] % sizeof(double));
+	ASSERT_EQUALS(QTSUCCESS, qtarenaalloc(&a, TEST_BLOCK, &b[2]));
+	ASSERT("the chunk is too small", (char*) b[2] < (char*) b[0]
+			|| (char*) b[2] >= (char*) b[1] + TEST_BLOCK);
+
+	/* the first chunk is recycled once its blocks are freed */
+	ASSERT_EQUALS(0U, a.nfree);
+	qtarenafree(b[0]);
+	qtarenafree(b[1]);
+	ASSERT_EQUALS(1U, a.nfree);
+	ASSERT_EQUALS(QTSUCCESS, qtarenaalloc(&a, TEST_BLOCK, &b[3]));
+	ASSERT_EQUALS(QTSUCCESS, qtarenaalloc(&a, TEST_BLOCK, &b[4]));
+	ASSERT_EQUALS(0U, a.nfree);
+	ASSERT("the chunk is not reused", b[4] == b[0]);
+
+	qtarenafree(b[2]);
+	qtarenafree(b[3]);
+	qtarenafree(b[4]);
+	ASSERT_EQUALS(QTSUCCESS, qtarenadestroy(&a));
+}
+
+void oversized_block()
+{
+	struct qtarena a;
+	void* b = NULL;
+
+	puts("Testing a block larger than the chunks of an arena...");
+	ASSERT_EQUALS(QTSUCCESS, qtarenainit(&a, TEST_CHUNK, 1));
+	ASSERT_EQUALS(QTSUCCESS, qtarenaalloc(&a, TEST_CHUNK * 4, &b));
+	((char*) b)[TEST_CHUNK * 4 - 1] = 1;
+	qtarenafree(b);
+
+	/* the block had a chunk of its own, which is not kept */
+	ASSERT_EQUALS(0U, a.nfree);
+	ASSERT("the chunk is kept", a.chunks == NULL);
+	ASSERT_EQUALS(QTSUCCESS, qtarenadestroy(&a));
+}
+
+void push_blocks()
+{
+	struct function_queue q;
+	struct qtpool_startup_info si;
+	struct qtpool tq;
+	struct qtarena a;
+	void* b = NULL;
+	int started = 0;
+	int i = 0;
+
+	puts("Testing tasks whose arguments are allocated from an arena...");
+	sum = 0;
+	ran = 0;
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_IA, TEST_SIZE));
+	ASSERT_EQUALS(QTSUCCESS, qtarenainit(&a, TEST_CHUNK, 2));
+	si.fq = &q;
+	si.max_threads = 2;
+	ASSERT_EQUALS(QTSUCCESS, qtinit(&tq, &si));
+	ASSERT_EQUALS(QTSUCCESS, qtstart(&tq, &started));
+
+	for(i = 1; i <= TEST_TASKS; ++i) {
+		ASSERT_EQUALS(QTSUCCESS, qtarenaalloc(&a, sizeof(int), &b));
+		*(int*) b = i;
+		ASSERT_EQUALS(QTSUCCESS, qtarenapush(&q, add, b, 1));
+	}
+
+	while(get_ran() < TEST_TASKS)
+		sleep_ms(1);
+
+	/* each task ran once with its own block */
+	ASSERT_EQUALS(TEST_TASKS * (TEST_TASKS + 1) / 2, sum);
+	ASSERT_EQUALS(QTSUCCESS, qtstop(&tq, 1));
+	ASSERT_EQUALS(QTSUCCESS, qtdestroy(&tq));
+	ASSERT_EQUALS(QTSUCCESS, qtarenadestroy(&a));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+int main(int argc, char** argv)
+{
+	(void) argc;
+	(void) argv;
+
+	RUN(alloc_and_reuse);
+	RUN(oversized_block);
+	RUN(push_blocks);
+	return TEST_REPORT();
+}
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "tinytest/tinytest.h"
+#include "../qtfiber.h"
+#include "../qtpool.h"
+#include "../function_queue.h"
+
+#define TEST_SIZE 16
+#define TEST_FIBERS 8
+
+char order[8];
+size_t norder = 0;
+int counter = 0;
+struct qtfibermutex mutex;
+pthread_mutex_t order_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void note(char c)
+{
+	pthread_mutex_lock(&order_lock);
+	order[norder++] = c;
+	pthread_mutex_unlock(&order_lock);
+}
+
+/* the argument is the letter which the fiber notes */
+void note_twice(void* arg)
+{
+	note(*(const char*) arg);
+	qtfiberyield();
+	note(*(const char*) arg);
+}
+
+/* the fiber yields while it owns the mutex */
+void increment(void* arg)
+{
+	int n = 0;
+
+	(void) arg;
+	qtfibermutexlock(&mutex);
+	n = counter;
+	qtfiberyield();
+	counter = n + 1;
+	qtfibermutexunlock(&mutex);
+}
+
+enum qterror start_pool(struct qtpool* tq, struct function_queue* q,
+		size_t n)
+{
+	struct qtpool_startup_info si;
+	enum qterror ret = QTSUCCESS;
+	int started = 0;
+
+	si.fq = q;
+	si.max_threads = n;
+	ret = qtinit(tq, &si);
+
+	if(ret != QTSUCCESS)
+		return ret;
+
+	return qtstart(tq, &started);
+}
+
+void yield_interleaves()
+{
+	struct function_queue q;
+	struct qtpool tq;
+	struct qtfiberpool fp;
+
+	puts("Testing fibers which yield their worker...");
+	norder = 0;
+	memset(order, 0, sizeof(order));
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_IA, TEST_SIZE));
+	ASSERT_EQUALS(QTSUCCESS, qtfiberinit(&fp, &q, 0, 1));
+	ASSERT_EQUALS(QTSUCCESS, qtfiberspawn(&fp, note_twice, "a", 0));
+	ASSERT_EQUALS(QTSUCCESS, qtfiberspawn(&fp, note_twice, "b", 0));
+
+	/* one worker runs the fibers in the order they were queued */
+	ASSERT_EQUALS(QTSUCCESS, start_pool(&tq, &q, 1));
+	ASSERT_EQUALS(QTSUCCESS, qtfiberdestroy(&fp));
+	ASSERT_EQUALS(0, strcmp("abab", order));
+	ASSERT_EQUALS(QTSUCCESS, qtstop(&tq, 1));
+	ASSERT_EQUALS(QTSUCCESS, qtdestroy(&tq));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+void mutex_handoff()
+{
+	struct function_queue q;
+	struct qtpool tq;
+	struct qtfiberpool fp;
+	int i = 0;
+
+	puts("Testing fibers which wait for a mutex...");
+	counter = 0;
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_IA, TEST_SIZE));
+	ASSERT_EQUALS(QTSUCCESS, qtfibermutexinit(&mutex));
+	ASSERT_EQUALS(QTSUCCESS, qtfiberinit(&fp, &q, 0, TEST_FIBERS));
+	ASSERT_EQUALS(QTSUCCESS, start_pool(&tq, &q, 2));
+
+	for(i = 0; i < TEST_FIBERS; ++i)
+		ASSERT_EQUALS(QTSUCCESS, qtfiberspawn(&fp, increment, NULL,
+					1));
+
+	/* no update is lost while the owner of the mutex is switched out */
+	ASSERT_EQUALS(QTSUCCESS, qtfiberdestroy(&fp));
+	ASSERT_EQUALS(TEST_FIBERS, counter);
+	ASSERT_EQUALS(QTSUCCESS, qtstop(&tq, 1));
+	ASSERT_EQUALS(QTSUCCESS, qtdestroy(&tq));
+	ASSERT_EQUALS(QTSUCCESS, qtfibermutexdestroy(&mutex));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+void outside_fiber()
+{
+	puts("Testing fiber calls made outside of a fiber...");
+	ASSERT_EQUALS(QTSUCCESS, qtfibermutexinit(&mutex));
+	ASSERT_EQUALS(QTEINVALID, qtfiberyield());
+	ASSERT_EQUALS(QTEINVALID, qtfibermutexlock(&mutex));
+	ASSERT_EQUALS(QTEINVALID, qtfibermutexunlock(&mutex));
+	ASSERT_EQUALS(QTSUCCESS, qtfibermutexdestroy(&mutex));
+}
+
+int main(int argc, char** argv)
+{
+	(void) argc;
+	(void) argv;
+
+	RUN(yield_interleaves);
+	RUN(mutex_handoff);
+	RUN(outside_fiber);
+	return TEST_REPORT();
+}
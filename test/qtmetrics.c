@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "tinytest/tinytest.h"
+#include "../qtmetrics.h"
+#include "../qtpool.h"
+#include "../function_queue.h"
+
+#define TEST_SIZE 8
+#define TEST_TASKS 3
+
+char name[64];
+
+void sleep_ms(long ms)
+{
+	struct timespec t;
+
+	t.tv_sec = ms / 1000;
+	t.tv_nsec = ms % 1000 * 1000000L;
+	nanosleep(&t, NULL);
+}
+
+void nothing(void* arg)
+{
+	(void) arg;
+}
+
+void publish_and_read()
+{
+	struct qtmetrics m;
+	struct qtmetricspage* page = NULL;
+	struct qtmetricsvalues v;
+	struct qtmetricsvalues read;
+
+	puts("Testing publishing and reading a metrics page...");
+	ASSERT_EQUALS(QTSUCCESS, qtmetricsinit(&m, name));
+	ASSERT_EQUALS(QTSUCCESS, qtmetricsattach(name, &page));
+	ASSERT_EQUALS(QTSUCCESS, qtmetricsread(page, &read));
+	ASSERT_EQUALS(0UL, read.executed);
+
+	v.depth = 1;
+	v.executed = 2;
+	v.idle = 3;
+	v.rejected = 4;
+	v.threads = 5;
+	qtmetricspublish(&m, &v);
+	ASSERT_EQUALS(QTSUCCESS, qtmetricsread(page, &read));
+	ASSERT_EQUALS(1UL, read.depth);
+	ASSERT_EQUALS(2UL, read.executed);
+	ASSERT_EQUALS(3UL, read.idle);
+	ASSERT_EQUALS(4UL, read.rejected);
+	ASSERT_EQUALS(5UL, read.threads);
+
+	/* a reader gives up on values which are left half written */
+	++m.page->sequence;
+	ASSERT_EQUALS(QTETIMEDOUT, qtmetricsread(page, &read));
+	++m.page->sequence;
+
+	ASSERT_EQUALS(QTSUCCESS, qtmetricsdetach(page));
+	ASSERT_EQUALS(QTSUCCESS, qtmetricsdestroy(&m));
+	ASSERT_EQUALS(QTEERRNO, qtmetricsattach(name, &page));
+}
+
+void publish_pool()
+{
+	struct function_queue q;
+	struct qtpool_startup_info si;
+	struct qtpool tq;
+	struct qtmetrics m;
+	struct qtmetricspage* page = NULL;
+	struct qtmetricsvalues read;
+	int i = 0;
+
+	puts("Testing publishing the metrics of a pool...");
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_SHARDED, TEST_SIZE));
+	si.fq = &q;
+	si.max_threads = 1;
+	ASSERT_EQUALS(QTSUCCESS, qtinit(&tq, &si));
+
+	for(i = 0; i < TEST_TASKS; ++i)
+		ASSERT_EQUALS(QTSUCCESS, fqpush(&q, nothing, NULL, 0));
+
+	ASSERT_EQUALS(QTSUCCESS, qtmetricsinit(&m, name));
+	ASSERT_EQUALS(QTSUCCESS, qtmetricsattach(name, &page));
+	ASSERT_EQUALS(QTSUCCESS, qtmetricsstart(&m, qtpoolmetrics, &tq, 1));
+	ASSERT_EQUALS(QTEINVALID, qtmetricsstart(&m, qtpoolmetrics, &tq, 1));
+
+	/* the depth of a concurrent queue is counted as well */
+	for(i = 0; i < 1000; ++i) {
+		ASSERT_EQUALS(QTSUCCESS, qtmetricsread(page, &read));
+
+		if(read.depth != 0)
+			break;
+
+		sleep_ms(1);
+	}
+
+	ASSERT_EQUALS((unsigned long) TEST_TASKS, read.depth);
+	ASSERT_EQUALS(0UL, read.threads);
+	ASSERT_EQUALS(QTSUCCESS, qtmetricsstop(&m));
+	ASSERT_EQUALS(QTSUCCESS, qtmetricsstop(&m));
+	ASSERT_EQUALS(QTSUCCESS, qtmetricsdetach(page));
+	ASSERT_EQUALS(QTSUCCESS, qtmetricsdestroy(&m));
+	ASSERT_EQUALS(QTSUCCESS, qtdestroy(&tq));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+int main(int argc, char** argv)
+{
+	(void) argc;
+	(void) argv;
+
+	sprintf(name, "/qtmetrics_test_%ld", (long) getpid());
+	RUN(publish_and_read);
+	RUN(publish_pool);
+	return TEST_REPORT();
+}
@@ -0,0 +1,533 @@
+/* pthread_getname_np() is an extension */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "tinytest/tinytest.h"
+#include "../qtpool.h"
+#include "../function_queue.h"
+
+#define TEST_SIZE 32
+#define TEST_TASKS 8
+
+int ran = 0;
+int dropped = 0;
+int blocked = 0;
+int handled = 0;
+int groups = 0;
+int retiring = 0;
+int retired = 0;
+pthread_t ran_on;
+int inits = 0;
+int teardowns = 0;
+char names[2][16];
+char order[8];
+size_t norder = 0;
+int shed = 0;
+pthread_mutex_t count_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void sleep_ms(long ms)
+{
+	struct timespec t;
+
+	t.tv_sec = ms / 1000;
+	t.tv_nsec = ms % 1000 * 1000000L;
+	nanosleep(&t, NULL);
+}
+
+int get_count(const int* count)
+{
+	int n = 0;
+
+	pthread_mutex_lock(&count_lock);
+	n = *count;
+	pthread_mutex_unlock(&count_lock);
+	return n;
+}
+
+void count_run(void* arg)
+{
+	(void) arg;
+	pthread_mutex_lock(&count_lock);
+	++ran;
+	pthread_mutex_unlock(&count_lock);
+}
+
+void count_drop(void (*func)(void*), void* arg)
+{
+	(void) func;
+	(void) arg;
+	pthread_mutex_lock(&count_lock);
+	++dropped;
+	pthread_mutex_unlock(&count_lock);
+}
+
+void block_until_cancelled(void* arg)
+{
+	(void) arg;
+	pthread_mutex_lock(&count_lock);
+	++blocked;
+	pthread_mutex_unlock(&count_lock);
+
+	while(1)
+		sleep_ms(1000);
+}
+
+void count_one(void* arg)
+{
+	(void) arg;
+	pthread_mutex_lock(&count_lock);
+	++handled;
+	pthread_mutex_unlock(&count_lock);
+}
+
+void count_group(void** args, size_t n)
+{
+	(void) args;
+	pthread_mutex_lock(&count_lock);
+	handled += (int) n;
+	++groups;
+	pthread_mutex_unlock(&count_lock);
+}
+
+/* the hooks note the index of each worker which calls them */
+void count_init(size_t index, void* arg)
+{
+	(void) arg;
+	pthread_mutex_lock(&count_lock);
+	inits |= 1 << index;
+	pthread_mutex_unlock(&count_lock);
+}
+
+void count_teardown(size_t index, void* arg)
+{
+	(void) arg;
+	pthread_mutex_lock(&count_lock);
+	teardowns |= 1 << index;
+	pthread_mutex_unlock(&count_lock);
+}
+
+/* the argument is the index of the name which is noted */
+void note_name(void* arg)
+{
+	char name[16];
+
+	pthread_getname_np(pthread_self(), name, sizeof(name));
+	pthread_mutex_lock(&count_lock);
+	strcpy(names[(size_t) arg], name);
+	++ran;
+	pthread_mutex_unlock(&count_lock);
+}
+
+/* the argument is the letter which the task notes */
+void note_order(void* arg)
+{
+	pthread_mutex_lock(&count_lock);
+	order[norder++] = *(const char*) arg;
+	++ran;
+	pthread_mutex_unlock(&count_lock);
+}
+
+void count_shed(void* arg)
+{
+	(void) arg;
+	pthread_mutex_lock(&count_lock);
+	++shed;
+	pthread_mutex_unlock(&count_lock);
+}
+
+void deadline_in(struct timespec* t, long ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, t);
+	t->tv_sec += ms / 1000;
+	t->tv_nsec += ms % 1000 * 1000000L;
+
+	if(t->tv_nsec >= 1000000000L) {
+		++t->tv_sec;
+		t->tv_nsec -= 1000000000L;
+	} else if(t->tv_nsec < 0) {
+		--t->tv_sec;
+		t->tv_nsec += 1000000000L;
+	}
+}
+
+/* the spare worker is slow to finish, so it is still retiring */
+void teardown_spare(size_t index, void* arg)
+{
+	if(index != *(size_t*) arg)
+		return;
+
+	pthread_mutex_lock(&count_lock);
+	++retiring;
+	pthread_mutex_unlock(&count_lock);
+	sleep_ms(50);
+	pthread_mutex_lock(&count_lock);
+	++retired;
+	pthread_mutex_unlock(&count_lock);
+}
+
+void note_thread(void* arg)
+{
+	(void) arg;
+	pthread_mutex_lock(&count_lock);
+	ran_on = pthread_self();
+	++ran;
+	pthread_mutex_unlock(&count_lock);
+}
+
+struct broadcast_args {
+	struct qtpool* tq;
+	enum qterror ret;
+};
+
+void* broadcast_and_wait(void* arg)
+{
+	struct broadcast_args* b = arg;
+
+	b->ret = qtbroadcast(b->tq, count_run, NULL, 1);
+	return NULL;
+}
+
+void block_briefly(void* arg)
+{
+	(void) arg;
+	qtblockingbegin();
+	sleep_ms(10);
+	qtblockingend();
+	count_run(NULL);
+}
+
+void wait_count(const int* count, int n)
+{
+	while(get_count(count) < n)
+		sleep_ms(1);
+}
+
+enum qterror init_pool(struct qtpool* tq, struct function_queue* q,
+		size_t n)
+{
+	struct qtpool_startup_info si;
+
+	si.fq = q;
+	si.max_threads = n;
+	return qtinit(tq, &si);
+}
+
+void cancel_mid_batch()
+{
+	struct function_queue q;
+	struct qtpool tq;
+	int started = 0;
+	int i = 0;
+
+	puts("Testing a worker cancelled in the middle of a batch...");
+	ran = 0;
+	dropped = 0;
+	blocked = 0;
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_IA, TEST_SIZE));
+	ASSERT_EQUALS(QTSUCCESS, fqsetondrop(&q, count_drop));
+	ASSERT_EQUALS(QTSUCCESS, fqpush(&q, block_until_cancelled, NULL, 0));
+
+	for(i = 1; i < TEST_TASKS; ++i)
+		ASSERT_EQUALS(QTSUCCESS, fqpush(&q, count_run, NULL, 0));
+
+	ASSERT_EQUALS(QTSUCCESS, init_pool(&tq, &q, 1));
+	ASSERT_EQUALS(QTSUCCESS, qtstart(&tq, &started));
+	ASSERT_EQUALS(1, started);
+	wait_count(&blocked, 1);
+	ASSERT_EQUALS(QTSUCCESS, qtstop(&tq, 1));
+
+	/* the rest of the batch is reported instead of lost */
+	ASSERT_EQUALS(0, ran);
+	ASSERT_EQUALS(TEST_TASKS - 1, dropped);
+	ASSERT_EQUALS(0U, q.size);
+	ASSERT_EQUALS(QTSUCCESS, qtdestroy(&tq));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+void cancel_without_drop_hook()
+{
+	struct function_queue q;
+	struct qtpool tq;
+	int started = 0;
+	int i = 0;
+
+	puts("Testing a worker cancelled without a drop hook...");
+	ran = 0;
+	blocked = 0;
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_IA, TEST_SIZE));
+	ASSERT_EQUALS(QTSUCCESS, fqpush(&q, block_until_cancelled, NULL, 0));
+
+	for(i = 1; i < TEST_TASKS; ++i)
+		ASSERT_EQUALS(QTSUCCESS, fqpush(&q, count_run, NULL, 0));
+
+	ASSERT_EQUALS(QTSUCCESS, init_pool(&tq, &q, 1));
+	ASSERT_EQUALS(QTSUCCESS, qtstart(&tq, &started));
+	wait_count(&blocked, 1);
+	ASSERT_EQUALS(QTSUCCESS, qtstop(&tq, 1));
+
+	/* the worker took one task, so the others are still queued */
+	ASSERT_EQUALS(0, ran);
+	ASSERT_EQUALS(TEST_TASKS - 1U, q.size);
+	ASSERT_EQUALS(QTSUCCESS, qtdestroy(&tq));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+void batch_handler()
+{
+	struct function_queue q;
+	struct qtpool tq;
+	int started = 0;
+	int i = 0;
+
+	puts("Testing a batch handler called for consecutive tasks...");
+	ran = 0;
+	handled = 0;
+	groups = 0;
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_IA, TEST_SIZE));
+	ASSERT_EQUALS(QTSUCCESS, fqsetondrop(&q, count_drop));
+
+	for(i = 0; i < TEST_TASKS; ++i)
+		ASSERT_EQUALS(QTSUCCESS, fqpush(&q, count_one, NULL, 0));
+
+	ASSERT_EQUALS(QTSUCCESS, fqpush(&q, count_run, NULL, 0));
+	ASSERT_EQUALS(QTSUCCESS, init_pool(&tq, &q, 1));
+	ASSERT_EQUALS(QTSUCCESS, qtsetbatch(&tq, count_one, count_group));
+	ASSERT_EQUALS(QTSUCCESS, qtstart(&tq, &started));
+	wait_count(&ran, 1);
+	ASSERT_EQUALS(QTSUCCESS, qtstop(&tq, 1));
+
+	/* the worker popped every task at once */
+	ASSERT_EQUALS(TEST_TASKS, handled);
+	ASSERT_EQUALS(1, groups);
+	ASSERT_EQUALS(QTSUCCESS, qtdestroy(&tq));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+void stop_retiring_spare()
+{
+	struct function_queue q;
+	struct qtpool tq;
+	struct qtworkerattr attr;
+	size_t spare_index = 1;
+	int started = 0;
+
+	puts("Testing stopping a pool while a spare worker retires...");
+	ran = 0;
+	retiring = 0;
+	retired = 0;
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_IA, TEST_SIZE));
+	ASSERT_EQUALS(QTSUCCESS, init_pool(&tq, &q, spare_index));
+	qtworkerattrinit(&attr);
+	attr.teardown = teardown_spare;
+	attr.arg = &spare_index;
+	ASSERT_EQUALS(QTSUCCESS, qtsetworkerattr(&tq, &attr));
+	ASSERT_EQUALS(QTSUCCESS, qtstart(&tq, &started));
+	ASSERT_EQUALS(QTSUCCESS, fqpush(&q, block_briefly, NULL, 1));
+	wait_count(&ran, 1);
+	wait_count(&retiring, 1);
+
+	/* the pool is not destroyed under the spare worker */
+	ASSERT_EQUALS(QTSUCCESS, qtstop(&tq, 1));
+	ASSERT_EQUALS(1, get_count(&retired));
+	ASSERT_EQUALS(QTSUCCESS, qtdestroy(&tq));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+void submit_to_worker()
+{
+	struct function_queue q;
+	struct qtpool tq;
+	int started = 0;
+
+	puts("Testing a task submitted to one worker...");
+	ran = 0;
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_IA, TEST_SIZE));
+	ASSERT_EQUALS(QTSUCCESS, init_pool(&tq, &q, 2));
+	ASSERT_EQUALS(QTEINVALID, qtbroadcast(&tq, count_run, NULL, 0));
+	ASSERT_EQUALS(QTSUCCESS, qtstart(&tq, &started));
+	ASSERT_EQUALS(QTEINVALID, qtsubmitto(&tq, 2, note_thread, NULL, 1));
+	ASSERT_EQUALS(QTSUCCESS, qtsubmitto(&tq, 1, note_thread, NULL, 1));
+	wait_count(&ran, 1);
+	ASSERT("the task ran on another worker",
+			pthread_equal(tq.threads[1], ran_on));
+	ASSERT_EQUALS(QTSUCCESS, qtstop(&tq, 1));
+	ASSERT_EQUALS(QTSUCCESS, qtdestroy(&tq));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+void broadcast_to_workers()
+{
+	struct function_queue q;
+	struct qtpool tq;
+	int started = 0;
+
+	puts("Testing a task broadcast to every worker...");
+	ran = 0;
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_IA, TEST_SIZE));
+	ASSERT_EQUALS(QTSUCCESS, init_pool(&tq, &q, 3));
+	ASSERT_EQUALS(QTSUCCESS, qtstart(&tq, &started));
+	ASSERT_EQUALS(QTSUCCESS, qtbroadcast(&tq, count_run, NULL, 1));
+	ASSERT_EQUALS(3, get_count(&ran));
+	ASSERT_EQUALS(QTSUCCESS, qtstop(&tq, 1));
+	ASSERT_EQUALS(QTEINVALID, qtbroadcast(&tq, count_run, NULL, 1));
+	ASSERT_EQUALS(QTSUCCESS, qtdestroy(&tq));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+void stop_during_broadcast()
+{
+	struct function_queue q;
+	struct qtpool tq;
+	struct broadcast_args b;
+	pthread_t thread;
+	int started = 0;
+
+	puts("Testing stopping a pool while a broadcast waits...");
+	ran = 0;
+	blocked = 0;
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_IA, TEST_SIZE));
+	ASSERT_EQUALS(QTSUCCESS, fqpush(&q, block_until_cancelled, NULL, 0));
+	ASSERT_EQUALS(QTSUCCESS, init_pool(&tq, &q, 1));
+	ASSERT_EQUALS(QTSUCCESS, qtstart(&tq, &started));
+	wait_count(&blocked, 1);
+	b.tq = &tq;
+	b.ret = QTELAST;
+	ASSERT_EQUALS(0, pthread_create(&thread, NULL, broadcast_and_wait,
+				&b));
+	sleep_ms(50);
+
+	/* the task left in the inbox of the worker is discarded */
+	ASSERT_EQUALS(QTSUCCESS, qtstop(&tq, 1));
+	ASSERT_EQUALS(0, pthread_join(thread, NULL));
+	ASSERT_EQUALS(QTSUCCESS, b.ret);
+	ASSERT_EQUALS(0, ran);
+	ASSERT_EQUALS(QTSUCCESS, qtdestroy(&tq));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+void worker_attributes()
+{
+	struct function_queue q;
+	struct qtpool tq;
+	struct qtworkerattr attr;
+	int started = 0;
+
+	puts("Testing the attributes and hooks of the workers...");
+	ran = 0;
+	inits = 0;
+	teardowns = 0;
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_IA, TEST_SIZE));
+	ASSERT_EQUALS(QTSUCCESS, init_pool(&tq, &q, 2));
+	qtworkerattrinit(&attr);
+	attr.stack_size = 1 << 18;
+	attr.name = "test";
+	attr.init = count_init;
+	attr.teardown = count_teardown;
+	ASSERT_EQUALS(QTSUCCESS, qtsetworkerattr(&tq, &attr));
+
+	/* the previous attributes are kept if the system rejects one */
+	attr.stack_size = 1;
+	ASSERT_EQUALS(QTEINVALID, qtsetworkerattr(&tq, &attr));
+	ASSERT_EQUALS((size_t) 1 << 18, tq.attr.stack_size);
+
+	ASSERT_EQUALS(QTSUCCESS, qtstart(&tq, &started));
+	ASSERT_EQUALS(QTSUCCESS, qtsubmitto(&tq, 0, note_name, (void*) 0, 1));
+	ASSERT_EQUALS(QTSUCCESS, qtsubmitto(&tq, 1, note_name, (void*) 1, 1));
+	wait_count(&ran, 2);
+	ASSERT_EQUALS(0, strcmp("test-0", names[0]));
+	ASSERT_EQUALS(0, strcmp("test-1", names[1]));
+	ASSERT_EQUALS(3, get_count(&inits));
+	ASSERT_EQUALS(0, get_count(&teardowns));
+
+	/* cancelled workers call their teardown hook as well */
+	ASSERT_EQUALS(QTSUCCESS, qtstop(&tq, 1));
+	ASSERT_EQUALS(3, teardowns);
+	ASSERT_EQUALS(QTSUCCESS, qtdestroy(&tq));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+void deadline_order()
+{
+	struct function_queue q;
+	struct qtpool tq;
+	struct timespec deadline;
+	int started = 0;
+
+	puts("Testing tasks which run in the order of their deadlines...");
+	ran = 0;
+	shed = 0;
+	norder = 0;
+	memset(order, 0, sizeof(order));
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_IA, TEST_SIZE));
+	ASSERT_EQUALS(QTSUCCESS, init_pool(&tq, &q, 1));
+	deadline_in(&deadline, 30000);
+	ASSERT_EQUALS(QTSUCCESS, qtpushdeadline(&tq, note_order, "c",
+				&deadline, count_shed, 0));
+	deadline_in(&deadline, 10000);
+	ASSERT_EQUALS(QTSUCCESS, qtpushdeadline(&tq, note_order, "a",
+				&deadline, count_shed, 0));
+	deadline_in(&deadline, 20000);
+	ASSERT_EQUALS(QTSUCCESS, qtpushdeadline(&tq, note_order, "b",
+				&deadline, count_shed, 0));
+
+	/* a task whose deadline passed is shed instead of run */
+	deadline_in(&deadline, -1000);
+	ASSERT_EQUALS(QTSUCCESS, qtpushdeadline(&tq, note_order, "x",
+				&deadline, count_shed, 0));
+
+	ASSERT_EQUALS(QTSUCCESS, qtstart(&tq, &started));
+	wait_count(&ran, 3);
+	wait_count(&shed, 1);
+	ASSERT_EQUALS(0, strcmp("abc", order));
+	ASSERT_EQUALS(QTSUCCESS, qtstop(&tq, 1));
+	ASSERT_EQUALS(QTSUCCESS, qtdestroy(&tq));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+void deadline_dropped()
+{
+	struct function_queue q;
+	struct qtpool tq;
+	struct timespec deadline;
+
+	puts("Testing tasks with deadlines which the queue drops...");
+	ran = 0;
+	shed = 0;
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_IA, TEST_SIZE));
+	ASSERT_EQUALS(QTSUCCESS, init_pool(&tq, &q, 1));
+	deadline_in(&deadline, 10000);
+	ASSERT_EQUALS(QTSUCCESS, qtpushdeadline(&tq, count_run, NULL,
+				&deadline, count_shed, 0));
+	ASSERT_EQUALS(QTSUCCESS, qtpushdeadline(&tq, count_run, NULL,
+				&deadline, NULL, 0));
+
+	/* the tasks are shed, or forgotten without an expired function */
+	ASSERT_EQUALS(QTSUCCESS, fqresize(&q, 0, 0));
+	ASSERT_EQUALS(1, shed);
+	ASSERT_EQUALS(0, ran);
+	ASSERT_EQUALS((size_t) 0, tq.ndeadlines);
+	ASSERT_EQUALS(QTSUCCESS, qtdestroy(&tq));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+int main(int argc, char** argv)
+{
+	(void) argc;
+	(void) argv;
+
+	RUN(cancel_mid_batch);
+	RUN(cancel_without_drop_hook);
+	RUN(batch_handler);
+	RUN(stop_retiring_spare);
+	RUN(submit_to_worker);
+	RUN(broadcast_to_workers);
+	RUN(stop_during_broadcast);
+	RUN(worker_attributes);
+	RUN(deadline_order);
+	RUN(deadline_dropped);
+	return TEST_REPORT();
+}
@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "tinytest/tinytest.h"
+#include "../qtprofile.h"
+#include "../qtpool.h"
+#include "../function_queue.h"
+
+#define TEST_SIZE 8
+#define TEST_TASKS 6
+
+int ran = 0;
+pthread_mutex_t count_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void sleep_ms(long ms)
+{
+	struct timespec t;
+
+	t.tv_sec = ms / 1000;
+	t.tv_nsec = ms % 1000 * 1000000L;
+	nanosleep(&t, NULL);
+}
+
+int get_ran()
+{
+	int n = 0;
+
+	pthread_mutex_lock(&count_lock);
+	n = ran;
+	pthread_mutex_unlock(&count_lock);
+	return n;
+}
+
+void short_task(void* arg)
+{
+	(void) arg;
+	pthread_mutex_lock(&count_lock);
+	++ran;
+	pthread_mutex_unlock(&count_lock);
+}
+
+void long_task(void* arg)
+{
+	(void) arg;
+	sleep_ms(5);
+	pthread_mutex_lock(&count_lock);
+	++ran;
+	pthread_mutex_unlock(&count_lock);
+}
+
+void set_element(struct function_queue_element* e, void (*func)(void*),
+		long sec, long nsec)
+{
+	e->func = func;
+	e->arg = NULL;
+	e->enqueued.tv_sec = sec;
+	e->enqueued.tv_nsec = nsec;
+}
+
+void set_time(struct timespec* t, long sec, long nsec)
+{
+	t->tv_sec = sec;
+	t->tv_nsec = nsec;
+}
+
+struct record_args {
+	struct qtprofile* p;
+	enum qterror ret;
+};
+
+void* record_other_thread(void* arg)
+{
+	struct record_args* r = arg;
+	struct function_queue_element e;
+	struct timespec start;
+	struct timespec end;
+
+	set_element(&e, short_task, 0, 0);
+	set_time(&start, 20, 0);
+	set_time(&end, 20, 500);
+	r->ret = qtprofilerecord(r->p, &e, 1, &start, &end);
+	return NULL;
+}
+
+void record_and_snapshot()
+{
+	struct qtprofile p;
+	struct qtprofilestats* stats = NULL;
+	struct function_queue_element e[2];
+	struct timespec start;
+	struct timespec end;
+	struct record_args r;
+	pthread_t thread;
+	size_t n = 0;
+
+	puts("Testing recording and merging profile statistics...");
+	ASSERT_EQUALS(QTSUCCESS, qtprofileinit(&p));
+
+	/* two calls run by a batch handler count as one run */
+	set_element(&e[0], long_task, 9, 999999000L);
+	set_element(&e[1], long_task, 0, 0);
+	set_time(&start, 10, 0);
+	set_time(&end, 10, 5000);
+	ASSERT_EQUALS(QTSUCCESS, qtprofilerecord(&p, e, 2, &start, &end));
+	set_element(&e[0], short_task, 0, 0);
+	set_time(&end, 10, 2000);
+	ASSERT_EQUALS(QTSUCCESS, qtprofilerecord(&p, e, 1, &start, &end));
+
+	/* the table of another thread is merged into the snapshot */
+	r.p = &p;
+	r.ret = QTELAST;
+	ASSERT_EQUALS(0, pthread_create(&thread, NULL, record_other_thread,
+				&r));
+	ASSERT_EQUALS(0, pthread_join(thread, NULL));
+	ASSERT_EQUALS(QTSUCCESS, r.ret);
+
+	ASSERT_EQUALS(QTSUCCESS, qtprofilesnapshot(&p, &stats, &n));
+	ASSERT_EQUALS((size_t) 2, n);
+	ASSERT("the functions are not sorted by total run time",
+			stats[0].func == long_task);
+	ASSERT_EQUALS(2UL, stats[0].calls);
+	ASSERT_EQUALS(5000UL, stats[0].total_run);
+	ASSERT_EQUALS(5000UL, stats[0].max_run);
+	ASSERT_EQUALS(1UL, stats[0].waited);
+	ASSERT_EQUALS(1000UL, stats[0].total_wait);
+	ASSERT("the functions are not sorted by total run time",
+			stats[1].func == short_task);
+	ASSERT_EQUALS(2UL, stats[1].calls);
+	ASSERT_EQUALS(2500UL, stats[1].total_run);
+	ASSERT_EQUALS(2000UL, stats[1].max_run);
+	ASSERT_EQUALS(0UL, stats[1].waited);
+	free(stats);
+	ASSERT_EQUALS(QTSUCCESS, qtprofiledestroy(&p));
+}
+
+void profile_pool()
+{
+	struct function_queue q;
+	struct qtpool_startup_info si;
+	struct qtpool tq;
+	struct qtprofile p;
+	struct qtprofilestats* stats = NULL;
+	char line[256];
+	FILE* out = NULL;
+	size_t n = 0;
+	int started = 0;
+	int lines = 0;
+	int i = 0;
+
+	puts("Testing profiling the tasks of a pool...");
+	ran = 0;
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_IA, TEST_SIZE));
+	ASSERT_EQUALS(QTSUCCESS, qtprofileinit(&p));
+	si.fq = &q;
+	si.max_threads = 2;
+	ASSERT_EQUALS(QTSUCCESS, qtinit(&tq, &si));
+	ASSERT_EQUALS(QTSUCCESS, qtsetprofile(&tq, &p));
+	ASSERT_EQUALS(QTSUCCESS, qtstart(&tq, &started));
+
+	for(i = 0; i < TEST_TASKS; ++i)
+		ASSERT_EQUALS(QTSUCCESS, fqpush(&q, i % 2 ? long_task
+					: short_task, NULL, 1));
+
+	while(get_ran() < TEST_TASKS)
+		sleep_ms(1);
+
+	/* the workers record a task before they can be cancelled again */
+	ASSERT_EQUALS(QTSUCCESS, qtstop(&tq, 1));
+	ASSERT_EQUALS(QTSUCCESS, qtprofilesnapshot(&p, &stats, &n));
+	ASSERT_EQUALS((size_t) 2, n);
+	ASSERT("the functions are not sorted by total run time",
+			stats[0].func == long_task);
+	ASSERT_EQUALS((unsigned long) TEST_TASKS / 2, stats[0].calls);
+	ASSERT("the run time is too short", stats[0].max_run >= 5000000UL);
+	ASSERT_EQUALS((unsigned long) TEST_TASKS / 2, stats[0].waited);
+	ASSERT_EQUALS((unsigned long) TEST_TASKS / 2, stats[1].calls);
+	free(stats);
+
+	/* the report has a header and a line for the top function */
+	out = tmpfile();
+	ASSERT("no temporary file", out != NULL);
+	ASSERT_EQUALS(QTSUCCESS, qtprofilereport(&p, out, 1));
+	rewind(out);
+
+	while(fgets(line, sizeof(line), out) != NULL)
+		++lines;
+
+	fclose(out);
+	ASSERT_EQUALS(2, lines);
+	ASSERT_EQUALS(QTSUCCESS, qtsetprofile(&tq, NULL));
+	ASSERT_EQUALS(QTSUCCESS, qtdestroy(&tq));
+	ASSERT_EQUALS(QTSUCCESS, qtprofiledestroy(&p));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+}
+
+int main(int argc, char** argv)
+{
+	(void) argc;
+	(void) argv;
+
+	RUN(record_and_snapshot);
+	RUN(profile_pool);
+	return TEST_REPORT();
+}
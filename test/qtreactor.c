@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "tinytest/tinytest.h"
+#include "../qtreactor.h"
+#include "../qtpool.h"
+#include "../function_queue.h"
+
+#define TEST_SIZE 8
+
+int called = 0;
+unsigned int got = 0;
+pthread_mutex_t count_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void sleep_ms(long ms)
+{
+	struct timespec t;
+
+	t.tv_sec = ms / 1000;
+	t.tv_nsec = ms % 1000 * 1000000L;
+	nanosleep(&t, NULL);
+}
+
+int get_called()
+{
+	int n = 0;
+
+	pthread_mutex_lock(&count_lock);
+	n = called;
+	pthread_mutex_unlock(&count_lock);
+	return n;
+}
+
+void wait_called(int n)
+{
+	while(get_called() < n)
+		sleep_ms(1);
+}
+
+/* the callback drains the pipe, so the descriptor is not ready again */
+void read_byte(int fd, unsigned int events, void* arg)
+{
+	char c = 0;
+
+	(void) arg;
+
+	if(read(fd, &c, 1) != 1)
+		return;
+
+	pthread_mutex_lock(&count_lock);
+	++called;
+	got = events;
+	pthread_mutex_unlock(&count_lock);
+}
+
+void nothing(void* arg)
+{
+	(void) arg;
+}
+
+void poll_ready()
+{
+	struct function_queue q;
+	struct function_queue_element e;
+	struct qtreactor r;
+	struct qtreactorwatch* w = NULL;
+	unsigned int n = 0;
+	int fds[2];
+
+	puts("Testing polling a reactor for a ready descriptor...");
+	called = 0;
+	ASSERT_EQUALS(0, pipe(fds));
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_IA, TEST_SIZE));
+	ASSERT_EQUALS(QTSUCCESS, qtreactorinit(&r, &q));
+	ASSERT_EQUALS(QTSUCCESS, qtreactoradd(&r, fds[0], QTREACTOR_READ,
+				read_byte, NULL, &w));
+	ASSERT_EQUALS(QTSUCCESS, qtreactorpoll(&r, 0, &n));
+	ASSERT_EQUALS(0U, n);
+
+	ASSERT_EQUALS(1, (int) write(fds[1], "x", 1));
+	ASSERT_EQUALS(QTSUCCESS, qtreactorpoll(&r, 1000, &n));
+	ASSERT_EQUALS(1U, n);
+
+	/* the descriptor is disarmed while its callback is queued */
+	ASSERT_EQUALS(QTSUCCESS, qtreactorpoll(&r, 0, &n));
+	ASSERT_EQUALS(0U, n);
+	ASSERT_EQUALS(QTSUCCESS, fqpop(&q, &e, 0));
+	e.func(e.arg);
+	ASSERT_EQUALS(1, called);
+	ASSERT_EQUALS(QTREACTOR_READ, got);
+
+	ASSERT_EQUALS(QTSUCCESS, qtreactorremove(&r, w));
+	ASSERT_EQUALS(QTEINVALID, qtreactorremove(&r, w));
+	ASSERT_EQUALS(QTSUCCESS, qtreactordestroy(&r));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+	close(fds[0]);
+	close(fds[1]);
+}
+
+void poll_thread()
+{
+	struct function_queue q;
+	struct qtpool_startup_info si;
+	struct qtpool tq;
+	struct qtreactor r;
+	struct qtreactorwatch* w = NULL;
+	int started = 0;
+	int fds[2];
+
+	puts("Testing a reactor polled by its own thread...");
+	called = 0;
+	ASSERT_EQUALS(0, pipe(fds));
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_IA, TEST_SIZE));
+	ASSERT_EQUALS(QTSUCCESS, qtreactorinit(&r, &q));
+	ASSERT_EQUALS(QTSUCCESS, qtreactoradd(&r, fds[0], QTREACTOR_READ,
+				read_byte, NULL, &w));
+	si.fq = &q;
+	si.max_threads = 1;
+	ASSERT_EQUALS(QTSUCCESS, qtinit(&tq, &si));
+	ASSERT_EQUALS(QTSUCCESS, qtstart(&tq, &started));
+	ASSERT_EQUALS(QTSUCCESS, qtreactorstart(&r));
+	ASSERT_EQUALS(QTEINVALID, qtreactorstart(&r));
+
+	/* the descriptor is armed again after each callback */
+	ASSERT_EQUALS(1, (int) write(fds[1], "x", 1));
+	wait_called(1);
+	ASSERT_EQUALS(1, (int) write(fds[1], "x", 1));
+	wait_called(2);
+
+	ASSERT_EQUALS(QTSUCCESS, qtreactorstop(&r));
+	ASSERT_EQUALS(QTSUCCESS, qtstop(&tq, 1));
+	ASSERT_EQUALS(QTSUCCESS, qtreactorremove(&r, w));
+	ASSERT_EQUALS(QTSUCCESS, qtdestroy(&tq));
+	ASSERT_EQUALS(QTSUCCESS, qtreactordestroy(&r));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+	close(fds[0]);
+	close(fds[1]);
+}
+
+void poll_idle_workers()
+{
+	struct function_queue q;
+	struct qtpool_startup_info si;
+	struct qtpool tq;
+	struct qtreactor r;
+	struct qtreactorwatch* w = NULL;
+	int started = 0;
+	int fds[2];
+
+	puts("Testing a reactor polled by the idle workers of a pool...");
+	called = 0;
+	ASSERT_EQUALS(0, pipe(fds));
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&q, FQTYPE_IA, TEST_SIZE));
+	ASSERT_EQUALS(QTSUCCESS, qtreactorinit(&r, &q));
+	ASSERT_EQUALS(QTSUCCESS, qtreactoradd(&r, fds[0], QTREACTOR_READ,
+				read_byte, NULL, &w));
+	si.fq = &q;
+	si.max_threads = 1;
+	ASSERT_EQUALS(QTSUCCESS, qtinit(&tq, &si));
+	ASSERT_EQUALS(QTSUCCESS, qtsetreactor(&tq, &r));
+	ASSERT_EQUALS(QTSUCCESS, qtstart(&tq, &started));
+
+	/* without a polling thread, the worker polls after its next task */
+	ASSERT_EQUALS(1, (int) write(fds[1], "x", 1));
+	ASSERT_EQUALS(QTSUCCESS, fqpush(&q, nothing, NULL, 1));
+	wait_called(1);
+
+	ASSERT_EQUALS(QTSUCCESS, qtstop(&tq, 1));
+	ASSERT_EQUALS(QTSUCCESS, qtreactorremove(&r, w));
+	ASSERT_EQUALS(QTSUCCESS, qtdestroy(&tq));
+	ASSERT_EQUALS(QTSUCCESS, qtreactordestroy(&r));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&q));
+	close(fds[0]);
+	close(fds[1]);
+}
+
+int main(int argc, char** argv)
+{
+	(void) argc;
+	(void) argv;
+
+	RUN(poll_ready);
+	RUN(poll_thread);
+	RUN(poll_idle_workers);
+	return TEST_REPORT();
+}
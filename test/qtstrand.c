@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "tinytest/tinytest.h"
+#include "../qtstrand.h"
+#include "../qtpool.h"
+#include "../function_queue.h"
+
+#define TEST_KEYS 4
+#define TEST_TASKS 1000
+
+struct qtstrandset set;
+struct function_queue queue;
+pthread_mutex_t count_lock = PTHREAD_MUTEX_INITIALIZER;
+int running[TEST_KEYS];
+int next_task[TEST_KEYS];
+int overlapped = 0;
+int out_of_order = 0;
+int ran = 0;
+int filled = 0;
+
+void sleep_ms(long ms)
+{
+	struct timespec t;
+
+	t.tv_sec = ms / 1000;
+	t.tv_nsec = ms % 1000 * 1000000L;
+	nanosleep(&t, NULL);
+}
+
+int get_ran()
+{
+	int n = 0;
+
+	pthread_mutex_lock(&count_lock);
+	n = ran;
+	pthread_mutex_unlock(&count_lock);
+	return n;
+}
+
+/* the argument encodes the key and the sequence number of the task */
+void check_serial(void* arg)
+{
+	unsigned long n = (unsigned long) arg;
+	unsigned long key = n % TEST_KEYS;
+
+	pthread_mutex_lock(&count_lock);
+
+	if(running[key]++ != 0)
+		++overlapped;
+
+	if((unsigned long) next_task[key]++ != n / TEST_KEYS)
+		++out_of_order;
+
+	pthread_mutex_unlock(&count_lock);
+	sched_yield();
+	pthread_mutex_lock(&count_lock);
+	--running[key];
+	++ran;
+	pthread_mutex_unlock(&count_lock);
+}
+
+void nothing(void* arg)
+{
+	(void) arg;
+}
+
+/* the first task fills the queue, so the strand cannot be requeued */
+void fill_and_count(void* arg)
+{
+	(void) arg;
+
+	if(!filled) {
+		filled = 1;
+		fqpush(&queue, nothing, NULL, 0);
+	}
+
+	pthread_mutex_lock(&count_lock);
+	++ran;
+	pthread_mutex_unlock(&count_lock);
+}
+
+void* run_element(void* arg)
+{
+	struct function_queue_element* e = arg;
+
+	e->func(e->arg);
+	return NULL;
+}
+
+void serial_per_key()
+{
+	struct qtpool tq;
+	struct qtpool_startup_info si;
+	unsigned long i = 0;
+	int started = 0;
+
+	puts("Testing that strands run their functions serially and in order...");
+	ran = 0;
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&queue, FQTYPE_IA, 64));
+	ASSERT_EQUALS(QTSUCCESS, qtstrandinit(&set, &queue, 8));
+	si.fq = &queue;
+	si.max_threads = 4;
+	ASSERT_EQUALS(QTSUCCESS, qtinit(&tq, &si));
+	ASSERT_EQUALS(QTSUCCESS, qtstart(&tq, &started));
+
+	for(i = 0; i < TEST_TASKS; ++i)
+		ASSERT_EQUALS(QTSUCCESS, qtstrandpush(&set, i % TEST_KEYS,
+					check_serial, (void*) i, 1));
+
+	while(get_ran() < TEST_TASKS)
+		sleep_ms(1);
+
+	ASSERT_EQUALS(QTSUCCESS, qtstop(&tq, 1));
+	ASSERT_EQUALS(0, overlapped);
+	ASSERT_EQUALS(0, out_of_order);
+	ASSERT_EQUALS(QTSUCCESS, qtdestroy(&tq));
+	ASSERT_EQUALS(QTSUCCESS, qtstranddestroy(&set));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&queue));
+}
+
+void bounded_drain()
+{
+	struct function_queue_element e;
+	struct function_queue_element filler;
+	pthread_t thread;
+	int i = 0;
+
+	puts("Testing that a strand which cannot be requeued stops draining...");
+	ran = 0;
+	filled = 0;
+	ASSERT_EQUALS(QTSUCCESS, fqinit(&queue, FQTYPE_IA, 1));
+	ASSERT_EQUALS(QTSUCCESS, qtstrandinit(&set, &queue, 1));
+
+	for(i = 0; i < TEST_TASKS; ++i)
+		ASSERT_EQUALS(QTSUCCESS, qtstrandpush(&set, 0, fill_and_count,
+					NULL, 0));
+
+	ASSERT_EQUALS(QTSUCCESS, fqpop(&queue, &e, 0));
+	ASSERT_EQUALS(0, pthread_create(&thread, NULL, run_element, &e));
+
+	/* the thread waits for room after a bounded run of functions */
+	sleep_ms(100);
+	ASSERT("the strand is drained without bound", get_ran() < TEST_TASKS);
+	ASSERT_EQUALS(QTSUCCESS, fqpop(&queue, &filler, 0));
+	ASSERT_EQUALS(0, pthread_join(thread, NULL));
+
+	while(fqpop(&queue, &e, 0) == QTSUCCESS)
+		e.func(e.arg);
+
+	ASSERT_EQUALS(TEST_TASKS, ran);
+	ASSERT_EQUALS(QTSUCCESS, qtstranddestroy(&set));
+	ASSERT_EQUALS(QTSUCCESS, fqdestroy(&queue));
+}
+
+int main(int argc, char** argv)
+{
+	(void) argc;
+	(void) argv;
+
+	RUN(serial_per_key);
+	RUN(bounded_drain);
+	return TEST_REPORT();
+}
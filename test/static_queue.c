@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "tinytest/tinytest.h"
+#include "../fq/static_queue.h"
+
+#define TEST_CAPACITY 4
+#define TEST_ELEMENTS 1000
+
+FQSTATIC_DEFINE(test_queue, TEST_CAPACITY)
+
+enum fqlocktype current_type = FQLOCK_MUTEX;
+struct test_queue queue;
+
+void sleep_ms(long ms)
+{
+	struct timespec t;
+
+	t.tv_sec = ms / 1000;
+	t.tv_nsec = ms % 1000 * 1000000L;
+	nanosleep(&t, NULL);
+}
+
+void nothing(void* arg)
+{
+	(void) arg;
+}
+
+/* the elements are numbered by their arguments */
+void* push_numbered(void* arg)
+{
+	unsigned long i = 0;
+
+	(void) arg;
+
+	for(i = 0; i < TEST_ELEMENTS; ++i)
+		if(test_queuepush(&queue, nothing, (void*) i, 1) != QTSUCCESS)
+			break;
+
+	return NULL;
+}
+
+void* pop_one(void* arg)
+{
+	struct function_queue_element* e = arg;
+
+	test_queuepop(&queue, e, 1);
+	return NULL;
+}
+
+void counters_wrap()
+{
+	struct function_queue_element e;
+	unsigned long i = 0;
+	int round = 0;
+
+	puts("Testing a static queue whose counters wrap around...");
+	ASSERT_EQUALS(QTSUCCESS, test_queueinit(&queue));
+
+	/* the counters pass UINT_MAX while the ring holds elements */
+	queue.head = UINT_MAX - 1;
+	queue.tail = UINT_MAX - 1;
+
+	for(round = 0; round < 2; ++round) {
+		for(i = 0; i < TEST_CAPACITY; ++i)
+			ASSERT_EQUALS(QTSUCCESS, test_queuetryput(&queue,
+						nothing, (void*) i));
+
+		ASSERT_EQUALS(QTEFQFULL, test_queuetryput(&queue, nothing,
+					NULL));
+
+		for(i = 0; i < TEST_CAPACITY; ++i) {
+			ASSERT_EQUALS(QTSUCCESS, test_queuetrytake(&queue, &e));
+			ASSERT("the element is out of order", e.func == nothing
+					&& e.arg == (void*) i);
+		}
+
+		ASSERT_EQUALS(QTEFQEMPTY, test_queuetrytake(&queue, &e));
+	}
+
+	ASSERT_EQUALS((unsigned int) 2 * TEST_CAPACITY - 2, queue.tail);
+	ASSERT_EQUALS(queue.tail, queue.head);
+	ASSERT_EQUALS(QTSUCCESS, test_queuedestroy(&queue));
+}
+
+void blocking_push_pop()
+{
+	struct function_queue_element e;
+	pthread_t thread;
+	unsigned long i = 0;
+
+	printf("Testing a blocking static queue under lock type %d...\n",
+			current_type);
+	ASSERT_EQUALS(QTSUCCESS, test_queueinitwithlock(&queue,
+				current_type));
+	ASSERT_EQUALS(QTEFQEMPTY, test_queuepop(&queue, &e, 0));
+
+	/* the pusher fills the ring and waits for room many times */
+	ASSERT_EQUALS(0, pthread_create(&thread, NULL, push_numbered, NULL));
+
+	for(i = 0; i < TEST_ELEMENTS; ++i) {
+		ASSERT_EQUALS(QTSUCCESS, test_queuepop(&queue, &e, 1));
+		ASSERT("the element is out of order", e.arg == (void*) i);
+	}
+
+	ASSERT_EQUALS(0, pthread_join(thread, NULL));
+	ASSERT_EQUALS(QTEFQEMPTY, test_queuepop(&queue, &e, 0));
+
+	/* a popper waiting on the empty queue gets the next element */
+	e.func = NULL;
+	ASSERT_EQUALS(0, pthread_create(&thread, NULL, pop_one, &e));
+	sleep_ms(10);
+	ASSERT_EQUALS(QTSUCCESS, test_queuepush(&queue, nothing, NULL, 1));
+	ASSERT_EQUALS(0, pthread_join(thread, NULL));
+	ASSERT("the waiting popper got no element", e.func == nothing);
+
+	for(i = 0; i < TEST_CAPACITY; ++i)
+		ASSERT_EQUALS(QTSUCCESS, test_queuepush(&queue, nothing, NULL,
+					0));
+
+	ASSERT_EQUALS(QTEFQFULL, test_queuepush(&queue, nothing, NULL, 0));
+	ASSERT_EQUALS(QTSUCCESS, test_queuedestroy(&queue));
+}
+
+int main(int argc, char** argv)
+{
+	(void) argc;
+	(void) argv;
+
+	RUN(counters_wrap);
+
+	for(; current_type < FQLOCK_LAST; ++current_type)
+		RUN(blocking_push_pop);
+
+	return TEST_REPORT();
+}
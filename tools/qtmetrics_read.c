@@ -0,0 +1,93 @@
+/*
+ * Copyright 2017 Brandon Yannoni
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * This program prints the values of a metrics page published by
+ * another process. The first argument is the name of the shared memory
+ * object. If an interval in milliseconds is given as the second
+ * argument, the values are printed again after every interval until the
+ * program is killed. Otherwise, they are printed once.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "../qtmetrics.h"
+#include "../qterror.h"
+
+static int print_values(const struct qtmetricspage*);
+
+int
+main(int argc, char** argv)
+{
+	struct qtmetricspage* page = NULL;
+	struct timespec delay;
+	unsigned long interval = 0;
+	enum qterror err = QTSUCCESS;
+	int status = EXIT_SUCCESS;
+
+	if(argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: %s name [interval_ms]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if(argc == 3)
+		interval = strtoul(argv[2], NULL, 10);
+
+	err = qtmetricsattach(argv[1], &page);
+
+	if(err != QTSUCCESS) {
+		fprintf(stderr, "%s: cannot attach to %s: %s\n", argv[0],
+				argv[1], err == QTEERRNO ? strerror(errno)
+				: "not a metrics page");
+		return EXIT_FAILURE;
+	}
+
+	delay.tv_sec = (time_t) (interval / 1000);
+	delay.tv_nsec = (long) (interval % 1000) * 1000000L;
+
+	do {
+		if(print_values(page) != 0) {
+			fprintf(stderr, "%s: cannot read %s\n", argv[0],
+					argv[1]);
+			status = EXIT_FAILURE;
+			break;
+		}
+	} while(interval > 0 && nanosleep(&delay, NULL) == 0);
+
+	(void) qtmetricsdetach(page);
+	return status;
+}
+
+/*
+ * This procedure prints one line with the values of the metrics page.
+ * It returns non-zero if the values could not be read.
+ */
+static int
+print_values(const struct qtmetricspage* page)
+{
+	struct qtmetricsvalues v;
+
+	if(qtmetricsread(page, &v) != QTSUCCESS)
+		return -1;
+
+	printf("depth=%lu executed=%lu idle=%lu rejected=%lu threads=%lu\n",
+			v.depth, v.executed, v.idle, v.rejected, v.threads);
+	return fflush(stdout) == EOF;
+}